@@ -65,6 +65,7 @@ enum keyword_string_config_field {
 	KSF_LISTEN,
 	KSF_OCSP_URI,
 	KSF_OCSP_TRUSTNAME,
+	KSF_UPDOWN_HELPER,
 
 	KSF_ROOF
 };
@@ -80,11 +81,15 @@ enum keyword_numeric_config_field {
 	KBF_LOGTIME,
 	KBF_LOGAPPEND,
 	KBF_LOGIP,
+	KBF_LOGASYNC,
 	KBF_AUDIT_LOG,
 	KBF_IKEBUF,
 	KBF_IKE_ERRQUEUE,
+	KBF_IKE_RECV_BATCH,
+	KBF_IKE_SOCKET_WORKERS,
 	KBF_PERPEERLOG,
 	KBF_XFRMLIFETIME,
+	KBF_NETLINK_BATCH,
 	KBF_CRL_STRICT,
 	KBF_CRL_CHECKINTERVAL,
 	KBF_OCSP_STRICT,
@@ -104,6 +109,15 @@ enum keyword_numeric_config_field {
 	KBF_FORCEBUSY, 		/* obsoleted for KBF_DDOS_MODE */
 	KBF_DDOS_IKE_THRESHOLD,
 	KBF_MAX_HALFOPEN_IKE,
+	KBF_DDOS_HELPER_THRESHOLD,
+	KBF_DH_POOL_LOW,
+	KBF_DH_POOL_HIGH,
+	KBF_IKE_RATE_LIMIT,
+	KBF_IKE_RATE_LIMIT_BURST,
+	KBF_IKE_RATE_LIMIT_IPV4_PREFIX,
+	KBF_IKE_RATE_LIMIT_IPV6_PREFIX,
+	KBF_REKEY_WINDOW,
+	KBF_REKEY_RATE,
 	KBF_SECCTX,		/* security context attribute value for labeled ipsec */
 	KBF_NFLOG_ALL,		/* Enable global nflog device */
 	KBF_DDOS_MODE,		/* set DDOS mode */
@@ -68,6 +68,9 @@ enum ike_version {
 #define SA_LIFE_DURATION_K_DEFAULT 0xFFFFFFFFlu
 
 #define IKE_BUF_AUTO 0 /* use system values for IKE socket buffer size */
+#define DEFAULT_IKE_RECV_BATCH 16 /* UDP datagrams read per wakeup */
+#define MAX_IKE_RECV_BATCH 64
+#define MAX_IKE_SOCKET_WORKERS 16 /* SO_REUSEPORT receive threads per UDP socket */
 
 #define DEFAULT_XFRM_IF_NAME "ipsec1"
 
@@ -192,6 +195,9 @@ enum global_timer {
 	EVENT_NAT_T_KEEPALIVE,		/* NAT Traversal Keepalive */
 
 	EVENT_PROCESS_KERNEL_QUEUE,	/* non-netkey */
+	EVENT_PROCESS_ACQUIRE_QUEUE,	/* initiate coalesced kernel acquires */
+	EVENT_TIMER_WHEEL,		/* run due state events */
+	EVENT_FLUSH_UPDOWN_HELPER,	/* write batched updown events */
 };
 
 extern const struct enum_names global_timer_names;
@@ -357,6 +363,11 @@ typedef enum {
 #define KERNEL_PROCESS_Q_PERIOD 1 /* seconds */
 #define DEFAULT_MAXIMUM_HALFOPEN_IKE_SA 50000 /* fairly arbitrary */
 #define DEFAULT_IKE_SA_DDOS_THRESHOLD 25000 /* fairly arbitrary */
+#define DEFAULT_HELPER_BACKLOG_DDOS_THRESHOLD 5000 /* fairly arbitrary */
+#define DEFAULT_DH_POOL_LOW 8	/* precomputed DH secrets, per group */
+#define DEFAULT_DH_POOL_HIGH 32
+#define DEFAULT_IKE_RATE_LIMIT_IPV4_PREFIX 24	/* sources sharing a rate limit bucket */
+#define DEFAULT_IKE_RATE_LIMIT_IPV6_PREFIX 64
 
 #define IPSEC_SA_DEFAULT_REPLAY_WINDOW 32
 
@@ -66,7 +66,7 @@
  */
 
 #define WHACK_BASIC_MAGIC (((((('w' << 8) + 'h') << 8) + 'k') << 8) + 25)
-#define WHACK_MAGIC (((((('o' << 8) + 'h') << 8) + 'k') << 8) + 49)
+#define WHACK_MAGIC (((((('o' << 8) + 'h') << 8) + 'k') << 8) + 50)
 
 /* struct whack_end is a lot like connection.h's struct end
  * It differs because it is going to be shipped down a socket
@@ -330,6 +330,10 @@ struct whack_message {
 	bool whack_crash;
 	ip_address whack_crash_peer;
 
+	/* for WHACK_PEER_STATUS - list connections and states of a peer */
+	bool whack_peer_status;
+	ip_address whack_peer_status_peer;
+
 	/* for WHACK_LIST */
 	bool whack_utc;
 	bool whack_checkpubkeys;	/* --checkpubkeys */
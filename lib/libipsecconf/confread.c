@@ -75,6 +75,7 @@ static void ipsecconf_default_values(struct starter_config *cfg)
 	SOPT(KBF_LOGTIME, TRUE);
 	SOPT(KBF_LOGAPPEND, TRUE);
 	SOPT(KBF_LOGIP, TRUE);
+	SOPT(KBF_LOGASYNC, FALSE);
 	SOPT(KBF_AUDIT_LOG, TRUE);
 	SOPT(KBF_UNIQUEIDS, TRUE);
 	SOPT(KBF_LISTEN_UDP, TRUE);
@@ -83,13 +84,25 @@ static void ipsecconf_default_values(struct starter_config *cfg)
 	SOPT(KBF_PERPEERLOG, FALSE);
 	SOPT(KBF_IKEBUF, IKE_BUF_AUTO);
 	SOPT(KBF_IKE_ERRQUEUE, TRUE);
+	SOPT(KBF_IKE_RECV_BATCH, DEFAULT_IKE_RECV_BATCH);
+	SOPT(KBF_IKE_SOCKET_WORKERS, 0); /* disabled per default */
 	SOPT(KBF_NFLOG_ALL, 0); /* disabled per default */
 	SOPT(KBF_XFRMLIFETIME, XFRM_LIFETIME_DEFAULT); /* not used by pluto itself */
+	SOPT(KBF_NETLINK_BATCH, TRUE);
 	SOPT(KBF_NHELPERS, -1); /* see also plutomain.c */
 
 	SOPT(KBF_KEEPALIVE, 0);                  /* config setup */
 	SOPT(KBF_DDOS_IKE_THRESHOLD, DEFAULT_IKE_SA_DDOS_THRESHOLD);
 	SOPT(KBF_MAX_HALFOPEN_IKE, DEFAULT_MAXIMUM_HALFOPEN_IKE_SA);
+	SOPT(KBF_DDOS_HELPER_THRESHOLD, DEFAULT_HELPER_BACKLOG_DDOS_THRESHOLD);
+	SOPT(KBF_DH_POOL_LOW, DEFAULT_DH_POOL_LOW);
+	SOPT(KBF_DH_POOL_HIGH, DEFAULT_DH_POOL_HIGH);
+	SOPT(KBF_IKE_RATE_LIMIT, 0); /* disabled per default */
+	SOPT(KBF_IKE_RATE_LIMIT_BURST, 0); /* same as rate */
+	SOPT(KBF_IKE_RATE_LIMIT_IPV4_PREFIX, DEFAULT_IKE_RATE_LIMIT_IPV4_PREFIX);
+	SOPT(KBF_IKE_RATE_LIMIT_IPV6_PREFIX, DEFAULT_IKE_RATE_LIMIT_IPV6_PREFIX);
+	SOPT(KBF_REKEY_WINDOW, 0); /* disabled per default */
+	SOPT(KBF_REKEY_RATE, 0); /* no cap */
 	SOPT(KBF_SHUNTLIFETIME, PLUTO_SHUNT_LIFE_DURATION_DEFAULT);
 	/* Don't inflict BSI requirements on everyone */
 	SOPT(KBF_SEEDBITS, 0);
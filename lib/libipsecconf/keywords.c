@@ -383,6 +383,7 @@ const struct keyword_def ipsec_conf_keywords[] = {
   { "logtime",  kv_config,  kt_bool,  KBF_LOGTIME, NULL, NULL, },
   { "logappend",  kv_config,  kt_bool,  KBF_LOGAPPEND, NULL, NULL, },
   { "logip",  kv_config,  kt_bool,  KBF_LOGIP, NULL, NULL, },
+  { "logasync",  kv_config,  kt_bool,  KBF_LOGASYNC, NULL, NULL, },
   { "audit-log",  kv_config,  kt_bool,  KBF_AUDIT_LOG, NULL, NULL, },
 #ifdef USE_DNSSEC
   { "dnssec-enable",  kv_config,  kt_bool,  KBF_DO_DNSSEC, NULL, NULL, },
@@ -407,6 +408,7 @@ const struct keyword_def ipsec_conf_keywords[] = {
   { "ocsp-uri",  kv_config,  kt_string,  KSF_OCSP_URI, NULL, NULL, },
   { "ocsp-timeout",  kv_config,  kt_number,  KBF_OCSP_TIMEOUT, NULL, NULL, },
   { "ocsp-trustname",  kv_config,  kt_string,  KSF_OCSP_TRUSTNAME, NULL, NULL, },
+  { "updown-helper",  kv_config,  kt_filename,  KSF_UPDOWN_HELPER, NULL, NULL, },
   { "ocsp-cache-size",  kv_config,  kt_number,  KBF_OCSP_CACHE_SIZE, NULL, NULL, },
   { "ocsp-cache-min-age",  kv_config,  kt_time,  KBF_OCSP_CACHE_MIN, NULL, NULL, },
   { "ocsp-cache-max-age",  kv_config,  kt_time,  KBF_OCSP_CACHE_MAX, NULL, NULL, },
@@ -418,10 +420,22 @@ const struct keyword_def ipsec_conf_keywords[] = {
 #endif
   { "ddos-ike-threshold",  kv_config,  kt_number,  KBF_DDOS_IKE_THRESHOLD, NULL, NULL, },
   { "max-halfopen-ike",  kv_config,  kt_number,  KBF_MAX_HALFOPEN_IKE, NULL, NULL, },
+  { "ddos-helper-threshold",  kv_config,  kt_number,  KBF_DDOS_HELPER_THRESHOLD, NULL, NULL, },
+  { "dh-pool-low",  kv_config,  kt_number,  KBF_DH_POOL_LOW, NULL, NULL, },
+  { "dh-pool-high",  kv_config,  kt_number,  KBF_DH_POOL_HIGH, NULL, NULL, },
+  { "ike-rate-limit",  kv_config,  kt_number,  KBF_IKE_RATE_LIMIT, NULL, NULL, },
+  { "ike-rate-limit-burst",  kv_config,  kt_number,  KBF_IKE_RATE_LIMIT_BURST, NULL, NULL, },
+  { "ike-rate-limit-ipv4-prefix",  kv_config,  kt_number,  KBF_IKE_RATE_LIMIT_IPV4_PREFIX, NULL, NULL, },
+  { "ike-rate-limit-ipv6-prefix",  kv_config,  kt_number,  KBF_IKE_RATE_LIMIT_IPV6_PREFIX, NULL, NULL, },
+  { "rekey-window",  kv_config,  kt_number,  KBF_REKEY_WINDOW, NULL, NULL, },
+  { "rekey-rate",  kv_config,  kt_number,  KBF_REKEY_RATE, NULL, NULL, },
   { "ike-socket-bufsize",  kv_config,  kt_number,  KBF_IKEBUF, NULL, NULL, },
   { "ike-socket-errqueue",  kv_config,  kt_bool,  KBF_IKE_ERRQUEUE, NULL, NULL, },
+  { "ike-socket-recv-batch",  kv_config,  kt_number,  KBF_IKE_RECV_BATCH, NULL, NULL, },
+  { "ike-socket-workers",  kv_config,  kt_number,  KBF_IKE_SOCKET_WORKERS, NULL, NULL, },
   { "nflog-all",  kv_config,  kt_number,  KBF_NFLOG_ALL, NULL, NULL, },
   { "xfrmlifetime",  kv_config,  kt_number,  KBF_XFRMLIFETIME, NULL, NULL, },
+  { "netlink-batch",  kv_config,  kt_bool,  KBF_NETLINK_BATCH, NULL, NULL, },
   { "virtual-private",  kv_config,  kt_string,  KSF_VIRTUALPRIVATE, NULL, NULL, },
   { "virtual_private",  kv_config,  kt_string,  KSF_VIRTUALPRIVATE, NULL, NULL, }, /* obsolete variant, very common */
   { "seedbits",  kv_config,  kt_number,  KBF_SEEDBITS, NULL, NULL, },
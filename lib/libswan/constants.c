@@ -2237,6 +2237,9 @@ static const char *global_timer_name[] = {
 	E(EVENT_RESET_LOG_RATE_LIMIT),
 	E(EVENT_PROCESS_KERNEL_QUEUE),
 	E(EVENT_NAT_T_KEEPALIVE),
+	E(EVENT_PROCESS_ACQUIRE_QUEUE),
+	E(EVENT_TIMER_WHEEL),
+	E(EVENT_FLUSH_UPDOWN_HELPER),
 #undef E
 };
 const struct enum_names global_timer_names = {
@@ -0,0 +1,211 @@
+/* coalescing of kernel ACQUIRE messages, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include "defs.h"
+#include "acquire_queue.h"
+#include "hash_table.h"
+#include "ip_protocol.h"
+#include "kernel.h"		/* for record_and_initiate_opportunistic() */
+#include "log.h"
+#include "show.h"
+#include "timer.h"
+
+/*
+ * Traffic to many opportunistic peers can have the kernel send a
+ * burst of ACQUIREs, often several for the same flow.  Each one costs
+ * a connection lookup, a bare shunt and, possibly, a DNS lookup.
+ *
+ * Instead of initiating straight away, ACQUIREs are queued for
+ * ACQUIRE_BATCH_MILLISECONDS and duplicates that turn up in the
+ * meantime are dropped; the queue is then drained, oldest first,
+ * through record_and_initiate_opportunistic().
+ *
+ * The queue holds at most ACQUIRE_QUEUE_MAX flows; past that, an
+ * ACQUIRE is initiated immediately (the old behaviour) and counted
+ * as an overflow.
+ */
+
+#define ACQUIRE_MAGIC 0xac0a1e5eUL
+#define ACQUIRE_BATCH_MILLISECONDS 10
+#define ACQUIRE_QUEUE_MAX 1024
+
+struct acquire_entry {
+	unsigned long magic;
+	struct list_entry hash_entry;
+	ip_endpoint local;
+	ip_endpoint remote;
+	chunk_t sec_label;
+	const char *why;
+};
+
+/* in arrival order */
+static struct acquire_entry *acquire_queue[ACQUIRE_QUEUE_MAX];
+static unsigned nr_queued;
+
+static unsigned long total_received;
+static unsigned long total_coalesced;
+static unsigned long total_overflowed;
+static unsigned long total_batches;
+
+static void jam_acquire_entry(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "NULL acquire");
+	} else {
+		const struct acquire_entry *entry = data;
+		passert(entry->magic == ACQUIRE_MAGIC);
+		jam_endpoint(buf, &entry->local);
+		jam(buf, "->");
+		jam_endpoint(buf, &entry->remote);
+	}
+}
+
+static hash_t endpoint_hasher(const ip_endpoint *endpoint, hash_t hash)
+{
+	ip_address address = endpoint_address(*endpoint);
+	int hport = endpoint_hport(*endpoint);
+	unsigned ipproto = endpoint_protocol(*endpoint)->ipproto;
+	hash = hash_table_hasher(address_as_shunk(&address), hash);
+	hash = hash_table_hasher(shunk2(&hport, sizeof(hport)), hash);
+	hash = hash_table_hasher(shunk2(&ipproto, sizeof(ipproto)), hash);
+	return hash;
+}
+
+static hash_t acquire_hasher(const ip_endpoint *local, const ip_endpoint *remote)
+{
+	return endpoint_hasher(remote, endpoint_hasher(local, zero_hash));
+}
+
+static hash_t acquire_entry_hasher(const void *data)
+{
+	const struct acquire_entry *entry = data;
+	passert(entry->magic == ACQUIRE_MAGIC);
+	return acquire_hasher(&entry->local, &entry->remote);
+}
+
+static struct list_entry *acquire_entry_entry(void *data)
+{
+	struct acquire_entry *entry = data;
+	passert(entry->magic == ACQUIRE_MAGIC);
+	return &entry->hash_entry;
+}
+
+static struct hash_table acquire_hash_table = {
+	.info = {
+		.name = "acquire queue",
+		.jam = jam_acquire_entry,
+	},
+	.hasher = acquire_entry_hasher,
+	.entry = acquire_entry_entry,
+	.nr_slots = 23,
+};
+
+static void free_acquire_entry(struct acquire_entry **entry)
+{
+	del_hash_table_entry(&acquire_hash_table, *entry);
+	free_chunk_content(&(*entry)->sec_label);
+	pfree(*entry);
+	*entry = NULL;
+}
+
+static void process_acquire_queue(struct logger *unused_logger UNUSED)
+{
+	/*
+	 * Take the whole queue; nothing below should queue more but
+	 * if it does it goes into a new batch.
+	 */
+	struct acquire_entry *batch[ACQUIRE_QUEUE_MAX];
+	unsigned nr_batch = nr_queued;
+	memcpy(batch, acquire_queue, nr_batch * sizeof(batch[0]));
+	nr_queued = 0;
+	total_batches++;
+
+	dbg("processing %u queued acquires", nr_batch);
+	for (unsigned i = 0; i < nr_batch; i++) {
+		struct acquire_entry *entry = batch[i];
+		del_hash_table_entry(&acquire_hash_table, entry);
+		record_and_initiate_opportunistic(&entry->local, &entry->remote,
+						  entry->sec_label, entry->why);
+		free_chunk_content(&entry->sec_label);
+		pfree(entry);
+	}
+}
+
+void queue_acquire(const ip_endpoint *local, const ip_endpoint *remote,
+		   const chunk_t sec_label, const char *why)
+{
+	total_received++;
+
+	hash_t hash = acquire_hasher(local, remote);
+	struct list_head *bucket = hash_table_bucket(&acquire_hash_table, hash);
+	struct acquire_entry *entry;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(bucket, entry) {
+		if (endpoint_eq_endpoint(entry->local, *local) &&
+		    endpoint_eq_endpoint(entry->remote, *remote) &&
+		    hunk_eq(entry->sec_label, sec_label)) {
+			total_coalesced++;
+			LSWDBGP(DBG_BASE, buf) {
+				jam(buf, "coalescing duplicate acquire ");
+				jam_acquire_entry(buf, entry);
+			}
+			return;
+		}
+	}
+
+	if (nr_queued >= ACQUIRE_QUEUE_MAX) {
+		total_overflowed++;
+		dbg("acquire queue full, initiating immediately");
+		record_and_initiate_opportunistic(local, remote, sec_label, why);
+		return;
+	}
+
+	entry = alloc_thing(struct acquire_entry, "queued acquire");
+	entry->magic = ACQUIRE_MAGIC;
+	entry->local = *local;
+	entry->remote = *remote;
+	entry->sec_label = clone_hunk(sec_label, "queued acquire sec_label");
+	entry->why = why;
+	add_hash_table_entry(&acquire_hash_table, entry);
+
+	if (nr_queued == 0) {
+		schedule_oneshot_timer(EVENT_PROCESS_ACQUIRE_QUEUE,
+				       deltatime_ms(ACQUIRE_BATCH_MILLISECONDS));
+	}
+	acquire_queue[nr_queued++] = entry;
+}
+
+void init_acquire_queue(void)
+{
+	init_hash_table(&acquire_hash_table);
+	init_oneshot_timer(EVENT_PROCESS_ACQUIRE_QUEUE, process_acquire_queue);
+}
+
+void free_acquire_queue(void)
+{
+	/* pending acquires are dropped */
+	for (unsigned i = 0; i < nr_queued; i++) {
+		free_acquire_entry(&acquire_queue[i]);
+	}
+	nr_queued = 0;
+	free_hash_table(&acquire_hash_table);
+}
+
+void show_acquire_queue(struct show *s)
+{
+	show_raw(s, "current.acquire.queued=%u", nr_queued);
+	show_raw(s, "total.acquire.received=%lu", total_received);
+	show_raw(s, "total.acquire.coalesced=%lu", total_coalesced);
+	show_raw(s, "total.acquire.overflowed=%lu", total_overflowed);
+	show_raw(s, "total.acquire.batches=%lu", total_batches);
+}
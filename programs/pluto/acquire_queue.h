@@ -0,0 +1,37 @@
+/* coalescing of kernel ACQUIRE messages, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef ACQUIRE_QUEUE_H
+#define ACQUIRE_QUEUE_H
+
+#include "ip_endpoint.h"
+#include "chunk.h"
+
+struct show;
+
+void init_acquire_queue(void);
+void free_acquire_queue(void);
+
+/*
+ * Hand a kernel ACQUIRE to record_and_initiate_opportunistic() after
+ * a short delay, dropping any duplicates (same local and remote
+ * endpoints, protocol, and sec_label) that arrive meanwhile.  WHY
+ * must be a string literal.
+ */
+void queue_acquire(const ip_endpoint *local, const ip_endpoint *remote,
+		   const chunk_t sec_label, const char *why);
+
+void show_acquire_queue(struct show *s);
+
+#endif
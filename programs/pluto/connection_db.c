@@ -82,24 +82,90 @@ struct connection *connection_by_serialno(co_serial_t serialno)
 	return NULL;
 }
 
+/*
+ * A table hashed by the remote (peer's) host address.
+ */
+
+static void jam_connection_remote_address(struct jambuf *buf, const void *data)
+{
+	const struct connection *c = data;
+	jam_connection_serialno(buf, c);
+	if (c != NULL) {
+		jam(buf, " ");
+		jam_address(buf, &c->spd.that.host_addr);
+	}
+}
+
+static hash_t remote_address_hasher(const ip_address *address)
+{
+	return hash_table_hasher(address_as_shunk(address), zero_hash);
+}
+
+static hash_t connection_remote_address_hasher(const void *data)
+{
+	const struct connection *c = data;
+	return remote_address_hasher(&c->spd.that.host_addr);
+}
+
+static struct list_entry *connection_remote_address_entry(void *data)
+{
+	struct connection *c = data;
+	return &c->hash_table_entries[CONNECTION_REMOTE_ADDRESS_HASH_TABLE];
+}
+
+struct connection *connection_by_remote_address(const ip_address *address,
+						connection_by_predicate *predicate,
+						void *predicate_context,
+						const char *reason)
+{
+	struct connection *c;
+	hash_t hash = remote_address_hasher(address);
+	struct list_head *bucket = hash_table_bucket(&connection_hash_tables[CONNECTION_REMOTE_ADDRESS_HASH_TABLE], hash);
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, c) {
+		if (!address_eq_address(c->spd.that.host_addr, *address)) {
+			continue;
+		}
+		if (predicate != NULL &&
+		    !predicate(c, predicate_context)) {
+			continue;
+		}
+		dbg("Connection DB: found connection \"%s\" "PRI_CO" (%s)",
+		    c->name, pri_co(c->serialno), reason);
+		return c;
+	}
+	dbg("Connection DB: connection not found (%s)", reason);
+	return NULL;
+}
+
+void rehash_connection_remote_address(struct connection *c)
+{
+	rehash_table_entry(&connection_hash_tables[CONNECTION_REMOTE_ADDRESS_HASH_TABLE], c);
+}
+
 /*
  * Maintain the contents of the hash tables.
  *
  * Unlike serialno, the IKE SPI[ir] keys can change over time.
  */
 
-static struct list_head hash_slots[CONNECTION_HASH_TABLES_ROOF][STATE_TABLE_SIZE];
-
 static struct hash_table connection_hash_tables[] = {
 	[CONNECTION_SERIALNO_HASH_TABLE] = {
 		.info = {
-			.name = "st_serialno table",
+			.name = "co_serialno table",
 			.jam = jam_connection_serialno,
 		},
 		.hasher = connection_serialno_hasher,
 		.entry = connection_serialno_entry,
-		.nr_slots = elemsof(hash_slots[CONNECTION_SERIALNO_HASH_TABLE]),
-		.slots = hash_slots[CONNECTION_SERIALNO_HASH_TABLE],
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[CONNECTION_REMOTE_ADDRESS_HASH_TABLE] = {
+		.info = {
+			.name = "remote address table",
+			.jam = jam_connection_remote_address,
+		},
+		.hasher = connection_remote_address_hasher,
+		.entry = connection_remote_address_entry,
+		.nr_slots = STATE_TABLE_SIZE,
 	},
 };
 
@@ -158,3 +224,21 @@ void init_connection_db(void)
 		init_hash_table(&connection_hash_tables[h]);
 	}
 }
+
+void free_connection_db(void)
+{
+	for (unsigned h = 0; h < elemsof(connection_hash_tables); h++) {
+		free_hash_table(&connection_hash_tables[h]);
+	}
+}
+
+void show_connection_db_stats(struct show *s)
+{
+	static const char *const names[] = {
+		[CONNECTION_SERIALNO_HASH_TABLE] = "hash.connection.serialno",
+		[CONNECTION_REMOTE_ADDRESS_HASH_TABLE] = "hash.connection.remote_address",
+	};
+	for (unsigned h = 0; h < elemsof(connection_hash_tables); h++) {
+		show_hash_table_stats(s, names[h], &connection_hash_tables[h]);
+	}
+}
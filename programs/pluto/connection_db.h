@@ -17,8 +17,10 @@
 #define CONNECTION_DB_H
 
 #include "where.h"
+#include "ip_address.h"
 
 struct connection;
+struct show;
 
 typedef struct { unsigned long co; } co_serial_t;
 
@@ -33,6 +35,8 @@ extern const co_serial_t unset_co_serial;
 #define co_serial_cmp(L, OP, R) ((L).co != 0 && (R).co != 0 && (L).co OP (R).co)
 
 void init_connection_db(void);
+void free_connection_db(void);
+void show_connection_db_stats(struct show *s);
 
 struct connection *alloc_connection(const char *name, where_t where);
 struct connection *clone_connection(const char *name, struct connection *template, where_t where);
@@ -41,11 +45,26 @@ void remove_connection_from_db(struct connection *c);
 
 struct connection *connection_by_serialno(co_serial_t serialno);
 
+/*
+ * Lookup a connection using the remote (peer's) host address.  When
+ * .spd.that.host_addr changes, call rehash_connection_remote_address()
+ * (connect_to_host_pair() does this).
+ */
+
+typedef bool (connection_by_predicate)(struct connection *c, void *context);
+
+struct connection *connection_by_remote_address(const ip_address *address,
+						connection_by_predicate *predicate /*optional*/,
+						void *predicate_context,
+						const char *reason);
+void rehash_connection_remote_address(struct connection *c);
+
 /*
  * All the hash tables states are stored in.
  */
 enum connection_hash_tables {
 	CONNECTION_SERIALNO_HASH_TABLE,
+	CONNECTION_REMOTE_ADDRESS_HASH_TABLE,
 	/* add tables here */
 	CONNECTION_HASH_TABLES_ROOF,
 };
@@ -28,6 +28,7 @@
  *
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -62,6 +63,7 @@
 #include <pk11pub.h>
 #include <keyhi.h>
 #include "lswnss.h"
+#include "show.h"
 
 struct dh_local_secret {
 	refcnt_t refcnt;
@@ -126,10 +128,166 @@ void dh_local_secret_delref(struct dh_local_secret **secret, where_t where)
 	refcnt_delref(secret, free_dh_local_secret, where);
 }
 
+/*
+ * Pools of precomputed DH secrets, one per DH group.
+ *
+ * A pool is created the first time a secret from the group is
+ * requested.  When a pool drops below the low watermark, idle helper
+ * threads refill it, one secret at a time, until it reaches the high
+ * watermark.  Each secret is handed out exactly once; popping it from
+ * the pool transfers the only reference.
+ *
+ * Since pools are filled and emptied by helper threads, accesses must
+ * be locked.
+ */
+
+unsigned pluto_dh_pool_low = DEFAULT_DH_POOL_LOW;
+unsigned pluto_dh_pool_high = DEFAULT_DH_POOL_HIGH;
+
+struct dh_local_secret_pool {
+	const struct dh_desc *group;
+	struct dh_local_secret **secrets; /* [pluto_dh_pool_high] */
+	unsigned nr_secrets;
+	unsigned nr_pending;	/* being computed by a helper */
+	bool refilling;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long refills;
+};
+
+#define MAX_DH_LOCAL_SECRET_POOLS 16	/* more than there are DH groups */
+
+static pthread_mutex_t dh_local_secret_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dh_local_secret_pool dh_local_secret_pools[MAX_DH_LOCAL_SECRET_POOLS];
+static unsigned nr_dh_local_secret_pools;
+
+/* must hold dh_local_secret_pool_mutex */
+static struct dh_local_secret_pool *dh_local_secret_pool(const struct dh_desc *group)
+{
+	for (unsigned i = 0; i < nr_dh_local_secret_pools; i++) {
+		if (dh_local_secret_pools[i].group == group) {
+			return &dh_local_secret_pools[i];
+		}
+	}
+	if (nr_dh_local_secret_pools >= elemsof(dh_local_secret_pools)) {
+		return NULL;
+	}
+	struct dh_local_secret_pool *pool = &dh_local_secret_pools[nr_dh_local_secret_pools++];
+	pool->group = group;
+	pool->secrets = alloc_things(struct dh_local_secret *, pluto_dh_pool_high,
+				     "DH secret pool");
+	return pool;
+}
+
+struct dh_local_secret *get_dh_local_secret(const struct dh_desc *group, struct logger *logger)
+{
+	if (pluto_dh_pool_high == 0) {
+		return calc_dh_local_secret(group, logger);
+	}
+
+	struct dh_local_secret *secret = NULL;
+	pthread_mutex_lock(&dh_local_secret_pool_mutex);
+	{
+		struct dh_local_secret_pool *pool = dh_local_secret_pool(group);
+		if (pool != NULL) {
+			if (pool->nr_secrets > 0) {
+				/* single use: remove it from the pool */
+				secret = pool->secrets[--pool->nr_secrets];
+				pool->secrets[pool->nr_secrets] = NULL;
+				pool->hits++;
+			} else {
+				pool->misses++;
+			}
+			if (pool->nr_secrets < pluto_dh_pool_low) {
+				pool->refilling = true;
+			}
+		}
+	}
+	pthread_mutex_unlock(&dh_local_secret_pool_mutex);
+
+	if (secret == NULL) {
+		return calc_dh_local_secret(group, logger);
+	}
+	LSWDBGP(DBG_CRYPT, buf) {
+		jam_dh_local_secret(buf, secret);
+		jam_string(buf, "taken from pool");
+	}
+	return secret;
+}
+
+/* IN A HELPER THREAD */
+bool refill_dh_local_secret_pools(struct logger *logger)
+{
+	struct dh_local_secret_pool *pool = NULL;
+	pthread_mutex_lock(&dh_local_secret_pool_mutex);
+	{
+		for (unsigned i = 0; i < nr_dh_local_secret_pools; i++) {
+			struct dh_local_secret_pool *p = &dh_local_secret_pools[i];
+			if (p->refilling &&
+			    p->nr_secrets + p->nr_pending < pluto_dh_pool_high) {
+				/* reserve a slot */
+				p->nr_pending++;
+				pool = p;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&dh_local_secret_pool_mutex);
+
+	if (pool == NULL) {
+		return false;
+	}
+
+	struct dh_local_secret *secret = calc_dh_local_secret(pool->group, logger);
+
+	pthread_mutex_lock(&dh_local_secret_pool_mutex);
+	{
+		pool->nr_pending--;
+		pool->secrets[pool->nr_secrets++] = secret;
+		pool->refills++;
+		if (pool->nr_secrets >= pluto_dh_pool_high) {
+			pool->refilling = false;
+		}
+	}
+	pthread_mutex_unlock(&dh_local_secret_pool_mutex);
+	return true;
+}
+
+void free_dh_local_secret_pools(void)
+{
+	for (unsigned i = 0; i < nr_dh_local_secret_pools; i++) {
+		struct dh_local_secret_pool *pool = &dh_local_secret_pools[i];
+		passert(pool->nr_pending == 0);
+		for (unsigned s = 0; s < pool->nr_secrets; s++) {
+			dh_local_secret_delref(&pool->secrets[s], HERE);
+		}
+		pfree(pool->secrets);
+		zero(pool);
+	}
+	nr_dh_local_secret_pools = 0;
+}
+
+void show_dh_local_secret_pools(struct show *s)
+{
+	show_raw(s, "config.setup.dh_pool.low=%u", pluto_dh_pool_low);
+	show_raw(s, "config.setup.dh_pool.high=%u", pluto_dh_pool_high);
+	pthread_mutex_lock(&dh_local_secret_pool_mutex);
+	for (unsigned i = 0; i < nr_dh_local_secret_pools; i++) {
+		const struct dh_local_secret_pool *pool = &dh_local_secret_pools[i];
+		const char *name = pool->group->common.fqn;
+		show_raw(s, "current.dh_pool.%s.size=%u", name, pool->nr_secrets);
+		show_raw(s, "total.dh_pool.%s.hits=%lu", name, pool->hits);
+		show_raw(s, "total.dh_pool.%s.misses=%lu", name, pool->misses);
+		show_raw(s, "total.dh_pool.%s.refills=%lu", name, pool->refills);
+	}
+	pthread_mutex_unlock(&dh_local_secret_pool_mutex);
+}
+
 struct task {
 	chunk_t remote_ke;
 	struct dh_local_secret *local_secret;
 	PK11SymKey *shared_secret;
+	struct v2_keymat *v2_keymat;	/* when non-NULL, also derive keys */
 	dh_shared_secret_cb *cb;
 };
 
@@ -168,6 +326,10 @@ static void compute_dh_shared_secret(struct logger *logger,
 		}
 		DBG_symkey(logger, "dh-shared ", "g^ir", task->shared_secret);
 	}
+
+	if (task->v2_keymat != NULL) {
+		calc_v2_keymat(task->v2_keymat, task->shared_secret, logger);
+	}
 }
 
 static void cleanup_dh_shared_secret(struct task **task)
@@ -175,6 +337,7 @@ static void cleanup_dh_shared_secret(struct task **task)
 	dh_local_secret_delref(&(*task)->local_secret, HERE);
 	free_chunk_content(&(*task)->remote_ke);
 	release_symkey("DH", "secret", &(*task)->shared_secret);
+	free_v2_keymat(&(*task)->v2_keymat);
 	pfreeany(*task);
 }
 
@@ -187,6 +350,9 @@ static stf_status complete_dh_shared_secret(struct state *st,
 	/* transfer */
 	st->st_dh_shared_secret = task->shared_secret;
 	task->shared_secret = NULL;
+	if (st->st_dh_shared_secret != NULL && task->v2_keymat != NULL) {
+		install_v2_keymat(st, &task->v2_keymat);
+	}
 	stf_status status = task->cb(st, md);
 	return status;
 }
@@ -198,8 +364,9 @@ static const struct task_handler dh_shared_secret_handler = {
 	.completed_cb = complete_dh_shared_secret,
 };
 
-void submit_dh_shared_secret(struct state *st, chunk_t remote_ke,
-			     dh_shared_secret_cb *cb, where_t where)
+static void submit_dh_shared_secret_task(struct state *st, chunk_t remote_ke,
+					 struct v2_keymat *v2_keymat,
+					 dh_shared_secret_cb *cb, where_t where)
 {
 	dbg("submitting DH shared secret for "PRI_WHERE, pri_where(where));
 	if (st->st_dh_shared_secret != NULL) {
@@ -210,6 +377,25 @@ void submit_dh_shared_secret(struct state *st, chunk_t remote_ke,
 	struct task *task = alloc_thing(struct task, "dh");
 	task->remote_ke = clone_hunk(remote_ke, "DH crypto");
 	task->local_secret = dh_local_secret_addref(st->st_dh_local_secret, HERE);
+	task->v2_keymat = v2_keymat;
 	task->cb = cb;
-	submit_task(st->st_logger, st, task, &dh_shared_secret_handler, "DH shared secret");
+	submit_task(st->st_logger, st, task, &dh_shared_secret_handler,
+		    (v2_keymat != NULL ? "DH shared secret and keymat" : "DH shared secret"));
+}
+
+void submit_dh_shared_secret(struct state *st, chunk_t remote_ke,
+			     dh_shared_secret_cb *cb, where_t where)
+{
+	submit_dh_shared_secret_task(st, remote_ke, NULL/*no keymat*/, cb, where);
+}
+
+void submit_dh_shared_secret_and_v2_keymat(struct state *st, chunk_t remote_ke,
+					   PK11SymKey *old_skey_d,
+					   const struct prf_desc *old_prf,
+					   const ike_spis_t *new_ike_spis,
+					   dh_shared_secret_cb *cb, where_t where)
+{
+	submit_dh_shared_secret_task(st, remote_ke,
+				     prepare_v2_keymat(st, old_skey_d, old_prf, new_ike_spis),
+				     cb, where);
 }
@@ -37,6 +37,7 @@ struct dh_desc;
 struct state;
 struct msg_digest;
 struct logger;
+struct show;
 
 /*
  * The DH secret (opaque, but we all know it is implemented using
@@ -45,6 +46,20 @@ struct logger;
 struct dh_local_secret;
 
 struct dh_local_secret *calc_dh_local_secret(const struct dh_desc *group, struct logger *logger);
+
+/*
+ * Precomputed DH secrets; get_dh_local_secret() takes one from the
+ * pool (computing it on a miss), idle helper threads call
+ * refill_dh_local_secret_pools().
+ */
+
+extern unsigned pluto_dh_pool_low;	/* start refilling below this */
+extern unsigned pluto_dh_pool_high;	/* stop refilling at this; 0 disables */
+
+struct dh_local_secret *get_dh_local_secret(const struct dh_desc *group, struct logger *logger);
+bool refill_dh_local_secret_pools(struct logger *logger);
+void free_dh_local_secret_pools(void);
+void show_dh_local_secret_pools(struct show *s);
 chunk_t clone_dh_local_secret_ke(struct dh_local_secret *local_secret);
 const struct dh_desc *dh_local_secret_desc(struct dh_local_secret *local_secret);
 
@@ -62,11 +77,30 @@ typedef stf_status (dh_shared_secret_cb)(struct state *st,
 extern void submit_dh_shared_secret(struct state *st, chunk_t remote_ke,
 				    dh_shared_secret_cb *callback, where_t where);
 
+/*
+ * Same, but also derive the IKEv2 SKEYSEED and SK_* keys from the
+ * result, on the helper, storing them in .st_skey_*.  OLD_SKEY_D and
+ * OLD_PRF are only for an IKE SA rekey.
+ */
+
+extern void submit_dh_shared_secret_and_v2_keymat(struct state *st, chunk_t remote_ke,
+						  PK11SymKey *old_skey_d,
+						  const struct prf_desc *old_prf,
+						  const ike_spis_t *new_ike_spis,
+						  dh_shared_secret_cb *callback,
+						  where_t where);
+
 /* internal */
 void calc_v1_skeyid_and_iv(struct state *st);
-void calc_v2_keymat(struct state *st,
-		    PK11SymKey *old_skey_d, /* SKEYSEED IKE Rekey */
-		    const struct prf_desc *old_prf, /* IKE Rekey */
-		    const ike_spis_t *new_ike_spis);
+
+struct v2_keymat;
+struct v2_keymat *prepare_v2_keymat(struct state *st,
+				    PK11SymKey *old_skey_d, /* SKEYSEED IKE Rekey */
+				    const struct prf_desc *old_prf, /* IKE Rekey */
+				    const ike_spis_t *new_ike_spis);
+void calc_v2_keymat(struct v2_keymat *keymat, PK11SymKey *shared,
+		    struct logger *logger); /* thread-safe */
+void install_v2_keymat(struct state *st, struct v2_keymat **keymat);
+void free_v2_keymat(struct v2_keymat **keymat);
 
 #endif
@@ -178,35 +178,146 @@ static void calc_skeyseed_v2(PK11SymKey *shared,
 	release_symkey(__func__, "finalkey", &finalkey);
 }
 
-void calc_v2_keymat(struct state *st,
-		    PK11SymKey *old_skey_d, /* SKEYSEED IKE Rekey */
-		    const struct prf_desc *old_prf, /* IKE Rekey */
-		    const ike_spis_t *new_ike_spis)
+/*
+ * SKEYSEED and SK_* keys for an IKE SA.
+ *
+ * Everything the calculation needs is copied from the state (main
+ * thread) so that the calculation itself can be run on a helper,
+ * straight after the DH shared secret it depends on.
+ */
+
+struct v2_keymat {
+	/* in */
+	const struct encrypt_desc *encrypter;
+	const struct prf_desc *prf;
+	const struct integ_desc *integ;
+	size_t key_size;
+	size_t salt_size;
+	chunk_t ni;
+	chunk_t nr;
+	ike_spis_t new_ike_spis;
+	const struct prf_desc *old_prf;
+	PK11SymKey *old_skey_d;
+	/* out */
+	bool calculated;
+	PK11SymKey *skey_d;
+	PK11SymKey *skey_ai;
+	PK11SymKey *skey_ar;
+	PK11SymKey *skey_ei;
+	PK11SymKey *skey_er;
+	PK11SymKey *skey_pi;
+	PK11SymKey *skey_pr;
+	chunk_t initiator_salt;
+	chunk_t responder_salt;
+	chunk_t chunk_SK_pi;
+	chunk_t chunk_SK_pr;
+};
+
+struct v2_keymat *prepare_v2_keymat(struct state *st,
+				    PK11SymKey *old_skey_d, /* SKEYSEED IKE Rekey */
+				    const struct prf_desc *old_prf, /* IKE Rekey */
+				    const ike_spis_t *new_ike_spis)
 {
-	calc_skeyseed_v2(st->st_dh_shared_secret,
+	struct v2_keymat *keymat = alloc_thing(struct v2_keymat, "v2 keymat");
+	keymat->encrypter = st->st_oakley.ta_encrypt;
+	keymat->prf = st->st_oakley.ta_prf;
+	keymat->integ = st->st_oakley.ta_integ;
+	keymat->key_size = st->st_oakley.enckeylen / BITS_PER_BYTE;
+	keymat->salt_size = (st->st_oakley.ta_encrypt != NULL ?
+			     st->st_oakley.ta_encrypt->salt_size : 0);
+	keymat->ni = clone_hunk(st->st_ni, "v2 keymat Ni");
+	keymat->nr = clone_hunk(st->st_nr, "v2 keymat Nr");
+	keymat->new_ike_spis = *new_ike_spis;
+	keymat->old_prf = old_prf;
+	keymat->old_skey_d = reference_symkey(__func__, "old SK_d", old_skey_d);
+	return keymat;
+}
+
+/* MUST BE THREAD-SAFE */
+void calc_v2_keymat(struct v2_keymat *keymat,
+		    PK11SymKey *shared,
+		    struct logger *logger)
+{
+	calc_skeyseed_v2(shared,
 			 /* input */
-			 st->st_oakley.ta_encrypt,
-			 st->st_oakley.ta_prf,
-			 st->st_oakley.ta_integ,
-			 st->st_oakley.enckeylen / BITS_PER_BYTE,
-			 (st->st_oakley.ta_encrypt != NULL ?
-			  st->st_oakley.ta_encrypt->salt_size : 0),
-			 st->st_ni, st->st_nr,
-			 new_ike_spis,
-			 old_prf, old_skey_d,
+			 keymat->encrypter,
+			 keymat->prf,
+			 keymat->integ,
+			 keymat->key_size,
+			 keymat->salt_size,
+			 keymat->ni, keymat->nr,
+			 &keymat->new_ike_spis,
+			 keymat->old_prf, keymat->old_skey_d,
 			 /* output */
-			 &st->st_skey_d_nss,
-			 &st->st_skey_ai_nss,
-			 &st->st_skey_ar_nss,
-			 &st->st_skey_ei_nss,
-			 &st->st_skey_er_nss,
-			 &st->st_skey_pi_nss,
-			 &st->st_skey_pr_nss,
-			 &st->st_skey_initiator_salt,
-			 &st->st_skey_responder_salt,
-			 &st->st_skey_chunk_SK_pi,
-			 &st->st_skey_chunk_SK_pr,
-			 st->st_logger);
+			 &keymat->skey_d,
+			 &keymat->skey_ai,
+			 &keymat->skey_ar,
+			 &keymat->skey_ei,
+			 &keymat->skey_er,
+			 &keymat->skey_pi,
+			 &keymat->skey_pr,
+			 &keymat->initiator_salt,
+			 &keymat->responder_salt,
+			 &keymat->chunk_SK_pi,
+			 &keymat->chunk_SK_pr,
+			 logger);
+	keymat->calculated = true;
+}
 
+#define TRANSFER_SYMKEY(LHS, RHS)			\
+	{						\
+		pexpect((LHS) == NULL);			\
+		release_symkey(__func__, #LHS, &(LHS));	\
+		(LHS) = (RHS);				\
+		(RHS) = NULL;				\
+	}
+
+#define TRANSFER_CHUNK(LHS, RHS)			\
+	{						\
+		free_chunk_content(&(LHS));		\
+		(LHS) = (RHS);				\
+		(RHS) = empty_chunk;			\
+	}
+
+void install_v2_keymat(struct state *st, struct v2_keymat **keymatp)
+{
+	struct v2_keymat *keymat = *keymatp;
+	passert(keymat->calculated);
+	TRANSFER_SYMKEY(st->st_skey_d_nss, keymat->skey_d);
+	TRANSFER_SYMKEY(st->st_skey_ai_nss, keymat->skey_ai);
+	TRANSFER_SYMKEY(st->st_skey_ar_nss, keymat->skey_ar);
+	TRANSFER_SYMKEY(st->st_skey_ei_nss, keymat->skey_ei);
+	TRANSFER_SYMKEY(st->st_skey_er_nss, keymat->skey_er);
+	TRANSFER_SYMKEY(st->st_skey_pi_nss, keymat->skey_pi);
+	TRANSFER_SYMKEY(st->st_skey_pr_nss, keymat->skey_pr);
+	TRANSFER_CHUNK(st->st_skey_initiator_salt, keymat->initiator_salt);
+	TRANSFER_CHUNK(st->st_skey_responder_salt, keymat->responder_salt);
+	TRANSFER_CHUNK(st->st_skey_chunk_SK_pi, keymat->chunk_SK_pi);
+	TRANSFER_CHUNK(st->st_skey_chunk_SK_pr, keymat->chunk_SK_pr);
 	st->hidden_variables.st_skeyid_calculated = true;
+	free_v2_keymat(keymatp);
+}
+
+void free_v2_keymat(struct v2_keymat **keymatp)
+{
+	struct v2_keymat *keymat = *keymatp;
+	if (keymat == NULL) {
+		return;
+	}
+	free_chunk_content(&keymat->ni);
+	free_chunk_content(&keymat->nr);
+	release_symkey(__func__, "old SK_d", &keymat->old_skey_d);
+	release_symkey(__func__, "SK_d", &keymat->skey_d);
+	release_symkey(__func__, "SK_ai", &keymat->skey_ai);
+	release_symkey(__func__, "SK_ar", &keymat->skey_ar);
+	release_symkey(__func__, "SK_ei", &keymat->skey_ei);
+	release_symkey(__func__, "SK_er", &keymat->skey_er);
+	release_symkey(__func__, "SK_pi", &keymat->skey_pi);
+	release_symkey(__func__, "SK_pr", &keymat->skey_pr);
+	free_chunk_content(&keymat->initiator_salt);
+	free_chunk_content(&keymat->responder_salt);
+	free_chunk_content(&keymat->chunk_SK_pi);
+	free_chunk_content(&keymat->chunk_SK_pr);
+	pfree(keymat);
+	*keymatp = NULL;
 }
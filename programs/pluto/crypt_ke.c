@@ -66,7 +66,7 @@ static void compute_ke_and_nonce(struct logger *logger,
 				 int thread_unused UNUSED)
 {
 	if (task->dh != NULL) {
-		task->local_secret = calc_dh_local_secret(task->dh, logger);
+		task->local_secret = get_dh_local_secret(task->dh, logger);
 		if (DBGP(DBG_CRYPT)) {
 			DBG_log("NSS: Local DH %s secret (pointer): %p",
 				task->dh->common.fqn, task->local_secret);
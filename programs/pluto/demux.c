@@ -70,7 +70,47 @@
 #include "pluto_stats.h"
 #include "ikev2_send.h"
 #include "iface.h"
+#include "server.h"		/* for pluto_sock_recv_batch */
 #include "impair_message.h"
+#include "ike_rate_limit.h"
+
+/*
+ * Create the real message digest; and set up md->packet_pbs to
+ * describe a copy of PACKET.
+ */
+
+static struct msg_digest *alloc_packet_md(const struct iface_endpoint *ifp,
+					  const struct iface_packet *packet)
+{
+	struct msg_digest *md = alloc_md(ifp, &packet->sender, HERE);
+	init_pbs(&md->packet_pbs,
+		 clone_bytes(packet->ptr, packet->len,
+			     "message buffer in read_packet()"),
+		 packet->len, "packet");
+
+	endpoint_buf sb;
+	endpoint_buf lb;
+	dbg("*received %d bytes from %s on %s %s using %s",
+	    (int) pbs_room(&md->packet_pbs),
+	    str_endpoint(&md->sender, &sb),
+	    ifp->ip_dev->id_rname,
+	    str_endpoint(&ifp->local_endpoint, &lb),
+	    ifp->protocol->name);
+
+	if (DBGP(DBG_BASE)) {
+		DBG_dump(NULL, md->packet_pbs.start, pbs_room(&md->packet_pbs));
+	}
+
+	return md;
+}
+
+static struct msg_digest *md_from_packet(struct iface_endpoint *ifp,
+					 const struct iface_packet *packet)
+{
+	struct msg_digest *md = alloc_packet_md(ifp, packet);
+	pstats_ike_in_bytes += pbs_room(&md->packet_pbs);
+	return md;
+}
 
 /*
  * read the message.
@@ -99,33 +139,55 @@ static enum iface_read_status read_message(struct iface_endpoint *ifp,
 		return status;
 	}
 
-	/*
-	 * Create the real message digest; and set up md->packet_pbs
-	 * to describe it.
-	 */
-	struct msg_digest *md = alloc_md(ifp, &packet.sender, HERE);
-	init_pbs(&md->packet_pbs,
-		 clone_bytes(packet.ptr, packet.len,
-			     "message buffer in read_packet()"),
-		 packet.len, "packet");
+	if (!admit_ike_packet(&packet)) {
+		/* counted by ike_rate_limit.c */
+		return IFACE_READ_IGNORE;
+	}
 
-	endpoint_buf sb;
-	endpoint_buf lb;
-	dbg("*received %d bytes from %s on %s %s using %s",
-	    (int) pbs_room(&md->packet_pbs),
-	    str_endpoint(&md->sender, &sb),
-	    ifp->ip_dev->id_rname,
-	    str_endpoint(&ifp->local_endpoint, &lb),
-	    ifp->protocol->name);
+	*mdp = md_from_packet(ifp, &packet);
+	return IFACE_READ_OK;
+}
 
-	if (DBGP(DBG_BASE)) {
-		DBG_dump(NULL, md->packet_pbs.start, pbs_room(&md->packet_pbs));
+/*
+ * Read a batch of messages.
+ *
+ * Same as read_message() but the overly large buffers, one per
+ * message, are kept around between calls.
+ */
+
+static uint8_t (*batch_buffers)[MAX_INPUT_UDP_SIZE];
+static unsigned nr_batch_buffers;
+
+static unsigned read_messages(struct iface_endpoint *ifp,
+			      struct msg_digest **mds,
+			      unsigned nr_mds,
+			      struct logger *logger)
+{
+	if (nr_batch_buffers < nr_mds) {
+		pfreeany(batch_buffers);
+		batch_buffers = alloc_bytes(nr_mds * sizeof(batch_buffers[0]),
+					    "IKE receive batch buffers");
+		nr_batch_buffers = nr_mds;
 	}
 
-	pstats_ike_in_bytes += pbs_room(&md->packet_pbs);
+	struct iface_packet packets[nr_mds];
+	for (unsigned i = 0; i < nr_mds; i++) {
+		packets[i] = (struct iface_packet) {
+			.ptr = batch_buffers[i],
+			.len = sizeof(batch_buffers[i]),
+			.logger = logger,
+		};
+	}
 
-	*mdp = md;
-	return IFACE_READ_OK;
+	unsigned nr = ifp->io->read_packets(ifp, packets, nr_mds, logger);
+	unsigned nr_admitted = 0;
+	for (unsigned i = 0; i < nr; i++) {
+		if (!admit_ike_packet(&packets[i])) {
+			continue;
+		}
+		mds[nr_admitted++] = md_from_packet(ifp, &packets[i]);
+	}
+	return nr_admitted;
 }
 
 /*
@@ -140,10 +202,13 @@ static enum iface_read_status read_message(struct iface_endpoint *ifp,
  * for *mdp being set to NULL.
  */
 
-void process_packet(struct msg_digest **mdp)
-{
-	struct msg_digest *md = *mdp;
+/*
+ * Decode the IKE header, returning false (after logging) when the
+ * packet should be dropped.  Thread-safe.
+ */
 
+static bool decode_packet_header(struct msg_digest *md)
+{
 	diag_t d = pbs_in_struct(&md->packet_pbs, &isakmp_hdr_desc,
 				 &md->hdr, sizeof(md->hdr), &md->message_pbs);
 	if (d != NULL) {
@@ -154,7 +219,7 @@ void process_packet(struct msg_digest **mdp)
 		 */
 		llog_diag(RC_LOG, md->md_logger, &d,
 			 "dropping packet with mangled IKE header: ");
-		return;
+		return false;
 	}
 
 	if (md->packet_pbs.roof > md->message_pbs.roof) {
@@ -170,6 +235,17 @@ void process_packet(struct msg_digest **mdp)
 		}
 	}
 
+	return true;
+}
+
+void process_packet(struct msg_digest **mdp)
+{
+	struct msg_digest *md = *mdp;
+
+	if (!md->hdr_decoded && !decode_packet_header(md)) {
+		return;
+	}
+
 	unsigned vmaj = md->hdr.isa_version >> ISA_MAJ_SHIFT;
 	unsigned vmin = md->hdr.isa_version & ISA_MIN_MASK;
 
@@ -292,6 +368,12 @@ void process_packet(struct msg_digest **mdp)
  */
 static void process_md(struct msg_digest **mdp)
 {
+	if ((*mdp)->iface->fd < 0) {
+		/* the interface was deleted while MD was queued */
+		dbg("dropping message received on deleted interface %s",
+		    (*mdp)->iface->ip_dev->id_rname);
+		return;
+	}
 	process_packet(mdp);
 }
 
@@ -313,6 +395,95 @@ static void process_md(struct msg_digest **mdp)
 
 static bool impair_incoming(struct msg_digest *md);
 
+static void process_iface_packets(struct iface_endpoint *ifp,
+				  struct logger *logger)
+{
+	threadtime_t md_start = threadtime_start();
+	struct msg_digest *mds[pluto_sock_recv_batch];
+	unsigned nr = read_messages(ifp, mds, pluto_sock_recv_batch, logger);
+
+	/*
+	 * XXX: Danger
+	 *
+	 * Everything has been read so processing the messages can't
+	 * trip over IFP being deleted (see below).
+	 */
+	ifp = NULL;
+	for (unsigned i = 0; i < nr; i++) {
+		struct msg_digest *md = mds[i];
+		md->md_inception = md_start;
+		if (!impair_incoming(md)) {
+			process_md(&md);
+		}
+		md_delref(&md, HERE);
+		pexpect(md == NULL);
+	}
+
+	threadtime_stop(&md_start, SOS_NOBODY,
+			"%s() reading and processing %u packets", __func__, nr);
+}
+
+/*
+ * IN A RECEIVE WORKER THREAD
+ *
+ * Do the stateless checks: the source must be within its rate limit
+ * (see ike_rate_limit.c), the IKE header must decode and, for an
+ * IKEv2 IKE_SA_INIT request carrying a COOKIE, the cookie must match.
+ * Anything needing state, policy, or a response is left to the main
+ * thread.
+ */
+
+struct msg_digest *screen_iface_packet(const struct iface_endpoint *ifp,
+				       const struct iface_packet *packet,
+				       struct logger *logger UNUSED)
+{
+	if (!admit_ike_packet(packet)) {
+		return NULL;
+	}
+
+	struct msg_digest *md = alloc_packet_md(ifp, packet);
+
+	if (!decode_packet_header(md)) {
+		md_delref(&md, HERE);
+		return NULL;
+	}
+	md->hdr_decoded = true;
+
+	if (hdr_ike_version(&md->hdr) == IKEv2 &&
+	    !v2_screen_message(md)) {
+		/* already logged */
+		md_delref(&md, HERE);
+		return NULL;
+	}
+
+	return md;
+}
+
+/*
+ * Process messages screened by the receive workers.
+ *
+ * Like process_iface_packets() the interface may be deleted part way
+ * through so the caller must not reference it.
+ */
+
+void process_screened_mds(struct msg_digest **mds, unsigned nr_mds)
+{
+	threadtime_t md_start = threadtime_start();
+	for (unsigned i = 0; i < nr_mds; i++) {
+		struct msg_digest *md = mds[i];
+		mds[i] = NULL;
+		pstats_ike_in_bytes += pbs_room(&md->packet_pbs);
+		md->md_inception = md_start;
+		if (!impair_incoming(md)) {
+			process_md(&md);
+		}
+		md_delref(&md, HERE);
+		pexpect(md == NULL);
+	}
+	threadtime_stop(&md_start, SOS_NOBODY,
+			"%s() processing %u screened packets", __func__, nr_mds);
+}
+
 void process_iface_packet(evutil_socket_t fd, const short event UNUSED, void *ifp_arg)
 {
 	struct logger logger[1] = { GLOBAL_LOGGER(null_fd), }; /* event-handler */
@@ -321,6 +492,11 @@ void process_iface_packet(evutil_socket_t fd, const short event UNUSED, void *if
 	/* on the same page^D^D^D fd? */
 	pexpect(ifp->fd == fd);
 
+	if (ifp->io->read_packets != NULL && pluto_sock_recv_batch > 1) {
+		process_iface_packets(ifp, logger);
+		return;
+	}
+
 	threadtime_t md_start = threadtime_start();
 	struct msg_digest *md = NULL;
 	enum iface_read_status status = read_message(ifp, &md, logger);
@@ -483,6 +659,9 @@ static bool impair_incoming(struct msg_digest *md)
 
 void free_demux(void)
 {
+	pfreeany(batch_buffers);
+	nr_batch_buffers = 0;
+
 	struct replay_entry *e = NULL;
 	FOR_EACH_LIST_ENTRY_NEW2OLD(&replay_packets, e) {
 		md_delref(&e->md, HERE);
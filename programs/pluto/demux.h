@@ -33,6 +33,7 @@
 
 struct state;   /* forward declaration of tag */
 struct iface_endpoint;
+struct iface_packet;
 
 /*
  * Used by UDP and TCP to inject packets.
@@ -40,6 +41,20 @@ struct iface_endpoint;
 
 void process_iface_packet(/*evutil_socket_t*/int fd, const short event, void *ifp_arg);
 
+/*
+ * Used by the UDP receive workers (see ike-socket-workers=).
+ *
+ * screen_iface_packet() is thread-safe: it turns PACKET into an MD
+ * and does the stateless checks, returning NULL when the packet
+ * should be dropped.  process_screened_mds() then processes the
+ * survivors on the main thread, releasing them.
+ */
+
+struct msg_digest *screen_iface_packet(const struct iface_endpoint *ifp,
+				       const struct iface_packet *packet,
+				       struct logger *logger);
+void process_screened_mds(struct msg_digest **mds, unsigned nr_mds);
+
 /* State transition function infrastructure
  *
  * com_handle parses a message, decides what state object it applies to,
@@ -155,6 +170,8 @@ struct msg_digest {
 	bool event_already_set;			/* (v1) */
 	bool fake_clone;			/* is this a fake (clone) message */
 	bool fake_dne;				/* created as part of fake_md() */
+	bool hdr_decoded;			/* .hdr and .message_pbs filled in by a receive worker */
+	bool v2_cookie_verified;		/* (v2) receive worker matched the COOKIE */
 
 	/*
 	 * Note that .pbs[] is indexed using either enum v1_pbs or
@@ -14,37 +14,182 @@
  */
 
 #include <stdint.h>
+#include <string.h>		/* for memcpy() */
 
 
 #include "defs.h"
+#include "log.h"
+#include "show.h"
+#include "rnd.h"		/* for get_rnd_bytes() */
 #include "hash_table.h"
+#include "siphash.h"
 
 const hash_t zero_hash = { 0 };
 
-void init_hash_table(struct hash_table *table)
+/*
+ * Resize thresholds, in entries per slot.  Grow by doubling once the
+ * average chain is longer than MAX_LOAD; shrink by halving once it
+ * drops below 1/MIN_LOAD_DIVISOR (but never below the initial size).
+ */
+#define MAX_LOAD 2
+#define MIN_LOAD_DIVISOR 8
+
+/*
+ * Number of OLD slots migrated each time an entry is added or
+ * deleted.  Growing happens after NR_SLOTS*MAX_LOAD adds so, with at
+ * least one slot migrated per add, a resize always completes well
+ * before the next is needed.
+ */
+#define MIGRATE_STEP 2
+
+static struct list_head *alloc_slots(const struct hash_table *table,
+				     unsigned long nr_slots)
 {
-	for (unsigned i = 0; i < table->nr_slots; i++) {
-		struct list_head *slot = &table->slots[i];
+	struct list_head *slots = alloc_things(struct list_head, nr_slots,
+					       table->info.name);
+	for (unsigned long i = 0; i < nr_slots; i++) {
+		struct list_head *slot = &slots[i];
 		*slot = (struct list_head) INIT_LIST_HEAD(slot, &table->info);
 	}
+	return slots;
+}
+
+/*
+ * Key for hash_table_hasher(), generated the first time a table is
+ * initialized (NSS must be up).  It must not change once entries
+ * have been hashed.
+ */
+
+static struct {
+	bool initialized;
+	struct siphash_key key;
+} hash_key;
+
+void init_hash_table(struct hash_table *table)
+{
+	if (!hash_key.initialized) {
+		get_rnd_bytes(&hash_key.key, sizeof(hash_key.key));
+		hash_key.initialized = true;
+	}
+	passert(table->nr_slots > 0);
+	passert(table->slots == NULL);
+	table->min_slots = table->nr_slots;
+	table->slots = alloc_slots(table, table->nr_slots);
+}
+
+void free_hash_table(struct hash_table *table)
+{
+	pfreeany(table->slots);
+	pfreeany(table->old.slots);
+	table->old.nr_slots = table->old.migrated = 0;
+	table->nr_slots = table->min_slots;
 }
 
+/*
+ * SipHash-1-3 keyed with HASH_KEY.
+ *
+ * The key stops a peer choosing values (such as IKE SPIi) that all
+ * land in the same bucket.  The result isn't expected to be stable
+ * across restarts.
+ *
+ * HASH, the result of an earlier call, is folded into the key so that
+ * several fields can be chained.
+ */
+
 hash_t hash_table_hasher(shunk_t data, hash_t hash)
 {
+	struct siphash_key key = {
+		.k0 = hash_key.key.k0 ^ hash.hash,
+		.k1 = hash_key.key.k1,
+	};
+	struct siphash sip;
+	siphash_init(&sip, &key, SIPHASH_1_3, SIPHASH_64_SIZE);
+	siphash_update(&sip, data.ptr, data.len);
+	uint8_t out[SIPHASH_64_SIZE];
+	siphash_final(&sip, out);
+
+	uint64_t h;
+	memcpy(&h, out, sizeof(h));
+	return (hash_t) { .hash = (unsigned)(h ^ (h >> 32)), };
+}
+
+/*
+ * Move all entries in OLD slot I to the new slots.
+ *
+ * Oldest entries are moved first and inserted as the newest, so
+ * entries with the same hash keep their relative order.
+ */
+
+static void migrate_old_slot(struct hash_table *table, unsigned long i)
+{
+	struct list_head *old = &table->old.slots[i];
+	while (old->head.newer != &old->head) {
+		struct list_entry *entry = old->head.newer;
+		remove_list_entry(entry);
+		hash_t hash = table->hasher(entry->data);
+		insert_list_entry(&table->slots[hash.hash % table->nr_slots], entry);
+	}
+}
+
+static void migrate_old_slots(struct hash_table *table, unsigned long nr)
+{
+	if (table->old.slots == NULL) {
+		return;
+	}
+	for (; nr > 0 && table->old.migrated < table->old.nr_slots; nr--) {
+		migrate_old_slot(table, table->old.migrated++);
+	}
+	if (table->old.migrated >= table->old.nr_slots) {
+		dbg("%s: resize from %lu to %lu slots complete",
+		    table->info.name, table->old.nr_slots, table->nr_slots);
+		pfree(table->old.slots);
+		table->old.slots = NULL;
+		table->old.nr_slots = table->old.migrated = 0;
+	}
+}
+
+void finish_hash_table_resize(struct hash_table *table)
+{
+	migrate_old_slots(table, table->old.nr_slots);
+}
+
+static void maybe_resize_hash_table(struct hash_table *table)
+{
+	unsigned long nr_slots = table->nr_slots;
+	unsigned long nr_entries = table->nr_entries;
+	if (nr_entries > nr_slots * MAX_LOAD) {
+		nr_slots = nr_slots * 2 + 1; /* keep it odd */
+	} else if (nr_entries < nr_slots / MIN_LOAD_DIVISOR &&
+		   nr_slots / 2 >= table->min_slots &&
+		   table->old.slots == NULL) {
+		/* shrinking can wait for the last resize to finish */
+		nr_slots = nr_slots / 2;
+	} else {
+		return;
+	}
 	/*
-	 * 251 is a prime close to 256 (so like <<8).
-	 *
-	 * There's no real rationale for doing this.
+	 * At most one resize in progress.  When growing this is a
+	 * no-op (see MIGRATE_STEP).
 	 */
-	const uint8_t *bytes = data.ptr;
-	for (unsigned j = 0; j < data.len; j++) {
-		hash.hash = hash.hash * 251 + bytes[j];
-	}
-	return hash;
+	finish_hash_table_resize(table);
+	dbg("%s: resizing from %lu to %lu slots; %lu entries",
+	    table->info.name, table->nr_slots, nr_slots, nr_entries);
+	table->old.slots = table->slots;
+	table->old.nr_slots = table->nr_slots;
+	table->old.migrated = 0;
+	table->slots = alloc_slots(table, nr_slots);
+	table->nr_slots = nr_slots;
 }
 
 struct list_head *hash_table_bucket(struct hash_table *table, hash_t hash)
 {
+	if (table->old.slots != NULL) {
+		/* entries matching HASH may still be in the old slot */
+		unsigned long i = hash.hash % table->old.nr_slots;
+		if (i >= table->old.migrated) {
+			migrate_old_slot(table, i);
+		}
+	}
 	return &table->slots[hash.hash % table->nr_slots];
 }
 
@@ -52,9 +197,11 @@ void add_hash_table_entry(struct hash_table *table, void *data)
 {
 	struct list_entry *entry = table->entry(data);
 	*entry = list_entry(&table->info, data);
+	table->nr_entries++;
+	maybe_resize_hash_table(table);
+	migrate_old_slots(table, MIGRATE_STEP);
 	hash_t hash = table->hasher(data);
 	struct list_head *bucket = hash_table_bucket(table, hash);
-	table->nr_entries++;
 	insert_list_entry(bucket, entry);
 }
 
@@ -63,6 +210,8 @@ void del_hash_table_entry(struct hash_table *table, void *data)
 	struct list_entry *entry = table->entry(data);
 	table->nr_entries--;
 	remove_list_entry(entry);
+	maybe_resize_hash_table(table);
+	migrate_old_slots(table, MIGRATE_STEP);
 }
 
 void rehash_table_entry(struct hash_table *table, void *data)
@@ -70,3 +219,39 @@ void rehash_table_entry(struct hash_table *table, void *data)
 	del_hash_table_entry(table, data);
 	add_hash_table_entry(table, data);
 }
+
+static unsigned long longest_chain(const struct list_head *slots,
+				   unsigned long nr_slots)
+{
+	unsigned long longest = 0;
+	for (unsigned long i = 0; i < nr_slots; i++) {
+		unsigned long length = 0;
+		const void *data;
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&slots[i], data) {
+			length++;
+		}
+		longest = (length > longest ? length : longest);
+	}
+	return longest;
+}
+
+void show_hash_table_stats(struct show *s, const char *name,
+			   struct hash_table *table)
+{
+	/*
+	 * Don't force the migration; a partially migrated table is
+	 * interesting in its own right.
+	 */
+	unsigned long longest = longest_chain(table->slots, table->nr_slots);
+	if (table->old.slots != NULL) {
+		unsigned long old = longest_chain(table->old.slots, table->old.nr_slots);
+		longest = (old > longest ? old : longest);
+	}
+	/* load factor as a fixed point value with two decimals */
+	unsigned long load = table->nr_entries * 100 / table->nr_slots;
+	show_raw(s, "%s.entries=%ld", name, table->nr_entries);
+	show_raw(s, "%s.slots=%lu", name, table->nr_slots);
+	show_raw(s, "%s.load=%lu.%02lu", name, load / 100, load % 100);
+	show_raw(s, "%s.longest_chain=%lu", name, longest);
+	show_raw(s, "%s.resizing=%s", name, table->old.slots != NULL ? "yes" : "no");
+}
@@ -19,8 +19,21 @@
 #include "list_entry.h"
 #include "shunk.h"		/* has constant ptr */
 
+struct show;
+
 /*
  * Generic hash table.
+ *
+ * The table grows and shrinks as entries are added.  Resizing is
+ * incremental: when a resize starts, the current slots become the
+ * OLD slots and a few of them are migrated to the new slots each time
+ * an entry is added or deleted.  Looking up a bucket first migrates
+ * the one OLD slot that could contain matching entries, so a lookup
+ * only ever needs to search a single bucket.
+ *
+ * A resize is only started by add_hash_table_entry() (and hence
+ * rehash_table_entry()).  Don't add entries while iterating over a
+ * bucket of the same table.
  */
 
 typedef struct { unsigned hash; } hash_t;
@@ -30,12 +43,20 @@ struct hash_table {
 	const struct list_info info;
 	hash_t (*hasher)(const void *data);
 	struct list_entry *(*entry)(void *data);
-	long nr_entries; /* approx? */
-	unsigned long nr_slots;
+	long nr_entries;
+	unsigned long nr_slots; /* initially, the minimum size */
 	struct list_head *slots;
+	/* private */
+	unsigned long min_slots;
+	struct {
+		unsigned long nr_slots;
+		struct list_head *slots;
+		unsigned long migrated; /* slots [0..migrated) are empty */
+	} old;
 };
 
 void init_hash_table(struct hash_table *table);
+void free_hash_table(struct hash_table *table);
 
 hash_t hash_table_hasher(shunk_t data, hash_t hash);
 
@@ -60,4 +81,19 @@ void rehash_table_entry(struct hash_table *table, void *data);
 
 struct list_head *hash_table_bucket(struct hash_table *table, hash_t hash);
 
+/*
+ * Complete any in-progress resize so that all entries are in
+ * TABLE->SLOTS[0..NR_SLOTS); use this before walking every slot.
+ */
+
+void finish_hash_table_resize(struct hash_table *table);
+
+/*
+ * Show the table's size, load factor, and longest chain using
+ * NAME.<field>=<value>.
+ */
+
+void show_hash_table_stats(struct show *s, const char *name,
+			   struct hash_table *table);
+
 #endif
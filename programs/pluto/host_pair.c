@@ -32,6 +32,7 @@
 #include "iface.h"
 #include "orient.h"
 #include "host_pair.h"
+#include "connection_db.h"
 
 /*
  * Table of host_pairs (local->remote endpoints/addresses).
@@ -74,8 +75,6 @@ static struct list_entry *host_pair_list_entry(void *data)
 	return &hp->host_pair_entry;
 }
 
-struct list_head host_pair_buckets[STATE_TABLE_SIZE];
-
 static struct hash_table host_pairs = {
 	.info = {
 		.name = "host_pair table",
@@ -83,8 +82,7 @@ static struct hash_table host_pairs = {
 	},
 	.hasher = host_pair_hasher,
 	.entry = host_pair_list_entry,
-	.nr_slots = elemsof(host_pair_buckets),
-	.slots = host_pair_buckets,
+	.nr_slots = STATE_TABLE_SIZE,
 };
 
 void init_host_pair(void)
@@ -92,6 +90,16 @@ void init_host_pair(void)
 	init_hash_table(&host_pairs);
 }
 
+void free_host_pairs(void)
+{
+	free_hash_table(&host_pairs);
+}
+
+void show_host_pair_stats(struct show *s)
+{
+	show_hash_table_stats(s, "hash.host_pair", &host_pairs);
+}
+
 #define LIST_RM(ENEXT, E, EHEAD, EXPECTED)				\
 	{								\
 		bool found_ = false;					\
@@ -245,6 +253,8 @@ struct connection *next_host_pair_connection(const ip_address local,
 
 void connect_to_host_pair(struct connection *c)
 {
+	/* the remote host address may have changed since last time */
+	rehash_connection_remote_address(c);
 	if (oriented(*c)) {
 		struct host_pair *hp = find_host_pair(c->spd.this.host_addr,
 						      /* remote could be unset OR any */
@@ -494,6 +504,17 @@ void check_orientations(void)
 		if (i->ip_dev->ifd_change != IFD_ADD) {
 			continue;
 		}
+		/*
+		 * Collect the host pairs first: re-orienting deletes
+		 * and adds host pairs which would both disturb the
+		 * walk (possibly resizing the table) and free the
+		 * entry being walked.
+		 */
+		finish_hash_table_resize(&host_pairs);
+		struct host_pair **bad = alloc_things(struct host_pair *,
+						      host_pairs.nr_entries + 1,
+						      "double-oriented host pairs");
+		unsigned nr_bad = 0;
 		for (unsigned u = 0; u < host_pairs.nr_slots; u++) {
 			struct list_head *bucket = &host_pairs.slots[u];
 			struct host_pair *hp = NULL;
@@ -504,37 +525,38 @@ void check_orientations(void)
 				 */
 				if (sameaddr(&hp->remote,
 					     &i->ip_dev->id_address)) {
-					/*
-					 * bad news: the whole chain
-					 * of connections hanging off
-					 * this host pair has both
-					 * sides matching an
-					 * interface.  We'll get rid
-					 * of them, using orient and
-					 * connect_to_host_pair.
-					 */
-					struct connection *c =
-						hp->connections;
-					hp->connections = NULL;
-					while (c != NULL) {
-						struct connection *nxt =
-							c->hp_next;
-						c->interface = NULL;
-						c->host_pair = NULL;
-						c->hp_next = NULL;
-						orient(c);
-						connect_to_host_pair(c);
-						c = nxt;
-					}
-					/*
-					 * XXX: is this ever not the
-					 * case?
-					 */
-					if (hp->connections == NULL) {
-						free_host_pair(&hp, HERE);
-					}
+					passert(nr_bad < host_pairs.nr_entries);
+					bad[nr_bad++] = hp;
 				}
 			}
 		}
+		for (unsigned b = 0; b < nr_bad; b++) {
+			struct host_pair *hp = bad[b];
+			/*
+			 * bad news: the whole chain of connections
+			 * hanging off this host pair has both sides
+			 * matching an interface.  We'll get rid of
+			 * them, using orient and
+			 * connect_to_host_pair.
+			 */
+			struct connection *c = hp->connections;
+			hp->connections = NULL;
+			while (c != NULL) {
+				struct connection *nxt = c->hp_next;
+				c->interface = NULL;
+				c->host_pair = NULL;
+				c->hp_next = NULL;
+				orient(c);
+				connect_to_host_pair(c);
+				c = nxt;
+			}
+			/*
+			 * XXX: is this ever not the case?
+			 */
+			if (hp->connections == NULL) {
+				free_host_pair(&hp, HERE);
+			}
+		}
+		pfree(bad);
 	}
 }
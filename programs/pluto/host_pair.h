@@ -33,6 +33,7 @@
 struct msg_digest;
 struct connection;
 struct pending;
+struct show;
 
 struct host_pair {
 	const char *magic;
@@ -64,6 +65,8 @@ extern void release_dead_interfaces(struct logger *logger);
 extern void check_orientations(void);
 
 void init_host_pair(void);
+void free_host_pairs(void);
+void show_host_pair_stats(struct show *s);
 
 struct connection *next_host_pair_connection(const ip_address local,
 					     const ip_address remote,
@@ -42,6 +42,7 @@
 #include "ip_info.h"
 #include "ip_sockaddr.h"
 #include "ip_encap.h"
+#include "send.h"			/* for flush_send_queue() */
 
 struct iface_endpoint  *interfaces = NULL;  /* public interfaces */
 
@@ -196,16 +197,37 @@ void free_ifaces(struct logger *logger)
 
 void free_any_iface_endpoint(struct iface_endpoint **ifp)
 {
+	/* queued packets point at the interface */
+	flush_send_queue();
 	/* generic stuff */
 	(*ifp)->io->cleanup(*ifp);
-	release_iface_dev(&(*ifp)->ip_dev);
 	/* XXX: after cleanup so code can log FD */
 	close((*ifp)->fd);
 	(*ifp)->fd = -1;
+	/* any MDs still hold a reference */
+	iface_endpoint_delref(ifp, HERE);
+}
+
+static void free_iface_endpoint(struct iface_endpoint **ifp,
+				where_t where UNUSED)
+{
+	release_iface_dev(&(*ifp)->ip_dev);
 	pfree((*ifp));
 	*ifp = NULL;
 }
 
+struct iface_endpoint *iface_endpoint_addref(const struct iface_endpoint *ifp,
+					     where_t where)
+{
+	struct iface_endpoint *p = (void*)ifp; /* hack const */
+	return refcnt_addref(p, where);
+}
+
+void iface_endpoint_delref(struct iface_endpoint **ifp, where_t where)
+{
+	refcnt_delref(ifp, free_iface_endpoint, where);
+}
+
 struct iface_endpoint *bind_iface_endpoint(struct iface_dev *ifd, const struct iface_io *io,
 					   ip_port port,
 					   bool esp_encapsulation_enabled,
@@ -231,8 +253,7 @@ struct iface_endpoint *bind_iface_endpoint(struct iface_dev *ifd, const struct i
 		return NULL;
 	}
 
-	struct iface_endpoint *ifp = alloc_thing(struct iface_endpoint,
-					     "struct iface_endpoint");
+	struct iface_endpoint *ifp = refcnt_alloc(struct iface_endpoint, HERE);
 	ifp->fd = fd;
 	ifp->ip_dev = add_ref(ifd);
 	ifp->io = io;
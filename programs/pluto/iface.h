@@ -39,6 +39,15 @@ struct iface_packet {
 	struct logger *logger; /*global*/
 };
 
+struct iface_write {
+	const void *ptr;
+	size_t len;
+	ip_endpoint remote_endpoint;
+	/* results */
+	ssize_t wlen;
+	int error;	/* errno when WLEN != LEN */
+};
+
 enum iface_read_status {
 	IFACE_READ_OK = 0,
 	IFACE_READ_IGNORE, /* aka EAGAIN */
@@ -54,10 +63,20 @@ struct iface_io {
 	enum iface_read_status (*read_packet)(struct iface_endpoint *ifp,
 					      struct iface_packet *,
 					      struct logger *logger);
+	/* optional; read a batch, return number of good packets */
+	unsigned (*read_packets)(struct iface_endpoint *ifp,
+				 struct iface_packet *packets,
+				 unsigned nr_packets,
+				 struct logger *logger);
 	ssize_t (*write_packet)(const struct iface_endpoint *ifp,
 				const void *ptr, size_t len,
 				const ip_endpoint *remote_endpoint,
 				struct logger *logger);
+	/* optional; write a batch, filling in each wlen and error */
+	void (*write_packets)(const struct iface_endpoint *ifp,
+			      struct iface_write *writes,
+			      unsigned nr_writes,
+			      struct logger *logger);
 	void (*cleanup)(struct iface_endpoint *ifp);
 	void (*listen)(struct iface_endpoint *fip, struct logger *logger);
 	int (*bind_iface_endpoint)(struct iface_dev *ifd,
@@ -95,6 +114,7 @@ void add_or_keep_iface_dev(struct raw_iface *ifp, struct logger *logger);
 struct iface_dev *find_iface_dev_by_address(const ip_address *address);
 
 struct iface_endpoint {
+	refcnt_t refcnt;	/* interfaces list or TCP state, and each MD */
 	struct iface_dev   *ip_dev;
 	const struct iface_io *io;
 	ip_endpoint local_endpoint;	/* interface IP address:port */
@@ -159,6 +179,7 @@ struct iface_endpoint {
 	bool float_nat_initiator;
 	/* udp only */
 	struct event *udp_message_listener;
+	struct udp_workers *udp_workers;	/* see ike-socket-workers= */
 	/* tcp port only */
 	struct evconnlistener *tcp_accept_listener;
 	/* tcp stream only */
@@ -177,6 +198,14 @@ struct iface_endpoint {
 void stop_iketcp_iface_endpoint(struct iface_endpoint **ifp);
 void free_any_iface_endpoint(struct iface_endpoint **ifp);
 
+/*
+ * An MD holds a reference so that, once free_any_iface_endpoint()
+ * has closed the socket (.fd is -1), queued and suspended messages
+ * can still look at the interface.
+ */
+struct iface_endpoint *iface_endpoint_addref(const struct iface_endpoint *ifp, where_t where);
+void iface_endpoint_delref(struct iface_endpoint **ifp, where_t where);
+
 extern struct iface_endpoint *interfaces;   /* public interfaces */
 
 extern struct iface_endpoint *find_iface_endpoint_by_local_endpoint(ip_endpoint local_endpoint);
@@ -742,7 +742,7 @@ stf_status create_tcp_interface(struct state *st)
 #endif
 	}
 
-	struct iface_endpoint *ifp = alloc_thing(struct iface_endpoint, "TCP iface initiator");
+	struct iface_endpoint *ifp = refcnt_alloc(struct iface_endpoint, HERE);
 	ifp->io = &iketcp_iface_io;
 	ifp->fd = fd;
 	ifp->local_endpoint = local_endpoint;
@@ -793,7 +793,7 @@ void accept_ike_in_tcp_cb(struct evconnlistener *evcon UNUSED,
 									      &ip_protocol_tcp,
 									      remote_tcp_port);
 
-	struct iface_endpoint *ifp = alloc_thing(struct iface_endpoint, "TCP iface responder");
+	struct iface_endpoint *ifp = refcnt_alloc(struct iface_endpoint, HERE);
 	ifp->fd = accepted_fd;
 	ifp->io = &iketcp_iface_io;
 	ifp->protocol = &ip_protocol_tcp;
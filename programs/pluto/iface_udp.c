@@ -29,11 +29,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifdef MSG_ERRQUEUE
 # include <netinet/in.h> 	/* for IP_RECVERR */
 # include <linux/errqueue.h>
-# include <poll.h>
 #endif
 
 #include "ip_address.h"
@@ -48,6 +48,7 @@
 #include "ip_info.h"
 #include "ip_sockaddr.h"
 #include "nat_traversal.h"	/* for nat_traversal_enabled which seems like a broken idea */
+#include "pluto_stats.h"
 
 static int bind_udp_socket(const struct iface_dev *ifd, ip_port port,
 			   struct logger *logger)
@@ -85,6 +86,17 @@ static int bind_udp_socket(const struct iface_dev *ifd, ip_port port,
 		return -1;
 	}
 
+#ifdef SO_REUSEPORT
+	/* receive workers share the port; see start_udp_workers() */
+	if (pluto_sock_workers > 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+		       (const void *)&on, sizeof(on)) < 0) {
+		log_errno(logger, errno, "setsockopt SO_REUSEPORT in create_socket()");
+		close(fd);
+		return -1;
+	}
+#endif
+
 #ifdef SO_PRIORITY
 	static const int so_prio = 6; /* rumored maximum priority, might be 7 on linux? */
 	if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY,
@@ -232,38 +244,50 @@ static bool nat_traversal_espinudp(int sk, struct iface_dev *ifd,
 }
 
 #ifdef MSG_ERRQUEUE
-static bool check_msg_errqueue(const struct iface_endpoint *ifp,
-			       short interest, const char *func,
-			       struct logger *logger);
+static unsigned drain_msg_errqueue(const struct iface_endpoint *ifp,
+				   const char *func,
+				   struct logger *logger);
 #endif
 
-static enum iface_read_status udp_read_packet(struct iface_endpoint *ifp,
-					      struct iface_packet *packet,
-					      struct logger *logger)
+/*
+ * A read failed (the socket is non-blocking so a wakeup with nothing
+ * normal to read shows up as EAGAIN).  Since epoll(7) reports a
+ * non-empty MSG_ERRQUEUE as POLLERR, which libevent turns into a
+ * read event, this is the point to drain that queue.
+ *
+ * Return true when the failure has been accounted for and need not
+ * be logged.
+ */
+
+static bool udp_read_failed(struct iface_endpoint *ifp /*possibly*/UNUSED,
+			    int packet_errno,
+			    struct logger *logger /*possibly*/UNUSED)
 {
 #ifdef MSG_ERRQUEUE
-	/*
-	 * Even though select(2) says that there is a message, it
-	 * might only be a MSG_ERRQUEUE message.  At least sometimes
-	 * that leads to a hanging recvfrom.  To avoid what appears to
-	 * be a kernel bug, check_msg_errqueue uses poll(2) and tells
-	 * us if there is anything for us to read.
-	 *
-	 * This is early enough that teardown isn't required:
-	 * just return on failure.
-	 */
 	if (pluto_sock_errqueue) {
 		threadtime_t errqueue_start = threadtime_start();
-		bool errqueue_ok = check_msg_errqueue(ifp, POLLIN, __func__,
-						      packet->logger);
+		unsigned nr = drain_msg_errqueue(ifp, __func__, logger);
 		threadtime_stop(&errqueue_start, SOS_NOBODY,
-				"%s() calling check_incoming_msg_errqueue()", __func__);
-		if (!errqueue_ok) {
-			return IFACE_READ_IGNORE; /* no normal message to read */
+				"%s() calling drain_msg_errqueue()", __func__);
+		if (nr > 0) {
+			/* the queued report is more informative */
+			return true;
 		}
 	}
 #endif
+	return (packet_errno == EAGAIN || packet_errno == EWOULDBLOCK);
+}
+
+static enum iface_read_status udp_check_packet(struct iface_endpoint *ifp,
+					       struct iface_packet *packet,
+					       ip_sockaddr from,
+					       int packet_errno,
+					       struct logger *logger);
 
+static enum iface_read_status udp_read_packet(struct iface_endpoint *ifp,
+					      struct iface_packet *packet,
+					      struct logger *logger)
+{
 	/*
 	 * COVERITY reports an overflow because FROM.LEN (aka
 	 * sizeof(FROM.SA)) > sizeof(from.sa.sa).  That's the point.
@@ -276,7 +300,84 @@ static enum iface_read_status udp_read_packet(struct iface_endpoint *ifp,
 	packet->len = recvfrom(ifp->fd, packet->ptr, packet->len, /*flags*/ 0,
 			       &from.sa.sa, &from.len);
 	int packet_errno = errno; /* save!!! */
+	if (packet->len < 0 && udp_read_failed(ifp, packet_errno, logger)) {
+		return IFACE_READ_IGNORE; /* no normal message to read */
+	}
+	return udp_check_packet(ifp, packet, from, packet_errno, logger);
+}
+
+#ifdef MSG_WAITFORONE
+
+/*
+ * Read up to NR_PACKETS datagrams using a single recvmmsg() call.
+ *
+ * Each PACKETS[] entry must describe an empty buffer.  Packets that
+ * fail udp_check_packet() are logged and dropped and the rest are
+ * packed at the front; return how many are left.
+ */
+
+static unsigned udp_read_packets(struct iface_endpoint *ifp,
+				 struct iface_packet *packets,
+				 unsigned nr_packets,
+				 struct logger *logger)
+{
+	struct mmsghdr msgs[nr_packets];
+	struct iovec iovs[nr_packets];
+	ip_sockaddr froms[nr_packets];
+	zero(&msgs);
+	zero(&froms);
+	for (unsigned i = 0; i < nr_packets; i++) {
+		froms[i].len = sizeof(froms[i].sa);
+		iovs[i] = (struct iovec) {
+			.iov_base = packets[i].ptr,
+			.iov_len = packets[i].len,
+		};
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &froms[i].sa.sa,
+			.msg_namelen = froms[i].len,
+			.msg_iov = &iovs[i],
+			.msg_iovlen = 1,
+		};
+	}
+
+	int nr = recvmmsg(ifp->fd, msgs, nr_packets, MSG_DONTWAIT, NULL);
+	if (nr < 0) {
+		int packet_errno = errno; /* save!!! */
+		if (udp_read_failed(ifp, packet_errno, logger)) {
+			return 0; /* no normal message to read */
+		}
+		/* let the single packet code explain the failure */
+		packets[0].len = -1;
+		udp_check_packet(ifp, &packets[0], froms[0], packet_errno, logger);
+		return 0;
+	}
+
+	pstats_ike_recv_batches++;
+	pstats_ike_recv_batched += nr;
+	if ((unsigned)nr == nr_packets) {
+		pstats_ike_recv_batch_full++;
+	}
 
+	unsigned nr_ok = 0;
+	for (int i = 0; i < nr; i++) {
+		struct iface_packet packet = packets[i];
+		packet.len = msgs[i].msg_len;
+		froms[i].len = msgs[i].msg_hdr.msg_namelen;
+		if (udp_check_packet(ifp, &packet, froms[i], 0, logger) == IFACE_READ_OK) {
+			packets[nr_ok++] = packet;
+		}
+	}
+	return nr_ok;
+}
+
+#endif
+
+static enum iface_read_status udp_check_packet(struct iface_endpoint *ifp,
+					       struct iface_packet *packet,
+					       ip_sockaddr from,
+					       int packet_errno,
+					       struct logger *logger)
+{
 	/*
 	 * Try to decode the from address.
 	 *
@@ -382,27 +483,53 @@ static enum iface_read_status udp_read_packet(struct iface_endpoint *ifp,
 	return IFACE_READ_OK;
 }
 
-static ssize_t udp_write_packet(const struct iface_endpoint *ifp,
-				const void *ptr, size_t len,
-				const ip_endpoint *remote_endpoint,
-				struct logger *logger /*possibly*/UNUSED)
+/*
+ * A write failed.  If that was because of a pending MSG_ERRQUEUE
+ * report (the kernel returns the error on the next socket operation)
+ * then draining the queue reports it against the likely sender and
+ * the write is worth trying again.
+ */
+
+static bool udp_retry_write(const struct iface_endpoint *ifp /*possibly*/UNUSED,
+			    const char *func /*possibly*/UNUSED,
+			    struct logger *logger /*possibly*/UNUSED)
 {
+	int write_errno = errno; /* save!!! */
+	bool retry = false;
 #ifdef MSG_ERRQUEUE
-	if (pluto_sock_errqueue) {
-		check_msg_errqueue(ifp, POLLOUT, __func__, logger);
+	if (pluto_sock_errqueue &&
+	    write_errno != EAGAIN && write_errno != EWOULDBLOCK) {
+		retry = (drain_msg_errqueue(ifp, func, logger) > 0);
 	}
 #endif
+	errno = write_errno;
+	return retry;
+}
 
+static ssize_t udp_write_packet(const struct iface_endpoint *ifp,
+				const void *ptr, size_t len,
+				const ip_endpoint *remote_endpoint,
+				struct logger *logger /*possibly*/UNUSED)
+{
 	ip_sockaddr remote_sa = sockaddr_from_endpoint(*remote_endpoint);
-	return sendto(ifp->fd, ptr, len, 0, &remote_sa.sa.sa, remote_sa.len);
+	ssize_t wlen = sendto(ifp->fd, ptr, len, 0, &remote_sa.sa.sa, remote_sa.len);
+	if (wlen < 0 && udp_retry_write(ifp, __func__, logger)) {
+		wlen = sendto(ifp->fd, ptr, len, 0, &remote_sa.sa.sa, remote_sa.len);
+	}
+	return wlen;
 };
 
+static void start_udp_workers(struct iface_endpoint *ifp,
+			      struct logger *logger);
+static void stop_udp_workers(struct iface_endpoint *ifp);
+
 static void udp_listen(struct iface_endpoint *ifp,
-		       struct logger *unused_logger UNUSED)
+		       struct logger *logger)
 {
 	if (ifp->udp_message_listener == NULL) {
 		attach_fd_read_sensor(&ifp->udp_message_listener, ifp->fd,
 				      process_iface_packet, ifp);
+		start_udp_workers(ifp, logger);
 	}
 }
 
@@ -421,17 +548,373 @@ static int udp_bind_iface_endpoint(struct iface_dev *ifd, ip_port port,
 	return fd;
 }
 
+/*
+ * Receive workers (ike-socket-workers=).
+ *
+ * Each worker owns an extra socket bound, using SO_REUSEPORT, to the
+ * same address:port as IFP; the kernel spreads incoming datagrams
+ * across IFP's socket and the workers' by address and port so
+ * messages from a given peer stay in order.  A worker blocks reading
+ * its socket, does the stateless checks (udp_check_packet() and
+ * screen_iface_packet()), and hands each surviving MD to the main
+ * thread through its own single-producer single-consumer queue.
+ *
+ * The worker sockets are only used for reading; responses still go
+ * out through IFP's socket.
+ */
+
+#define UDP_WORKER_QUEUE_SIZE 256	/* power of two */
+
+struct udp_worker {
+	uint64_t tail;		/* written by the worker */
+	char tail_pad[64 - sizeof(uint64_t)];
+	uint64_t head;		/* written by the main thread */
+	char head_pad[64 - sizeof(uint64_t)];
+	struct msg_digest *mds[UDP_WORKER_QUEUE_SIZE];
+	struct udp_workers *workers;
+	unsigned id;
+	int fd;
+	pthread_t thread;
+};
+
+struct udp_workers {
+	struct iface_endpoint *ifp;
+	struct event *event;	/* wakes the main thread */
+	bool wakeup;		/* .event is (about to be) active */
+	bool stopping;
+	unsigned nr;
+	struct udp_worker worker[];
+};
+
+/* IN A WORKER THREAD */
+static bool push_udp_worker_queue(struct udp_worker *w, struct msg_digest *md)
+{
+	uint64_t tail = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+	if (tail - head >= UDP_WORKER_QUEUE_SIZE) {
+		return false;
+	}
+	w->mds[tail % UDP_WORKER_QUEUE_SIZE] = md;
+	/* publish the MD; see wake_udp_workers_event() for why this is SEQ_CST */
+	__atomic_store_n(&w->tail, tail + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+/* IN THE MAIN THREAD */
+static struct msg_digest *pop_udp_worker_queue(struct udp_worker *w)
+{
+	uint64_t head = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST);
+	if (head == tail) {
+		return NULL;
+	}
+	struct msg_digest *md = w->mds[head % UDP_WORKER_QUEUE_SIZE];
+	__atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+	return md;
+}
+
+/*
+ * Only the first push after the main thread clears .wakeup activates
+ * the event.  Since the push, the exchange, the main thread's clear,
+ * and its pop are all SEQ_CST, either this sees .wakeup clear or the
+ * main thread sees the push.
+ */
+
+static void wake_udp_workers_event(struct udp_workers *workers)
+{
+	if (!__atomic_exchange_n(&workers->wakeup, true, __ATOMIC_SEQ_CST)) {
+		event_active(workers->event, EV_READ, 0);
+	}
+}
+
+static void *udp_worker_thread(void *arg)
+{
+	struct udp_worker *w = arg;
+	struct udp_workers *workers = w->workers;
+	struct logger logger[1] = { GLOBAL_LOGGER(null_fd), };
+	uint8_t *buffer = alloc_bytes(MAX_INPUT_UDP_SIZE, "receive worker buffer");
+
+	dbg("receive worker %u for %s started", w->id,
+	    workers->ifp->ip_dev->id_rname);
+
+	while (!__atomic_load_n(&workers->stopping, __ATOMIC_ACQUIRE)) {
+		ip_sockaddr from = {
+			.len = sizeof(from.sa),
+		};
+		struct iface_packet packet = {
+			.ptr = buffer,
+			.len = MAX_INPUT_UDP_SIZE,
+			.logger = logger,
+		};
+		packet.len = recvfrom(w->fd, packet.ptr, packet.len, /*flags*/ 0,
+				      &from.sa.sa, &from.len);
+		int packet_errno = errno; /* save!!! */
+		if (__atomic_load_n(&workers->stopping, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		if (packet.len < 0) {
+			/*
+			 * Timeouts (SO_RCVTIMEO) are expected.
+			 * IP_RECVERR is off (see start_udp_workers())
+			 * so there is no MSG_ERRQUEUE to drain.
+			 */
+			if (packet_errno != EAGAIN && packet_errno != EWOULDBLOCK &&
+			    packet_errno != EINTR) {
+				dbg("receive worker %u: recvfrom failed "PRI_ERRNO,
+				    w->id, pri_errno(packet_errno));
+			}
+			continue;
+		}
+
+		struct msg_digest *md = NULL;
+		if (udp_check_packet(workers->ifp, &packet, from, 0, logger) == IFACE_READ_OK) {
+			md = screen_iface_packet(workers->ifp, &packet, logger);
+		}
+		if (md == NULL) {
+			/* already logged */
+			__atomic_add_fetch(&pstats_ike_recv_screened_out, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!push_udp_worker_queue(w, md)) {
+			dbg("receive worker %u: queue full, dropping packet", w->id);
+			md_delref(&md, HERE);
+			__atomic_add_fetch(&pstats_ike_recv_worker_overflow, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		wake_udp_workers_event(workers);
+	}
+
+	dbg("receive worker %u stopped", w->id);
+	pfree(buffer);
+	return NULL;
+}
+
+static void udp_workers_handler(evutil_socket_t fd UNUSED,
+				const short event UNUSED, void *arg)
+{
+	struct udp_workers *workers = arg;
+	__atomic_store_n(&workers->wakeup, false, __ATOMIC_SEQ_CST);
+
+	/* round-robin so that one busy worker can't starve the rest */
+	struct msg_digest *mds[MAX_IKE_RECV_BATCH];
+	unsigned nr = 0;
+	bool more = true;
+	while (more && nr < elemsof(mds)) {
+		more = false;
+		for (unsigned i = 0; i < workers->nr && nr < elemsof(mds); i++) {
+			struct msg_digest *md = pop_udp_worker_queue(&workers->worker[i]);
+			if (md != NULL) {
+				mds[nr++] = md;
+				more = true;
+			}
+		}
+	}
+	if (more) {
+		/* batch is full; come back for the rest */
+		wake_udp_workers_event(workers);
+	}
+
+	/*
+	 * XXX: Danger
+	 *
+	 * Processing a message can delete the interface and, with
+	 * it, the workers.
+	 */
+	workers = NULL;
+	process_screened_mds(mds, nr);
+}
+
+static void start_udp_workers(struct iface_endpoint *ifp,
+			      struct logger *logger)
+{
+	if (pluto_sock_workers == 0) {
+		return;
+	}
+#ifndef SO_REUSEPORT
+	llog(RC_LOG, logger,
+	     "ike-socket-workers=%u ignored, SO_REUSEPORT is not supported",
+	     pluto_sock_workers);
+#else
+	passert(ifp->udp_workers == NULL);
+	struct udp_workers *workers =
+		alloc_bytes(sizeof(struct udp_workers) +
+			    pluto_sock_workers * sizeof(struct udp_worker),
+			    "receive workers");
+	workers->ifp = ifp;
+	workers->event = event_new(get_pluto_event_base(), -1, 0,
+				   udp_workers_handler, workers);
+	passert(workers->event != NULL);
+	ifp->udp_workers = workers;
+
+	ip_port port = endpoint_port(ifp->local_endpoint);
+	for (unsigned i = 0; i < pluto_sock_workers; i++) {
+		int fd = udp_bind_iface_endpoint(ifp->ip_dev, port,
+						 ifp->esp_encapsulation_enabled,
+						 logger);
+		if (fd < 0) {
+			/* already logged */
+			break;
+		}
+
+		/*
+		 * The worker blocks in recvfrom(); the timeout is so
+		 * it notices when it is being stopped.
+		 */
+		int fcntl_flags = fcntl(fd, F_GETFL);
+		const struct timeval timeout = { .tv_sec = 1, };
+		if (fcntl_flags < 0 ||
+		    fcntl(fd, F_SETFL, fcntl_flags & ~O_NONBLOCK) < 0 ||
+		    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+			       &timeout, sizeof(timeout)) < 0) {
+			log_errno(logger, errno, "configuring receive worker socket failed");
+			close(fd);
+			break;
+		}
+
+#ifdef MSG_ERRQUEUE
+		/*
+		 * With SO_REUSEPORT the kernel can deliver an ICMP
+		 * error for a packet sent on the main socket to a
+		 * worker socket.  Since only the main thread can look
+		 * up the sender (see drain_msg_errqueue()), and a
+		 * blocked worker never notices its MSG_ERRQUEUE, turn
+		 * IP_RECVERR off (which also purges the queue); such
+		 * errors go unreported.
+		 */
+		if (pluto_sock_errqueue) {
+			static const int off = false;
+			if (setsockopt(fd, SOL_IP, IP_RECVERR,
+				       (const void *)&off, sizeof(off)) < 0) {
+				log_errno(logger, errno, "setsockopt IP_RECVERR in start_udp_workers()");
+				close(fd);
+				break;
+			}
+		}
+#endif
+
+		struct udp_worker *w = &workers->worker[workers->nr];
+		w->workers = workers;
+		w->id = workers->nr + 1;
+		w->fd = fd;
+		int status = pthread_create(&w->thread, NULL, udp_worker_thread, w);
+		if (status != 0) {
+			log_errno(logger, status, "starting receive worker failed");
+			close(fd);
+			break;
+		}
+		workers->nr++;
+	}
+
+	endpoint_buf eb;
+	llog(RC_LOG, logger, "started %u of %u receive workers for %s %s",
+	     workers->nr, pluto_sock_workers, ifp->ip_dev->id_rname,
+	     str_endpoint(&ifp->local_endpoint, &eb));
+#endif
+}
+
+static void stop_udp_workers(struct iface_endpoint *ifp)
+{
+	struct udp_workers *workers = ifp->udp_workers;
+	if (workers == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&workers->stopping, true, __ATOMIC_SEQ_CST);
+	for (unsigned i = 0; i < workers->nr; i++) {
+		/* wake up recvfrom(); Linux does this for UDP */
+		shutdown(workers->worker[i].fd, SHUT_RD);
+	}
+	for (unsigned i = 0; i < workers->nr; i++) {
+		struct udp_worker *w = &workers->worker[i];
+		pthread_join(w->thread, NULL);
+		close(w->fd);
+		struct msg_digest *md;
+		while ((md = pop_udp_worker_queue(w)) != NULL) {
+			md_delref(&md, HERE);
+		}
+	}
+
+	event_free(workers->event);
+	pfree(workers);
+	ifp->udp_workers = NULL;
+}
+
 static void udp_cleanup(struct iface_endpoint *ifp)
 {
+	stop_udp_workers(ifp);
 	event_free(ifp->udp_message_listener);
 	ifp->udp_message_listener = NULL;
 }
 
+#ifdef MSG_WAITFORONE
+
+/*
+ * Write NR_WRITES datagrams using as few sendmmsg() calls as
+ * possible.  A datagram that the kernel rejects is marked as failed
+ * (with errno) and skipped; the rest are still sent.
+ */
+
+static void udp_write_packets(const struct iface_endpoint *ifp,
+			      struct iface_write *writes,
+			      unsigned nr_writes,
+			      struct logger *logger /*possibly*/UNUSED)
+{
+	struct mmsghdr msgs[nr_writes];
+	struct iovec iovs[nr_writes];
+	ip_sockaddr remote_sas[nr_writes];
+	zero(&msgs);
+	for (unsigned i = 0; i < nr_writes; i++) {
+		remote_sas[i] = sockaddr_from_endpoint(writes[i].remote_endpoint);
+		iovs[i] = (struct iovec) {
+			.iov_base = (void *)writes[i].ptr,
+			.iov_len = writes[i].len,
+		};
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &remote_sas[i].sa.sa,
+			.msg_namelen = remote_sas[i].len,
+			.msg_iov = &iovs[i],
+			.msg_iovlen = 1,
+		};
+		writes[i].wlen = -1;
+		writes[i].error = 0;
+	}
+
+	unsigned next = 0;
+	bool retried = false;	/* has writes[next] been retried? */
+	while (next < nr_writes) {
+		int n = sendmmsg(ifp->fd, &msgs[next], nr_writes - next, 0);
+		if (n < 0 && !retried && udp_retry_write(ifp, __func__, logger)) {
+			retried = true;
+			continue;
+		}
+		if (n <= 0) {
+			/* first unsent packet failed; skip it */
+			writes[next].error = (n < 0 ? errno : EAGAIN);
+			next++;
+			retried = false;
+			continue;
+		}
+		retried = false;
+		for (int i = 0; i < n; i++) {
+			writes[next + i].wlen = msgs[next + i].msg_len;
+		}
+		next += n;
+	}
+}
+
+#endif
+
 const struct iface_io udp_iface_io = {
 	.send_keepalive = true,
 	.protocol = &ip_protocol_udp,
 	.read_packet = udp_read_packet,
+#ifdef MSG_WAITFORONE
+	.read_packets = udp_read_packets,
+#endif
 	.write_packet = udp_write_packet,
+#ifdef MSG_WAITFORONE
+	.write_packets = udp_write_packets,
+#endif
 	.listen = udp_listen,
 	.bind_iface_endpoint = udp_bind_iface_endpoint,
 	.cleanup = udp_cleanup,
@@ -455,35 +938,30 @@ const struct iface_io udp_iface_io = {
  *
  * ??? how long can the message be?
  *
- * ??? poll(2) has a very incomplete description of the POLL* events.
- * We assume that POLLIN, POLLOUT, and POLLERR are all we need to deal with
- * and that POLLERR will be on iff there is a MSG_ERRQUEUE message.
+ * The queue is drained lazily, so that the common case costs no
+ * extra system calls:
  *
- * We have to code around a couple of surprises:
- *
- * - Select can say that a socket is ready to read from, and
- *   yet a read will hang.  It turns out that a message available on the
- *   MSG_ERRQUEUE will cause select to say something is pending, but
- *   a normal read will hang.  poll(2) can tell when a MSG_ERRQUEUE
- *   message is pending.
- *
- *   This is dealt with by calling check_msg_errqueue after select has
- *   indicated that there is something to read, but before the read is
- *   performed.  check_msg_errqueue will return "true" if there is
- *   something left to read.
+ * - A MSG_ERRQUEUE message makes epoll(7) report POLLERR which
+ *   libevent delivers as a read event.  The socket is non-blocking so
+ *   the normal read then fails (EAGAIN, or the error itself) and only
+ *   then is the queue drained (see udp_read_failed()).  Since the
+ *   event is level-triggered, anything not drained causes another
+ *   wakeup.
  *
  * - A write to a socket may fail because there is a pending MSG_ERRQUEUE
  *   message, without there being anything wrong with the write.  This
  *   makes for confusing diagnostics.
  *
- *   To avoid this, we call check_msg_errqueue before a write.  True,
- *   there is a race condition (a MSG_ERRQUEUE message might arrive
- *   between the check and the write), but we should eliminate many
- *   of the problematic events.  To narrow the window, the poll(2)
- *   will await until an event happens (in the case or a write,
- *   POLLOUT; this should be benign for POLLIN).
+ *   To avoid this, when a write fails the queue is drained and, if
+ *   that found something, the write is retried once (see
+ *   udp_retry_write()).
+ *
+ * At most MAX_ERRQUEUE_DRAIN messages are processed per call so that
+ * a flood of ICMP can't starve the event loop.
  */
 
+#define MAX_ERRQUEUE_DRAIN 32
+
 static struct state *find_likely_sender(size_t packet_len, uint8_t *buffer,
 					size_t sizeof_buffer)
 {
@@ -571,19 +1049,13 @@ static struct state *find_likely_sender(size_t packet_len, uint8_t *buffer,
 	return st;
 }
 
-static bool check_msg_errqueue(const struct iface_endpoint *ifp, short interest,
-			       const char *before,
-			       struct logger *logger)
+static unsigned drain_msg_errqueue(const struct iface_endpoint *ifp,
+				   const char *before,
+				   struct logger *logger)
 {
-	struct pollfd pfd;
-	int again_count = 0;
-
-	pfd.fd = ifp->fd;
-	pfd.events = interest | POLLPRI | POLLOUT;
+	unsigned nr = 0;
 
-	while (/*clear .revents*/ pfd.revents = 0,
-		/*poll .revents*/ poll(&pfd, 1, -1) > 0 &&
-		/*test .revents*/ (pfd.revents & POLLERR)) {
+	while (nr < MAX_ERRQUEUE_DRAIN) {
 
 		/*
 		 * A single IOV (I/O Vector) pointing at a buffer for
@@ -623,29 +1095,18 @@ static bool check_msg_errqueue(const struct iface_endpoint *ifp, short interest,
 			.msg_flags = 0,
 		};
 
-		ssize_t packet_len = recvmsg(ifp->fd, &emh, MSG_ERRQUEUE);
+		ssize_t packet_len = recvmsg(ifp->fd, &emh, MSG_ERRQUEUE | MSG_DONTWAIT);
 
 		if (packet_len == -1) {
-			/* XXX: all paths either break. return, or continue */
-			if (errno == EAGAIN) {
-				/* 32 is picked from thin air */
-				if (again_count == 32) {
-					llog(RC_LOG_SERIOUS, logger,
-						    "recvmsg(,, MSG_ERRQUEUE): given up reading socket after 32 EAGAIN errors");
-					return false;
-				}
-				again_count++;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				log_errno(logger, errno,
-					  "recvmsg(,, MSG_ERRQUEUE) on %s failed (noticed before %s) (attempt %d)",
-					  ifp->ip_dev->id_rname, before, again_count);
-				continue;
+					  "recvmsg(,, MSG_ERRQUEUE) on %s failed (noticed in %s)",
+					  ifp->ip_dev->id_rname, before);
 			}
-			log_errno(logger, errno,
-				  "recvmsg(,, MSG_ERRQUEUE) on %s failed (noticed before %s)",
-				  ifp->ip_dev->id_rname, before);
-			break;
+			break; /* queue is empty */
 		}
 		passert(packet_len >= 0);
+		nr++;
 
 		/*
 		 * Getting back a truncated IKE datagram isn't a big
@@ -857,7 +1318,7 @@ static bool check_msg_errqueue(const struct iface_endpoint *ifp, short interest,
 			}
 		}
 	}
-	return (pfd.revents & interest) != 0;
+	return nr;
 }
 
 #endif /* MSG_ERRQUEUE */
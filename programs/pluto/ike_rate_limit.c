@@ -0,0 +1,290 @@
+/* per-source IKE rate limiting, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include <pthread.h>
+
+#include "defs.h"
+#include "ike_rate_limit.h"
+#include "iface.h"		/* for struct iface_packet */
+#include "hash_table.h"		/* for hash_table_hasher() */
+#include "ip_info.h"
+#include "log.h"
+#include "monotime.h"
+#include "show.h"
+#include "packet.h"		/* for struct isakmp_hdr */
+#include "demux.h"		/* for hdr_ike_version() */
+
+/*
+ * A token bucket per source prefix, consulted before a message that
+ * starts a new exchange is turned into a msg_digest.  Unlike the
+ * global DDOS thresholds (require_ddos_cookies(), drop_new_exchanges())
+ * this stops one noisy network pushing everyone else into cookie
+ * mode.
+ *
+ * The buckets live in a fixed size set-associative table, so memory
+ * use is bounded: when a set is full the least recently refilled
+ * bucket is recycled.  A mutex is needed since the receive workers
+ * (see iface_udp.c) also call admit_ike_packet().
+ */
+
+#define IKE_RATE_LIMIT_SETS 1024
+#define IKE_RATE_LIMIT_WAYS 4		/* buckets per set */
+#define IKE_RATE_LIMIT_TOP 10		/* top talkers shown */
+#define MILLITOKENS_PER_MESSAGE 1000
+
+unsigned pluto_ike_rate_limit = 0;
+unsigned pluto_ike_rate_limit_burst = 0;
+unsigned pluto_ike_rate_limit_ipv4_prefix = DEFAULT_IKE_RATE_LIMIT_IPV4_PREFIX;
+unsigned pluto_ike_rate_limit_ipv6_prefix = DEFAULT_IKE_RATE_LIMIT_IPV6_PREFIX;
+
+struct source_bucket {
+	ip_address prefix;		/* !is_set when unused */
+	monotime_t last;		/* last refill */
+	uint64_t millitokens;
+	unsigned long admitted;
+	unsigned long limited;
+};
+
+static struct source_bucket (*buckets)[IKE_RATE_LIMIT_WAYS];
+static pthread_mutex_t buckets_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long total_admitted;
+static unsigned long total_limited;
+static unsigned long total_recycled;
+
+void init_ike_rate_limit(struct logger *logger)
+{
+	if (pluto_ike_rate_limit == 0) {
+		return;
+	}
+	if (pluto_ike_rate_limit_burst == 0) {
+		pluto_ike_rate_limit_burst = pluto_ike_rate_limit;
+	}
+	buckets = alloc_bytes(IKE_RATE_LIMIT_SETS * sizeof(buckets[0]),
+			      "IKE rate limit buckets");
+	llog(RC_LOG, logger,
+	     "limiting new IKE exchanges to %u/second (burst %u) per IPv4 /%u and IPv6 /%u",
+	     pluto_ike_rate_limit, pluto_ike_rate_limit_burst,
+	     pluto_ike_rate_limit_ipv4_prefix, pluto_ike_rate_limit_ipv6_prefix);
+}
+
+void free_ike_rate_limit(void)
+{
+	pfreeany(buckets);
+}
+
+static unsigned prefix_bits(const struct ip_info *afi)
+{
+	return (afi == &ipv4_info ? pluto_ike_rate_limit_ipv4_prefix :
+		pluto_ike_rate_limit_ipv6_prefix);
+}
+
+/* mask SENDER down to the configured prefix */
+static ip_address source_prefix(const ip_endpoint *sender)
+{
+	ip_address prefix = endpoint_address(*sender);
+	const struct ip_info *afi = address_type(&prefix);
+	if (afi == NULL) {
+		return unset_address;
+	}
+	unsigned bits = prefix_bits(afi);
+	chunk_t bytes = address_as_chunk(&prefix);
+	for (size_t i = 0; i < bytes.len; i++) {
+		unsigned keep = (bits >= 8 * (i + 1) ? 8 :
+				 bits > 8 * i ? bits - 8 * i : 0);
+		bytes.ptr[i] &= (uint8_t)(0xff << (8 - keep));
+	}
+	return prefix;
+}
+
+/*
+ * IKEv1 and IKEv2 headers both start with the initiator and responder
+ * SPIs; a request starting a new exchange (Main Mode, Aggressive
+ * Mode, IKE_SA_INIT) has a zero responder SPI.  Anything too short
+ * is left for the header decoder to reject.
+ *
+ * An IKE_SA_INIT response carrying a COOKIE or INVALID_KE_PAYLOAD
+ * notification also has a zero responder SPI; for IKEv2 the flags
+ * tell the two apart.
+ */
+static bool starts_new_exchange(const struct iface_packet *packet)
+{
+	if (packet->len < (ssize_t)sizeof(struct isakmp_hdr)) {
+		return false;
+	}
+	struct pbs_in packet_pbs;
+	init_pbs(&packet_pbs, packet->ptr, packet->len, __func__);
+	struct isakmp_hdr hdr;
+	diag_t d = pbs_in_struct(&packet_pbs, &raw_isakmp_hdr_desc,
+				 &hdr, sizeof(hdr), NULL);
+	if (d != NULL) {
+		pfree_diag(&d);
+		return false;
+	}
+	if (!ike_spi_is_zero(&hdr.isa_ike_responder_spi)) {
+		return false;
+	}
+	switch (hdr_ike_version(&hdr)) {
+	case IKEv2:
+		return (hdr.isa_xchg == ISAKMP_v2_IKE_SA_INIT &&
+			(hdr.isa_flags & ISAKMP_FLAGS_v2_IKE_I) &&
+			!(hdr.isa_flags & ISAKMP_FLAGS_v2_MSG_R));
+	case IKEv1:
+		return (hdr.isa_xchg == ISAKMP_XCHG_IDPROT ||
+			hdr.isa_xchg == ISAKMP_XCHG_AGGR);
+	default:
+		return false;
+	}
+}
+
+bool admit_ike_packet(const struct iface_packet *packet)
+{
+	if (buckets == NULL || !starts_new_exchange(packet)) {
+		return true;
+	}
+
+	ip_address prefix = source_prefix(&packet->sender);
+	if (!prefix.is_set) {
+		return true;
+	}
+
+	hash_t hash = hash_table_hasher(address_as_shunk(&prefix), zero_hash);
+	uint64_t capacity = (uint64_t)pluto_ike_rate_limit_burst * MILLITOKENS_PER_MESSAGE;
+	monotime_t now = mononow();
+	bool admit;
+
+	pthread_mutex_lock(&buckets_mutex);
+	{
+		struct source_bucket *set = buckets[hash.hash % IKE_RATE_LIMIT_SETS];
+		struct source_bucket *bucket = NULL;
+		struct source_bucket *victim = &set[0];
+		for (unsigned w = 0; w < IKE_RATE_LIMIT_WAYS; w++) {
+			struct source_bucket *b = &set[w];
+			if (b->prefix.is_set && address_eq_address(b->prefix, prefix)) {
+				bucket = b;
+				break;
+			}
+			if (victim->prefix.is_set &&
+			    (!b->prefix.is_set || monobefore(b->last, victim->last))) {
+				victim = b;
+			}
+		}
+
+		if (bucket == NULL) {
+			if (victim->prefix.is_set) {
+				total_recycled++;
+			}
+			*victim = (struct source_bucket) {
+				.prefix = prefix,
+				.last = now,
+				.millitokens = capacity,
+			};
+			bucket = victim;
+		} else {
+			/* tokens are per-second so millitokens are per-millisecond */
+			intmax_t ms = deltamillisecs(monotimediff(now, bucket->last));
+			if (ms > 0) {
+				uint64_t refill = (uint64_t)ms * pluto_ike_rate_limit;
+				bucket->millitokens = (capacity - bucket->millitokens <= refill ? capacity :
+						       bucket->millitokens + refill);
+				bucket->last = now;
+			}
+		}
+
+		admit = (bucket->millitokens >= MILLITOKENS_PER_MESSAGE);
+		if (admit) {
+			bucket->millitokens -= MILLITOKENS_PER_MESSAGE;
+			bucket->admitted++;
+			total_admitted++;
+		} else {
+			bucket->limited++;
+			total_limited++;
+		}
+	}
+	pthread_mutex_unlock(&buckets_mutex);
+
+	if (!admit && DBGP(DBG_BASE)) {
+		address_buf ab;
+		DBG_log("rate limiting new IKE exchange from %s/%u",
+			str_address_sensitive(&prefix, &ab),
+			prefix_bits(address_type(&prefix)));
+	}
+	return admit;
+}
+
+static unsigned long bucket_messages(const struct source_bucket *b)
+{
+	return b->admitted + b->limited;
+}
+
+void show_ike_rate_limit(struct show *s)
+{
+	show_raw(s, "config.setup.ike.rate_limit=%u", pluto_ike_rate_limit);
+	show_raw(s, "config.setup.ike.rate_limit_burst=%u", pluto_ike_rate_limit_burst);
+	show_raw(s, "config.setup.ike.rate_limit_ipv4_prefix=%u", pluto_ike_rate_limit_ipv4_prefix);
+	show_raw(s, "config.setup.ike.rate_limit_ipv6_prefix=%u", pluto_ike_rate_limit_ipv6_prefix);
+	if (buckets == NULL) {
+		return;
+	}
+
+	/* snapshot the busiest buckets (insertion sort) */
+	struct source_bucket top[IKE_RATE_LIMIT_TOP];
+	unsigned nr_top = 0;
+	unsigned nr_sources = 0;
+	unsigned long admitted, limited, recycled;
+
+	pthread_mutex_lock(&buckets_mutex);
+	{
+		for (unsigned i = 0; i < IKE_RATE_LIMIT_SETS; i++) {
+			for (unsigned w = 0; w < IKE_RATE_LIMIT_WAYS; w++) {
+				const struct source_bucket *b = &buckets[i][w];
+				if (!b->prefix.is_set) {
+					continue;
+				}
+				nr_sources++;
+				unsigned t = nr_top;
+				while (t > 0 && bucket_messages(&top[t - 1]) < bucket_messages(b)) {
+					if (t < IKE_RATE_LIMIT_TOP) {
+						top[t] = top[t - 1];
+					}
+					t--;
+				}
+				if (t < IKE_RATE_LIMIT_TOP) {
+					top[t] = *b;
+					if (nr_top < IKE_RATE_LIMIT_TOP) {
+						nr_top++;
+					}
+				}
+			}
+		}
+		admitted = total_admitted;
+		limited = total_limited;
+		recycled = total_recycled;
+	}
+	pthread_mutex_unlock(&buckets_mutex);
+
+	show_raw(s, "current.ike.rate_limit.sources=%u", nr_sources);
+	show_raw(s, "total.ike.rate_limit.admitted=%lu", admitted);
+	show_raw(s, "total.ike.rate_limit.limited=%lu", limited);
+	show_raw(s, "total.ike.rate_limit.recycled=%lu", recycled);
+	for (unsigned t = 0; t < nr_top; t++) {
+		address_buf ab;
+		show_raw(s, "current.ike.rate_limit.top.%u.source=%s/%u", t + 1,
+			 str_address_sensitive(&top[t].prefix, &ab),
+			 prefix_bits(address_type(&top[t].prefix)));
+		show_raw(s, "current.ike.rate_limit.top.%u.admitted=%lu", t + 1,
+			 top[t].admitted);
+		show_raw(s, "current.ike.rate_limit.top.%u.limited=%lu", t + 1,
+			 top[t].limited);
+	}
+}
@@ -0,0 +1,41 @@
+/* per-source IKE rate limiting, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef IKE_RATE_LIMIT_H
+#define IKE_RATE_LIMIT_H
+
+#include <stdbool.h>
+
+struct iface_packet;
+struct show;
+struct logger;
+
+extern unsigned pluto_ike_rate_limit;		/* new exchanges/second/prefix; 0 disables */
+extern unsigned pluto_ike_rate_limit_burst;	/* bucket size; 0 means same as rate */
+extern unsigned pluto_ike_rate_limit_ipv4_prefix;
+extern unsigned pluto_ike_rate_limit_ipv6_prefix;
+
+void init_ike_rate_limit(struct logger *logger);
+void free_ike_rate_limit(void);
+
+/*
+ * Return false when PACKET starts a new exchange (the responder SPI
+ * is zero) and its source prefix has used up its tokens.  Called
+ * before the msg_digest is allocated.  Thread-safe.
+ */
+bool admit_ike_packet(const struct iface_packet *packet);
+
+void show_ike_rate_limit(struct show *s);
+
+#endif
@@ -15,14 +15,12 @@
  * for more details.
  */
 
-#include "ike_alg_hash.h"
-
 #include "defs.h"	/* for all_zero */
 #include "log.h"
 #include "state.h"	/* for ike_sa */
 #include "ike_spi.h"
 #include "rnd.h"
-#include "crypt_hash.h"
+#include "siphash.h"
 
 const ike_spi_t zero_ike_spi;  /* guaranteed 0 */
 
@@ -42,9 +40,7 @@ bool ike_spis_eq(const ike_spis_t *lhs, const ike_spis_t *rhs)
 		ike_spi_eq(&lhs->responder, &rhs->responder));
 }
 
-static struct {
-	uint8_t bytes[SHA2_256_DIGEST_SIZE];
-} ike_spi_secret;
+static struct siphash_key ike_spi_secret;
 
 void refresh_ike_spi_secret(void)
 {
@@ -80,8 +76,13 @@ ike_spi_t ike_initiator_spi(void)
  * an attacker from gaining raw data from our random pool and
  * it will prevent an attacker from depleting our random pool
  * or entropy.
+ *
+ * The hash is SipHash-2-4 keyed with ike_spi_secret, whose 64-bit
+ * output is exactly an SPI; unlike an NSS hash it needs no context
+ * per IKE_SA_INIT.
  */
-ike_spi_t ike_responder_spi(const ip_endpoint *initiator_endpoint, struct logger *logger)
+ike_spi_t ike_responder_spi(const ip_endpoint *initiator_endpoint,
+			    struct logger *logger UNUSED)
 {
 	if (impair.ike_responder_spi > 0) {
 		/* 1-biased so that 0 is "disable" */
@@ -96,21 +97,15 @@ ike_spi_t ike_responder_spi(const ip_endpoint *initiator_endpoint, struct logger
 	do {
 		static uint32_t counter = 0; /* STATIC */
 
-		struct crypt_hash *ctx = crypt_hash_init("IKE SPIr",
-							 &ike_alg_hash_sha2_256,
-							 logger);
-
-		crypt_hash_digest_thing(ctx, "addr", *initiator_endpoint);
-		crypt_hash_digest_thing(ctx, "sod", ike_spi_secret);
+		struct siphash sip;
+		siphash_init(&sip, &ike_spi_secret, SIPHASH_2_4, SIPHASH_64_SIZE);
+		siphash_update_thing(&sip, *initiator_endpoint);
 		counter++;
-		crypt_hash_digest_thing(ctx, "counter", counter);
+		siphash_update_thing(&sip, counter);
 
-		uint8_t buffer[SHA2_256_DIGEST_SIZE];
-		crypt_hash_final_bytes(&ctx, buffer, SHA2_256_DIGEST_SIZE);
-		/* cookie size is smaller than hash output size */
-		passert(IKE_SA_SPI_SIZE <= SHA2_256_DIGEST_SIZE);
+		passert(IKE_SA_SPI_SIZE == SIPHASH_64_SIZE);
 		passert(IKE_SA_SPI_SIZE == sizeof(spi));
-		memcpy(&spi, buffer, sizeof(spi));
+		siphash_final(&sip, spi.bytes);
 	} while (ike_spi_is_zero(&spi)); /* probably never loops */
 	return spi;
 }
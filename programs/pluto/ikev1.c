@@ -170,6 +170,7 @@
 #endif
 
 #include "pluto_stats.h"
+#include "rekey_schedule.h"
 
 /*
  * state_v1_microcode is a tuple of information parameterizing certain
@@ -1075,6 +1076,7 @@ static stf_status informational(struct state *st, struct msg_digest *md)
 
 				/* update peer's address */
 				tmp_c->spd.that.host_addr = new_peer;
+				rehash_connection_remote_address(tmp_c);
 
 				/* Modifying connection info to store the redirected remote peer info */
 				dbg("Old host_addr_name : %s", tmp_c->spd.that.host_addr_name);
@@ -2782,7 +2784,11 @@ void complete_v1_state_transition(struct state *st, struct msg_digest *md, stf_s
 					}
 				}
 				/* XXX: DELAY_MS should be a deltatime_t */
-				event_schedule(kind, deltatime_ms(delay_ms), st);
+				if (kind != EVENT_SA_EXPIRE) {
+					schedule_rekey_event(kind, deltatime_ms(delay_ms), st);
+				} else {
+					event_schedule(kind, deltatime_ms(delay_ms), st);
+				}
 				break;
 
 			case EVENT_SO_DISCARD:
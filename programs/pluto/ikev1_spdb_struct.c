@@ -1025,14 +1025,6 @@ bool ikev1_out_sa(pb_stream *outs,
 			const struct db_prop *const p = &pc->props[pn];
 			pb_stream proposal_pbs;
 
-			/*
-			 * set the tunnel_mode bit on the last proposal only, and
-			 * only if we are trying to negotiate tunnel mode in the first
-			 * place.
-			 */
-			const bool tunnel_mode = (valid_prop_cnt == 1) &&
-				      (st->st_policy & POLICY_TUNNEL);
-
 			/*
 			 * pick the part of the proposal we are trying to work on
 			 */
@@ -1135,9 +1127,7 @@ bool ikev1_out_sa(pb_stream *outs,
 					 */
 					if (!ipcomp_cpi_generated) {
 						st->st_ipcomp.our_spi =
-							get_my_cpi(&c->spd,
-								   tunnel_mode,
-								   st->st_logger);
+							get_my_cpi(st->st_logger);
 						if (st->st_ipcomp.our_spi == 0)
 							goto fail; /* problem generating CPI */
 
@@ -1163,8 +1153,6 @@ bool ikev1_out_sa(pb_stream *outs,
 					if (!*spi_generated) {
 						*spi_ptr = get_ipsec_spi(0,
 									 proto,
-									 &c->spd,
-									 tunnel_mode,
 									 st->st_logger);
 						*spi_generated = TRUE;
 					}
@@ -2798,8 +2786,6 @@ static void echo_proposal(struct isakmp_proposal r_proposal,    /* proposal to e
 			  struct ipsec_proto_info *pi,          /* info about this protocol instance */
 			  struct_desc *trans_desc,              /* descriptor for this transformation */
 			  pb_stream *trans_pbs,                 /* PBS for incoming transform */
-			  const struct spd_route *sr,           /* host details for the association */
-			  bool tunnel_mode,                     /* true for inner most tunnel SA */
 			  struct logger *logger)
 {
 	pb_stream r_proposal_pbs;
@@ -2818,7 +2804,7 @@ static void echo_proposal(struct isakmp_proposal r_proposal,    /* proposal to e
 		 * Note: we may fail to generate a satisfactory CPI,
 		 * but we'll ignore that.
 		 */
-		pi->our_spi = get_my_cpi(sr, tunnel_mode, logger);
+		pi->our_spi = get_my_cpi(logger);
 		passert(out_raw((uint8_t *) &pi->our_spi +
 				IPSEC_DOI_SPI_SIZE - IPCOMP_CPI_SIZE,
 				IPCOMP_CPI_SIZE,
@@ -2827,8 +2813,6 @@ static void echo_proposal(struct isakmp_proposal r_proposal,    /* proposal to e
 		pi->our_spi = get_ipsec_spi(pi->attrs.spi,
 					    r_proposal.isap_protoid == PROTO_IPSEC_AH ?
 						&ip_protocol_ah : &ip_protocol_esp,
-					    sr,
-					    tunnel_mode,
 					    logger);
 		/* XXX should check for errors */
 		passert(out_raw((uint8_t *) &pi->our_spi, IPSEC_DOI_SPI_SIZE,
@@ -2928,8 +2912,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 			ah_seen = FALSE,
 			esp_seen = FALSE,
 			ipcomp_seen = FALSE;
-		const ip_protocol *inner_proto = NULL;
-		bool tunnel_mode = FALSE;
 		uint16_t well_known_cpi = 0;
 
 		pb_stream
@@ -3206,10 +3188,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 				continue;
 			}
 			ah_attrs.spi = ah_spi;
-			inner_proto = &ip_protocol_ah;
-			if (ah_attrs.mode ==
-			    ENCAPSULATION_MODE_TUNNEL)
-				tunnel_mode = TRUE;
 		}
 
 		if (esp_seen) {
@@ -3271,10 +3249,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 				continue; /* we didn't find a nice one */
 
 			esp_attrs.spi = esp_spi;
-			inner_proto = &ip_protocol_esp;
-			if (esp_attrs.mode ==
-			    ENCAPSULATION_MODE_TUNNEL)
-				tunnel_mode = TRUE;
 		} else if (st->st_policy & POLICY_ENCRYPT) {
 			connection_buf cib;
 			address_buf b;
@@ -3375,10 +3349,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 			if (tn == ipcomp_proposal.isap_notrans)
 				continue; /* we didn't find a nice one */
 			ipcomp_attrs.spi = ipcomp_cpi;
-			inner_proto = &ip_protocol_comp;
-			if (ipcomp_attrs.mode ==
-			    ENCAPSULATION_MODE_TUNNEL)
-				tunnel_mode = TRUE;
 		}
 
 		/* Eureka: we liked what we saw -- accept it. */
@@ -3399,9 +3369,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 					      &st->st_ah,
 					      &isakmp_ah_transform_desc,
 					      &ah_trans_pbs,
-					      &c->spd,
-					      tunnel_mode &&
-					      inner_proto == &ip_protocol_ah,
 					      st->st_logger);
 			}
 
@@ -3414,9 +3381,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 					      &st->st_esp,
 					      &isakmp_esp_transform_desc,
 					      &esp_trans_pbs,
-					      &c->spd,
-					      tunnel_mode &&
-					      inner_proto == &ip_protocol_esp,
 					      st->st_logger);
 			}
 
@@ -3429,9 +3393,6 @@ notification_t parse_ipsec_sa_body(pb_stream *sa_pbs,           /* body of input
 					      &st->st_ipcomp,
 					      &isakmp_ipcomp_transform_desc,
 					      &ipcomp_trans_pbs,
-					      &c->spd,
-					      tunnel_mode &&
-					      inner_proto == &ip_protocol_comp,
 					      st->st_logger);
 			}
 
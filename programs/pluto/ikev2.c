@@ -1361,6 +1361,38 @@ static bool is_duplicate_response(struct ike_sa *ike,
 	return false;
 }
 
+/*
+ * IN A RECEIVE WORKER THREAD
+ *
+ * Return false when the message should be dropped.
+ *
+ * Only an IKE_SA_INIT request leading with a notification (presumably
+ * a COOKIE) is looked at: its payloads are decoded here, saving the
+ * main thread the work, and then the cookie is checked.  Everything
+ * else is left for ikev2_process_packet().
+ */
+
+bool v2_screen_message(struct msg_digest *md)
+{
+	if (md->hdr.isa_xchg != ISAKMP_v2_IKE_SA_INIT ||
+	    md->hdr.isa_msgid != 0 ||
+	    v2_msg_role(md) != MESSAGE_REQUEST ||
+	    (md->hdr.isa_flags & ISAKMP_FLAGS_v2_IKE_I) == 0 ||
+	    md->hdr.isa_np != ISAKMP_NEXT_v2N) {
+		return true;
+	}
+
+	md->message_payloads = ikev2_decode_payloads(md->md_logger, md,
+						     &md->message_pbs,
+						     md->hdr.isa_np);
+	if (md->message_payloads.n != v2N_NOTHING_WRONG) {
+		/* main thread decides if a response is needed */
+		return true;
+	}
+
+	return v2_screen_initiator_cookie(md);
+}
+
 /*
  * process an input packet, possibly generating a reply.
  *
@@ -1657,10 +1689,12 @@ void ikev2_process_packet(struct msg_digest *md)
 			 * INVALID_SYNTAX, but could be
 			 * v2N_UNSUPPORTED_CRITICAL_PAYLOAD.
 			 */
-			pexpect(!md->message_payloads.parsed);
-			md->message_payloads = ikev2_decode_payloads(md->md_logger, md,
-								     &md->message_pbs,
-								     md->hdr.isa_np);
+			if (!md->message_payloads.parsed) {
+				/* else decoded by v2_screen_message() */
+				md->message_payloads = ikev2_decode_payloads(md->md_logger, md,
+									     &md->message_pbs,
+									     md->hdr.isa_np);
+			}
 			if (md->message_payloads.n != v2N_NOTHING_WRONG) {
 				if (require_ddos_cookies()) {
 					dbg("DDOS so not responding to invalid packet");
@@ -2679,6 +2713,7 @@ static void ikev2_child_emancipate(struct ike_sa *from, struct child_sa *to,
 {
 	/* initialize the the new IKE SA. reset and message ID */
 	to->sa.st_clonedfrom = SOS_NOBODY;
+	rehash_state_clonedfrom(&to->sa);
 	v2_msgid_init_ike(pexpect_ike_sa(&to->sa));
 
 	/* Switch to the new IKE SPIs */
@@ -2914,6 +2949,7 @@ static void success_v2_state_transition(struct state *st, struct msg_digest *md,
 			    str_endpoint(&ike->sa.st_remote_endpoint, &sb),
 			    str_endpoint(&md->sender, &mb));
 			ike->sa.st_remote_endpoint = md->sender;
+			rehash_state_remote_address(&ike->sa);
 		}
 	}
 
@@ -3104,6 +3140,42 @@ static void success_v2_state_transition(struct state *st, struct msg_digest *md,
  * - remember_received_packet(st, md);
  * - fragvid, dpd, nortel
  */
+/*
+ * Record how long MD, a real message, took from arriving to having
+ * its transition completed (including any time spent waiting for, and
+ * running on, a helper).  Transitions between the same pair of states
+ * share a histogram.
+ */
+
+static void record_v2_latency(const struct msg_digest *md,
+			      const struct state_v2_microcode *transition)
+{
+	double seconds = threadtime_sub(threadtime_start(), md->md_inception).wall_seconds;
+
+	static struct latency exchange_latency[ISAKMP_v2_IKE_INTERMEDIATE + 1 - ISAKMP_v2_IKE_SA_INIT][2];
+	enum isakmp_xchg_types ix = md->hdr.isa_xchg;
+	if (ix >= ISAKMP_v2_IKE_SA_INIT && ix <= ISAKMP_v2_IKE_INTERMEDIATE) {
+		bool response = (v2_msg_role(md) == MESSAGE_RESPONSE);
+		record_latency(&exchange_latency[ix - ISAKMP_v2_IKE_SA_INIT][response],
+			       seconds, "ikev2.%s.%s",
+			       enum_name_short(&ikev2_exchange_names, ix),
+			       response ? "response" : "request");
+	}
+
+	static struct latency transition_latency[elemsof(v2_state_microcode_table)];
+	const struct state_v2_microcode *t = v2_state_microcode_table;
+	while (t->state < STATE_IKEv2_ROOF &&
+	       (t->state != transition->state || t->next_state != transition->next_state)) {
+		t++;
+	}
+	if (t->state < STATE_IKEv2_ROOF) {
+		record_latency(&transition_latency[t - v2_state_microcode_table],
+			       seconds, "ikev2.transition.%s.%s",
+			       finite_states[t->state]->short_name,
+			       finite_states[t->next_state]->short_name);
+	}
+}
+
 void complete_v2_state_transition(struct state *st,
 				  struct msg_digest *md,
 				  stf_status result)
@@ -3189,6 +3261,11 @@ void complete_v2_state_transition(struct state *st,
 		transition = &undefined_transition;
 	}
 
+	if (md != NULL && !md->fake_dne && !md->fake_clone &&
+	    result != STF_SUSPEND && result != STF_IGNORE) {
+		record_v2_latency(md, transition);
+	}
+
 	LSWDBGP(DBG_BASE, buf) {
 		const struct finite_state *transition_from = finite_states[transition->state];
 
@@ -3417,9 +3494,7 @@ bool emit_v2N_compression(struct state *cst,
 		/* calculate and keep our CPI */
 		if (cst->st_ipcomp.our_spi == 0) {
 			/* CPI is stored in network low order end of an ipsec_spi_t */
-			cst->st_ipcomp.our_spi = get_my_cpi(&c->spd,
-							    LIN(POLICY_TUNNEL, c->policy),
-							    cst->st_logger);
+			cst->st_ipcomp.our_spi = get_my_cpi(cst->st_logger);
 			c_spi = (uint16_t)ntohl(cst->st_ipcomp.our_spi);
 			if (c_spi < IPCOMP_FIRST_NEGOTIATED) {
 				/* get_my_cpi() failed */
@@ -20,11 +20,13 @@ struct spd_route;
 struct crypt_mac;
 struct hash_desc;
 struct payload_digest;
+struct pubkey_authsig;
 
 typedef stf_status crypto_transition_fn(struct state *st, struct msg_digest *md,
 					struct pluto_crypto_req *r);
 
 void ikev2_process_packet(struct msg_digest *mdp);
+bool v2_screen_message(struct msg_digest *md); /* thread-safe */
 void ikev2_process_state_packet(struct ike_sa *ike, struct state *st,
 				struct msg_digest *mdp);
 
@@ -155,8 +157,7 @@ bool ikev2_proposal_to_trans_attrs(const struct ikev2_proposal *chosen,
 
 struct ipsec_proto_info *ikev2_child_sa_proto_info(struct child_sa *child, lset_t policy);
 
-ipsec_spi_t ikev2_child_sa_spi(const struct spd_route *spd_route, lset_t policy,
-			       struct logger *logger);
+ipsec_spi_t ikev2_child_sa_spi(lset_t policy, struct logger *logger);
 
 extern void ikev2_log_parentSA(const struct state *st);
 
@@ -176,15 +177,17 @@ extern bool ikev2_create_psk_auth(enum keyword_authby authby,
 				  const struct crypt_mac *idhash,
 				  chunk_t *additional_auth /* output */);
 
-diag_t v2_authsig_and_log_using_RSA_pubkey(struct ike_sa *ike,
+diag_t v2_prepare_authsig_using_RSA_pubkey(struct ike_sa *ike,
 					   const struct crypt_mac *idhash,
 					   shunk_t signature,
-					   const struct hash_desc *hash_algo);
+					   const struct hash_desc *hash_algo,
+					   struct pubkey_authsig **authsig);
 
-diag_t v2_authsig_and_log_using_ECDSA_pubkey(struct ike_sa *ike,
+diag_t v2_prepare_authsig_using_ECDSA_pubkey(struct ike_sa *ike,
 					     const struct crypt_mac *idhash,
 					     shunk_t signature,
-					     const struct hash_desc *hash_algo);
+					     const struct hash_desc *hash_algo,
+					     struct pubkey_authsig **authsig);
 
 extern void ikev2_derive_child_keys(struct child_sa *child);
 
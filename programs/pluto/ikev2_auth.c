@@ -386,14 +386,22 @@ static bool ikev2_try_asn1_hash_blob(const struct hash_desc *hash_algo,
  *
  * This just needs to answer the very simple yes/no question.  Did
  * auth succeed.  Caller needs to decide what response is appropriate.
+ *
+ * PSK and NULL are checked here.  For the public key methods only the
+ * candidate keys are collected; *AUTHSIG is set and the caller
+ * finishes the job (see v2_authsig_and_log() for the inline version
+ * and submit_v2_authsig_and_log() for the helper version).
  */
 
-diag_t v2_authsig_and_log(enum ikev2_auth_method recv_auth,
+diag_t prepare_v2_authsig(enum ikev2_auth_method recv_auth,
 			  struct ike_sa *ike,
 			  const struct crypt_mac *idhash_in,
 			  struct pbs_in *signature_pbs,
-			  const enum keyword_authby that_authby)
+			  const enum keyword_authby that_authby,
+			  struct pubkey_authsig **authsig)
 {
+	*authsig = NULL;
+
 	/*
 	 * XXX: can the boiler plate check that THAT_AUTHBY matches
 	 * recv_auth appearing in all case branches be merged?
@@ -408,13 +416,8 @@ diag_t v2_authsig_and_log(enum ikev2_auth_method recv_auth,
 		}
 
 		shunk_t signature = pbs_in_left_as_shunk(signature_pbs);
-		diag_t d = v2_authsig_and_log_using_RSA_pubkey(ike, idhash_in, signature,
-							       &ike_alg_hash_sha1);
-		if (d != NULL) {
-			return d;
-		}
-
-		return NULL;
+		return v2_prepare_authsig_using_RSA_pubkey(ike, idhash_in, signature,
+							   &ike_alg_hash_sha1, authsig);
 	}
 
 	case IKEv2_AUTH_PSK:
@@ -505,11 +508,13 @@ diag_t v2_authsig_and_log(enum ikev2_auth_method recv_auth,
 		shunk_t signature = pbs_in_left_as_shunk(signature_pbs);
 		switch (that_authby) {
 		case AUTHBY_RSASIG:
-			d = v2_authsig_and_log_using_RSA_pubkey(ike, idhash_in, signature, hap->algo);
+			d = v2_prepare_authsig_using_RSA_pubkey(ike, idhash_in, signature,
+								hap->algo, authsig);
 			break;
 
 		case AUTHBY_ECDSA:
-			d = v2_authsig_and_log_using_ECDSA_pubkey(ike, idhash_in, signature, hap->algo);
+			d = v2_prepare_authsig_using_ECDSA_pubkey(ike, idhash_in, signature,
+								  hap->algo, authsig);
 			break;
 
 		default:
@@ -524,3 +529,21 @@ diag_t v2_authsig_and_log(enum ikev2_auth_method recv_auth,
 			    enum_name(&ikev2_auth_names, recv_auth));
 	}
 }
+
+diag_t v2_authsig_and_log(enum ikev2_auth_method recv_auth,
+			  struct ike_sa *ike,
+			  const struct crypt_mac *idhash_in,
+			  struct pbs_in *signature_pbs,
+			  const enum keyword_authby that_authby)
+{
+	struct pubkey_authsig *authsig;
+	diag_t d = prepare_v2_authsig(recv_auth, ike, idhash_in, signature_pbs,
+				      that_authby, &authsig);
+	if (authsig == NULL) {
+		/* early failure, or PSK/NULL which is already done */
+		return d;
+	}
+	pexpect(d == NULL);
+	authsig_using_pubkey_candidates(authsig, ike->sa.st_logger);
+	return log_authsig_using_pubkey(ike, &authsig);
+}
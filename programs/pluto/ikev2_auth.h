@@ -29,6 +29,7 @@ struct msg_digest;
 struct hash_desc;
 struct logger;
 struct private_key_stuff;
+struct pubkey_authsig;
 enum perspective;
 
 struct crypt_mac v2_calculate_sighash(const struct ike_sa *ike,
@@ -67,10 +68,37 @@ bool submit_v2_auth_signature(struct ike_sa *ike,
 			      enum ikev2_auth_method auth_method,
 			      v2_auth_signature_cb *cb);
 
+diag_t prepare_v2_authsig(enum ikev2_auth_method recv_auth,
+			  struct ike_sa *ike,
+			  const struct crypt_mac *idhash_in,
+			  struct pbs_in *signature_pbs,
+			  const enum keyword_authby that_authby,
+			  struct pubkey_authsig **authsig);
+
 diag_t v2_authsig_and_log(enum ikev2_auth_method recv_auth,
 			  struct ike_sa *ike,
 			  const struct crypt_mac *idhash_in,
 			  struct pbs_in *signature_pbs,
 			  const enum keyword_authby that_authby);
 
+/*
+ * Like v2_authsig_and_log() but, when a public key signature needs
+ * checking, do it on a helper thread and then resume STATE_TO_RESUME
+ * by calling CB with the verdict.  PSK and NULL, which are cheap, call
+ * CB directly.
+ */
+
+typedef stf_status (v2_authsig_cb)(struct state *st,
+				   struct msg_digest *md,
+				   diag_t d);
+
+stf_status submit_v2_authsig_and_log(enum ikev2_auth_method recv_auth,
+				     struct ike_sa *ike,
+				     struct state *state_to_resume,
+				     struct msg_digest *md,
+				     const struct crypt_mac *idhash_in,
+				     struct pbs_in *signature_pbs,
+				     const enum keyword_authby that_authby,
+				     v2_authsig_cb *cb);
+
 #endif
@@ -0,0 +1,95 @@
+/* IKEv2 peer signature verification helper, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include "defs.h"
+#include "ikev2_auth.h"
+#include "keys.h"
+#include "server_pool.h"
+#include "state.h"
+#include "log.h"
+
+/*
+ * Verify the peer's AUTH signature.
+ *
+ * The candidate keys are collected (with counted references) on the
+ * main thread; the helper only runs the signature checks; and the
+ * result is logged, and the IKE SA updated, back on the main thread.
+ */
+
+struct task {
+	/* in */
+	struct pubkey_authsig *authsig;
+	v2_authsig_cb *cb;
+};
+
+static task_computer_fn v2_authsig_computer; /* type check */
+static task_completed_cb v2_authsig_completed; /* type check */
+static task_cleanup_cb v2_authsig_cleanup; /* type check */
+
+struct task_handler v2_authsig_handler = {
+	.name = "verify signature",
+	.computer_fn = v2_authsig_computer,
+	.completed_cb = v2_authsig_completed,
+	.cleanup_cb = v2_authsig_cleanup,
+};
+
+stf_status submit_v2_authsig_and_log(enum ikev2_auth_method recv_auth,
+				     struct ike_sa *ike,
+				     struct state *state_to_resume,
+				     struct msg_digest *md,
+				     const struct crypt_mac *idhash_in,
+				     struct pbs_in *signature_pbs,
+				     const enum keyword_authby that_authby,
+				     v2_authsig_cb *cb)
+{
+	struct pubkey_authsig *authsig;
+	diag_t d = prepare_v2_authsig(recv_auth, ike, idhash_in, signature_pbs,
+				      that_authby, &authsig);
+	if (authsig == NULL) {
+		/* early failure, or PSK/NULL which is already done */
+		return cb(state_to_resume, md, d);
+	}
+	pexpect(d == NULL);
+
+	struct task task = {
+		.authsig = authsig,
+		.cb = cb,
+	};
+	submit_task(ike->sa.st_logger, state_to_resume,
+		    clone_thing(task, "verify signature task"),
+		    &v2_authsig_handler,
+		    "verifying peer signature");
+	return STF_SUSPEND;
+}
+
+static void v2_authsig_computer(struct logger *logger, struct task *task,
+				int unused_my_thread UNUSED)
+{
+	authsig_using_pubkey_candidates(task->authsig, logger);
+}
+
+static stf_status v2_authsig_completed(struct state *st,
+				       struct msg_digest *md,
+				       struct task *task)
+{
+	struct ike_sa *ike = ike_sa(st, HERE);
+	diag_t d = log_authsig_using_pubkey(ike, &task->authsig);
+	return task->cb(st, md, d);
+}
+
+static void v2_authsig_cleanup(struct task **task)
+{
+	free_pubkey_authsig(&(*task)->authsig);
+	pfreeany(*task);
+}
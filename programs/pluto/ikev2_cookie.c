@@ -31,62 +31,171 @@
 #include "rnd.h"
 #include "ikev2_cookie.h"
 #include "demux.h"
-#include "ike_alg_hash.h"	/* for sha2 */
-#include "crypt_hash.h"
+#include "siphash.h"
 #include "ikev2_send.h"
 #include "log.h"
 #include "state.h"
 #include "ikev2.h"
 
 /*
- * That the cookie size of 32-bytes happens to match
- * SHA2_256_DIGEST_SIZE is just a happy coincidence.
+ * Cookie = <VersionIDofSecret> | Hash(Ni | IPi | SPIi | <secret>)
+ *
+ * where <secret> is a randomly generated secret known only to us and
+ * Hash() is SipHash-2-4-128 keyed with it (every unauthenticated
+ * IKE_SA_INIT can end up here so it needs to be cheap; see
+ * siphash.h).
+ *
+ * The current and previous secrets are kept, indexed by the bottom
+ * bit of <VersionIDofSecret>, so that cookies handed out just before
+ * refresh_v2_cookie_secret() are still accepted.
  */
+
 typedef struct {
-	uint8_t bytes[32];
+	uint8_t version;	/* <VersionIDofSecret> */
+	uint8_t mac[SIPHASH_128_SIZE];
 } v2_cookie_t;
 
-static v2_cookie_t v2_cookie_secret;
+static struct siphash_key v2_cookie_secrets[2];
+static uint8_t v2_cookie_secret_version;	/* read by receive workers */
 
 void refresh_v2_cookie_secret(void)
 {
-	get_rnd_bytes(&v2_cookie_secret, sizeof(v2_cookie_secret));
+	static bool initialized = false; /* STATIC */
+	if (!initialized) {
+		/* never accept a cookie keyed with zero */
+		get_rnd_bytes(v2_cookie_secrets, sizeof(v2_cookie_secrets));
+		initialized = true;
+	}
+	/*
+	 * Fill in the next secret, which replaces the previous, and
+	 * only then publish it.
+	 */
+	uint8_t version = v2_cookie_secret_version + 1;
+	get_rnd_bytes(&v2_cookie_secrets[version % 2], sizeof(v2_cookie_secrets[0]));
+	__atomic_store_n(&v2_cookie_secret_version, version, __ATOMIC_RELEASE);
 	if (DBGP(DBG_CRYPT)) {
-		DBG_dump_thing("v2_cookie_secret", v2_cookie_secret);
+		DBG_log("v2_cookie_secret version %u", version);
+		DBG_dump_thing("v2_cookie_secret", v2_cookie_secrets[version % 2]);
 	}
 }
 
-/*
- * Cookie = <VersionIDofSecret> | Hash(Ni | IPi | SPIi | <secret>)
- * where <secret> is a randomly generated secret known only to us
- *
- * Our implementation does not use <VersionIDofSecret> which means
- * once a day and while under DOS attack, we could fail a few cookies
- * until the peer restarts from scratch.
- */
-static bool compute_v2_cookie_from_md(v2_cookie_t *cookie,
+static uint8_t current_v2_cookie_secret_version(void)
+{
+	return __atomic_load_n(&v2_cookie_secret_version, __ATOMIC_ACQUIRE);
+}
+
+static bool v2_cookie_secret_known(uint8_t version)
+{
+	uint8_t current = current_v2_cookie_secret_version();
+	return (version == current || version == (uint8_t)(current - 1));
+}
+
+static void compute_v2_cookie_from_md(v2_cookie_t *cookie,
 				      struct msg_digest *md,
-				      shunk_t Ni)
+				      shunk_t Ni, uint8_t version)
 {
-	struct crypt_hash *ctx = crypt_hash_init("IKEv2 COOKIE",
-						 &ike_alg_hash_sha2_256,
-						 md->md_logger);
+	struct siphash sip;
+	siphash_init(&sip, &v2_cookie_secrets[version % 2],
+		     SIPHASH_2_4, SIPHASH_128_SIZE);
 
-	crypt_hash_digest_hunk(ctx, "Ni", Ni);
+	siphash_update_hunk(&sip, Ni);
 
 	ip_address sender = endpoint_address(md->sender);
 	shunk_t IPi = address_as_shunk(&sender);
-	crypt_hash_digest_hunk(ctx, "IPi", IPi);
+	siphash_update_hunk(&sip, IPi);
 
-	crypt_hash_digest_thing(ctx, "SPIi", md->hdr.isa_ike_initiator_spi);
+	siphash_update_thing(&sip, md->hdr.isa_ike_initiator_spi);
 
-	crypt_hash_digest_thing(ctx, "<secret>", v2_cookie_secret);
+	cookie->version = version;
+	siphash_final(&sip, cookie->mac);
+}
 
-	/* happy coincidence? */
-	pexpect(sizeof(cookie->bytes) == SHA2_256_DIGEST_SIZE);
-	crypt_hash_final_bytes(&ctx, cookie->bytes, sizeof(cookie->bytes));
+/*
+ * The COOKIE notification, which is expected to be first (and don't
+ * bother checking for things like duplicates), or NULL.
+ */
 
-	return true;
+static struct payload_digest *v2_cookie_digest(struct msg_digest *md)
+{
+	if (md->hdr.isa_np == ISAKMP_NEXT_v2N &&
+	    pexpect(md->chain[ISAKMP_NEXT_v2N] != NULL) &&
+	    md->chain[ISAKMP_NEXT_v2N]->payload.v2n.isan_type == v2N_COOKIE) {
+		struct payload_digest *cookie_digest = md->chain[ISAKMP_NEXT_v2N];
+		pexpect(&cookie_digest->pbs == md->pbs[PBS_v2N_COOKIE]);
+		return cookie_digest;
+	}
+	return NULL;
+}
+
+/*
+ * Compute our cookie for MD, returning why not on failure.
+ *
+ * Annoyingly this is the only reason why the payload needs to be
+ * parsed - the cookie is first so parsing the full packet shouldn't
+ * be needed.
+ *
+ * RFC 5996 Section 2.10 Nonces used in IKEv2 MUST be randomly chosen,
+ * MUST be at least 128 bits in size, and MUST be at least half the
+ * key size of the negotiated pseudorandom function (PRF) (We can
+ * check for minimum 128bit length).
+ */
+
+static const char *compute_v2_cookie(v2_cookie_t *cookie, struct msg_digest *md,
+				     uint8_t version)
+{
+	if (md->chain[ISAKMP_NEXT_v2Ni] == NULL) {
+		return "DDOS cookie requires Ni paylod - dropping message";
+	}
+	shunk_t Ni = pbs_in_left_as_shunk(&md->chain[ISAKMP_NEXT_v2Ni]->pbs);
+	if (Ni.len < IKEv2_MINIMUM_NONCE_SIZE || IKEv2_MAXIMUM_NONCE_SIZE < Ni.len) {
+		return "DOS cookie failed as Ni payload invalid  - dropping message";
+	}
+	compute_v2_cookie_from_md(cookie, md, Ni, version);
+	return NULL;
+}
+
+/*
+ * Check that the cookie notification is well constructed (mainly for
+ * own sanity) and matches the cookie computed using the secret it
+ * names; return why not on failure.
+ *
+ * Since they payload is understood ISAKMP_PAYLOAD_CRITICAL should be
+ * ignored.
+ */
+
+static const char *v2_cookie_mismatch(struct payload_digest *cookie_digest,
+				      struct msg_digest *md)
+{
+	struct ikev2_notify *cookie_header = &cookie_digest->payload.v2n;
+	shunk_t remote_cookie = pbs_in_left_as_shunk(&cookie_digest->pbs);
+	if (cookie_header->isan_protoid != 0 ||
+	    cookie_header->isan_spisize != 0 ||
+	    cookie_header->isan_length != sizeof(v2_cookie_t) + sizeof(struct ikev2_notify) ||
+	    remote_cookie.len != sizeof(v2_cookie_t)) {
+		return "DOS cookie notification corrupt, or invalid - dropping message";
+	}
+
+	uint8_t version = ((const uint8_t *)remote_cookie.ptr)[0];
+	if (!v2_cookie_secret_known(version)) {
+		return "DOS cookie secret expired - dropping message";
+	}
+
+	v2_cookie_t my_cookie;
+	const char *ugh = compute_v2_cookie(&my_cookie, md, version);
+	if (ugh != NULL) {
+		return ugh;
+	}
+	chunk_t local_cookie = chunk2(&my_cookie, sizeof(my_cookie));
+
+	if (DBGP(DBG_BASE)) {
+		DBG_dump_hunk("received cookie", remote_cookie);
+		DBG_dump_hunk("computed cookie", local_cookie);
+	}
+
+	if (!hunk_eq(local_cookie, remote_cookie)) {
+		return "DOS cookies do not match - dropping message";
+	}
+	return NULL;
 }
 
 bool v2_rejected_initiator_cookie(struct msg_digest *md,
@@ -100,56 +209,34 @@ bool v2_rejected_initiator_cookie(struct msg_digest *md,
 		return true; /* reject cookie */
 	}
 
-	/*
-	 * Expect the cookie notification to be first, and don't
-	 * bother checking for things like duplicates.
-	 */
-	struct payload_digest *cookie_digest = NULL;
-	if (md->hdr.isa_np == ISAKMP_NEXT_v2N &&
-	    pexpect(md->chain[ISAKMP_NEXT_v2N] != NULL) &&
-	    md->chain[ISAKMP_NEXT_v2N]->payload.v2n.isan_type == v2N_COOKIE) {
-		cookie_digest = md->chain[ISAKMP_NEXT_v2N];
-		pexpect(&cookie_digest->pbs == md->pbs[PBS_v2N_COOKIE]);
-	}
+	struct payload_digest *cookie_digest = v2_cookie_digest(md);
 	if (!me_want_cookie && cookie_digest == NULL) {
 		dbg("DDOS disabled and no cookie sent, continuing");
 		return false; /* all ok!?! */
 	}
 	pexpect(me_want_cookie || cookie_digest != NULL);
 
+	if (cookie_digest != NULL && md->v2_cookie_verified) {
+		dbg("cookie already matched by receive worker");
+		return false; /* love the cookie */
+	}
+
 	/*
 	 * Paranoid mode is on - either DDOS or there's a cookie (or
 	 * both).  So need to compute a cookie, but to do that v2Ni is
 	 * needed ...
-	 *
-	 * Annoyingly this is the only reason why the payload needs to
-	 * be parsed - the cookie is first so parsing the full packet
-	 * shouldn't be needed.
-	 *
-	 * RFC 5996 Section 2.10 Nonces used in IKEv2 MUST be randomly
-	 * chosen, MUST be at least 128 bits in size, and MUST be at
-	 * least half the key size of the negotiated pseudorandom
-	 * function (PRF) (We can check for minimum 128bit length).
 	 */
-	if (md->chain[ISAKMP_NEXT_v2Ni] == NULL) {
-		rate_log(md, "DDOS cookie requires Ni paylod - dropping message");
-		return true; /* reject cookie */
-	}
-	shunk_t Ni = pbs_in_left_as_shunk(&md->chain[ISAKMP_NEXT_v2Ni]->pbs);
-	if (Ni.len < IKEv2_MINIMUM_NONCE_SIZE || IKEv2_MAXIMUM_NONCE_SIZE < Ni.len) {
-		rate_log(md, "DOS cookie failed as Ni payload invalid  - dropping message");
-		return true; /* reject cookie */
-	}
 
-	/* Most code paths require our cookie, compute it. */
-	v2_cookie_t my_cookie;
-	if (!compute_v2_cookie_from_md(&my_cookie, md, Ni)) {
-		return true; /* reject cookie */
-	}
-	chunk_t local_cookie = chunk2(&my_cookie, sizeof(my_cookie));
-
-	/* No cookie? demand one */
+	/* No cookie? demand one, using the current secret */
 	if (me_want_cookie && cookie_digest == NULL) {
+		v2_cookie_t my_cookie;
+		const char *ugh = compute_v2_cookie(&my_cookie, md,
+						    current_v2_cookie_secret_version());
+		if (ugh != NULL) {
+			rate_log(md, "%s", ugh);
+			return true; /* reject cookie */
+		}
+		chunk_t local_cookie = chunk2(&my_cookie, sizeof(my_cookie));
 		rate_log(md, "DOS mode on; responding to IKE_SA_INIT with cookie notification request");
 		send_v2N_response_from_md(md, v2N_COOKIE, &local_cookie);
 		return true; /* reject cookie */
@@ -159,34 +246,46 @@ bool v2_rejected_initiator_cookie(struct msg_digest *md,
 	/* done: me_want_cookie && cookie_digest == NULL */
 	passert(cookie_digest != NULL);
 
-	/*
-	 * Check that the cookie notification is well constructed.
-	 * Mainly for own sanity.
-	 *
-	 * Since they payload is understood ISAKMP_PAYLOAD_CRITICAL
-	 * should be ignored.
-	 */
-	struct ikev2_notify *cookie_header = &cookie_digest->payload.v2n;
-	if (cookie_header->isan_protoid != 0 ||
-	    cookie_header->isan_spisize != 0 ||
-	    cookie_header->isan_length != sizeof(v2_cookie_t) + sizeof(struct ikev2_notify)) {
-		rate_log(md, "DOS cookie notification corrupt, or invalid - dropping message");
+	const char *ugh = v2_cookie_mismatch(cookie_digest, md);
+	if (ugh != NULL) {
+		rate_log(md, "%s", ugh);
 		return true; /* reject cookie */
 	}
-	shunk_t remote_cookie = pbs_in_left_as_shunk(&cookie_digest->pbs);
+	dbg("cookies match");
 
-	if (DBGP(DBG_BASE)) {
-		DBG_dump_hunk("received cookie", remote_cookie);
-		DBG_dump_hunk("computed cookie", local_cookie);
+	return false; /* love the cookie */
+}
+
+/*
+ * IN A RECEIVE WORKER THREAD
+ *
+ * When the IKE_SA_INIT request carries a COOKIE, check it now so that
+ * a flood of bad cookies never reaches the main thread; return false
+ * when the message should be dropped.  Whether a cookie is wanted at
+ * all depends on state only the main thread has, so a request without
+ * one is passed through.
+ *
+ * refresh_v2_cookie_secret() runs on the main thread; since it only
+ * overwrites the secret that has just expired, a racing check can at
+ * worst reject a cookie that would have been rejected anyway.
+ */
+
+bool v2_screen_initiator_cookie(struct msg_digest *md)
+{
+	struct payload_digest *cookie_digest = v2_cookie_digest(md);
+	if (cookie_digest == NULL) {
+		return true;
 	}
 
-	if (!hunk_eq(local_cookie, remote_cookie)) {
-		rate_log(md, "DOS cookies do not match - dropping message");
-		return true; /* reject cookie */
+	const char *ugh = v2_cookie_mismatch(cookie_digest, md);
+	if (ugh != NULL) {
+		dbg("receive worker: %s", ugh);
+		return false;
 	}
-	dbg("cookies match");
 
-	return false; /* love the cookie */
+	dbg("receive worker: cookies match");
+	md->v2_cookie_verified = true;
+	return true;
 }
 
 static stf_status resume_IKE_SA_INIT_with_cookie(struct ike_sa *ike)
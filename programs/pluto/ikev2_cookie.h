@@ -27,6 +27,7 @@ void refresh_v2_cookie_secret(void);
 
 bool v2_rejected_initiator_cookie(struct msg_digest *md,
 				  bool me_want_cookies);
+bool v2_screen_initiator_cookie(struct msg_digest *md); /* thread-safe */
 
 stf_status ikev2_in_IKE_SA_INIT_R_v2N_COOKIE(struct ike_sa *ike,
 					     struct child_sa *child,
@@ -165,10 +165,11 @@ bool authsig_using_ECDSA_ikev2_pubkey(const struct crypt_mac *hash, shunk_t sign
 	return true;
 }
 
-diag_t v2_authsig_and_log_using_ECDSA_pubkey(struct ike_sa *ike,
+diag_t v2_prepare_authsig_using_ECDSA_pubkey(struct ike_sa *ike,
 					     const struct crypt_mac *idhash,
 					     shunk_t signature,
-					     const struct hash_desc *hash_algo)
+					     const struct hash_desc *hash_algo,
+					     struct pubkey_authsig **authsig)
 {
 	statetime_t start = statetime_start(&ike->sa);
 
@@ -178,9 +179,9 @@ diag_t v2_authsig_and_log_using_ECDSA_pubkey(struct ike_sa *ike,
 
 	struct crypt_mac calc_hash = v2_calculate_sighash(ike, idhash, hash_algo,
 							  REMOTE_PERSPECTIVE);
-	diag_t d = authsig_and_log_using_pubkey(ike, &calc_hash, signature, hash_algo,
+	*authsig = prepare_authsig_using_pubkey(ike, &calc_hash, signature, hash_algo,
 						&pubkey_type_ecdsa,
 						authsig_using_ECDSA_ikev2_pubkey);
 	statetime_stop(&start, "%s()", __func__);
-	return d;
+	return NULL;
 }
@@ -76,6 +76,7 @@
 #include "send.h"
 #include "ikev2_send.h"
 #include "pluto_stats.h"
+#include "rekey_schedule.h"
 #include "ikev2_retry.h"
 #include "ipsecconf/confread.h"		/* for struct starter_end */
 #include "addr_lookup.h"
@@ -107,6 +108,8 @@ struct mobike {
 static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_tail(struct state *st,
 							  struct msg_digest *md,
 							  bool pam_status);
+static v2_authsig_cb ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_post_authsig; /* type check */
+static v2_authsig_cb v2_in_IKE_AUTH_R_post_authsig; /* type check */
 
 static stf_status ikev2_child_out_tail(struct ike_sa *ike,
 				       struct child_sa *child,
@@ -1478,8 +1481,16 @@ stf_status ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_AUTH_I_or_IKE_IN
 			ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_INTERMEDIATE_I_continue :
 		ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_AUTH_I_continue;
 
-	submit_dh_shared_secret(st, st->st_gr/*initiator needs responder KE*/,
-				pcrc_func, HERE);
+	if (md->hdr.isa_xchg == ISAKMP_v2_IKE_INTERMEDIATE) {
+		/* keymat was derived along with IKE_SA_INIT's g^ir */
+		submit_dh_shared_secret(st, st->st_gr/*initiator needs responder KE*/,
+					pcrc_func, HERE);
+	} else {
+		submit_dh_shared_secret_and_v2_keymat(st, st->st_gr/*initiator needs responder KE*/,
+						      NULL, NULL, /*no old keymat*/
+						      &st->st_ike_rekey_spis,
+						      pcrc_func, HERE);
+	}
 	return STF_SUSPEND;
 }
 
@@ -1506,9 +1517,8 @@ static stf_status ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_INTERMEDI
 		return STF_FAIL;
 	}
 
-	calc_v2_keymat(st,
-		       NULL, NULL, /*previous keymat*/
-		       &st->st_ike_rekey_spis);
+	/* SKEYSEED et.al. were derived along with g^ir */
+	pexpect(st->hidden_variables.st_skeyid_calculated);
 
 	/*
 	 * All systems are go.
@@ -1802,9 +1812,8 @@ static stf_status ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_AUTH_I_co
 			pstat_sa_failed(pst, REASON_CRYPTO_FAILED);
 			return STF_FAIL;
 		}
-		calc_v2_keymat(st,
-			       NULL, NULL, /*no old keymat*/
-			       &st->st_ike_rekey_spis);
+		/* SKEYSEED et.al. were derived along with g^ir */
+		pexpect(st->hidden_variables.st_skeyid_calculated);
 	}
 
 	/*
@@ -2220,7 +2229,7 @@ static stf_status ikev2_in_IKE_SA_INIT_R_or_IKE_INTERMEDIATE_R_out_IKE_AUTH_I_si
 
 	/* code does not support AH+ESP, which not recommended as per RFC 8247 */
 	struct ipsec_proto_info *proto_info = ikev2_child_sa_proto_info(child, cc->policy);
-	proto_info->our_spi = ikev2_child_sa_spi(&cc->spd, cc->policy, child->sa.st_logger);
+	proto_info->our_spi = ikev2_child_sa_spi(cc->policy, child->sa.st_logger);
 	const chunk_t local_spi = THING_AS_CHUNK(proto_info->our_spi);
 
 	/*
@@ -2452,9 +2461,12 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_no_skeyid(struct ike_sa *ike,
 	dbg("ikev2 parent %s(): calculating g^{xy} in order to decrypt I2", __func__);
 
 	/* initiate calculation of g^xy */
-	submit_dh_shared_secret(st, st->st_gi/*responder needs initiator KE*/,
-				ikev2_ike_sa_process_auth_request_no_keymat_continue,
-				HERE);
+	submit_dh_shared_secret_and_v2_keymat(st, st->st_gi/*responder needs initiator KE*/,
+					      NULL/*old_skey_d*/,
+					      NULL/*old_prf*/,
+					      &st->st_ike_spis/*new SPIs*/,
+					      ikev2_ike_sa_process_auth_request_no_keymat_continue,
+					      HERE);
 	return STF_SUSPEND;
 }
 
@@ -2485,10 +2497,8 @@ static stf_status ikev2_ike_sa_process_auth_request_no_keymat_continue(struct st
 		return STF_FATAL;
 	}
 
-	calc_v2_keymat(st,
-		       NULL/*old_skey_d*/,
-		       NULL/*old_prf*/,
-		       &st->st_ike_spis/*new SPIs*/);
+	/* SKEYSEED et.al. were derived along with g^ir */
+	pexpect(st->hidden_variables.st_skeyid_calculated);
 
 	ikev2_process_state_packet(pexpect_ike_sa(st), st, md);
 	/* above does complete state transition */
@@ -2511,9 +2521,11 @@ stf_status ikev2_in_IKE_INTERMEDIATE_I_out_IKE_INTERMEDIATE_R_no_skeyid(struct i
 	dbg("ikev2 parent %s(): calculating g^{xy} in order to decrypt I2", __func__);
 
 	/* initiate calculation of g^xy */
-	submit_dh_shared_secret(st, st->st_gi/*responder needs initiator KE*/,
-				ikev2_ike_sa_process_intermediate_request_no_skeyid_continue,
-				HERE);
+	submit_dh_shared_secret_and_v2_keymat(st, st->st_gi/*responder needs initiator KE*/,
+					      NULL, NULL, /* no old keymat */
+					      &st->st_ike_spis,
+					      ikev2_ike_sa_process_intermediate_request_no_skeyid_continue,
+					      HERE);
 	return STF_SUSPEND;
 }
 
@@ -2542,9 +2554,8 @@ static stf_status ikev2_ike_sa_process_intermediate_request_no_skeyid_continue(s
 		return STF_FATAL;
 	}
 
-	calc_v2_keymat(st,
-		       NULL, NULL, /* no old keymat */
-		       &st->st_ike_spis);
+	/* SKEYSEED et.al. were derived along with g^ir */
+	pexpect(st->hidden_variables.st_skeyid_calculated);
 
 	ikev2_process_state_packet(pexpect_ike_sa(st), st, md);
 	return STF_SKIP_COMPLETE_STATE_TRANSITION;
@@ -2903,25 +2914,36 @@ stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_id_tail(struct msg_digest *md)
 			dbg("NULL_AUTH verified");
 		} else {
 			dbg("verifying AUTH payload");
-			diag_t d = v2_authsig_and_log(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
-						      ike, &idhash_in, &md->chain[ISAKMP_NEXT_v2AUTH]->pbs,
-						      st->st_connection->spd.that.authby);
-			if (d != NULL) {
-				llog_diag(RC_LOG_SERIOUS, ike->sa.st_logger, &d, "%s", "");
-				dbg("I2 Auth Payload failed");
-				record_v2N_response(ike->sa.st_logger, ike, md,
-						    v2N_AUTHENTICATION_FAILED, NULL/*no data*/,
-						    ENCRYPTED_PAYLOAD);
-				free_chunk_content(&null_auth);
-				pstat_sa_failed(&ike->sa, REASON_AUTH_FAILED);
-				return STF_FATAL;
-			}
+			free_chunk_content(&null_auth);
+			return submit_v2_authsig_and_log(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
+							 ike, st, md, &idhash_in,
+							 &md->chain[ISAKMP_NEXT_v2AUTH]->pbs,
+							 st->st_connection->spd.that.authby,
+							 ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_post_authsig);
 		}
 	}
 
 	/* AUTH succeeded */
 
 	free_chunk_content(&null_auth);
+	return ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_post_authsig(st, md, NULL);
+}
+
+static stf_status ikev2_in_IKE_AUTH_I_out_IKE_AUTH_R_post_authsig(struct state *st,
+								  struct msg_digest *md,
+								  diag_t d)
+{
+	struct ike_sa *ike = ike_sa(st, HERE);
+
+	if (d != NULL) {
+		llog_diag(RC_LOG_SERIOUS, ike->sa.st_logger, &d, "%s", "");
+		dbg("I2 Auth Payload failed");
+		record_v2N_response(ike->sa.st_logger, ike, md,
+				    v2N_AUTHENTICATION_FAILED, NULL/*no data*/,
+				    ENCRYPTED_PAYLOAD);
+		pstat_sa_failed(&ike->sa, REASON_AUTH_FAILED);
+		return STF_FATAL;
+	}
 
 #ifdef AUTH_HAVE_PAM
 	if (st->st_connection->policy & POLICY_IKEV2_PAM_AUTHORIZE)
@@ -3794,8 +3816,20 @@ static stf_status v2_in_IKE_AUTH_R_post_cert_decode(struct state *st, struct msg
 	/* process AUTH payload */
 
 	dbg("verifying AUTH payload");
-	d = v2_authsig_and_log(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
-			       ike, &idhash_in, &md->chain[ISAKMP_NEXT_v2AUTH]->pbs, that_authby);
+	return submit_v2_authsig_and_log(md->chain[ISAKMP_NEXT_v2AUTH]->payload.v2auth.isaa_auth_method,
+					 ike, st, md, &idhash_in,
+					 &md->chain[ISAKMP_NEXT_v2AUTH]->pbs, that_authby,
+					 v2_in_IKE_AUTH_R_post_authsig);
+}
+
+static stf_status v2_in_IKE_AUTH_R_post_authsig(struct state *st,
+						struct msg_digest *md,
+						diag_t d)
+{
+	struct ike_sa *ike = ike_sa(st, HERE);
+	struct state *pst = &ike->sa;
+	struct connection *c = st->st_connection;
+
 	if (d != NULL) {
 		llog_diag(RC_LOG_SERIOUS, ike->sa.st_logger, &d, "%s", "");
 		dbg("R2 Auth Payload failed");
@@ -4107,7 +4141,7 @@ static stf_status ikev2_child_add_ipsec_payloads(struct child_sa *child,
 	/* ??? this code won't support AH + ESP */
 	struct ipsec_proto_info *proto_info
 		= ikev2_child_sa_proto_info(child, cc->policy);
-	proto_info->our_spi = ikev2_child_sa_spi(&cc->spd, cc->policy, child->sa.st_logger);
+	proto_info->our_spi = ikev2_child_sa_spi(cc->policy, child->sa.st_logger);
 	chunk_t local_spi = THING_AS_CHUNK(proto_info->our_spi);
 
 	/*
@@ -4335,9 +4369,12 @@ stf_status ikev2_child_ike_inR(struct ike_sa *ike,
 				  &st->st_ike_rekey_spis.responder);
 
 	/* initiate calculation of g^xy for rekey */
-	submit_dh_shared_secret(st, st->st_gr/*initiator needs responder's KE*/,
-				ikev2_child_ike_inR_continue,
-				HERE);
+	submit_dh_shared_secret_and_v2_keymat(st, st->st_gr/*initiator needs responder's KE*/,
+					      ike->sa.st_skey_d_nss, /* only IKE has SK_d */
+					      ike->sa.st_oakley.ta_prf, /* for IKE/ESP/AH */
+					      &child->sa.st_ike_rekey_spis/* new SPIs */,
+					      ikev2_child_ike_inR_continue,
+					      HERE);
 	return STF_SUSPEND;
 }
 
@@ -4374,10 +4411,8 @@ static stf_status ikev2_child_ike_inR_continue(struct state *st,
 		return STF_FAIL + v2N_INVALID_SYNTAX;
 	}
 
-	calc_v2_keymat(st,
-		       ike->sa.st_skey_d_nss, /* only IKE has SK_d */
-		       ike->sa.st_oakley.ta_prf, /* for IKE/ESP/AH */
-		       &child->sa.st_ike_rekey_spis/* new SPIs */);
+	/* SKEYSEED et.al. were derived along with g^ir */
+	pexpect(st->hidden_variables.st_skeyid_calculated);
 
 	ikev2_rekey_expire_pred(st, st->st_ike_pred);
 	return STF_OK;
@@ -4827,9 +4862,12 @@ static stf_status ikev2_child_ike_inIoutR_continue(struct state *st,
 				  &st->st_ike_rekey_spis.initiator);
 	st->st_ike_rekey_spis.responder = ike_responder_spi(&md->sender,
 							    st->st_logger);
-	submit_dh_shared_secret(st, st->st_gi/*responder needs initiator KE*/,
-				ikev2_child_ike_inIoutR_continue_continue,
-				HERE);
+	submit_dh_shared_secret_and_v2_keymat(st, st->st_gi/*responder needs initiator KE*/,
+					      ike->sa.st_skey_d_nss, /* only IKE has SK_d */
+					      ike->sa.st_oakley.ta_prf, /* for IKE/ESP/AH */
+					      &st->st_ike_rekey_spis,
+					      ikev2_child_ike_inIoutR_continue_continue,
+					      HERE);
 
 	return STF_SUSPEND;
 }
@@ -4866,10 +4904,8 @@ static stf_status ikev2_child_ike_inIoutR_continue_continue(struct state *st,
 		return STF_FATAL; /* kill family */
 	}
 
-	calc_v2_keymat(st,
-		       ike->sa.st_skey_d_nss, /* only IKE has SK_d */
-		       ike->sa.st_oakley.ta_prf, /* for IKE/ESP/AH */
-		       &st->st_ike_rekey_spis);
+	/* SKEYSEED et.al. were derived along with g^ir */
+	pexpect(st->hidden_variables.st_skeyid_calculated);
 
 	return ikev2_child_out_tail(ike, child, md);
 }
@@ -5233,6 +5269,7 @@ static void mobike_reset_remote(struct state *st, struct mobike *est_remote)
 		return;
 
 	st->st_remote_endpoint = est_remote->remote;
+	rehash_state_remote_address(st);
 	st->st_interface = est_remote->interface;
 	pexpect_st_local_endpoint(st);
 	st->st_mobike_remote_endpoint = unset_endpoint;
@@ -5254,6 +5291,7 @@ static void mobike_switch_remote(struct msg_digest *md, struct mobike *est_remot
 
 		/* set temp one and after the message sent reset it */
 		st->st_remote_endpoint = md->sender;
+		rehash_state_remote_address(st);
 		st->st_interface = md->iface;
 		pexpect_st_local_endpoint(st);
 	}
@@ -6337,7 +6375,11 @@ void v2_schedule_replace_event(struct state *st)
 	}
 
 	delete_event(st);
-	event_schedule(kind, deltatime(delay), st);
+	if (kind == EVENT_SA_REKEY) {
+		schedule_rekey_event(kind, deltatime(delay), st);
+	} else {
+		event_schedule(kind, deltatime(delay), st);
+	}
 }
 
 void v2_event_sa_rekey(struct state *st)
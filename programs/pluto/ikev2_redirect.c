@@ -32,7 +32,7 @@
 #include "ipsec_doi.h"
 #include "ikev2.h"
 #include "ikev2_send.h"
-#include "kernel.h"		/* needed for del_spi */
+#include "ipsec_spi.h"		/* for release_ipsec_spi() */
 #include "ip_info.h"
 #include "ikev2_redirect.h"
 #include "initiate.h"
@@ -423,28 +423,21 @@ err_t parse_redirect_payload(const struct pbs_in *notify_pbs,
 }
 
 /*
- * if we were redirected in AUTH, we must delete one XFRM
- * state entry manually (to the old gateway), because
- * teardown_half_ipsec_sa() in kernel.c, that is called eventually
- * following the above EVENT_SA_EXPIRE, does not delete
- * it. It does not delete it (via del_spi) because
+ * if we were redirected in AUTH, we must release our inbound ESP SPI
+ * manually, because teardown_half_ipsec_sa() in kernel.c, that is
+ * called eventually following the above EVENT_SA_EXPIRE, does not
+ * release it.  It does not release it (via del_spi) because
  * st->st_esp.present was not still at that point set to
  * TRUE. (see the method teardown_half_ipsec_sa for more details)
  *
  * note: the IPsec SA is not truly and fully established when
- * we are doing redirect in IKE_AUTH, and because of that
- * we may delete XFRM state entry without any worries.
+ * we are doing redirect in IKE_AUTH, so nothing is in the kernel;
+ * the SPI is only reserved by pluto (see ipsec_spi.c).
  */
 static void del_spi_trick(struct state *st)
 {
-	if (del_spi(st->st_esp.our_spi, &ip_protocol_esp,
-		    &st->st_connection->temp_vars.old_gw_address,
-		    &st->st_connection->spd.this.host_addr,
-		    st->st_logger)) {
-		dbg("redirect: successfully deleted lingering SPI entry");
-	} else {
-		dbg("redirect: failed to delete lingering SPI entry");
-	}
+	release_ipsec_spi(st->st_esp.our_spi, &ip_protocol_esp);
+	dbg("redirect: released lingering SPI reservation");
 }
 
 void initiate_redirect(struct state *st)
@@ -481,6 +474,7 @@ void initiate_redirect(struct state *st)
 	c->temp_vars.old_gw_address = c->spd.that.host_addr;
 	/* update host_addr of other end, port stays the same */
 	c->spd.that.host_addr = redirect_ip;
+	rehash_connection_remote_address(c);
 
 	address_buf b;
 	log_state(RC_LOG, st, "initiating a redirect to new gateway (address: %s)",
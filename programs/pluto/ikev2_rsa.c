@@ -142,10 +142,11 @@ bool ikev2_calculate_rsa_hash(struct ike_sa *ike,
 	return TRUE;
 }
 
-diag_t v2_authsig_and_log_using_RSA_pubkey(struct ike_sa *ike,
+diag_t v2_prepare_authsig_using_RSA_pubkey(struct ike_sa *ike,
 					   const struct crypt_mac *idhash,
 					   shunk_t signature,
-					   const struct hash_desc *hash_algo)
+					   const struct hash_desc *hash_algo,
+					   struct pubkey_authsig **authsig)
 {
 	statetime_t start = statetime_start(&ike->sa);
 
@@ -160,8 +161,8 @@ diag_t v2_authsig_and_log_using_RSA_pubkey(struct ike_sa *ike,
 
 	struct crypt_mac hash = v2_calculate_sighash(ike, idhash, hash_algo,
 						     REMOTE_PERSPECTIVE);
-	diag_t d = authsig_and_log_using_pubkey(ike, &hash, signature, hash_algo,
+	*authsig = prepare_authsig_using_pubkey(ike, &hash, signature, hash_algo,
 						&pubkey_type_rsa, authsig_using_RSA_pubkey);
 	statetime_stop(&start, "%s()", __func__);
-	return d;
+	return NULL;
 }
@@ -2245,8 +2245,7 @@ struct ipsec_proto_info *ikev2_child_sa_proto_info(struct child_sa *child, lset_
 	}
 }
 
-ipsec_spi_t ikev2_child_sa_spi(const struct spd_route *spd_route, lset_t policy,
-			       struct logger *logger)
+ipsec_spi_t ikev2_child_sa_spi(lset_t policy, struct logger *logger)
 {
 	const struct ip_protocol *ipprotoid;
 	switch (policy & (POLICY_ENCRYPT | POLICY_AUTHENTICATE)) {
@@ -2260,9 +2259,7 @@ ipsec_spi_t ikev2_child_sa_spi(const struct spd_route *spd_route, lset_t policy,
 		bad_case(policy);
 	}
 	return get_ipsec_spi(0 /* avoid this # */,
-			     ipprotoid, spd_route,
-			     true /* tunnel */,
-			     logger);
+			     ipprotoid, logger);
 }
 
 /*
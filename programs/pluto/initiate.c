@@ -966,6 +966,7 @@ static void connection_check_ddns1(struct connection *c)
 	    str_address_sensitive(&c->spd.that.host_addr, &old),
 	    str_address_sensitive(&new_addr, &new));
 	c->spd.that.host_addr = new_addr;
+	rehash_connection_remote_address(c);
 	update_ends_from_this_host_addr(&c->spd.that, &c->spd.this);
 
 	/*
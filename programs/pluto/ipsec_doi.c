@@ -82,6 +82,7 @@
 #include "iface.h"
 #include "ikev2_delete.h"	/* for record_v2_delete(); but call is dying */
 #include "orient.h"
+#include "state_db.h"
 
 void ipsecdoi_initiate(struct fd *whack_sock,
 		       struct connection *c,
@@ -291,6 +292,7 @@ void initialize_new_state(struct state *st,
 	st->st_remote_endpoint = endpoint_from_address_protocol_port(c->spd.that.host_addr,
 								     c->interface->protocol,
 								     ip_hport(c->spd.that.host_port));
+	rehash_state_remote_address(st);
 	endpoint_buf eb;
 	dbg("in %s with remote endpoint set to %s",
 	    __func__, str_endpoint(&st->st_remote_endpoint, &eb));
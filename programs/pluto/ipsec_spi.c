@@ -0,0 +1,244 @@
+/* inbound IPsec SPI allocation, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include "defs.h"
+#include "ipsec_spi.h"
+#include "hash_table.h"
+#include "ip_protocol.h"
+#include "log.h"
+#include "monotime.h"
+#include "rnd.h"
+#include "show.h"
+
+/*
+ * Pluto picks the SPI (or CPI) of each inbound SA itself rather than
+ * asking the kernel for one (XFRM_MSG_ALLOCSPI), saving a synchronous
+ * round trip per Child SA.
+ *
+ * Each SPI handed out is remembered in spis_hash_table until the SA
+ * is deleted (teardown_half_ipsec_sa() calls release_ipsec_spi()), so
+ * pluto never hands out the same SPI twice.  Entries are keyed by
+ * protocol and SPI alone since the local address can change (MOBIKE)
+ * while the SA stays installed.  A reservation whose SA never makes
+ * it into the kernel (the negotiation failed) is dropped once it is
+ * IPSEC_SPI_RESERVATION_SECONDS old; this mirrors the kernel expiring
+ * the larval SA that ALLOCSPI used to create.
+ *
+ * An SA that pluto did not create (for instance, manually keyed) can
+ * still hold the SPI; that is detected when the kernel rejects the
+ * new SA, and the negotiation fails.  With 32-bit random SPIs this is
+ * very unlikely.
+ */
+
+#define IPSEC_SPI_MAGIC 0x1b5e5b1aUL
+#define IPSEC_SPI_RESERVATION_SECONDS 300
+#define IPSEC_SPI_TRIES 64
+
+struct spi_entry {
+	unsigned long magic;
+	struct list_entry hash_entry;
+	ipsec_spi_t spi;		/* network order */
+	const struct ip_protocol *proto;
+	bool installed;
+	monotime_t expires;		/* when !installed */
+};
+
+static unsigned long total_allocated;
+static unsigned long total_expired;
+static unsigned long total_exhausted;
+static monotime_t next_sweep;
+
+static void jam_spi_entry(struct jambuf *buf, const void *data)
+{
+	if (data == NULL) {
+		jam(buf, "NULL spi");
+	} else {
+		const struct spi_entry *entry = data;
+		passert(entry->magic == IPSEC_SPI_MAGIC);
+		jam(buf, "%s.%08x", entry->proto->name, ntohl(entry->spi));
+		jam(buf, "%s", entry->installed ? " installed" : " reserved");
+	}
+}
+
+static hash_t spi_hasher(ipsec_spi_t spi, const struct ip_protocol *proto)
+{
+	hash_t hash = zero_hash;
+	hash = hash_table_hasher(shunk2(&spi, sizeof(spi)), hash);
+	hash = hash_table_hasher(shunk2(&proto->ipproto, sizeof(proto->ipproto)), hash);
+	return hash;
+}
+
+static hash_t spi_entry_hasher(const void *data)
+{
+	const struct spi_entry *entry = data;
+	passert(entry->magic == IPSEC_SPI_MAGIC);
+	return spi_hasher(entry->spi, entry->proto);
+}
+
+static struct list_entry *spi_entry_entry(void *data)
+{
+	struct spi_entry *entry = data;
+	passert(entry->magic == IPSEC_SPI_MAGIC);
+	return &entry->hash_entry;
+}
+
+static struct hash_table spis_hash_table = {
+	.info = {
+		.name = "inbound SPI table",
+		.jam = jam_spi_entry,
+	},
+	.hasher = spi_entry_hasher,
+	.entry = spi_entry_entry,
+	.nr_slots = 23,
+};
+
+void init_ipsec_spi(void)
+{
+	init_hash_table(&spis_hash_table);
+}
+
+static void free_spi_entry(struct spi_entry **entry)
+{
+	del_hash_table_entry(&spis_hash_table, *entry);
+	pfree(*entry);
+	*entry = NULL;
+}
+
+static bool spi_entry_expired(const struct spi_entry *entry, monotime_t now)
+{
+	return !entry->installed && !monobefore(now, entry->expires);
+}
+
+/* drop every entry, or just the expired reservations */
+static void sweep_spi_entries(bool all, monotime_t now)
+{
+	finish_hash_table_resize(&spis_hash_table);
+	for (unsigned i = 0; i < spis_hash_table.nr_slots; i++) {
+		struct spi_entry *entry;
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&spis_hash_table.slots[i], entry) {
+			if (all || spi_entry_expired(entry, now)) {
+				if (!all) {
+					total_expired++;
+				}
+				free_spi_entry(&entry);
+			}
+		}
+	}
+}
+
+void free_ipsec_spi(void)
+{
+	sweep_spi_entries(true, mononow());
+	free_hash_table(&spis_hash_table);
+}
+
+static struct spi_entry *find_spi_entry(ipsec_spi_t spi, const struct ip_protocol *proto)
+{
+	struct list_head *bucket = hash_table_bucket(&spis_hash_table,
+						     spi_hasher(spi, proto));
+	struct spi_entry *entry;
+	FOR_EACH_LIST_ENTRY_OLD2NEW(bucket, entry) {
+		if (entry->spi == spi && entry->proto == proto) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+ipsec_spi_t alloc_ipsec_spi(const struct ip_protocol *proto,
+			    ipsec_spi_t min, ipsec_spi_t max,
+			    ipsec_spi_t avoid, struct logger *logger)
+{
+	passert(min <= max);
+	monotime_t now = mononow();
+
+	/* don't let abandoned reservations pile up */
+	if (!monobefore(now, next_sweep)) {
+		sweep_spi_entries(false, now);
+		next_sweep = monotime_add(now, deltatime(IPSEC_SPI_RESERVATION_SECONDS));
+	}
+
+	for (unsigned try = 0; try < IPSEC_SPI_TRIES; try++) {
+		uint32_t r;
+		get_rnd_bytes(&r, sizeof(r));
+		ipsec_spi_t spi = htonl(min + r % (max - min + 1));
+		if (spi == avoid) {
+			continue;
+		}
+		struct spi_entry *entry = find_spi_entry(spi, proto);
+		if (entry != NULL) {
+			if (!spi_entry_expired(entry, now)) {
+				continue;
+			}
+			total_expired++;
+			free_spi_entry(&entry);
+		}
+
+		entry = alloc_thing(struct spi_entry, "inbound SPI");
+		entry->magic = IPSEC_SPI_MAGIC;
+		entry->spi = spi;
+		entry->proto = proto;
+		entry->expires = monotime_add(now, deltatime(IPSEC_SPI_RESERVATION_SECONDS));
+		add_hash_table_entry(&spis_hash_table, entry);
+		total_allocated++;
+
+		dbg("allocated %s SPI 0x%08x", proto->name, ntohl(spi));
+		return spi;
+	}
+
+	total_exhausted++;
+	llog(RC_LOG_SERIOUS, logger,
+	     "unable to find an unused %s SPI in the range 0x%x-0x%x after %u tries",
+	     proto->name, min, max, IPSEC_SPI_TRIES);
+	return 0;
+}
+
+void keep_ipsec_spi(ipsec_spi_t spi, const struct ip_protocol *proto)
+{
+	struct spi_entry *entry = find_spi_entry(spi, proto);
+	if (entry != NULL) {
+		entry->installed = true;
+	}
+}
+
+void release_ipsec_spi(ipsec_spi_t spi, const struct ip_protocol *proto)
+{
+	struct spi_entry *entry = find_spi_entry(spi, proto);
+	if (entry != NULL) {
+		free_spi_entry(&entry);
+	}
+}
+
+void show_ipsec_spi_stats(struct show *s)
+{
+	unsigned long installed = 0;
+	unsigned long reserved = 0;
+	finish_hash_table_resize(&spis_hash_table);
+	for (unsigned i = 0; i < spis_hash_table.nr_slots; i++) {
+		const struct spi_entry *entry;
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&spis_hash_table.slots[i], entry) {
+			if (entry->installed) {
+				installed++;
+			} else {
+				reserved++;
+			}
+		}
+	}
+	show_raw(s, "current.ipsec.spi.installed=%lu", installed);
+	show_raw(s, "current.ipsec.spi.reserved=%lu", reserved);
+	show_raw(s, "total.ipsec.spi.allocated=%lu", total_allocated);
+	show_raw(s, "total.ipsec.spi.expired=%lu", total_expired);
+	show_raw(s, "total.ipsec.spi.exhausted=%lu", total_exhausted);
+	show_hash_table_stats(s, "hash.ipsec_spi", &spis_hash_table);
+}
@@ -0,0 +1,50 @@
+/* inbound IPsec SPI allocation, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef IPSEC_SPI_H
+#define IPSEC_SPI_H
+
+#include <stdbool.h>
+
+#include "libreswan.h"		/* for ipsec_spi_t */
+
+struct ip_protocol;
+struct show;
+struct logger;
+
+void init_ipsec_spi(void);
+void free_ipsec_spi(void);
+
+/*
+ * Reserve an unused SPI (network order) in [MIN, MAX] (host order)
+ * for an inbound SA; AVOID (network order) is never returned.
+ * Returns 0 when nothing could be found.
+ */
+ipsec_spi_t alloc_ipsec_spi(const struct ip_protocol *proto,
+			    ipsec_spi_t min, ipsec_spi_t max,
+			    ipsec_spi_t avoid, struct logger *logger);
+
+/* the inbound SA using SPI is now in the kernel; keep it until released */
+void keep_ipsec_spi(ipsec_spi_t spi, const struct ip_protocol *proto);
+
+/*
+ * The inbound SA using SPI is being deleted.  Only call this for
+ * inbound SAs: an outbound SA uses the peer's SPI, which can coincide
+ * with one of ours.
+ */
+void release_ipsec_spi(ipsec_spi_t spi, const struct ip_protocol *proto);
+
+void show_ipsec_spi_stats(struct show *s);
+
+#endif
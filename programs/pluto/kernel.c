@@ -56,6 +56,8 @@
 #include "id.h"
 #include "connections.h"        /* needs id.h */
 #include "state.h"
+#include "state_db.h"		/* for rehash_state_ipsec_spis() */
+#include "ipsec_spi.h"
 #include "timer.h"
 #include "kernel.h"
 #include "kernel_xfrm.h"
@@ -80,6 +82,8 @@
 # include "kernel_xfrm_interface.h"
 #include "iface.h"
 #include "ip_selector.h"
+#include "updown_helper.h"
+#include "ipsecconf/confread.h"	/* for DEFAULT_UPDOWN */
 #include "ip_encap.h"
 #include "show.h"
 
@@ -267,72 +271,26 @@ void record_and_initiate_opportunistic(const ip_endpoint *local_client,
 	}
 }
 
-static reqid_t get_proto_reqid(reqid_t base, const struct ip_protocol *proto)
-{
-	if (proto == &ip_protocol_comp)
-		return reqid_ipcomp(base);
-
-	if (proto == &ip_protocol_esp)
-		return reqid_esp(base);
-
-	if (proto == &ip_protocol_ah)
-		return reqid_ah(base);
-
-	PASSERT_FAIL("bad protocol %s", proto->name);
-}
-
 /* Generate Unique SPI numbers.
  *
  * The specs say that the number must not be less than IPSEC_DOI_SPI_MIN.
  * Pluto generates numbers not less than IPSEC_DOI_SPI_OUR_MIN,
  * reserving numbers in between for manual keying (but we cannot so
  * restrict numbers generated by our peer).
- * XXX This should be replaced by a call to the kernel when
- * XXX we get an API.
  * The returned SPI is in network byte order.
- * We use a random number as the initial SPI so that there is
- * a good chance that different Pluto instances will choose
- * different SPIs.  This is good for two reasons.
- * - the keying material for the initiator and responder only
- *   differs if the SPIs differ.
- * - if Pluto is restarted, it would otherwise recycle the SPI
- *   numbers and confuse everything.  When the kernel generates
- *   SPIs, this will no longer matter.
- * We then allocate numbers sequentially.  Thus we don't have to
- * check if the number was previously used (assuming that no
- * SPI lives longer than 4G of its successors).
+ *
+ * The SPI is chosen at random, by pluto, and reserved until the SA is
+ * deleted (see ipsec_spi.c).  Random numbers give a good chance that
+ * different Pluto instances, or a restarted Pluto, choose different
+ * SPIs.
  */
 ipsec_spi_t get_ipsec_spi(ipsec_spi_t avoid,
 			  const struct ip_protocol *proto,
-			  const struct spd_route *sr,
-			  bool tunnel,
 			  struct logger *logger)
 {
 	passert(proto == &ip_protocol_ah || proto == &ip_protocol_esp);
-
-	if (kernel_ops->get_spi != NULL) {
-		char text_said[SATOT_BUF];
-		set_text_said(text_said, &sr->this.host_addr, 0, proto);
-		return kernel_ops->get_spi(&sr->that.host_addr,
-					   &sr->this.host_addr, proto, tunnel,
-					   get_proto_reqid(sr->reqid, proto),
-					   IPSEC_DOI_SPI_OUR_MIN, 0xffffffff,
-					   text_said, logger);
-	} else {
-		static ipsec_spi_t spi = 0; /* host order, so not returned directly! */
-
-		spi++;
-		while (spi < IPSEC_DOI_SPI_OUR_MIN || spi == ntohl(avoid))
-			get_rnd_bytes((uint8_t *)&spi, sizeof(spi));
-
-		if (DBGP(DBG_BASE)) {
-			ipsec_spi_t spi_net = htonl(spi);
-			DBG_dump("generate SPI:", (uint8_t *)&spi_net,
-				 sizeof(spi_net));
-		}
-
-		return htonl(spi);
-	}
+	return alloc_ipsec_spi(proto, IPSEC_DOI_SPI_OUR_MIN, 0xffffffff,
+			       avoid, logger);
 }
 
 /* Generate Unique CPI numbers.
@@ -343,40 +301,11 @@ ipsec_spi_t get_ipsec_spi(ipsec_spi_t avoid,
  * If we can't find one easily, return 0 (a bad SPI,
  * no matter what order) indicating failure.
  */
-ipsec_spi_t get_my_cpi(const struct spd_route *sr, bool tunnel,
-		       struct logger *logger)
+ipsec_spi_t get_my_cpi(struct logger *logger)
 {
-	if (kernel_ops->get_spi != NULL) {
-		char text_said[SATOT_BUF];
-		set_text_said(text_said, &sr->this.host_addr, 0, &ip_protocol_comp);
-		return kernel_ops->get_spi(&sr->that.host_addr,
-					   &sr->this.host_addr, &ip_protocol_comp,
-					   tunnel,
-					   get_proto_reqid(sr->reqid, &ip_protocol_comp),
-					   IPCOMP_FIRST_NEGOTIATED,
-					   IPCOMP_LAST_NEGOTIATED,
-					   text_said, logger);
-	} else {
-		static cpi_t first_busy_cpi = 0;
-		static cpi_t latest_cpi = 0;
-
-		while (!(IPCOMP_FIRST_NEGOTIATED <= first_busy_cpi &&
-				first_busy_cpi < IPCOMP_LAST_NEGOTIATED)) {
-			get_rnd_bytes((uint8_t *)&first_busy_cpi,
-				sizeof(first_busy_cpi));
-			latest_cpi = first_busy_cpi;
-		}
-
-		latest_cpi++;
-
-		if (latest_cpi == first_busy_cpi)
-			find_my_cpi_gap(&latest_cpi, &first_busy_cpi);
-
-		if (latest_cpi > IPCOMP_LAST_NEGOTIATED)
-			latest_cpi = IPCOMP_FIRST_NEGOTIATED;
-
-		return htonl((ipsec_spi_t)latest_cpi);
-	}
+	return alloc_ipsec_spi(&ip_protocol_comp,
+			       IPCOMP_FIRST_NEGOTIATED, IPCOMP_LAST_NEGOTIATED,
+			       0, logger);
 }
 
 /*
@@ -661,6 +590,24 @@ bool fmt_common_shell_out(char *buf, size_t blen, const struct connection *c,
 	return jambuf_ok(&jambuf);
 }
 
+/*
+ * What leftupdown=%native doesn't do; connections using any of these
+ * still run the default script.
+ */
+static bool native_updown_covers(const struct connection *c,
+				 const struct spd_route *sr)
+{
+	return (kernel_ops->native_updown != NULL &&
+		c->vti_iface == NULL &&
+		c->nflog_group == 0 &&
+		!sr->this.has_cat &&
+		!sr->this.modecfg_client
+#ifdef HAVE_NM
+		&& !c->nmconfigured
+#endif
+		);
+}
+
 bool do_command(const struct connection *c,
 		const struct spd_route *sr,
 		const char *verb,
@@ -678,7 +625,23 @@ bool do_command(const struct connection *c,
 		dbg("skipped updown %s command - disabled per policy", verb);
 		return true;
 	}
-	dbg("running updown command \"%s\" for verb %s ", sr->this.updown, verb);
+
+	const char *updown = sr->this.updown;
+	if (streq(updown, "%native")) {
+		if (native_updown_covers(c, sr)) {
+			dbg("running native updown for verb %s", verb);
+			return kernel_ops->native_updown(c, sr, verb, st, logger);
+		}
+		dbg("native updown can't handle this connection, falling back to %s", DEFAULT_UPDOWN);
+		updown = DEFAULT_UPDOWN;
+	}
+	bool helper = streq(updown, "%helper");
+	if (helper && pluto_updown_helper == NULL) {
+		dbg("no updown-helper configured, falling back to %s", DEFAULT_UPDOWN);
+		helper = false;
+		updown = DEFAULT_UPDOWN;
+	}
+	dbg("running updown command \"%s\" for verb %s ", updown, verb);
 
 	/*
 	 * Figure out which verb suffix applies.
@@ -715,6 +678,11 @@ bool do_command(const struct connection *c,
 		return false;
 	}
 
+	if (helper) {
+		return updown_helper_command(verb, verb_suffix, c->name,
+					     common_shell_out_str, logger);
+	}
+
 	/* must free */
 	char *cmd = alloc_printf("2>&1 "      /* capture stderr along with stdout */
 				 "PLUTO_VERB='%s%s' "
@@ -722,7 +690,7 @@ bool do_command(const struct connection *c,
 				 "%s",        /* actual script */
 				 verb, verb_suffix,
 				 common_shell_out_str,
-				 sr->this.updown);
+				 updown);
 	if (cmd == NULL) {
 		llog(RC_LOG_SERIOUS, logger,
 			    "%s%s command too long!", verb,
@@ -1778,6 +1746,35 @@ static void setup_esp_nic_offload(struct kernel_sa *sa, struct connection *c,
 	sa->nic_offload_dev = c->interface->ip_dev->id_rname;
 }
 
+/*
+ * Collect the outcome of the kernel calls made since begin_batch():
+ * NR_SAS add_sa() calls, whose outcome is stored in SAS_OK[], then,
+ * when EROUTE_OK is non-NULL, one raw_eroute().  Return false if any
+ * SA failed.
+ */
+
+static bool end_kernel_batch(unsigned nr_sas, bool sas_ok[],
+			     bool *eroute_ok, struct logger *logger)
+{
+	bool ok[EM_MAXRELSPIS + 1];
+	passert(nr_sas < elemsof(ok));
+	for (unsigned i = 0; i < elemsof(ok); i++) {
+		ok[i] = true;
+	}
+
+	kernel_ops->end_batch(ok, elemsof(ok), logger);
+
+	bool all_ok = true;
+	for (unsigned i = 0; i < nr_sas; i++) {
+		sas_ok[i] = ok[i];
+		all_ok &= ok[i];
+	}
+	if (eroute_ok != NULL) {
+		*eroute_ok = ok[nr_sas];
+	}
+	return all_ok;
+}
+
 /*
  * Set up one direction of the SA bundle
  */
@@ -1789,7 +1786,6 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 	ipsec_spi_t inner_spi = 0;
 	const struct ip_protocol *proto = NULL;
 	enum eroute_type esatype = ET_UNSPEC;
-	bool replace = inbound && (kernel_ops->get_spi != NULL);
 	bool outgoing_ref_set = false;
 	bool incoming_ref_set = false;
 	IPsecSAref_t ref_peer = st->st_ref_peer;
@@ -1799,11 +1795,25 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 	/* SPIs, saved for spigrouping or undoing, if necessary */
 	struct kernel_sa said[EM_MAXRELSPIS];
 	struct kernel_sa *said_next = said;
+	/* cleared when a batched add_sa() turns out to have failed */
+	bool said_ok[EM_MAXRELSPIS];
+	for (unsigned i = 0; i < elemsof(said_ok); i++) {
+		said_ok[i] = true;
+	}
 
 	char text_ipcomp[SATOT_BUF];
 	char text_esp[SATOT_BUF];
 	char text_ah[SATOT_BUF];
 
+	/*
+	 * Pipeline the add_sa() and inbound raw_eroute() calls; their
+	 * outcome is only known after end_kernel_batch().
+	 */
+	bool batching = (kernel_ops->begin_batch != NULL);
+	if (batching) {
+		kernel_ops->begin_batch();
+	}
+
 	ip_address src, dst;
 	ip_selector src_client, dst_client;
 	if (inbound) {
@@ -1912,7 +1922,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 			outgoing_ref_set  = true;
 		}
 
-		if (!kernel_ops->add_sa(said_next, replace, st->st_logger)) {
+		if (!kernel_ops->add_sa(said_next, st->st_logger)) {
 			log_state(RC_LOG, st, "add_sa ipcomp failed");
 			goto fail;
 		}
@@ -2129,13 +2139,23 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		}
 		setup_esp_nic_offload(said_next, c, &nic_offload_fallback);
 
-		bool ret = kernel_ops->add_sa(said_next, replace, st->st_logger);
+		if (batching && nic_offload_fallback &&
+		    said_next->nic_offload_dev != NULL) {
+			/* the fallback needs to know the outcome straight away */
+			batching = false;
+			if (!end_kernel_batch(said_next - said, said_ok,
+					      NULL, st->st_logger)) {
+				goto fail;
+			}
+		}
+
+		bool ret = kernel_ops->add_sa(said_next, st->st_logger);
 
 		if (!ret && nic_offload_fallback &&
 			said_next->nic_offload_dev != NULL) {
 			/* Fallback to non-nic-offload crypto */
 			said_next->nic_offload_dev = NULL;
-			ret = kernel_ops->add_sa(said_next, replace, st->st_logger);
+			ret = kernel_ops->add_sa(said_next, st->st_logger);
 		}
 
 		/* scrub keys from memory */
@@ -2221,7 +2241,7 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 			outgoing_ref_set = true;	/* outgoing_ref_set not subsequently used */
 		}
 
-		if (!kernel_ops->add_sa(said_next, replace, st->st_logger)) {
+		if (!kernel_ops->add_sa(said_next, st->st_logger)) {
 			/* scrub key from memory */
 			memset(said_next->authkey, 0, said_next->authkeylen);
 			goto fail;
@@ -2258,7 +2278,8 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 	 */
 	dbg("%s() is installing inbound eroute? inbound=%d owner=#%lu mode=%d",
 	    __func__, inbound, c->spd.eroute_owner, mode);
-	if (inbound && c->spd.eroute_owner == SOS_NOBODY) {
+	bool inbound_eroute = (inbound && c->spd.eroute_owner == SOS_NOBODY);
+	if (inbound_eroute) {
 		dbg("%s() is installing inbound eroute", __func__);
 		struct pfkey_proto_info proto_info[4];
 		int i = 0;
@@ -2340,6 +2361,46 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		}
 	}
 
+	if (batching) {
+		batching = false;
+		bool eroute_ok = true;
+		if (!end_kernel_batch(said_next - said, said_ok,
+				      inbound_eroute ? &eroute_ok : NULL,
+				      st->st_logger)) {
+			/*
+			 * The kernel applied the inbound policy on
+			 * its own; take it out again as it would
+			 * never have been added without the SAs.
+			 */
+			if (inbound_eroute && eroute_ok &&
+			    !raw_eroute(&c->spd.that.host_addr,
+					&c->spd.that.client,
+					&c->spd.this.host_addr,
+					&c->spd.this.client,
+					inner_spi, inner_spi,
+					proto,
+					c->spd.this.protocol,
+					esatype,
+					null_proto_info,
+					deltatime(0),
+					calculate_sa_prio(c, false),
+					&c->sa_marks,
+					0, /* xfrm_if_id. needed to tear down? */
+					ERO_DEL_INBOUND,
+					"delete inbound",
+					&c->spd.this.sec_label,
+					st->st_logger)) {
+				llog(RC_LOG, st->st_logger,
+					    "raw_eroute() in setup_half_ipsec_sa() failed to delete inbound");
+			}
+			goto fail;
+		}
+		if (!eroute_ok) {
+			llog(RC_LOG, st->st_logger,
+				    "raw_eroute() in setup_half_ipsec_sa() failed to add inbound");
+		}
+	}
+
 	/* If there are multiple SPIs, group them. */
 
 	if (kernel_ops->grp_sa != NULL && said_next > &said[1]) {
@@ -2374,18 +2435,39 @@ static bool setup_half_ipsec_sa(struct state *st, bool inbound)
 		DBG_log("Impair SA creation is set, pretending to fail");
 		goto fail;
 	}
+
+	if (inbound) {
+		/* our SPIs are now in use by kernel SAs */
+		if (st->st_ah.present)
+			keep_ipsec_spi(st->st_ah.our_spi, &ip_protocol_ah);
+		if (st->st_esp.present)
+			keep_ipsec_spi(st->st_esp.our_spi, &ip_protocol_esp);
+		if (st->st_ipcomp.present)
+			keep_ipsec_spi(st->st_ipcomp.our_spi, &ip_protocol_comp);
+	}
+
+	/* the SPIs are now settled; index the state by them */
+	rehash_state_ipsec_spis(st);
 	return true;
 
 fail:
 	log_state(RC_LOG, st, "setup_half_ipsec_sa() hit fail:");
-	/* undo the done SPIs */
+	if (batching) {
+		/* flush what was queued */
+		end_kernel_batch(said_next - said, said_ok,
+				 NULL, st->st_logger);
+	}
+	/* undo the done SPIs; skip any the kernel rejected */
 	while (said_next-- != said) {
-		if (said_next->proto != 0) {
+		if (said_next->proto != 0 && said_ok[said_next - said]) {
 			(void) del_spi(said_next->spi,
 				       said_next->proto,
 				       &src, said_next->dst.address,
 				       st->st_logger);
 		}
+		if (said_next->proto != 0 && inbound) {
+			release_ipsec_spi(said_next->spi, said_next->proto);
+		}
 	}
 	return false;
 }
@@ -2461,6 +2543,13 @@ static bool teardown_half_ipsec_sa(struct state *st, bool inbound)
 		i++;
 	}
 
+	/* our SPIs can be handed out again */
+	if (inbound) {
+		for (int p = 0; p < i; p++) {
+			release_ipsec_spi(protos[p].info->our_spi, protos[p].proto);
+		}
+	}
+
 	/*
 	 * If the SAs have been grouped, deleting any one will do:
 	 * we just delete the first one found (protos[0]).
@@ -3290,6 +3379,24 @@ bool was_eroute_idle(struct state *st, deltatime_t since_when)
 	return false;
 }
 
+/*
+ * Bracket a walk calling get_sa_info() on many states so that the
+ * kernel can be asked for all the counters at once.
+ */
+void begin_sa_info_walk(struct logger *logger)
+{
+	if (kernel_ops->begin_sa_stats != NULL) {
+		kernel_ops->begin_sa_stats(logger);
+	}
+}
+
+void end_sa_info_walk(void)
+{
+	if (kernel_ops->end_sa_stats != NULL) {
+		kernel_ops->end_sa_stats();
+	}
+}
+
 /*
  * get information about a given sa - needs merging with was_eroute_idle
  *
@@ -3355,6 +3462,11 @@ bool get_sa_info(struct state *st, bool inbound, deltatime_t *ago /* OUTPUT */)
 		.src.address = src,
 		.dst.address = dst,
 		.text_said = text_said,
+		/*
+		 * Liveness and idle checks want AGO; counters up to
+		 * a scan interval old only make the SA look idler.
+		 */
+		.stats_cached = (ago != NULL),
 	};
 
 	dbg("get_sa_info %s", text_said);
@@ -3539,6 +3651,9 @@ static void expire_bare_shunts(struct logger *logger, bool all)
 static void kernel_scan_shunts(struct logger *logger)
 {
 	expire_bare_shunts(logger, false/*not-all*/);
+	if (kernel_ops->refresh_sa_stats != NULL) {
+		kernel_ops->refresh_sa_stats(logger);
+	}
 }
 
 void shutdown_kernel(struct logger *logger)
@@ -176,6 +176,7 @@ struct kernel_sa {
 	struct sa_mark mark_set; /* config keyword mark-out */
 
 	deltatime_t sa_lifetime; /* number of seconds until SA expires */
+	bool stats_cached;	/* get_sa() may answer from the last dump */
 };
 
 struct raw_iface {
@@ -237,8 +238,17 @@ struct kernel_ops {
 				      const ip_selector *ours,
 				      const ip_selector *peers);
 	bool (*add_sa)(const struct kernel_sa *sa,
-		       bool replace,
 		       struct logger *logger);
+	/*
+	 * Optional pipelining: after begin_batch(), add_sa() and
+	 * raw_eroute() may queue their requests and return true.
+	 * end_batch() sends anything still queued, waits for every
+	 * reply, and stores the outcome of the I'th call made since
+	 * begin_batch() in OK[I] (failures have been logged); it
+	 * returns false if any call failed.
+	 */
+	void (*begin_batch)(void);
+	bool (*end_batch)(bool ok[], unsigned nr_ok, struct logger *logger);
 	bool (*grp_sa)(const struct kernel_sa *sa_outer,
 		       const struct kernel_sa *sa_inner);
 	bool (*del_sa)(const struct kernel_sa *sa,
@@ -247,15 +257,16 @@ struct kernel_ops {
 		       uint64_t *bytes,
 		       uint64_t *add_time,
 		       struct logger *logger);
-	ipsec_spi_t (*get_spi)(const ip_address *src,
-			       const ip_address *dst,
-			       const struct ip_protocol *proto,
-			       bool tunnel_mode,
-			       reqid_t reqid,
-			       ipsec_spi_t min,
-			       ipsec_spi_t max,
-			       const char *text_said,
-			       struct logger *logger);
+	/*
+	 * Optional: between begin_sa_stats() and end_sa_stats(),
+	 * get_sa() may answer from a single dump of every SA.  For
+	 * walks, such as trafficstatus, that want all the counters.
+	 * Outside of a walk, only for .stats_cached lookups and from
+	 * the dump made by the last refresh_sa_stats() or walk.
+	 */
+	void (*refresh_sa_stats)(struct logger *logger);
+	void (*begin_sa_stats)(struct logger *logger);
+	void (*end_sa_stats)(void);
 	void (*process_raw_ifaces)(struct raw_iface *rifaces, struct logger *logger);
 	bool (*exceptsocket)(int socketfd, int family, struct logger *logger);
 	err_t (*migrate_sa_check)(struct logger *);
@@ -263,6 +274,15 @@ struct kernel_ops {
 	void (*v6holes)(struct logger *logger);
 	bool (*poke_ipsec_policy_hole)(const struct iface_dev *ifd, int fd, struct logger *logger);
 	bool (*detect_offload)(const struct raw_iface *ifp, struct logger *logger);
+	/*
+	 * Optional: perform the standard updown VERB (prepare, route,
+	 * unroute, up or down) for SR in-process; see leftupdown=%native.
+	 */
+	bool (*native_updown)(const struct connection *c,
+			      const struct spd_route *sr,
+			      const char *verb,
+			      struct state *st,
+			      struct logger *logger);
 };
 
 extern int create_socket(const struct raw_iface *ifp, const char *v_name, int port, int proto);
@@ -390,11 +410,8 @@ extern ipsec_spi_t shunt_policy_spi(const struct connection *c, bool prospective
 struct state;   /* forward declaration of tag */
 extern ipsec_spi_t get_ipsec_spi(ipsec_spi_t avoid,
 				 const struct ip_protocol *proto,
-				 const struct spd_route *sr,
-				 bool tunnel_mode,
 				 struct logger *logger);
-extern ipsec_spi_t get_my_cpi(const struct spd_route *sr, bool tunnel_mode,
-			      struct logger *logger);
+extern ipsec_spi_t get_my_cpi(struct logger *logger);
 
 extern bool install_inbound_ipsec_sa(struct state *st);
 extern bool install_ipsec_sa(struct state *st, bool inbound_also);
@@ -407,6 +424,8 @@ extern bool route_and_eroute(struct connection *c,
 
 extern bool was_eroute_idle(struct state *st, deltatime_t idle_max);
 extern bool get_sa_info(struct state *st, bool inbound, deltatime_t *ago /* OUTPUT */);
+extern void begin_sa_info_walk(struct logger *logger);
+extern void end_sa_info_walk(void);
 extern bool migrate_ipsec_sa(struct state *st);
 extern bool del_spi(ipsec_spi_t spi,
 		    const struct ip_protocol *proto,
@@ -785,7 +785,7 @@ static bool bsdkame_sag_eroute(const struct state *st,
 				  st->st_logger);
 }
 
-static bool bsdkame_add_sa(const struct kernel_sa *sa, bool replace,
+static bool bsdkame_add_sa(const struct kernel_sa *sa,
 			   struct logger *logger)
 {
 	ip_sockaddr saddr = sockaddr_from_address(*sa->src.address);
@@ -838,7 +838,7 @@ static bool bsdkame_add_sa(const struct kernel_sa *sa, bool replace,
 	    sa->integ->common.fqn, sa->authkeylen,
 	    sa->spi, sa->reqid, satype);
 
-	ret =  (replace ? pfkey_send_update : pfkey_send_add)(pfkeyfd,
+	ret = pfkey_send_add(pfkeyfd,
 			    satype, mode,
 			    &saddr.sa.sa, &daddr.sa.sa,
 			    sa->spi,
@@ -858,7 +858,7 @@ static bool bsdkame_add_sa(const struct kernel_sa *sa, bool replace,
 #if 0
 	struct pfkey_send_sa_args add_args = {
 		.so = pfkeyfd,
-		.type = (replace ? SADB_UPDATE : SADB_ADD),
+		.type = SADB_ADD,
 		.satype = satype,
 		.mode = mode,
 		.src = &saddr.sa.sa,
@@ -979,7 +979,6 @@ const struct kernel_ops bsdkame_kernel_ops = {
 	.add_sa = bsdkame_add_sa,
 	.grp_sa = NULL,
 	.del_sa = bsdkame_del_sa,
-	.get_spi = NULL,
 	.eroute_idle = bsdkame_was_eroute_idle,
 	.init = bsdkame_init_pfkey,
 	.shutdown = NULL,
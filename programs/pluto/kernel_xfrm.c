@@ -82,6 +82,7 @@
 #include "nat_traversal.h"
 #include "state.h"
 #include "kernel_xfrm.h"
+#include "acquire_queue.h"	/* for queue_acquire() */
 #include "netlink_attrib.h"
 #include "log.h"
 #include "whack.h"	/* for RC_LOG_SERIOUS */
@@ -92,6 +93,8 @@
 #include "ip_address.h"
 #include "ip_info.h"
 # include "kernel_xfrm_interface.h"
+#include "kernel_xfrm_updown.h"
+#include "pluto_timing.h"	/* for record_latency() */
 #include "iface.h"
 #include "ip_selector.h"
 #include "ip_encap.h"
@@ -341,66 +344,188 @@ static void init_netlink(struct logger *logger)
 }
 
 /*
- * send_netlink_msg
+ * Netlink transactions.
  *
- * @param hdr - Data to be sent.
- * @param expected_resp_type - type of message expected from netlink
- * @param rbuf - Return Buffer - contains data returned from the send.
- * @param description - String - user friendly description of what is
- *                      being attempted.  Used for diagnostics
- * @param text_said - String
- * @return bool True if the message was successfully sent.
+ * A transaction is a request, the response expected, and (once the
+ * kernel has replied) the outcome.  send_netlink_txns() writes one or
+ * more requests to NETLINK_XFRM in a single datagram (the kernel works
+ * through the messages in turn, replying to each) and then collects
+ * the replies, matching them to their request by sequence number.
  */
-static int netlink_errno;	/* side-channel result of send_netlink_msg */
 
-static bool send_netlink_msg(struct nlmsghdr *hdr,
-			     unsigned expected_resp_type, struct nlm_resp *rbuf,
-			     const char *description, const char *text_said,
-			     struct logger *logger)
+struct nl_txn {
+	/* request */
+	struct nlmsghdr *hdr;
+	unsigned expected_resp_type;
+	struct nlm_resp *rbuf;		/* optional; response copied here */
+	bool enoent_ok;			/* NLMSG_ERROR ENOENT is success */
+	const char *description;
+	const char *text_said;
+	unsigned call;			/* see netlink_batch */
+	/* response */
+	bool replied;
+	bool ok;
+	int error;			/* from recvfrom() or the kernel */
+};
+
+static uint32_t netlink_seq = 0;
+
+/* time from write() to the reply, per request type */
+static void record_netlink_latency(const struct nl_txn *txn, const threadtime_t *sent)
 {
-	struct nlm_resp rsp;
-	size_t len;
-	ssize_t r;
-	struct sockaddr_nl addr;
-	static uint32_t seq = 0;	/* STATIC */
+	static struct latency netlink_latency[XFRM_MSG_MAX + 1 - XFRM_MSG_BASE];
+	unsigned type = txn->hdr->nlmsg_type;
+	if (type < XFRM_MSG_BASE || type > XFRM_MSG_MAX) {
+		return;
+	}
+	record_latency(&netlink_latency[type - XFRM_MSG_BASE],
+		       threadtime_sub(threadtime_start(), *sent).wall_seconds,
+		       "netlink.%s", sparse_val_show(xfrm_type_names, type));
+}
 
-	netlink_errno = 0;
+/*
+ * Check the reply RSP (R bytes) to TXN; log and return false when it
+ * is an error.
+ */
 
-	hdr->nlmsg_seq = ++seq;
-	len = hdr->nlmsg_len;
+static bool check_netlink_reply(struct nl_txn *txn, const struct nlm_resp *rsp,
+				ssize_t r, struct logger *logger)
+{
+	if (rsp->n.nlmsg_len > (size_t) r) {
+		llog(RC_LOG_SERIOUS, logger,
+			    "netlink recvfrom() of response to our %s message for %s %s was truncated: %zd instead of %zu",
+			    sparse_val_show(xfrm_type_names, txn->hdr->nlmsg_type),
+			    txn->description, txn->text_said,
+			    r, (size_t) rsp->n.nlmsg_len);
+		return false;
+	}
+
+	if (rsp->n.nlmsg_type == NLMSG_ERROR) {
+		txn->error = -rsp->u.e.error;
+	}
+
+	if (txn->expected_resp_type == NLMSG_ERROR) {
+		/* kind of surprising: success is an error structure! */
+		if (rsp->n.nlmsg_type == NLMSG_ERROR &&
+		    (txn->error == 0 || (txn->error == ENOENT && txn->enoent_ok))) {
+			txn->error = 0;
+		} else if (rsp->n.nlmsg_type == NLMSG_ERROR) {
+			llog(RC_LOG_SERIOUS, logger,
+				    "ERROR: netlink %s response for flow %s included errno %d: %s",
+				    sparse_val_show(xfrm_type_names, txn->hdr->nlmsg_type),
+				    txn->text_said, txn->error, strerror(txn->error));
+			return false;
+		}
+	} else if (rsp->n.nlmsg_type == NLMSG_ERROR) {
+		if (txn->error != 0) {
+			llog(RC_LOG_SERIOUS, logger,
+				    "ERROR: netlink response for %s %s included errno %d: %s",
+				    txn->description, txn->text_said, txn->error,
+				    strerror(txn->error));
+			if (txn->error == EEXIST &&
+			    txn->hdr->nlmsg_type == XFRM_MSG_NEWSA) {
+				llog(RC_LOG_SERIOUS, logger,
+					    "Warning: SPI of %s is already used by an SA that pluto did not create",
+					    txn->text_said);
+			}
+			return false;
+		}
+		/*
+		 * What the heck does a 0 error mean?
+		 * Since the caller doesn't depend on the result
+		 * we'll let it pass.
+		 * This really happens for netlink_add_sa().
+		 */
+		dbg("netlink response for %s %s included non-error error",
+		    txn->description, txn->text_said);
+		/* ignore */
+	}
+
+	if (txn->rbuf == NULL) {
+		return true;
+	}
+	if (rsp->n.nlmsg_type != txn->expected_resp_type) {
+		llog(RC_LOG_SERIOUS, logger,
+			    "netlink recvfrom() of response to our %s message for %s %s was of wrong type (%s)",
+			    sparse_val_show(xfrm_type_names, txn->hdr->nlmsg_type),
+			    txn->description, txn->text_said,
+			    sparse_val_show(xfrm_type_names, rsp->n.nlmsg_type));
+		return false;
+	}
+	memcpy(txn->rbuf, rsp, r);
+	return true;
+}
+
+/*
+ * Write the LEN bytes at PTR, containing the NR_TXNS requests TXNS[],
+ * as one datagram and wait for every reply.  Returns true when all
+ * the transactions succeeded.
+ */
+
+static bool send_netlink_txns(const void *ptr, size_t len,
+			      struct nl_txn *txns, unsigned nr_txns,
+			      struct logger *logger)
+{
+	uint32_t first_seq = netlink_seq + 1;
+	for (unsigned i = 0; i < nr_txns; i++) {
+		struct nl_txn *txn = &txns[i];
+		txn->hdr->nlmsg_seq = ++netlink_seq;
+		txn->replied = txn->ok = false;
+		txn->error = 0;
+	}
+
+	threadtime_t sent = threadtime_start();
+	ssize_t r;
 	do {
-		r = write(nl_send_fd, hdr, len);
+		r = write(nl_send_fd, ptr, len);
 	} while (r < 0 && errno == EINTR);
 	if (r < 0) {
-		log_errno(logger, errno,
-			  "netlink write() of %s message for %s %s failed",
-			  sparse_val_show(xfrm_type_names,
-					  hdr->nlmsg_type),
-			  description, text_said);
-		return FALSE;
+		int e = errno;
+		for (unsigned i = 0; i < nr_txns; i++) {
+			struct nl_txn *txn = &txns[i];
+			txn->error = e;
+			log_errno(logger, e,
+				  "netlink write() of %s message for %s %s failed",
+				  sparse_val_show(xfrm_type_names,
+						  txn->hdr->nlmsg_type),
+				  txn->description, txn->text_said);
+		}
+		return false;
 	} else if ((size_t)r != len) {
 		llog(RC_LOG_SERIOUS, logger,
-			    "ERROR: netlink write() of %s message for %s %s truncated: %zd instead of %zu",
-			    sparse_val_show(xfrm_type_names, hdr->nlmsg_type),
-			    description, text_said, r, len);
-		return FALSE;
+			    "ERROR: netlink write() of %u %s message(s) for %s %s truncated: %zd instead of %zu",
+			    nr_txns,
+			    sparse_val_show(xfrm_type_names, txns[0].hdr->nlmsg_type),
+			    txns[0].description, txns[0].text_said, r, len);
+		return false;
 	}
 
-	for (;;) {
+	unsigned nr_pending = nr_txns;
+	bool ok = true;
+	while (nr_pending > 0) {
+		struct nlm_resp rsp;
+		struct sockaddr_nl addr;
 		socklen_t alen = sizeof(addr);
 
 		r = recvfrom(nl_send_fd, &rsp, sizeof(rsp), 0,
-			(struct sockaddr *)&addr, &alen);
+			     (struct sockaddr *)&addr, &alen);
 		if (r < 0) {
 			if (errno == EINTR)
 				continue;
-			netlink_errno = errno;
-			log_errno(logger, errno,
-				  "netlink recvfrom() of response to our %s message for %s %s failed",
-				  sparse_val_show(xfrm_type_names,
-							hdr->nlmsg_type),
-				  description, text_said);
-			return FALSE;
+			int e = errno;
+			for (unsigned i = 0; i < nr_txns; i++) {
+				struct nl_txn *txn = &txns[i];
+				if (txn->replied) {
+					continue;
+				}
+				txn->error = e;
+				log_errno(logger, e,
+					  "netlink recvfrom() of response to our %s message for %s %s failed",
+					  sparse_val_show(xfrm_type_names,
+							  txn->hdr->nlmsg_type),
+					  txn->description, txn->text_said);
+			}
+			return false;
 		} else if ((size_t) r < sizeof(rsp.n)) {
 			llog(RC_LOG, logger,
 				    "netlink read truncated message: %zd bytes; ignore message", r);
@@ -411,55 +536,204 @@ static bool send_netlink_msg(struct nlmsghdr *hdr,
 			    sparse_val_show(xfrm_type_names, rsp.n.nlmsg_type),
 			    addr.nl_pid);
 			continue;
-		} else if (rsp.n.nlmsg_seq != seq) {
-			dbg("netlink: ignoring out of sequence (%u/%u) message %s",
-			    rsp.n.nlmsg_seq, seq,
+		}
+
+		uint32_t i = rsp.n.nlmsg_seq - first_seq; /* wraps */
+		if (i >= nr_txns || txns[i].replied) {
+			dbg("netlink: ignoring out of sequence (%u/%u..%u) message %s",
+			    rsp.n.nlmsg_seq, first_seq, netlink_seq,
 			    sparse_val_show(xfrm_type_names, rsp.n.nlmsg_type));
 			continue;
 		}
-		break;
+
+		struct nl_txn *txn = &txns[i];
+		txn->replied = true;
+		nr_pending--;
+		record_netlink_latency(txn, &sent);
+		txn->ok = check_netlink_reply(txn, &rsp, r, logger);
+		ok &= txn->ok;
 	}
+	return ok;
+}
 
-	if (rsp.n.nlmsg_len > (size_t) r) {
-		llog(RC_LOG_SERIOUS, logger,
-			    "netlink recvfrom() of response to our %s message for %s %s was truncated: %zd instead of %zu",
-			    sparse_val_show(xfrm_type_names, hdr->nlmsg_type),
-			    description, text_said,
-			    len, (size_t) rsp.n.nlmsg_len);
-		return FALSE;
+/*
+ * Batching.
+ *
+ * Between netlink_begin_batch() and netlink_end_batch(), requests
+ * that only expect an ACK are copied into netlink_batch.buf instead of
+ * being sent; the kernel_ops call that queued them returns true.  The
+ * queue is sent as a single datagram when it fills, when a request
+ * needing its answer straight away comes along, or at the end of the
+ * batch.  The outcome of each kernel_ops call (some, such as
+ * netlink_raw_eroute(), queue more than one request) is recorded in
+ * .call_ok[] for netlink_end_batch() to hand back.
+ *
+ * With netlink-batch=no every request is sent synchronously, as
+ * before, but the outcomes are still recorded.
+ */
+
+bool pluto_netlink_batch = true;
+
+#define NETLINK_BATCH_MAX 32		/* requests, and calls */
+#define NETLINK_BATCH_BUF_SIZE (64 * 1024)
+
+static struct {
+	bool recording;
+	unsigned nr_calls;
+	bool call_ok[NETLINK_BATCH_MAX];
+	unsigned nr_txns;
+	struct {
+		struct nl_txn txn;
+		char text_said[SATOT_BUF + SATOT_BUF];
+	} queue[NETLINK_BATCH_MAX];
+	size_t len;
+	/* nlmsghdr is 32-bit aligned */
+	uint8_t buf[NETLINK_BATCH_BUF_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+} netlink_batch;
+
+static void record_netlink_call(bool ok)
+{
+	if (netlink_batch.recording && netlink_batch.nr_calls > 0) {
+		netlink_batch.call_ok[netlink_batch.nr_calls - 1] &= ok;
 	}
+}
 
-	if (rsp.n.nlmsg_type != expected_resp_type && rsp.n.nlmsg_type == NLMSG_ERROR) {
-		if (rsp.u.e.error != 0) {
-			llog(RC_LOG_SERIOUS, logger,
-				    "ERROR: netlink response for %s %s included errno %d: %s",
-				    description, text_said, -rsp.u.e.error,
-				    strerror(-rsp.u.e.error));
-			return FALSE;
+static void flush_netlink_batch(struct logger *logger)
+{
+	if (netlink_batch.nr_txns == 0) {
+		return;
+	}
+
+	struct nl_txn txns[NETLINK_BATCH_MAX];
+	for (unsigned i = 0; i < netlink_batch.nr_txns; i++) {
+		txns[i] = netlink_batch.queue[i].txn;
+	}
+	dbg("netlink: sending %u batched messages, %zu bytes",
+	    netlink_batch.nr_txns, netlink_batch.len);
+	send_netlink_txns(netlink_batch.buf, netlink_batch.len,
+			  txns, netlink_batch.nr_txns, logger);
+	for (unsigned i = 0; i < netlink_batch.nr_txns; i++) {
+		if (pexpect(txns[i].call < NETLINK_BATCH_MAX)) {
+			netlink_batch.call_ok[txns[i].call] &= txns[i].ok;
 		}
-		/*
-		 * What the heck does a 0 error mean?
-		 * Since the caller doesn't depend on the result
-		 * we'll let it pass.
-		 * This really happens for netlink_add_sa().
-		 */
-		dbg("netlink response for %s %s included non-error error",
-		    description, text_said);
-		/* ignore */
 	}
-	if (rbuf == NULL) {
-		return TRUE;
+
+	/* scrub keys from memory */
+	memset(netlink_batch.buf, 0, netlink_batch.len);
+	netlink_batch.len = 0;
+	netlink_batch.nr_txns = 0;
+}
+
+static void netlink_begin_batch(void)
+{
+	pexpect(!netlink_batch.recording);
+	netlink_batch.recording = true;
+	netlink_batch.nr_calls = 0;
+	for (unsigned i = 0; i < NETLINK_BATCH_MAX; i++) {
+		netlink_batch.call_ok[i] = true;
 	}
-	if (rsp.n.nlmsg_type != expected_resp_type) {
-		llog(RC_LOG_SERIOUS, logger,
-			    "netlink recvfrom() of response to our %s message for %s %s was of wrong type (%s)",
-			    sparse_val_show(xfrm_type_names, hdr->nlmsg_type),
-			    description, text_said,
-			    sparse_val_show(xfrm_type_names, rsp.n.nlmsg_type));
-		return FALSE;
+}
+
+static bool netlink_end_batch(bool ok[], unsigned nr_ok, struct logger *logger)
+{
+	flush_netlink_batch(logger);
+	bool all_ok = true;
+	for (unsigned i = 0; i < netlink_batch.nr_calls; i++) {
+		all_ok &= netlink_batch.call_ok[i];
+		if (i < nr_ok) {
+			ok[i] = netlink_batch.call_ok[i];
+		}
 	}
-	memcpy(rbuf, &rsp, r);
-	return TRUE;
+	netlink_batch.recording = false;
+	return all_ok;
+}
+
+/*
+ * A kernel_ops entry point that may queue requests has been called;
+ * anything it queues is recorded against .call_ok[.nr_calls-1].  A
+ * call that fails before queueing returns false directly.
+ */
+static void start_netlink_call(void)
+{
+	if (netlink_batch.recording &&
+	    pexpect(netlink_batch.nr_calls < NETLINK_BATCH_MAX)) {
+		netlink_batch.nr_calls++;
+	}
+}
+
+/*
+ * send_netlink_msg
+ *
+ * @param hdr - Data to be sent.
+ * @param expected_resp_type - type of message expected from netlink
+ * @param rbuf - Return Buffer - contains data returned from the send.
+ * @param description - String - user friendly description of what is
+ *                      being attempted.  Used for diagnostics
+ * @param text_said - String
+ * @return bool True if the message was successfully sent.
+ */
+
+static bool send_netlink_msg(struct nlmsghdr *hdr,
+			     unsigned expected_resp_type, struct nlm_resp *rbuf,
+			     const char *description, const char *text_said,
+			     struct logger *logger)
+{
+	/* anything queued goes first */
+	flush_netlink_batch(logger);
+
+	struct nl_txn txn = {
+		.hdr = hdr,
+		.expected_resp_type = expected_resp_type,
+		.rbuf = rbuf,
+		.description = description,
+		.text_said = text_said,
+	};
+	return send_netlink_txns(hdr, hdr->nlmsg_len, &txn, 1, logger);
+}
+
+/*
+ * Like send_netlink_msg() for requests that only expect an ACK, but
+ * queue HDR when a batch is open.
+ */
+
+static bool queue_netlink_msg(struct nlmsghdr *hdr, unsigned expected_resp_type,
+			      bool enoent_ok, const char *description,
+			      const char *text_said, struct logger *logger)
+{
+	size_t len = NLMSG_ALIGN(hdr->nlmsg_len);
+	if (netlink_batch.recording && pluto_netlink_batch &&
+	    netlink_batch.nr_calls > 0 && len <= NETLINK_BATCH_BUF_SIZE) {
+		if (netlink_batch.nr_txns >= NETLINK_BATCH_MAX ||
+		    netlink_batch.len + len > NETLINK_BATCH_BUF_SIZE) {
+			flush_netlink_batch(logger);
+		}
+		struct nlmsghdr *copy = (void *)(netlink_batch.buf + netlink_batch.len);
+		memcpy(copy, hdr, hdr->nlmsg_len);
+		netlink_batch.len += len;
+		typeof(netlink_batch.queue[0]) *q = &netlink_batch.queue[netlink_batch.nr_txns++];
+		jam_str(q->text_said, sizeof(q->text_said), text_said);
+		q->txn = (struct nl_txn) {
+			.hdr = copy,
+			.expected_resp_type = expected_resp_type,
+			.enoent_ok = enoent_ok,
+			.description = description, /* static */
+			.text_said = q->text_said,
+			.call = netlink_batch.nr_calls - 1,
+		};
+		return true;
+	}
+
+	flush_netlink_batch(logger);
+	struct nl_txn txn = {
+		.hdr = hdr,
+		.expected_resp_type = expected_resp_type,
+		.enoent_ok = enoent_ok,
+		.description = description,
+		.text_said = text_said,
+	};
+	bool ok = send_netlink_txns(hdr, hdr->nlmsg_len, &txn, 1, logger);
+	record_netlink_call(ok);
+	return ok;
 }
 
 /*
@@ -473,24 +747,8 @@ static bool send_netlink_msg(struct nlmsghdr *hdr,
 static bool netlink_policy(struct nlmsghdr *hdr, bool enoent_ok,
 			   const char *text_said, struct logger *logger)
 {
-	struct nlm_resp rsp;
-
-	if (!send_netlink_msg(hdr, NLMSG_ERROR, &rsp,
-			      "policy", text_said, logger))
-		return FALSE;
-
-	/* kind of surprising: we get here by success which implies an error structure! */
-
-	int error = -rsp.u.e.error;
-
-	if (error == 0 || (error == ENOENT && enoent_ok))
-		return TRUE;
-
-	llog(RC_LOG_SERIOUS, logger,
-		    "ERROR: netlink %s response for flow %s included errno %d: %s",
-		    sparse_val_show(xfrm_type_names, hdr->nlmsg_type),
-		    text_said, error, strerror(error));
-	return FALSE;
+	return queue_netlink_msg(hdr, NLMSG_ERROR, enoent_ok,
+				 "policy", text_said, logger);
 }
 
 /*
@@ -541,6 +799,8 @@ static bool netlink_raw_eroute(const ip_address *this_host,
 
 	int policy = IPSEC_POLICY_IPSEC;
 
+	start_netlink_call();
+
 	if (sadb_op == ERO_DELETE && proto_info[0].reqid == 0 &&
 		(ntohl(new_spi) == SPI_PASS || ntohl(new_spi) == SPI_HOLD) &&
 		strstr("IGNORE_ON_XFRM", text_said) != NULL) {
@@ -1185,11 +1445,10 @@ static bool netlink_detect_offload(const struct raw_iface *ifp, struct logger *l
 /*
  * netlink_add_sa - Add an SA into the kernel SPDB via netlink
  *
- * @param sa Kernel SA to add/modify
- * @param replace boolean - true if this replaces an existing SA
+ * @param sa Kernel SA to add
  * @return bool True if successful
  */
-static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
+static bool netlink_add_sa(const struct kernel_sa *sa,
 			   struct logger *logger)
 {
 	struct {
@@ -1200,9 +1459,11 @@ static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
 	struct rtattr *attr;
 	int ret;
 
+	start_netlink_call();
+
 	zero(&req);
 	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	req.n.nlmsg_type = replace ? XFRM_MSG_UPDSA : XFRM_MSG_NEWSA;
+	req.n.nlmsg_type = XFRM_MSG_NEWSA;
 
 	req.p.saddr = xfrm_from_address(sa->src.address);
 	req.p.id.daddr = xfrm_from_address(sa->dst.address);
@@ -1570,13 +1831,8 @@ static bool netlink_add_sa(const struct kernel_sa *sa, bool replace,
 		attr = (struct rtattr *)((char *)attr + attr->rta_len);
 	}
 
-	ret = send_netlink_msg(&req.n, NLMSG_NOOP, NULL,
-			       "Add SA", sa->text_said, logger);
-	if (!ret && netlink_errno == ESRCH &&
-		req.n.nlmsg_type == XFRM_MSG_UPDSA) {
-		llog(RC_LOG_SERIOUS, logger,
-			    "Warning: kernel expired our reserved IPsec SA SPI - negotiation took too long? Try increasing /proc/sys/net/core/xfrm_acq_expires");
-	}
+	ret = queue_netlink_msg(&req.n, NLMSG_NOOP, false,
+				"Add SA", sa->text_said, logger);
 	return ret;
 }
 
@@ -1791,8 +2047,7 @@ static void netlink_acquire(struct nlmsghdr *n, struct logger *logger)
 		/* updates remaining too */
 		attr = RTA_NEXT(attr, remaining);
 	}
-	record_and_initiate_opportunistic(&local, &remote, sec_label,
-					  "%acquire-netlink");
+	queue_acquire(&local, &remote, sec_label, "%acquire-netlink");
 }
 
 static void netlink_shunt_expire(struct xfrm_userpolicy_info *pol,
@@ -2006,56 +2261,6 @@ static void netlink_process_msg(int fd, struct logger *logger)
 	do {} while (netlink_get(fd, logger));
 }
 
-static ipsec_spi_t netlink_get_spi(const ip_address *src,
-				   const ip_address *dst,
-				   const struct ip_protocol *proto,
-				   bool tunnel_mode,
-				   reqid_t reqid,
-				   ipsec_spi_t min,
-				   ipsec_spi_t max,
-				   const char *text_said,
-				   struct logger *logger)
-{
-	struct {
-		struct nlmsghdr n;
-		struct xfrm_userspi_info spi;
-	} req;
-	struct nlm_resp rsp;
-
-	zero(&req);
-	req.n.nlmsg_flags = NLM_F_REQUEST;
-	req.n.nlmsg_type = XFRM_MSG_ALLOCSPI;
-
-	req.spi.info.saddr = xfrm_from_address(src);
-	req.spi.info.id.daddr = xfrm_from_address(dst);
-	req.spi.info.mode = tunnel_mode;
-	req.spi.info.reqid = reqid;
-	req.spi.info.id.proto = proto->ipproto;
-	req.spi.info.family = addrtypeof(src);
-
-	req.n.nlmsg_len = NLMSG_ALIGN(NLMSG_LENGTH(sizeof(req.spi)));
-
-	req.spi.min = min;
-	req.spi.max = max;
-
-	if (!send_netlink_msg(&req.n, XFRM_MSG_NEWSA, &rsp,
-			      "Get SPI", text_said, logger)) {
-		return 0;
-	}
-
-	if (rsp.n.nlmsg_len < NLMSG_LENGTH(sizeof(rsp.u.sa))) {
-		llog(RC_LOG, logger,
-			    "netlink_get_spi: XFRM_MSG_ALLOCSPI returned message with length %zu < %zu bytes; ignore message",
-			    (size_t) rsp.n.nlmsg_len,
-			    sizeof(rsp.u.sa));
-		return 0;
-	}
-
-	dbg("netlink_get_spi: allocated 0x%x for %s",
-	    ntohl(rsp.u.sa.id.spi), text_said);
-	return rsp.u.sa.id.spi;
-}
-
 /*
  * install or remove eroute for SA Group
  *
@@ -2451,6 +2656,213 @@ static void netlink_process_raw_ifaces(struct raw_iface *rifaces, struct logger
 	}
 }
 
+/*
+ * Cache of SA lifetime counters, filled by dumping every SA with a
+ * single XFRM_MSG_GETSA/NLM_F_DUMP instead of sending one GETSA per
+ * SA and direction.
+ *
+ * The cache is refreshed once per shunt scan interval by
+ * netlink_refresh_sa_stats() and, so that the numbers are current,
+ * by netlink_begin_sa_stats() at the start of walks such as
+ * trafficstatus.  During a walk every lookup is answered from the
+ * cache; otherwise only lookups that can live with numbers up to an
+ * interval old (liveness and idle checks, see .stats_cached) are.
+ * The rest (updown, delete) and SAs added since the dump send a
+ * GETSA.
+ */
+
+#define SA_DUMP_BUF_SIZE (64 * 1024)
+
+struct sa_stats_key {
+	xfrm_address_t daddr;
+	uint32_t spi;
+	uint16_t family;
+	uint8_t proto;
+};
+
+struct sa_stats {
+	struct sa_stats_key key;
+	uint64_t bytes;
+	uint64_t add_time;
+	uint64_t use_time;
+};
+
+static struct {
+	struct sa_stats *entries;	/* sorted by .key */
+	unsigned nr;
+	unsigned size;
+	bool valid;
+	bool walking;	/* between begin and end */
+} sa_stats_cache;
+
+static struct sa_stats_key sa_stats_key(const xfrm_address_t *daddr,
+					uint32_t spi, uint16_t family,
+					uint8_t proto)
+{
+	struct sa_stats_key key;
+	zero(&key);	/* padding is compared */
+	key.daddr = *daddr;
+	key.spi = spi;
+	key.family = family;
+	key.proto = proto;
+	return key;
+}
+
+static int sa_stats_cmp(const void *l, const void *r)
+{
+	return memcmp(l, r, sizeof(struct sa_stats_key));
+}
+
+static void free_sa_stats_cache(void)
+{
+	pfreeany(sa_stats_cache.entries);
+	zero(&sa_stats_cache);
+}
+
+static void add_sa_stats(const struct xfrm_usersa_info *info)
+{
+	if (sa_stats_cache.nr >= sa_stats_cache.size) {
+		unsigned size = (sa_stats_cache.size == 0 ? 64 : sa_stats_cache.size * 2);
+		realloc_things(sa_stats_cache.entries, sa_stats_cache.size, size,
+			       "SA stats cache");
+		sa_stats_cache.size = size;
+	}
+	sa_stats_cache.entries[sa_stats_cache.nr++] = (struct sa_stats) {
+		.key = sa_stats_key(&info->id.daddr, info->id.spi,
+				    info->family, info->id.proto),
+		.bytes = info->curlft.bytes,
+		.add_time = info->curlft.add_time,
+		.use_time = info->curlft.use_time,
+	};
+}
+
+/*
+ * Dump every SA into the cache; return false (leaving the cache
+ * invalid) on failure.
+ */
+
+static bool dump_sa_stats(struct logger *logger)
+{
+	struct {
+		struct nlmsghdr n;
+		struct xfrm_usersa_info info;
+	} req;
+
+	/* anything queued goes first */
+	flush_netlink_batch(logger);
+
+	zero(&req);
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.n.nlmsg_type = XFRM_MSG_GETSA;
+	req.n.nlmsg_len = NLMSG_ALIGN(NLMSG_LENGTH(sizeof(req.info)));
+	req.n.nlmsg_seq = ++netlink_seq;
+
+	sa_stats_cache.nr = 0;
+	sa_stats_cache.valid = false;
+
+	ssize_t r;
+	do {
+		r = write(nl_send_fd, &req, req.n.nlmsg_len);
+	} while (r < 0 && errno == EINTR);
+	if (r != (ssize_t)req.n.nlmsg_len) {
+		log_errno(logger, errno, "netlink write() of SA dump request failed");
+		return false;
+	}
+
+	uint8_t *buf = alloc_bytes(SA_DUMP_BUF_SIZE, "SA dump buffer");
+	bool done = false;
+	bool ok = true;
+	while (!done && ok) {
+		struct sockaddr_nl addr;
+		socklen_t alen = sizeof(addr);
+		r = recvfrom(nl_send_fd, buf, SA_DUMP_BUF_SIZE, 0,
+			     (struct sockaddr *)&addr, &alen);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno(logger, errno,
+				  "netlink recvfrom() of SA dump failed");
+			ok = false;
+			break;
+		}
+		if (addr.nl_pid != 0) {
+			/* not for us: ignore */
+			continue;
+		}
+		size_t len = r;
+		for (struct nlmsghdr *n = (struct nlmsghdr *)buf;
+		     NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+			if (n->nlmsg_seq != req.n.nlmsg_seq) {
+				dbg("netlink: ignoring out of sequence (%u/%u) message %s during SA dump",
+				    n->nlmsg_seq, req.n.nlmsg_seq,
+				    sparse_val_show(xfrm_type_names, n->nlmsg_type));
+				continue;
+			}
+			if (n->nlmsg_type == NLMSG_DONE) {
+				done = true;
+				break;
+			}
+			if (n->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *e = NLMSG_DATA(n);
+				llog(RC_LOG_SERIOUS, logger,
+				     "ERROR: netlink SA dump failed with errno %d: %s",
+				     -e->error, strerror(-e->error));
+				ok = false;
+				break;
+			}
+			if (n->nlmsg_type == XFRM_MSG_NEWSA &&
+			    n->nlmsg_len >= NLMSG_LENGTH(sizeof(struct xfrm_usersa_info))) {
+				add_sa_stats(NLMSG_DATA(n));
+			}
+		}
+	}
+	/* scrub keys from memory */
+	memset(buf, 0, SA_DUMP_BUF_SIZE);
+	pfree(buf);
+
+	if (!ok) {
+		/* any rest of the dump is ignored, by seq, by the next reader */
+		return false;
+	}
+
+	qsort(sa_stats_cache.entries, sa_stats_cache.nr,
+	      sizeof(sa_stats_cache.entries[0]), sa_stats_cmp);
+	sa_stats_cache.valid = true;
+	dbg("netlink: SA dump cached %u SAs", sa_stats_cache.nr);
+	return true;
+}
+
+static void netlink_refresh_sa_stats(struct logger *logger)
+{
+	dump_sa_stats(logger);
+}
+
+static void netlink_begin_sa_stats(struct logger *logger)
+{
+	dump_sa_stats(logger);
+	sa_stats_cache.walking = true;
+}
+
+static void netlink_end_sa_stats(void)
+{
+	/* keep the dump for liveness and idle checks */
+	sa_stats_cache.walking = false;
+}
+
+static const struct sa_stats *find_sa_stats(const struct kernel_sa *sa)
+{
+	if (!sa_stats_cache.valid ||
+	    !(sa_stats_cache.walking || sa->stats_cached)) {
+		return NULL;
+	}
+	xfrm_address_t daddr = xfrm_from_address(sa->dst.address);
+	struct sa_stats_key key = sa_stats_key(&daddr, sa->spi,
+					       addrtypeof(sa->src.address),
+					       sa->proto->ipproto);
+	return bsearch(&key, sa_stats_cache.entries, sa_stats_cache.nr,
+		       sizeof(sa_stats_cache.entries[0]), sa_stats_cmp);
+}
+
 /*
  * netlink_get_sa - Get SA information from the kernel
  *
@@ -2469,6 +2881,13 @@ static bool netlink_get_sa(const struct kernel_sa *sa, uint64_t *bytes,
 
 	struct nlm_resp rsp;
 
+	const struct sa_stats *stats = find_sa_stats(sa);
+	if (stats != NULL) {
+		*bytes = stats->bytes;
+		*add_time = stats->add_time;
+		return true;
+	}
+
 	zero(&req);
 	req.n.nlmsg_flags = NLM_F_REQUEST;
 	req.n.nlmsg_type = XFRM_MSG_GETSA;
@@ -2769,6 +3188,15 @@ static bool netlink_poke_ipsec_policy_hole(const struct iface_dev *ifd, int fd,
 	return true;
 }
 
+static void netlink_shutdown(struct logger *logger UNUSED)
+{
+	free_sa_stats_cache();
+	free_native_updown();
+#ifdef USE_XFRM_INTERFACE
+	free_xfrmi_ipsec1(logger);
+#endif
+}
+
 const struct kernel_ops xfrm_kernel_ops = {
 	.kern_name = "xfrm",
 	.type = USE_XFRM,
@@ -2777,19 +3205,19 @@ const struct kernel_ops xfrm_kernel_ops = {
 	.replay_window = IPSEC_SA_DEFAULT_REPLAY_WINDOW,
 
 	.init = init_netlink,
-#ifdef USE_XFRM_INTERFACE
-	.shutdown = free_xfrmi_ipsec1,
-#else
-	.shutdown = NULL,
-#endif
+	.shutdown = netlink_shutdown,
 	.process_msg = netlink_process_msg,
 	.raw_eroute = netlink_raw_eroute,
 	.add_sa = netlink_add_sa,
+	.begin_batch = netlink_begin_batch,
+	.end_batch = netlink_end_batch,
 	.del_sa = netlink_del_sa,
 	.get_sa = netlink_get_sa,
+	.refresh_sa_stats = netlink_refresh_sa_stats,
+	.begin_sa_stats = netlink_begin_sa_stats,
+	.end_sa_stats = netlink_end_sa_stats,
 	.process_queue = NULL,
 	.grp_sa = NULL,
-	.get_spi = netlink_get_spi,
 	.exceptsocket = NULL,
 	.process_raw_ifaces = netlink_process_raw_ifaces,
 	.shunt_eroute = netlink_shunt_eroute,
@@ -2807,4 +3235,5 @@ const struct kernel_ops xfrm_kernel_ops = {
 	.v6holes = netlink_v6holes,
 	.poke_ipsec_policy_hole = netlink_poke_ipsec_policy_hole,
 	.detect_offload = netlink_detect_offload,
+	.native_updown = netlink_native_updown,
 };
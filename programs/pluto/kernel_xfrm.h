@@ -24,4 +24,6 @@
  * IPsec labels (see rhbz#1154784)
  */
 #define MAX_NETLINK_DATA_SIZE 8192
+
+extern bool pluto_netlink_batch;	/* pipeline NETLINK_XFRM requests */
 #endif
@@ -0,0 +1,557 @@
+/* in-process updown actions, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#include <linux/if_addr.h>
+
+#include "defs.h"
+#include "connections.h"
+#include "state.h"
+#include "iface.h"
+#include "log.h"
+#include "ip_info.h"
+#include "netlink_attrib.h"
+#include "kernel_netlink_query.h"
+#include "kernel_xfrm_interface.h"
+#include "kernel_xfrm_updown.h"
+
+/*
+ * leftupdown=%native: the route, source IP and XFRMi firewall mark
+ * handling of _updown.xfrm done with rtnetlink requests, saving a
+ * fork()+exec() of a shell per verb per SPD.
+ *
+ * This follows the script's defaults (no --route option): a route is
+ * only added when the connection has a source IP, an MTU, or uses an
+ * XFRM interface, or when the peer's client has "No route to host"
+ * (routing is mandatory for IPsec).  Proxy ARP is not done.
+ */
+
+#define RTNL_TIMEOUT_MILLISECONDS 1000
+#define UPDOWN_ROUTE_TABLE 50		/* "ip route ... table 50" */
+#define UPDOWN_RULE_PRIORITY 100	/* "ip rule ... prio 100" */
+#define UPDOWN_SOURCEIP_SCOPE 50	/* tags IPv4 addresses we added */
+
+struct rtnl_req {
+	struct nlmsghdr n;
+	union {
+		struct rtmsg rtm;
+		struct ifaddrmsg ifa;
+		struct fib_rule_hdr frh;
+	} u;
+	char data[1024];
+};
+
+/*
+ * Source IPs added to an interface; .routes counts the installed
+ * routes that use the address as their source so it can be removed
+ * along with the last one.
+ */
+struct sourceip {
+	ip_address address;
+	int ifindex;
+	unsigned routes;
+	struct sourceip *next;
+};
+
+static struct sourceip *sourceips;
+
+static struct rtnl_req init_rtnl_req(uint16_t type, uint16_t flags, size_t size)
+{
+	struct rtnl_req req;
+	zero(&req);
+	req.n.nlmsg_len = NLMSG_LENGTH(size);
+	req.n.nlmsg_type = type;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	req.n.nlmsg_pid = getpid();
+	return req;
+}
+
+static void rtnl_addattr_address(struct rtnl_req *req, int type, const ip_address *address)
+{
+	shunk_t bytes = address_as_shunk(address);
+	nl_addattr_l(&req->n, sizeof(*req), type, bytes.ptr, bytes.len);
+}
+
+/*
+ * Send REQ and wait for the kernel's acknowledgement; return 0 or the
+ * errno.  When REPLY is non-NULL the answer (if any) that precedes
+ * the acknowledgement is copied there.
+ */
+static int rtnl_talk(const struct rtnl_req *req, struct nlm_resp *reply,
+		     struct logger *logger)
+{
+	int fd = nl_send_query(&req->n, NETLINK_ROUTE, logger);
+	if (fd < 0) {
+		/* already logged */
+		return EIO;
+	}
+
+	int error = 0;
+	bool done = false;
+	while (!done) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN, };
+		int r = poll(&pfd, 1, RTNL_TIMEOUT_MILLISECONDS);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			error = (r == 0 ? ETIMEDOUT : errno);
+			break;
+		}
+
+		struct nlm_resp rsp;
+		ssize_t s = recv(fd, &rsp, sizeof(rsp), 0);
+		if (s < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			error = errno;
+			break;
+		}
+
+		size_t len = s;
+		for (struct nlmsghdr *n = &rsp.n;
+		     NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+			if (n->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *e = NLMSG_DATA(n);
+				error = -e->error;
+				done = true;
+				break;
+			}
+			if (reply != NULL && n->nlmsg_len <= sizeof(*reply)) {
+				memcpy(reply, n, n->nlmsg_len);
+				reply = NULL;
+			}
+		}
+	}
+
+	close(fd);
+	return error;
+}
+
+static bool rtnl_request(const struct rtnl_req *req, const char *what,
+			 int ignore, struct logger *logger)
+{
+	int error = rtnl_talk(req, NULL, logger);
+	if (error != 0 && error != ignore) {
+		log_errno(logger, error, "native updown %s failed", what);
+		return false;
+	}
+	return true;
+}
+
+static int updown_ifindex(const char *name, struct logger *logger)
+{
+	/* drop any ":alias" */
+	char dev[IFNAMSIZ] = "";
+	snprintf(dev, sizeof(dev), "%.*s", (int)strcspn(name, ":"), name);
+	int ifindex = if_nametoindex(dev);
+	if (ifindex == 0) {
+		log_errno(logger, errno, "native updown cannot find interface %s", dev);
+	}
+	return ifindex;
+}
+
+static bool interface_is_pointopoint(int ifindex)
+{
+	struct ifreq ifr;
+	zero(&ifr);
+	if (if_indextoname(ifindex, ifr.ifr_name) == NULL) {
+		return false;
+	}
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return false;
+	}
+	bool ptp = (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0 &&
+		    (ifr.ifr_flags & IFF_POINTOPOINT));
+	close(fd);
+	return ptp;
+}
+
+/* ip route get ADDRESS | grep ^local */
+static bool address_is_local(const ip_address *address, struct logger *logger)
+{
+	const struct ip_info *afi = address_type(address);
+	struct rtnl_req req = init_rtnl_req(RTM_GETROUTE, 0, sizeof(req.u.rtm));
+	req.u.rtm.rtm_family = afi->af;
+	req.u.rtm.rtm_dst_len = afi->mask_cnt;
+	rtnl_addattr_address(&req, RTA_DST, address);
+
+	struct nlm_resp reply;
+	zero(&reply);
+	if (rtnl_talk(&req, &reply, logger) != 0 ||
+	    reply.n.nlmsg_type != RTM_NEWROUTE) {
+		return false;
+	}
+	const struct rtmsg *rtm = NLMSG_DATA(&reply.n);
+	return rtm->rtm_type == RTN_LOCAL;
+}
+
+/* ip route get PLUTO_PEER_CLIENT_NET | grep 'No route to host' */
+static bool peer_client_unreachable(const struct spd_route *sr,
+				    struct logger *logger)
+{
+	ip_address net = selector_prefix(sr->that.client);
+	const struct ip_info *afi = address_type(&net);
+	struct rtnl_req req = init_rtnl_req(RTM_GETROUTE, 0, sizeof(req.u.rtm));
+	req.u.rtm.rtm_family = afi->af;
+	req.u.rtm.rtm_dst_len = afi->mask_cnt;
+	rtnl_addattr_address(&req, RTA_DST, &net);
+
+	struct nlm_resp reply;
+	zero(&reply);
+	return rtnl_talk(&req, &reply, logger) == EHOSTUNREACH;
+}
+
+static struct sourceip **find_sourceip(const ip_address *address)
+{
+	for (struct sourceip **sp = &sourceips; *sp != NULL; sp = &(*sp)->next) {
+		if (address_eq_address((*sp)->address, *address)) {
+			return sp;
+		}
+	}
+	return NULL;
+}
+
+static int sourceip_ifindex(const struct connection *c, struct logger *logger)
+{
+	if (c->xfrmi != NULL && c->xfrmi->if_id > 0 && c->xfrmi->name != NULL) {
+		return updown_ifindex(c->xfrmi->name, logger);
+	}
+	return updown_ifindex("lo", logger);
+}
+
+static struct rtnl_req sourceip_req(uint16_t type, uint16_t flags,
+				    const ip_address *address, int ifindex)
+{
+	const struct ip_info *afi = address_type(address);
+	struct rtnl_req req = init_rtnl_req(type, flags, sizeof(req.u.ifa));
+	req.u.ifa.ifa_family = afi->af;
+	req.u.ifa.ifa_prefixlen = afi->mask_cnt;
+	req.u.ifa.ifa_scope = (afi == &ipv4_info ? UPDOWN_SOURCEIP_SCOPE : RT_SCOPE_UNIVERSE);
+	req.u.ifa.ifa_index = ifindex;
+	rtnl_addattr_address(&req, IFA_LOCAL, address);
+	rtnl_addattr_address(&req, IFA_ADDRESS, address);
+	return req;
+}
+
+/* addsource: make sure the source IP is one of ours */
+static bool add_sourceip(const struct connection *c, const struct spd_route *sr,
+			 struct logger *logger)
+{
+	const ip_address *address = &sr->this.host_srcip;
+	if (!address_is_specified(*address) ||
+	    find_sourceip(address) != NULL ||
+	    address_is_local(address, logger)) {
+		return true;
+	}
+
+	int ifindex = sourceip_ifindex(c, logger);
+	if (ifindex == 0) {
+		return false;
+	}
+	struct rtnl_req req = sourceip_req(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+					   address, ifindex);
+	if (!rtnl_request(&req, "addsource", EEXIST, logger)) {
+		return false;
+	}
+
+	struct sourceip *sip = alloc_thing(struct sourceip, "native updown source ip");
+	sip->address = *address;
+	sip->ifindex = ifindex;
+	sip->next = sourceips;
+	sourceips = sip;
+	address_buf ab;
+	dbg("native updown added source ip %s", str_address(address, &ab));
+	return true;
+}
+
+/* delsource: drop the source IP once no route uses it */
+static void del_sourceip(const struct spd_route *sr, const struct state *st,
+			 struct logger *logger)
+{
+	struct sourceip **sp = find_sourceip(&sr->this.host_srcip);
+	if (sp == NULL || (*sp)->routes > 0) {
+		return;
+	}
+	if (st != NULL && st->st_mobike_del_src_ip) {
+		/* the address moves with the SA */
+		return;
+	}
+	struct sourceip *sip = *sp;
+	struct rtnl_req req = sourceip_req(RTM_DELADDR, 0, &sip->address, sip->ifindex);
+	/* the address is gone or was changed underneath us */
+	rtnl_request(&req, "delsource", EADDRNOTAVAIL, logger);
+	*sp = sip->next;
+	pfree(sip);
+}
+
+static bool route_subnet(uint16_t type, const ip_subnet *dst, uint8_t table,
+			 int ifindex, const ip_address *via, const ip_address *src,
+			 const struct connection *c, struct logger *logger)
+{
+	const struct ip_info *afi = subnet_type(dst);
+	ip_address prefix = subnet_prefix(*dst);
+	struct rtnl_req req = init_rtnl_req(type,
+					    (type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0),
+					    sizeof(req.u.rtm));
+	req.u.rtm.rtm_family = afi->af;
+	req.u.rtm.rtm_dst_len = subnet_prefix_bits(*dst);
+	req.u.rtm.rtm_table = table;
+	req.u.rtm.rtm_protocol = RTPROT_BOOT;
+	req.u.rtm.rtm_scope = (via != NULL ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK);
+	req.u.rtm.rtm_type = RTN_UNICAST;
+	if (type == RTM_DELROUTE) {
+		req.u.rtm.rtm_scope = RT_SCOPE_NOWHERE;
+	}
+
+	rtnl_addattr_address(&req, RTA_DST, &prefix);
+	nl_addattr32(&req.n, sizeof(req), RTA_OIF, ifindex);
+	if (via != NULL) {
+		rtnl_addattr_address(&req, RTA_GATEWAY, via);
+	}
+	if (src != NULL) {
+		rtnl_addattr_address(&req, RTA_PREFSRC, src);
+	}
+	if (c->metric != 0) {
+		nl_addattr32(&req.n, sizeof(req), RTA_PRIORITY, c->metric);
+	}
+	if (c->connmtu != 0 && type == RTM_NEWROUTE) {
+		struct rtattr *metrics = nl_addattr_nest(&req.n, sizeof(req), RTA_METRICS);
+		nl_addattr32(&req.n, sizeof(req), RTAX_MTU, c->connmtu);
+		nl_addattr_nest_end(&req.n, metrics);
+	}
+
+	subnet_buf sb;
+	dbg("native updown %s %s table %u",
+	    type == RTM_NEWROUTE ? "replacing route" : "deleting route",
+	    str_subnet(dst, &sb), table);
+	/* "RTNETLINK answers: No such process" is ignored */
+	return rtnl_request(&req, type == RTM_NEWROUTE ? "route replace" : "route del",
+			    ESRCH, logger);
+}
+
+static ip_subnet numeric_subnet(const char *address, const struct ip_info *afi,
+				unsigned bits)
+{
+	ip_address prefix;
+	err_t e = ttoaddress_num(shunk1(address), afi, &prefix);
+	passert(e == NULL);
+	return subnet_from_address_prefix_bits(prefix, bits);
+}
+
+/* a route for the peer's client; the default route is eclipsed, not replaced */
+static bool route_client(uint16_t type, const ip_selector *client, int ifindex,
+			 const ip_address *via, const ip_address *src,
+			 const struct connection *c, struct logger *logger)
+{
+	const struct ip_info *afi = selector_type(client);
+	if (selector_is_all(*client)) {
+		if (afi == &ipv4_info) {
+			ip_subnet lo = numeric_subnet("0.0.0.0", afi, 1);
+			ip_subnet hi = numeric_subnet("128.0.0.0", afi, 1);
+			return (route_subnet(type, &lo, RT_TABLE_MAIN, ifindex, via, src, c, logger) &&
+				route_subnet(type, &hi, RT_TABLE_MAIN, ifindex, via, src, c, logger));
+		}
+		ip_subnet global = numeric_subnet("2000::", afi, 3);
+		return route_subnet(type, &global, RT_TABLE_MAIN, ifindex, via, src, c, logger);
+	}
+	ip_subnet dst = selector_subnet(*client);
+	return route_subnet(type, &dst, RT_TABLE_MAIN, ifindex, via, src, c, logger);
+}
+
+/* PLUTO_XFRMI_FWMARK */
+static bool xfrmi_fwmark(const struct connection *c, const struct spd_route *sr,
+			 uint32_t *mark, uint32_t *mask)
+{
+	if (c->xfrmi == NULL) {
+		return false;
+	}
+	if (c->sa_marks.out.val != 0) {
+		*mark = c->sa_marks.out.val;
+		*mask = c->sa_marks.out.mask;
+		return true;
+	}
+	if (address_in_selector_subnet(sr->that.host_addr, sr->that.client)) {
+		*mark = c->xfrmi->if_id;
+		*mask = 0xffffffff;
+		return true;
+	}
+	return false;
+}
+
+/* ip rule {add,del} prio 100 to PEER_CLIENT fwmark MARK/MASK lookup 50 */
+static bool rule_fwmark(uint16_t type, const struct spd_route *sr,
+			uint32_t mark, uint32_t mask, struct logger *logger)
+{
+	const struct ip_info *afi = selector_type(&sr->that.client);
+	ip_address prefix = selector_prefix(sr->that.client);
+	struct rtnl_req req = init_rtnl_req(type,
+					    (type == RTM_NEWRULE ? NLM_F_CREATE | NLM_F_EXCL : 0),
+					    sizeof(req.u.frh));
+	req.u.frh.family = afi->af;
+	req.u.frh.dst_len = selector_prefix_bits(sr->that.client);
+	req.u.frh.table = UPDOWN_ROUTE_TABLE;
+	req.u.frh.action = FR_ACT_TO_TBL;
+	nl_addattr32(&req.n, sizeof(req), FRA_PRIORITY, UPDOWN_RULE_PRIORITY);
+	rtnl_addattr_address(&req, FRA_DST, &prefix);
+	nl_addattr32(&req.n, sizeof(req), FRA_FWMARK, mark);
+	nl_addattr32(&req.n, sizeof(req), FRA_FWMASK, mask);
+	return rtnl_request(&req, type == RTM_NEWRULE ? "rule add" : "rule del",
+			    type == RTM_NEWRULE ? EEXIST : ENOENT, logger);
+}
+
+/* doroute replace|del */
+static bool do_native_route(uint16_t type, const struct connection *c,
+			    const struct spd_route *sr, struct logger *logger)
+{
+	bool xfrmi_route = (c->xfrmi != NULL && c->xfrmi->if_id > 0 &&
+			    !selector_subnet_eq_subnet(sr->that.client, sr->this.client));
+	bool has_srcip = address_is_specified(sr->this.host_srcip);
+	bool route = has_srcip || c->connmtu != 0;
+	uint32_t mark, mask;
+	bool xfrmi_rule = xfrmi_fwmark(c, sr, &mark, &mask);
+
+	/*
+	 * As the script, only when adding and when neither an XFRM
+	 * interface route nor the fwmark rule takes care of it.
+	 */
+	if (!route && type == RTM_NEWROUTE && !xfrmi_rule &&
+	    (c->xfrmi == NULL || c->xfrmi->if_id == 0) &&
+	    peer_client_unreachable(sr, logger)) {
+		dbg("native updown: peer client has no route to host, routing");
+		route = true;
+	}
+
+	if (!route && !xfrmi_route && !xfrmi_rule) {
+		dbg("native updown: no route needed");
+		return true;
+	}
+
+	if (c->interface == NULL) {
+		llog(RC_LOG_SERIOUS, logger, "native updown: connection has no interface");
+		return false;
+	}
+	int esp_ifindex = updown_ifindex(c->interface->ip_dev->id_rname, logger);
+	if (esp_ifindex == 0) {
+		return false;
+	}
+
+	/* nexthop unless %direct or on a point-to-point link */
+	const ip_address *nexthop = NULL;
+	if (address_is_specified(sr->this.host_nexthop) &&
+	    !address_eq_address(sr->this.host_nexthop, sr->that.host_addr) &&
+	    !interface_is_pointopoint(esp_ifindex)) {
+		nexthop = &sr->this.host_nexthop;
+	}
+
+	if (route || xfrmi_route) {
+		int ifindex = esp_ifindex;
+		if (xfrmi_route) {
+			ifindex = updown_ifindex(c->xfrmi->name, logger);
+			if (ifindex == 0) {
+				return false;
+			}
+		}
+		const ip_address *src = NULL;
+		if (type == RTM_NEWROUTE && has_srcip) {
+			if (!add_sourceip(c, sr, logger)) {
+				return false;
+			}
+			src = &sr->this.host_srcip;
+		}
+		if (!route_client(type, &sr->that.client, ifindex,
+				  xfrmi_route ? NULL : nexthop, src, c, logger)) {
+			return false;
+		}
+		struct sourceip **sp = find_sourceip(&sr->this.host_srcip);
+		if (has_srcip && sp != NULL) {
+			if (type == RTM_NEWROUTE) {
+				(*sp)->routes++;
+			} else if ((*sp)->routes > 0) {
+				(*sp)->routes--;
+			}
+		}
+	}
+
+	if (xfrmi_rule) {
+		/* ESP to the peer goes out the real interface */
+		ip_subnet peer = subnet_from_address(sr->that.host_addr);
+		if (!route_subnet(type, &peer, UPDOWN_ROUTE_TABLE, esp_ifindex,
+				  nexthop, NULL, c, logger)) {
+			return false;
+		}
+		if (!rule_fwmark(type == RTM_NEWROUTE ? RTM_NEWRULE : RTM_DELRULE,
+				 sr, mark, mask, logger)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool netlink_native_updown(const struct connection *c,
+			   const struct spd_route *sr,
+			   const char *verb,
+			   struct state *st,
+			   struct logger *logger)
+{
+	bool client = !selector_subnet_eq_address(sr->this.client, sr->this.host_addr);
+	dbg("native updown %s-%s", verb, client ? "client" : "host");
+
+	if (streq(verb, "prepare")) {
+		/* the script only adds a VTI interface; route replaces */
+		return true;
+	}
+	if (streq(verb, "route")) {
+		return do_native_route(RTM_NEWROUTE, c, sr, logger);
+	}
+	if (streq(verb, "unroute")) {
+		bool ok = do_native_route(RTM_DELROUTE, c, sr, logger);
+		del_sourceip(sr, st, logger);
+		return ok;
+	}
+	if (streq(verb, "up")) {
+		return !client || add_sourceip(c, sr, logger);
+	}
+	if (streq(verb, "down")) {
+		/* downrule */
+		if (c->remotepeertype == CISCO &&
+		    address_is_specified(sr->this.host_srcip) &&
+		    address_type(&sr->this.host_addr) == &ipv4_info) {
+			return do_native_route(RTM_DELROUTE, c, sr, logger);
+		}
+		return true;
+	}
+	llog(RC_LOG_SERIOUS, logger, "native updown: unknown verb %s", verb);
+	return false;
+}
+
+void free_native_updown(void)
+{
+	/* the addresses stay; like the script, pluto leaves them behind */
+	while (sourceips != NULL) {
+		struct sourceip *sip = sourceips;
+		sourceips = sip->next;
+		pfree(sip);
+	}
+}
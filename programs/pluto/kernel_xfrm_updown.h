@@ -0,0 +1,34 @@
+/* in-process updown actions, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef KERNEL_XFRM_UPDOWN_H
+#define KERNEL_XFRM_UPDOWN_H
+
+#include <stdbool.h>
+
+struct connection;
+struct spd_route;
+struct state;
+struct logger;
+
+/* kernel_ops->native_updown() */
+bool netlink_native_updown(const struct connection *c,
+			   const struct spd_route *sr,
+			   const char *verb,
+			   struct state *st,
+			   struct logger *logger);
+
+void free_native_updown(void);
+
+#endif
@@ -317,69 +317,71 @@ bool authsig_using_RSA_pubkey(const struct crypt_mac *expected_hash,
 }
 
 /*
- * Check signature against all RSA public keys we can find.  If we
- * need keys from DNS KEY records, and they haven't been fetched,
- * return STF_SUSPEND to ask for asynch DNS lookup.
+ * Check signature against all RSA public keys we can find.
  *
- * Note: parameter keys_from_dns contains results of DNS lookup for
- * key or is NULL indicating lookup not yet tried.
+ * This is done in three steps so that the expensive middle step can
+ * be run on a helper thread:
  *
- * take_a_crack is a helper function.  Mostly forensic.  If only we
- * had coroutines. (XXX: generators).
+ * - prepare_authsig_using_pubkey() (main thread) collects counted
+ *   references to the keys that are worth trying
+ *
+ * - authsig_using_pubkey_candidates() (any thread) tries each
+ *   candidate in turn until one verifies the signature; it only
+ *   looks at the candidates and never the key databases
+ *
+ * - log_authsig_using_pubkey() (main thread) logs the result and
+ *   saves the key that worked
  */
 
-struct tac_state {
+struct pubkey_candidate {
+	struct pubkey *key;		/* counted reference */
+	const char *cert_origin;	/* "peer" or "preloaded" */
+};
+
+struct pubkey_authsig {
 	const struct pubkey_type *type;
-	const struct crypt_mac *hash;
-	shunk_t signature;
+	struct crypt_mac hash;
+	chunk_t signature;
 	const struct hash_desc *hash_algo;
 	authsig_using_pubkey_fn *try_pubkey;
-	realtime_t now;
-	struct logger *logger;
-	const struct end *remote;
-	const char *cert_origin;
+	struct pubkey_candidate *candidates;
+	unsigned nr_candidates;
 
 	/*
-	 * Both accumulated across calls and used to return the final
-	 * result.
+	 * Result.
 	 *
-	 * See below.
+	 *   FATAL_DIAG  FOUND  tried_cnt
+	 *     NULL      NULL       0      no key
+	 *     NULL      NULL      >0      no key worked
+	 *   <valid>   <valid>     N/A     fatal error caused by FOUND
+	 *     NULL    <valid>     N/A     FOUND worked
 	 */
-
 	int tried_cnt;			/* number of keys tried */
 	char tried[50];			/* keyids of tried public keys */
 	struct jambuf tried_jambuf;	/* jambuf for same */
-	struct pubkey *key;		/* last key tried, if any */
-	diag_t fatal_diag;		/* fatal error from KEY, if any */
+	const struct pubkey_candidate *found;
+	diag_t fatal_diag;		/* fatal error from FOUND, if any */
 };
 
 /*
- * Try all keys from PUBKEY_DB.
- *
- * Return true when searching should stop (not when it succeeded);
- * return false when searching can continue.
- *
- *   Returns  FATAL_DIAG  KEY     tried_cnt
- *    false     NULL     NULL        0      no key, try again
- *    false     NULL     NULL       >0      no key worked, try again
- *    true    <valid>   <valid>     N/A     fatal error caused by KEY
- *    true      NULL    <valid>     N/A     KEY worked
+ * Add the keys in PUBKEY_DB that could have produced the signature
+ * to the candidate list.
  */
 
-static bool try_all_keys(const char *cert_origin,
-			 struct pubkey_list *pubkey_db,
-			 struct tac_state *s)
+static void collect_pubkey_candidates(const char *cert_origin,
+				      struct pubkey_list *pubkey_db,
+				      const struct end *remote,
+				      realtime_t now,
+				      struct pubkey_authsig *authsig)
 {
 	id_buf thatid;
-	dbg("trying all '%s's for %s key that matches ID: %s",
-	    cert_origin, s->type->name, str_id(&s->remote->id, &thatid));
-	s->cert_origin = cert_origin;
+	dbg("collecting all '%s's for %s key that matches ID: %s",
+	    cert_origin, authsig->type->name, str_id(&remote->id, &thatid));
 
-	bool described = false;
 	for (struct pubkey_list *p = pubkey_db; p != NULL; p = p->next) {
 		struct pubkey *key = p->key;
 
-		if (key->type != s->type) {
+		if (key->type != authsig->type) {
 			id_buf printkid;
 			dbg("  skipping '%s' with type %s",
 			    str_id(&key->id, &printkid), key->type->name);
@@ -387,7 +389,7 @@ static bool try_all_keys(const char *cert_origin,
 		}
 
 		int wildcards; /* value ignored */
-		if (!match_id(&key->id, &s->remote->id, &wildcards)) {
+		if (!match_id(&key->id, &remote->id, &wildcards)) {
 			id_buf printkid;
 			dbg("  skipping '%s' with wrong ID",
 			    str_id(&key->id, &printkid));
@@ -395,7 +397,7 @@ static bool try_all_keys(const char *cert_origin,
 		}
 
 		int pl;	/* value ignored */
-		if (!trusted_ca_nss(key->issuer, s->remote->ca, &pl)) {
+		if (!trusted_ca_nss(key->issuer, remote->ca, &pl)) {
 			id_buf printkid;
 			dn_buf buf;
 			dbg("  skipping '%s' with untrusted CA '%s'",
@@ -410,7 +412,7 @@ static bool try_all_keys(const char *cert_origin,
 		 * loop will be deleted.
 		 */
 		if (!is_realtime_epoch(key->until_time) &&
-		    realbefore(key->until_time, s->now)) {
+		    realbefore(key->until_time, now)) {
 			id_buf printkid;
 			realtime_buf buf;
 			dbg("  skipping '%s' which expired on %s",
@@ -421,70 +423,34 @@ static bool try_all_keys(const char *cert_origin,
 
 		id_buf printkid;
 		dn_buf buf;
-		const char *keyid_str = str_keyid(*pubkey_keyid(key));
-		dbg("  trying '%s' aka *%s issued by CA '%s'",
-		    str_id(&key->id, &printkid), keyid_str,
+		dbg("  candidate '%s' aka *%s issued by CA '%s'",
+		    str_id(&key->id, &printkid), str_keyid(*pubkey_keyid(key)),
 		    str_dn_or_null(key->issuer, "%any", &buf));
-		s->tried_cnt++;
-
-		if (!described) {
-			jam(&s->tried_jambuf, " %s:", cert_origin);
-			described = true;
-		}
-		jam(&s->tried_jambuf, " *%s", keyid_str);
-
-		logtime_t try_time = logtime_start(s->logger);
-		bool passed = (s->try_pubkey)(s->hash, s->signature,
-						 key, s->hash_algo,
-						 &s->fatal_diag, s->logger);
-		logtime_stop(&try_time, "%s() trying a pubkey", __func__);
-
-		if (s->fatal_diag != NULL) {
-			/* already logged */
-			dbg("  '%s' fatal", keyid_str);
-			jam(&s->tried_jambuf, "(fatal)");
-			s->key = key; /* also return failing key */
-			return true; /* stop searching; enough is enough */
-		}
-
-		if (passed) {
-			dbg("  '%s' passed", keyid_str);
-			s->key = key;
-			return true; /* stop searching */
-		}
-
-		/* should have been logged */
-		dbg("  '%s' failed", keyid_str);
-		pexpect(s->key == NULL);
+		realloc_things(authsig->candidates, authsig->nr_candidates,
+			       authsig->nr_candidates + 1, "pubkey candidates");
+		authsig->candidates[authsig->nr_candidates++] = (struct pubkey_candidate) {
+			.key = pubkey_addref(key, HERE),
+			.cert_origin = cert_origin,
+		};
 	}
-
-	return false; /* keep searching */
 }
 
-diag_t authsig_and_log_using_pubkey(struct ike_sa *ike,
-				    const struct crypt_mac *hash,
-				    shunk_t signature,
-				    const struct hash_desc *hash_algo,
-				    const struct pubkey_type *type,
-				    authsig_using_pubkey_fn *try_pubkey)
+struct pubkey_authsig *prepare_authsig_using_pubkey(struct ike_sa *ike,
+						    const struct crypt_mac *hash,
+						    shunk_t signature,
+						    const struct hash_desc *hash_algo,
+						    const struct pubkey_type *type,
+						    authsig_using_pubkey_fn *try_pubkey)
 {
 	const struct connection *c = ike->sa.st_connection;
-	struct tac_state s = {
-		/* in */
-		.type = type,
-		.logger = ike->sa.st_logger,
-		.hash = hash,
-		.now = realnow(),
-		.signature = signature,
-		.hash_algo = hash_algo,
-		.remote = &c->spd.that,
-		.try_pubkey = try_pubkey,
-		/* out */
-		.tried_cnt = 0,
-		.key = NULL,
-		.fatal_diag = NULL,
-	};
-	s.tried_jambuf = ARRAY_AS_JAMBUF(s.tried);
+	realtime_t now = realnow();
+	struct pubkey_authsig *authsig = alloc_thing(struct pubkey_authsig, "pubkey authsig");
+	authsig->type = type;
+	authsig->hash = *hash;
+	authsig->signature = clone_hunk(signature, "pubkey authsig signature");
+	authsig->hash_algo = hash_algo;
+	authsig->try_pubkey = try_pubkey;
+	authsig->tried_jambuf = ARRAY_AS_JAMBUF(authsig->tried);
 
 	/* try all appropriate Public keys */
 
@@ -502,7 +468,7 @@ diag_t authsig_and_log_using_pubkey(struct ike_sa *ike,
 	for (struct pubkey_list **pp = &pluto_pubkeys; *pp != NULL; ) {
 		struct pubkey *key = (*pp)->key;
 		if (!is_realtime_epoch(key->until_time) &&
-		    realbefore(key->until_time, s.now)) {
+		    realbefore(key->until_time, now)) {
 			id_buf printkid;
 			log_state(RC_LOG_SERIOUS, &ike->sa,
 				  "cached %s public key '%s' has expired and has been deleted",
@@ -513,52 +479,139 @@ diag_t authsig_and_log_using_pubkey(struct ike_sa *ike,
 		pp = &(*pp)->next;
 	}
 
-	bool stop = try_all_keys("peer", ike->sa.st_remote_certs.pubkey_db, &s);
-	if (!stop) {
-		stop = try_all_keys("preloaded", pluto_pubkeys, &s);
+	collect_pubkey_candidates("peer", ike->sa.st_remote_certs.pubkey_db,
+				  &c->spd.that, now, authsig);
+	collect_pubkey_candidates("preloaded", pluto_pubkeys,
+				  &c->spd.that, now, authsig);
+	return authsig;
+}
+
+void authsig_using_pubkey_candidates(struct pubkey_authsig *authsig,
+				     struct logger *logger)
+{
+	const char *described = NULL;
+	for (unsigned i = 0; i < authsig->nr_candidates; i++) {
+		const struct pubkey_candidate *candidate = &authsig->candidates[i];
+		struct pubkey *key = candidate->key;
+
+		const char *keyid_str = str_keyid(*pubkey_keyid(key));
+		id_buf printkid;
+		dbg("  trying '%s' aka *%s from '%s'",
+		    str_id(&key->id, &printkid), keyid_str,
+		    candidate->cert_origin);
+		authsig->tried_cnt++;
+
+		if (described != candidate->cert_origin) {
+			jam(&authsig->tried_jambuf, " %s:", candidate->cert_origin);
+			described = candidate->cert_origin;
+		}
+		jam(&authsig->tried_jambuf, " *%s", keyid_str);
+
+		logtime_t try_time = logtime_start(logger);
+		bool passed = (authsig->try_pubkey)(&authsig->hash,
+						    HUNK_AS_SHUNK(authsig->signature),
+						    key, authsig->hash_algo,
+						    &authsig->fatal_diag, logger);
+		logtime_stop(&try_time, "%s() trying a pubkey", __func__);
+
+		if (authsig->fatal_diag != NULL) {
+			/* already logged */
+			dbg("  '%s' fatal", keyid_str);
+			jam(&authsig->tried_jambuf, "(fatal)");
+			authsig->found = candidate; /* also return failing key */
+			return; /* stop searching; enough is enough */
+		}
+
+		if (passed) {
+			dbg("  '%s' passed", keyid_str);
+			authsig->found = candidate;
+			return; /* stop searching */
+		}
+
+		/* should have been logged */
+		dbg("  '%s' failed", keyid_str);
 	}
+}
 
-	if (s.fatal_diag != NULL) {
-		passert(s.key != NULL);
-		id_buf idb;
-		return diag_diag(&s.fatal_diag, "authentication aborted: problem with '%s': ",
-				 str_id(&s.key->id, &idb));
+void free_pubkey_authsig(struct pubkey_authsig **authsig)
+{
+	if (*authsig == NULL) {
+		return;
 	}
+	for (unsigned i = 0; i < (*authsig)->nr_candidates; i++) {
+		pubkey_delref(&(*authsig)->candidates[i].key, HERE);
+	}
+	pfreeany((*authsig)->candidates);
+	free_chunk_content(&(*authsig)->signature);
+	pfree_diag(&(*authsig)->fatal_diag);
+	pfree(*authsig);
+	*authsig = NULL;
+}
 
-	if (s.key == NULL) {
-		if (s.tried_cnt == 0) {
+diag_t log_authsig_using_pubkey(struct ike_sa *ike,
+				struct pubkey_authsig **authsigp)
+{
+	struct pubkey_authsig *authsig = *authsigp;
+	const struct connection *c = ike->sa.st_connection;
+	const struct pubkey_type *type = authsig->type;
+	const struct hash_desc *hash_algo = authsig->hash_algo;
+	diag_t d = NULL;
+
+	if (authsig->fatal_diag != NULL) {
+		passert(authsig->found != NULL);
+		id_buf idb;
+		d = diag_diag(&authsig->fatal_diag, "authentication aborted: problem with '%s': ",
+			      str_id(&authsig->found->key->id, &idb));
+	} else if (authsig->found == NULL) {
+		if (authsig->tried_cnt == 0) {
 			id_buf idb;
-			return diag("authentication failed: no certificate matched %s with %s and '%s'",
-				    type->name, hash_algo->common.fqn,
-				    str_id(&c->spd.that.id, &idb));
+			d = diag("authentication failed: no certificate matched %s with %s and '%s'",
+				 type->name, hash_algo->common.fqn,
+				 str_id(&c->spd.that.id, &idb));
 		} else {
 			id_buf idb;
-			return diag("authentication failed: using %s with %s for '%s' tried%s",
-				    type->name, hash_algo->common.fqn,
-				    str_id(&c->spd.that.id, &idb),
-				    s.tried);
+			d = diag("authentication failed: using %s with %s for '%s' tried%s",
+				 type->name, hash_algo->common.fqn,
+				 str_id(&c->spd.that.id, &idb),
+				 authsig->tried);
 		}
-	}
-
-	pexpect(s.key != NULL);
-	pexpect(s.tried_cnt > 0);
-	LLOG_JAMBUF(RC_LOG_SERIOUS, ike->sa.st_logger, buf) {
-		jam(buf, "authenticated using %s with %s and %s certificate ",
-		    type->name, hash_algo->common.fqn,
-		    s.cert_origin);
-		jam(buf, "'");
-		jam_id_bytes(buf, &s.key->id, jam_sanitized_bytes);
-		jam(buf, "'");
-		/* this is so that the cert verified line can be deleted */
-		if (s.key->issuer.ptr != NULL) {
-			jam(buf, " issued by CA '");
-			jam_dn(buf, s.key->issuer, jam_sanitized_bytes);
+	} else {
+		const struct pubkey *key = authsig->found->key;
+		pexpect(authsig->tried_cnt > 0);
+		LLOG_JAMBUF(RC_LOG_SERIOUS, ike->sa.st_logger, buf) {
+			jam(buf, "authenticated using %s with %s and %s certificate ",
+			    type->name, hash_algo->common.fqn,
+			    authsig->found->cert_origin);
+			jam(buf, "'");
+			jam_id_bytes(buf, &key->id, jam_sanitized_bytes);
 			jam(buf, "'");
+			/* this is so that the cert verified line can be deleted */
+			if (key->issuer.ptr != NULL) {
+				jam(buf, " issued by CA '");
+				jam_dn(buf, key->issuer, jam_sanitized_bytes);
+				jam(buf, "'");
+			}
 		}
+		pubkey_delref(&ike->sa.st_peer_pubkey, HERE);
+		ike->sa.st_peer_pubkey = pubkey_addref(authsig->found->key, HERE);
 	}
-	pubkey_delref(&ike->sa.st_peer_pubkey, HERE);
-	ike->sa.st_peer_pubkey = pubkey_addref(s.key, HERE);
-	return NULL;
+
+	free_pubkey_authsig(authsigp);
+	return d;
+}
+
+diag_t authsig_and_log_using_pubkey(struct ike_sa *ike,
+				    const struct crypt_mac *hash,
+				    shunk_t signature,
+				    const struct hash_desc *hash_algo,
+				    const struct pubkey_type *type,
+				    authsig_using_pubkey_fn *try_pubkey)
+{
+	struct pubkey_authsig *authsig =
+		prepare_authsig_using_pubkey(ike, hash, signature, hash_algo,
+					     type, try_pubkey);
+	authsig_using_pubkey_candidates(authsig, ike->sa.st_logger);
+	return log_authsig_using_pubkey(ike, &authsig);
 }
 
 /*
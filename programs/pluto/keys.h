@@ -93,4 +93,25 @@ extern diag_t authsig_and_log_using_pubkey(struct ike_sa *ike,
 					   const struct pubkey_type *type,
 					   authsig_using_pubkey_fn *try_pubkey);
 
+/*
+ * authsig_and_log_using_pubkey() split into its three steps so that
+ * the middle step, which does the actual signature verification, can
+ * be run on a helper thread.  Prepare and log are main-thread only;
+ * log (or free) releases AUTHSIG.
+ */
+
+struct pubkey_authsig;
+
+struct pubkey_authsig *prepare_authsig_using_pubkey(struct ike_sa *ike,
+						    const struct crypt_mac *hash,
+						    shunk_t signature,
+						    const struct hash_desc *hash_algo,
+						    const struct pubkey_type *type,
+						    authsig_using_pubkey_fn *try_pubkey);
+void authsig_using_pubkey_candidates(struct pubkey_authsig *authsig,
+				     struct logger *logger);
+diag_t log_authsig_using_pubkey(struct ike_sa *ike,
+				struct pubkey_authsig **authsig);
+void free_pubkey_authsig(struct pubkey_authsig **authsig);
+
 #endif /* _KEYS_H */
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>		/* for nanosleep() */
 
 #include "defs.h"
 #include "log.h"
@@ -41,8 +42,10 @@
 #include "impair.h"
 #include "demux.h"	/* for struct msg_digest */
 #include "pending.h"
+#include "show.h"
 
 static void log_raw(int severity, const char *prefix, struct jambuf *buf);
+static void start_log_writer(void);
 
 struct logger failsafe_logger = {
 	.where = { .basename = "<global>", .func = "<global>", },
@@ -62,6 +65,7 @@ bool
 	log_to_stderr = TRUE,		/* should log go to stderr? */
 	log_to_syslog = TRUE,		/* should log go to syslog? */
 	log_append = TRUE,
+	log_async = FALSE,
 	log_to_audit = FALSE;
 
 char *pluto_log_file = NULL;	/* pathname */
@@ -108,6 +112,9 @@ void pluto_init_log(struct log_param param)
 	if (log_to_syslog)
 		openlog("pluto", LOG_CONS | LOG_NDELAY | LOG_PID,
 			LOG_AUTHPRIV);
+
+	if (log_async)
+		start_log_writer();
 }
 
 /*
@@ -115,7 +122,7 @@ void pluto_init_log(struct log_param param)
  * The compiler will likely inline these.
  */
 
-static void stdlog_raw(const char *prefix, char *message, const struct realtm *t)
+static void stdlog_raw(const char *prefix, const char *message, const struct realtm *t)
 {
 	if (log_to_stderr || pluto_log_fp != NULL) {
 		FILE *out = log_to_stderr ? stderr : pluto_log_fp;
@@ -130,12 +137,241 @@ static void stdlog_raw(const char *prefix, char *message, const struct realtm *t
 	}
 }
 
-static void syslog_raw(int severity, const char *prefix, char *message)
+static void syslog_raw(int severity, const char *prefix, const char *message)
 {
 	if (log_to_syslog)
 		syslog(severity, "%s%s", prefix, message);
 }
 
+static void write_log_raw(int severity, const char *prefix,
+			  const char *message, realtime_t time)
+{
+	struct realtm t = local_realtime(time);
+	stdlog_raw(prefix, message, &t);
+	syslog_raw(severity, prefix, message);
+}
+
+/*
+ * The log queue.
+ *
+ * With logasync=yes, log_raw() doesn't write the message.  Instead
+ * the message, along with the time, is copied into a bounded ring
+ * and the log writer thread formats the timestamp and writes it to
+ * the log file (or stderr) and syslog.  A slow syslog or disk then
+ * only stalls the writer.
+ *
+ * Both the main and helper threads log so the ring has many
+ * producers: a producer claims a slot by advancing LOG_ENQUEUE using
+ * a compare-and-swap, and then publishes it by setting the slot's
+ * .seq to one past its position.  The writer, the only consumer,
+ * waits for that .seq, writes the message, and then hands the slot
+ * back by advancing .seq a full lap.
+ *
+ * When the ring is full the message is dropped and counted (the
+ * writer reports the count once it catches up).  Errors are never
+ * dropped: they are written directly and, when queued, the logging
+ * thread waits for the writer to get them out in case what follows
+ * is abort().
+ *
+ * Messages to whack are still written directly; they are part of the
+ * conversation with whack (prompts, status codes) and whack's socket
+ * is closed as soon as the command completes.
+ *
+ * The message is formatted by the logging thread; only the timestamp
+ * is left to the writer.  jambuf_to_logger() can't defer the rest:
+ * the prefix is built from the state or connection, which can be
+ * deleted before the writer gets to it, and the arguments are often
+ * pointers into buffers that are gone the moment the caller returns
+ * (str_*() and jam_*() output, packet contents).  Copying the
+ * message, at most LOG_WIDTH bytes, is the safe equivalent.
+ */
+
+#define LOG_QUEUE_SIZE 1024	/* power of two */
+#define LOG_WRITER_WAIT_MILLISECONDS 1000
+
+struct log_slot {
+	uint64_t seq;
+	int severity;
+	const char *prefix;	/* static: "" or DEBUG_PREFIX */
+	realtime_t time;	/* when logged, not when written */
+	char message[LOG_WIDTH];
+};
+
+static struct log_slot *log_slots;	/* [LOG_QUEUE_SIZE] */
+
+static uint64_t log_enqueue;		/* claimed by producers using CAS */
+static uint64_t log_dequeue;		/* written by the writer */
+
+static unsigned long log_dropped;
+static bool log_writer_running;
+static bool log_writer_sleeping;
+static bool log_writer_stopping;
+static pthread_t log_writer_thread;
+static pthread_mutex_t log_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+
+static bool log_slot_ready(const struct log_slot *slot, uint64_t pos)
+{
+	return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+static void *log_writer(void *arg UNUSED)
+{
+	uint64_t pos = 0;
+	unsigned long reported_dropped = 0;
+	while (true) {
+		struct log_slot *slot = &log_slots[pos % LOG_QUEUE_SIZE];
+		if (log_slot_ready(slot, pos)) {
+			write_log_raw(slot->severity, slot->prefix,
+				      slot->message, slot->time);
+			__atomic_store_n(&slot->seq, pos + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+			__atomic_store_n(&log_dequeue, ++pos, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		/* caught up */
+		unsigned long dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+		if (dropped != reported_dropped) {
+			char message[64];
+			snprintf(message, sizeof(message), "log queue full, %lu messages dropped",
+				 dropped - reported_dropped);
+			write_log_raw(LOG_WARNING, "", message, realnow());
+			reported_dropped = dropped;
+		}
+
+		/*
+		 * Sleep.  Since the lock is held while checking,
+		 * either a producer sees LOG_WRITER_SLEEPING and
+		 * signals, or the check sees its message.
+		 */
+		bool stop = false;
+		pthread_mutex_lock(&log_writer_mutex);
+		__atomic_store_n(&log_writer_sleeping, true, __ATOMIC_SEQ_CST);
+		if (!log_slot_ready(slot, pos)) {
+			if (log_writer_stopping) {
+				stop = true;
+			} else {
+				pthread_cond_wait(&log_writer_cond, &log_writer_mutex);
+			}
+		}
+		__atomic_store_n(&log_writer_sleeping, false, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log_writer_mutex);
+		if (stop) {
+			return NULL;
+		}
+	}
+}
+
+static void wake_log_writer(void)
+{
+	if (__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&log_writer_mutex);
+		pthread_cond_signal(&log_writer_cond);
+		pthread_mutex_unlock(&log_writer_mutex);
+	}
+}
+
+/* false when the queue is full; POS is where the message went */
+static bool queue_log(int severity, const char *prefix, struct jambuf *buf,
+		      realtime_t time, uint64_t *pos)
+{
+	*pos = __atomic_load_n(&log_enqueue, __ATOMIC_RELAXED);
+	struct log_slot *slot;
+	while (true) {
+		slot = &log_slots[*pos % LOG_QUEUE_SIZE];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == *pos) {
+			/* free; try to claim it */
+			if (__atomic_compare_exchange_n(&log_enqueue, pos, *pos + 1,
+							/*weak*/false,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+			/* lost the race; POS has been reloaded */
+		} else if (seq < *pos) {
+			/* still holds the message from a lap ago */
+			return false;
+		} else {
+			/* claimed by another producer */
+			*pos = __atomic_load_n(&log_enqueue, __ATOMIC_RELAXED);
+		}
+	}
+
+	shunk_t message = jambuf_as_shunk(buf);
+	size_t len = (message.len < sizeof(slot->message) ? message.len :
+		      sizeof(slot->message) - 1);
+	memcpy(slot->message, message.ptr, len);
+	slot->message[len] = '\0';
+	slot->severity = severity;
+	slot->prefix = prefix;
+	slot->time = time;
+	/* publish the message; see log_writer() for why this is SEQ_CST */
+	__atomic_store_n(&slot->seq, *pos + 1, __ATOMIC_SEQ_CST);
+	wake_log_writer();
+	return true;
+}
+
+/* give up after a while; the writer may be stuck in the slow write */
+static void wait_for_log_writer(uint64_t pos)
+{
+	const struct timespec ms = { .tv_nsec = 1000 * 1000, };
+	for (unsigned i = 0; i < LOG_WRITER_WAIT_MILLISECONDS; i++) {
+		if (__atomic_load_n(&log_dequeue, __ATOMIC_ACQUIRE) > pos) {
+			return;
+		}
+		nanosleep(&ms, NULL);
+	}
+}
+
+/* after fork() there's no writer; the child writes directly */
+static void log_writer_atfork_child(void)
+{
+	log_writer_running = false;
+}
+
+static void start_log_writer(void)
+{
+	log_slots = alloc_things(struct log_slot, LOG_QUEUE_SIZE, "log queue");
+	for (unsigned i = 0; i < LOG_QUEUE_SIZE; i++) {
+		log_slots[i].seq = i;
+	}
+	int e = pthread_create(&log_writer_thread, NULL, log_writer, NULL);
+	if (e != 0) {
+		/* stay synchronous */
+		fprintf(stderr, "pluto: creating log writer thread failed: %s\n",
+			strerror(e));
+		pfreeany(log_slots);
+		return;
+	}
+	pthread_atfork(NULL, NULL, log_writer_atfork_child);
+	__atomic_store_n(&log_writer_running, true, __ATOMIC_RELEASE);
+}
+
+static void stop_log_writer(void)
+{
+	if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	/* from now on, write directly */
+	__atomic_store_n(&log_writer_running, false, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&log_writer_mutex);
+	log_writer_stopping = true;
+	pthread_cond_signal(&log_writer_cond);
+	pthread_mutex_unlock(&log_writer_mutex);
+	pthread_join(log_writer_thread, NULL);
+	pfreeany(log_slots);
+}
+
+void show_log_queue(struct show *s)
+{
+	uint64_t enqueued = __atomic_load_n(&log_enqueue, __ATOMIC_RELAXED);
+	uint64_t dequeued = __atomic_load_n(&log_dequeue, __ATOMIC_RELAXED);
+	show_raw(s, "current.log.queued=%ju", (uintmax_t)(enqueued - dequeued));
+	show_raw(s, "total.log.queued=%ju", (uintmax_t)enqueued);
+	show_raw(s, "total.log.dropped=%lu",
+		 __atomic_load_n(&log_dropped, __ATOMIC_RELAXED));
+}
+
 static void jambuf_to_whack(struct jambuf *buf, const struct fd *whackfd, enum rc_type rc)
 {
 	/*
@@ -221,9 +457,20 @@ bool whack_prompt_for(struct state *st, const char *prompt,
 static void log_raw(int severity, const char *prefix, struct jambuf *buf)
 {
 	/* assume there's a logging prefix; normally there is */
-	struct realtm t = local_realtime(realnow());
-	stdlog_raw(prefix, buf->array, &t);
-	syslog_raw(severity, prefix, buf->array);
+	realtime_t now = realnow();
+	uint64_t pos;
+	if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE)) {
+		write_log_raw(severity, prefix, buf->array, now);
+	} else if (queue_log(severity, prefix, buf, now, &pos)) {
+		if (severity == LOG_ERR) {
+			wait_for_log_writer(pos);
+		}
+	} else if (severity == LOG_ERR) {
+		/* never drop an error */
+		write_log_raw(severity, prefix, buf->array, now);
+	} else {
+		__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+	}
 	/* not whack */
 }
 
@@ -252,6 +499,8 @@ void jambuf_to_default_streams(struct jambuf *buf, enum rc_type rc)
 
 void close_log(void)
 {
+	stop_log_writer();	/* drains the queue */
+
 	if (log_to_syslog)
 		closelog();
 
@@ -53,6 +53,7 @@ extern void close_log(void);
 
 extern bool log_to_audit;
 extern bool log_append;
+extern bool log_async;		/* write from a separate thread? */
 extern bool log_to_syslog;          /* should log go to syslog? */
 extern char *pluto_log_file;
 extern char *pluto_stats_binary;
@@ -181,6 +182,7 @@ extern void show_status(struct show *s);
 extern void show_setup_plutomain(struct show *s);
 extern void show_setup_natt(struct show *s);
 extern void show_global_status(struct show *s);
+extern void show_log_queue(struct show *s);
 
 enum linux_audit_kind {
 	LAK_PARENT_START,
@@ -28,7 +28,7 @@ struct msg_digest *alloc_md(const struct iface_endpoint *ifp, const ip_endpoint
 	 * - .encrypted = FALSE
 	 */
 	struct msg_digest *md = refcnt_alloc(struct msg_digest, where);
-	md->iface = ifp;
+	md->iface = iface_endpoint_addref(ifp, where);
 	md->sender = *sender;
 	md->md_logger = alloc_logger(md, &logger_message_vec, where);
 	return md;
@@ -53,6 +53,8 @@ struct msg_digest *md_addref(struct msg_digest *md, where_t where)
 
 static void free_mdp(struct msg_digest **mdp, where_t where)
 {
+	struct iface_endpoint *ifp = (void*)(*mdp)->iface; /* hack const */
+	iface_endpoint_delref(&ifp, where);
 	free_chunk_content(&(*mdp)->raw_packet);
 	free_logger(&(*mdp)->md_logger, where);
 	pfreeany((*mdp)->packet_pbs.start);
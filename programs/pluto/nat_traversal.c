@@ -800,10 +800,13 @@ static bool nat_traversal_update_family_mapp_state(struct state *st, void *data)
 
 		/* update it */
 		st->st_remote_endpoint = nfo->new_remote_endpoint;
+		rehash_state_remote_address(st);
 		st->hidden_variables.st_natd = endpoint_address(nfo->new_remote_endpoint);
 		struct connection *c = st->st_connection;
-		if (c->kind == CK_INSTANCE)
+		if (c->kind == CK_INSTANCE) {
 			c->spd.that.host_addr = endpoint_address(nfo->new_remote_endpoint);
+			rehash_connection_remote_address(c);
+		}
 	}
 	return false; /* search for more */
 }
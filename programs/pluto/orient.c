@@ -32,6 +32,7 @@
 #include "iface.h"
 #include "server.h"		/* for listening; */
 #include "orient.h"
+#include "connection_db.h"
 
 /*
  * Swap ends and try again.
@@ -80,6 +81,8 @@ static void swap_ends(struct connection *c)
 	}
 	/* re-compute the base policy priority using the swapped left/right */
 	set_policy_prio(c);
+	/* the remote host address is now the old local one */
+	rehash_connection_remote_address(c);
 }
 
 static bool orient_new_iface_endpoint(struct connection *c, struct fd *whackfd, bool this)
@@ -106,11 +106,14 @@ static void init_seccomp(uint32_t def_action, bool main, struct logger *logger)
 		LSW_SECCOMP_ADD(readlink);
 		LSW_SECCOMP_ADD(readlinkat);
 		LSW_SECCOMP_ADD(recvfrom);
+		LSW_SECCOMP_ADD(recvmmsg);
 		LSW_SECCOMP_ADD(recvmsg);
 		LSW_SECCOMP_ADD(select);
+		LSW_SECCOMP_ADD(sendmmsg);
 		LSW_SECCOMP_ADD(sendmsg);
 		LSW_SECCOMP_ADD(set_robust_list);
 		LSW_SECCOMP_ADD(setsockopt);
+		LSW_SECCOMP_ADD(shutdown);
 		LSW_SECCOMP_ADD(socket);
 		LSW_SECCOMP_ADD(socketcall);
 		LSW_SECCOMP_ADD(socketpair);
@@ -47,15 +47,26 @@
 #include "fetch.h"		/* for stop_crl_fetch_helper() et.al. */
 #include "crl_queue.h"		/* for free_crl_queue() */
 #include "iface.h"		/* for free_ifaces() */
+#include "send.h"		/* for free_send_queue() */
 #include "kernel.h"		/* for kernel_ops.shutdown() and free_kernel() */
 #include "virtual_ip.h"		/* for free_virtual_ip() */
 #include "server.h"		/* for free_server() */
 #include "revival.h"		/* for free_revivals() */
+#include "acquire_queue.h"	/* for free_acquire_queue() */
+#include "rekey_schedule.h"	/* for free_rekey_schedule() */
+#include "updown_helper.h"	/* for free_updown_helper() */
 #ifdef USE_DNSSEC
 #include "dnssec.h"		/* for unbound_ctx_free() */
 #endif
 #include "demux.h"		/* for free_demux() */
 #include "impair_message.h"	/* for free_impair_message() */
+#include "state_db.h"		/* for free_state_db() */
+#include "connection_db.h"	/* for free_connection_db() */
+#include "host_pair.h"		/* for free_host_pairs() */
+#include "server_fork.h"	/* for free_server_fork() */
+#include "ipsec_spi.h"		/* for free_ipsec_spi() */
+#include "crypt_dh.h"		/* for free_dh_local_secret_pools() */
+#include "ike_rate_limit.h"	/* for free_ike_rate_limit() */
 
 volatile bool exiting_pluto = false;
 static bool pluto_leave_state = false;
@@ -118,7 +129,10 @@ void exit_epilogue(void)
 		exit(PLUTO_EXIT_LEAVE_STATE);
 	}
 
+	free_acquire_queue();	/* pending acquires are dropped */
 	delete_every_connection();
+	free_rekey_schedule();
+	free_updown_helper(logger);	/* after the last down/unroute */
 	free_root_certs(logger);
 	free_preshared_secrets(logger);
 	free_remembered_public_keys();
@@ -148,8 +162,10 @@ void exit_epilogue(void)
 
 	lsw_conf_free_oco();	/* free global_oco containing path names */
 
+	free_send_queue();	/* before the interfaces go */
 	free_ifaces(logger);	/* free interface list from memory */
 	shutdown_kernel(logger);
+	free_dh_local_secret_pools();	/* before NSS goes away */
 	lsw_nss_shutdown();
 	delete_lock();	/* delete any lock files */
 #ifdef USE_DNSSEC
@@ -163,8 +179,14 @@ void exit_epilogue(void)
 
 	free_virtual_ip();	/* virtual_private= */
 	free_demux();
+	free_ike_rate_limit();
 	free_pluto_main();	/* our static chars */
 	free_impair_message(logger);
+	free_state_db();	/* after delete_every_connection() */
+	free_connection_db();
+	free_host_pairs();
+	free_server_fork();
+	free_ipsec_spi();	/* after delete_every_connection() */
 
 	/* report memory leaks now, after all free_* calls */
 	if (leak_detective) {
@@ -38,6 +38,7 @@
 #include "ike_alg.h"
 #include "pluto_stats.h"
 #include "nat_traversal.h"
+#include "pluto_timing.h"	/* for show_latency() */
 
 unsigned long pstats_ipsec_sa;
 unsigned long pstats_ikev1_sa;
@@ -68,6 +69,13 @@ uint64_t pstats_ipsec_in_bytes;	/* total incoming IPsec traffic */
 uint64_t pstats_ipsec_out_bytes;	/* total outgoing IPsec traffic */
 unsigned long pstats_ike_in_bytes;	/* total incoming IPsec traffic */
 unsigned long pstats_ike_out_bytes;	/* total outgoing IPsec traffic */
+unsigned long pstats_ike_recv_batches;	/* recvmmsg() calls that returned packets */
+unsigned long pstats_ike_recv_batched;	/* packets read by those calls */
+unsigned long pstats_ike_recv_batch_full;	/* calls that filled the batch */
+unsigned long pstats_ike_recv_screened_out;	/* dropped by a receive worker */
+unsigned long pstats_ike_recv_worker_overflow;	/* dropped, receive worker queue full */
+unsigned long pstats_ike_send_batches;	/* queued-packet flushes, per interface */
+unsigned long pstats_ike_send_batched;	/* packets written by those flushes */
 unsigned long pstats_ikev1_sent_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 unsigned long pstats_ikev1_recv_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 unsigned long pstats_ike_stf[10];	/* count state transitions */ /* ??? what is 10? */
@@ -432,6 +440,13 @@ void show_pluto_stats(struct show *s)
 	show_raw(s, "total.ike.dpd.replied=%lu", pstats_ike_dpd_replied);
 	show_raw(s, "total.ike.traffic.in=%lu", pstats_ike_in_bytes);
 	show_raw(s, "total.ike.traffic.out=%lu", pstats_ike_out_bytes);
+	show_raw(s, "total.ike.recv.batches=%lu", pstats_ike_recv_batches);
+	show_raw(s, "total.ike.recv.batched=%lu", pstats_ike_recv_batched);
+	show_raw(s, "total.ike.recv.batch_full=%lu", pstats_ike_recv_batch_full);
+	show_raw(s, "total.ike.recv.screened_out=%lu", pstats_ike_recv_screened_out);
+	show_raw(s, "total.ike.recv.worker_overflow=%lu", pstats_ike_recv_worker_overflow);
+	show_raw(s, "total.ike.send.batches=%lu", pstats_ike_send_batches);
+	show_raw(s, "total.ike.send.batched=%lu", pstats_ike_send_batched);
 
 	show_raw(s, "total.pamauth.started=%lu", pstats_pamauth_started);
 	show_raw(s, "total.pamauth.stopped=%lu", pstats_pamauth_stopped);
@@ -478,6 +493,8 @@ void show_pluto_stats(struct show *s)
 	whack_pluto_stat(s, &pstats_ikev2_recv_notifies_e);
 	whack_pluto_stat(s, &pstats_ikev2_sent_notifies_s);
 	whack_pluto_stat(s, &pstats_ikev2_recv_notifies_s);
+
+	show_latency(s);
 }
 
 void clear_pluto_stats(void)
@@ -495,6 +512,9 @@ void clear_pluto_stats(void)
 
 	pstats_ipsec_in_bytes = pstats_ipsec_out_bytes = 0;
 	pstats_ike_in_bytes = pstats_ike_out_bytes = 0;
+	pstats_ike_recv_batches = pstats_ike_recv_batched = pstats_ike_recv_batch_full = 0;
+	pstats_ike_recv_screened_out = pstats_ike_recv_worker_overflow = 0;
+	pstats_ike_send_batches = pstats_ike_send_batched = 0;
 	pstats_ipsec_esp = pstats_ipsec_ah = pstats_ipsec_ipcomp = 0;
 	pstats_ipsec_encap_yes = pstats_ipsec_encap_no = 0;
 	pstats_ipsec_esn = pstats_ipsec_tfc = 0;
@@ -525,4 +545,5 @@ void clear_pluto_stats(void)
 	clear_pluto_stat(&pstats_ikev2_sent_notifies_s);
 	clear_pluto_stat(&pstats_ikev2_recv_notifies_s);
 	memset(pstats_ikev1_recv_notifies_e, 0, sizeof pstats_ikev1_recv_notifies_e);
+	clear_latency();
 }
@@ -39,6 +39,13 @@ extern unsigned long pstats_invalidke_sent_u[OAKLEY_GROUP_PSTATS_ROOF];
 extern uint64_t pstats_ipsec_in_bytes;	/* total incoming IPsec traffic */
 extern uint64_t pstats_ipsec_out_bytes;	/* total outgoing IPsec traffic */
 extern unsigned long pstats_ike_in_bytes;	/* total incoming IPsec traffic */
+extern unsigned long pstats_ike_recv_batches;	/* recvmmsg() calls that returned packets */
+extern unsigned long pstats_ike_recv_batched;	/* packets read by those calls */
+extern unsigned long pstats_ike_recv_batch_full;	/* calls that filled the batch */
+extern unsigned long pstats_ike_recv_screened_out;	/* dropped by a receive worker */
+extern unsigned long pstats_ike_recv_worker_overflow;	/* dropped, receive worker queue full */
+extern unsigned long pstats_ike_send_batches;	/* queued-packet flushes, per interface */
+extern unsigned long pstats_ike_send_batched;	/* packets written by those flushes */
 extern unsigned long pstats_ike_out_bytes;	/* total outgoing IPsec traffic */
 extern unsigned long pstats_ikev1_sent_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
 extern unsigned long pstats_ikev1_recv_notifies_e[v1N_ERROR_PSTATS_ROOF]; /* types of NOTIFY ERRORS */
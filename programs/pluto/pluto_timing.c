@@ -21,6 +21,7 @@
 #include "connections.h"
 #include "pluto_timing.h"
 #include "log.h"
+#include "show.h"
 
 #define INDENT " "
 #define MISSING_FUDGE 0.001
@@ -53,7 +54,7 @@ static double seconds_sub(struct timespec stop, const struct timespec start)
 	return seconds;
 }
 
-static struct cpu_usage threadtime_sub(threadtime_t l, threadtime_t r)
+struct cpu_usage threadtime_sub(threadtime_t l, threadtime_t r)
 {
 	struct cpu_usage s = {
 		.thread_seconds = seconds_sub(l.thread_clock, r.thread_clock),
@@ -275,3 +276,91 @@ void statetime_stop(const statetime_t *start, const char *fmt, ...)
 		cpu_usage_add(st->st_timing.main_usage, usage);
 	}
 }
+
+static struct latency *latencies;	/* in the order first recorded */
+static struct latency **latencies_tail = &latencies;
+
+void record_latency(struct latency *latency, double seconds,
+		    const char *fmt, ...)
+{
+	if (latency->name[0] == '\0') {
+		va_list ap;
+		va_start(ap, fmt);
+		vsnprintf(latency->name, sizeof(latency->name), fmt, ap);
+		va_end(ap);
+		*latencies_tail = latency;
+		latencies_tail = &latency->next;
+	}
+
+	if (seconds < 0) {
+		seconds = 0;
+	}
+	uint64_t us = seconds * 1000 * 1000;
+	unsigned bucket = (us == 0 ? 0 : 64 - __builtin_clzll(us));
+	if (bucket >= LATENCY_BUCKETS) {
+		bucket = LATENCY_BUCKETS - 1;
+	}
+	latency->count[bucket]++;
+	latency->samples++;
+	latency->total_seconds += seconds;
+	if (seconds > latency->max_seconds) {
+		latency->max_seconds = seconds;
+	}
+}
+
+/* upper bound of the bucket containing the PERCENT'th sample */
+static double latency_percentile(const struct latency *latency, unsigned percent)
+{
+	unsigned long rank = (latency->samples * percent + 99) / 100;
+	unsigned long seen = 0;
+	for (unsigned b = 0; b < LATENCY_BUCKETS - 1; b++) {
+		seen += latency->count[b];
+		if (seen >= rank) {
+			double upper = (double)(UINT64_C(1) << b) / 1000 / 1000;
+			return (upper < latency->max_seconds ? upper : latency->max_seconds);
+		}
+	}
+	return latency->max_seconds;
+}
+
+void show_latency(struct show *s)
+{
+	for (const struct latency *l = latencies; l != NULL; l = l->next) {
+		if (l->samples == 0) {
+			continue;
+		}
+		show_raw(s, "total.latency.%s.count=%lu", l->name, l->samples);
+		show_raw(s, "total.latency.%s.avg_ms=%.3f", l->name,
+			 l->total_seconds * 1000 / l->samples);
+		static const unsigned percentiles[] = { 50, 90, 99, };
+		for (unsigned i = 0; i < elemsof(percentiles); i++) {
+			show_raw(s, "total.latency.%s.p%u_ms=%.3f", l->name, percentiles[i],
+				 latency_percentile(l, percentiles[i]) * 1000);
+		}
+		show_raw(s, "total.latency.%s.max_ms=%.3f", l->name,
+			 l->max_seconds * 1000);
+		for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+			if (l->count[b] == 0) {
+				continue;
+			}
+			if (b < LATENCY_BUCKETS - 1) {
+				show_raw(s, "total.latency.%s.lt_%juus=%lu", l->name,
+					 (uintmax_t)(UINT64_C(1) << b), l->count[b]);
+			} else {
+				show_raw(s, "total.latency.%s.ge_%juus=%lu", l->name,
+					 (uintmax_t)(UINT64_C(1) << (b - 1)), l->count[b]);
+			}
+		}
+	}
+}
+
+void clear_latency(void)
+{
+	/* keep the names, and the list */
+	for (struct latency *l = latencies; l != NULL; l = l->next) {
+		memset(l->count, 0, sizeof(l->count));
+		l->samples = 0;
+		l->total_seconds = 0;
+		l->max_seconds = 0;
+	}
+}
@@ -24,6 +24,7 @@
 
 struct state;
 struct logger;
+struct show;
 
 /*
  * Try to format all cpu usage messaages the same.  All delta-times
@@ -60,6 +61,7 @@ struct cpu_usage {
 typedef struct cpu_timing threadtime_t;
 threadtime_t threadtime_start(void);
 void threadtime_stop(const threadtime_t *start, long serialno, const char *fmt, ...) PRINTF_LIKE(3);
+struct cpu_usage threadtime_sub(threadtime_t l, threadtime_t r);
 
 /*
  * For helper threads that have some context.
@@ -129,4 +131,33 @@ statetime_t statetime_backdate(struct state *st, const threadtime_t *inception);
 statetime_t statetime_start(struct state *st);
 void statetime_stop(const statetime_t *start, const char *fmt, ...) PRINTF_LIKE(2);
 
+/*
+ * Latency histograms.
+ *
+ * Wall-clock times, for instance how long an IKE_AUTH request took
+ * to process, are counted in power-of-two microsecond buckets so
+ * that percentiles can be shown (by whack --globalstatus) without
+ * DBG_CPU_USAGE.  Bucket 0 is under 1us; bucket B (B > 0) is
+ * [2^(B-1), 2^B) microseconds; the last bucket is everything longer.
+ *
+ * The histogram is named (FMT) when the first sample is recorded;
+ * only histograms with samples are shown.  Main thread only.
+ */
+
+#define LATENCY_BUCKETS 26
+
+struct latency {
+	char name[64];
+	unsigned long count[LATENCY_BUCKETS];
+	unsigned long samples;
+	double total_seconds;
+	double max_seconds;
+	struct latency *next;	/* all recorded histograms */
+};
+
+void record_latency(struct latency *latency, double seconds,
+		    const char *fmt, ...) PRINTF_LIKE(3);
+void show_latency(struct show *s);
+void clear_latency(void);
+
 #endif
@@ -46,8 +46,10 @@
 #include "defs.h"
 #include "nss_ocsp.h"
 #include "server_fork.h"		/* for init_server_fork() */
+#include "ipsec_spi.h"		/* for init_ipsec_spi() */
 #include "server.h"
 #include "kernel.h"	/* needs connections.h */
+#include "kernel_xfrm.h"	/* for pluto_netlink_batch */
 #include "log.h"
 #include "keys.h"
 #include "secrets.h"    /* for free_remembered_public_keys() */
@@ -60,6 +62,10 @@
 #include "virtual_ip.h"
 #include "state_db.h"		/* for init_state_db() */
 #include "revival.h"		/* for init_revival() */
+#include "timer.h"		/* for init_timer_wheel() */
+#include "acquire_queue.h"	/* for init_acquire_queue() */
+#include "rekey_schedule.h"	/* for init_rekey_schedule() */
+#include "updown_helper.h"	/* for init_updown_helper() */
 #include "connection_db.h"	/* for connection_state_db() */
 #include "nat_traversal.h"
 #include "ike_alg.h"
@@ -72,6 +78,8 @@
 #include "crl_queue.h"		/* for free_crl_queue() */
 #include "iface.h"
 #include "server_pool.h"
+#include "crypt_dh.h"		/* for pluto_dh_pool_{low,high} */
+#include "ike_rate_limit.h"
 
 #ifndef IPSECDIR
 #define IPSECDIR "/etc/ipsec.d"
@@ -1197,6 +1205,7 @@ int main(int argc, char **argv)
 			log_param.log_with_timestamp = cfg->setup.options[KBF_LOGTIME];
 			log_append = cfg->setup.options[KBF_LOGAPPEND];
 			log_ip = cfg->setup.options[KBF_LOGIP];
+			log_async = cfg->setup.options[KBF_LOGASYNC];
 			log_to_audit = cfg->setup.options[KBF_AUDIT_LOG];
 			pluto_drop_oppo_null = cfg->setup.options[KBF_DROP_OPPO_NULL];
 			pluto_ddos_mode = cfg->setup.options[KBF_DDOS_MODE];
@@ -1214,9 +1223,43 @@ int main(int argc, char **argv)
 				/* force-busy is obsoleted, translate to ddos-mode= */
 				pluto_ddos_mode = cfg->setup.options[KBF_DDOS_MODE] = DDOS_FORCE_BUSY;
 			}
-			/* ddos-ike-threshold and max-halfopen-ike */
+			/* ddos-ike-threshold, max-halfopen-ike and ddos-helper-threshold */
 			pluto_ddos_threshold = cfg->setup.options[KBF_DDOS_IKE_THRESHOLD];
 			pluto_max_halfopen = cfg->setup.options[KBF_MAX_HALFOPEN_IKE];
+			pluto_ddos_helper_threshold = cfg->setup.options[KBF_DDOS_HELPER_THRESHOLD];
+
+			/* precomputed DH secrets */
+			pluto_dh_pool_high = cfg->setup.options[KBF_DH_POOL_HIGH];
+			pluto_dh_pool_low = cfg->setup.options[KBF_DH_POOL_LOW];
+			if (pluto_dh_pool_low > pluto_dh_pool_high) {
+				llog(RC_LOG, logger,
+				     "dh-pool-low=%u is above dh-pool-high=%u; using %u",
+				     pluto_dh_pool_low, pluto_dh_pool_high,
+				     pluto_dh_pool_high);
+				pluto_dh_pool_low = pluto_dh_pool_high;
+			}
+
+			/* ike-rate-limit= et.al. */
+			pluto_ike_rate_limit = cfg->setup.options[KBF_IKE_RATE_LIMIT];
+			pluto_ike_rate_limit_burst = cfg->setup.options[KBF_IKE_RATE_LIMIT_BURST];
+			pluto_ike_rate_limit_ipv4_prefix = cfg->setup.options[KBF_IKE_RATE_LIMIT_IPV4_PREFIX];
+			if (pluto_ike_rate_limit_ipv4_prefix > 32) {
+				llog(RC_LOG, logger,
+				     "ike-rate-limit-ipv4-prefix=%u is too big, using 32",
+				     pluto_ike_rate_limit_ipv4_prefix);
+				pluto_ike_rate_limit_ipv4_prefix = 32;
+			}
+			pluto_ike_rate_limit_ipv6_prefix = cfg->setup.options[KBF_IKE_RATE_LIMIT_IPV6_PREFIX];
+			if (pluto_ike_rate_limit_ipv6_prefix > 128) {
+				llog(RC_LOG, logger,
+				     "ike-rate-limit-ipv6-prefix=%u is too big, using 128",
+				     pluto_ike_rate_limit_ipv6_prefix);
+				pluto_ike_rate_limit_ipv6_prefix = 128;
+			}
+
+			/* rekey-window= rekey-rate= */
+			pluto_rekey_window = cfg->setup.options[KBF_REKEY_WINDOW];
+			pluto_rekey_rate = cfg->setup.options[KBF_REKEY_RATE];
 
 			crl_strict = cfg->setup.options[KBF_CRL_STRICT];
 
@@ -1269,6 +1312,26 @@ int main(int argc, char **argv)
 			pluto_sock_bufsize = cfg->setup.options[KBF_IKEBUF];
 			pluto_sock_errqueue = cfg->setup.options[KBF_IKE_ERRQUEUE];
 
+			/* ike-socket-recv-batch= */
+			pluto_sock_recv_batch = cfg->setup.options[KBF_IKE_RECV_BATCH];
+			if (pluto_sock_recv_batch < 1) {
+				pluto_sock_recv_batch = 1;
+			} else if (pluto_sock_recv_batch > MAX_IKE_RECV_BATCH) {
+				llog(RC_LOG, logger,
+				     "ike-socket-recv-batch=%u is too big, using %u",
+				     pluto_sock_recv_batch, MAX_IKE_RECV_BATCH);
+				pluto_sock_recv_batch = MAX_IKE_RECV_BATCH;
+			}
+
+			/* ike-socket-workers= */
+			pluto_sock_workers = cfg->setup.options[KBF_IKE_SOCKET_WORKERS];
+			if (pluto_sock_workers > MAX_IKE_SOCKET_WORKERS) {
+				llog(RC_LOG, logger,
+				     "ike-socket-workers=%u is too big, using %u",
+				     pluto_sock_workers, MAX_IKE_SOCKET_WORKERS);
+				pluto_sock_workers = MAX_IKE_SOCKET_WORKERS;
+			}
+
 			/* listen-tcp= / listen-udp= */
 			pluto_listen_tcp = cfg->setup.options[KBF_LISTEN_TCP];
 			pluto_listen_udp = cfg->setup.options[KBF_LISTEN_UDP];
@@ -1280,6 +1343,11 @@ int main(int argc, char **argv)
 			/* only causes nflog nmber to show in ipsec status */
 			pluto_xfrmlifetime = cfg->setup.options[KBF_XFRMLIFETIME];
 
+#ifdef XFRM_SUPPORT
+			/* netlink-batch= */
+			pluto_netlink_batch = cfg->setup.options[KBF_NETLINK_BATCH];
+#endif
+
 			/* no config option: rundir */
 			/* secretsfile= */
 			if (cfg->setup.strings[KSF_SECRETSFILE] &&
@@ -1333,6 +1401,13 @@ int main(int argc, char **argv)
 				}
 			}
 
+			if (cfg->setup.strings[KSF_UPDOWN_HELPER] != NULL) {
+				/* updown-helper= */
+				pfreeany(pluto_updown_helper);
+				pluto_updown_helper = clone_str(cfg->setup.strings[KSF_UPDOWN_HELPER],
+								"updown-helper via --config");
+			}
+
 			pluto_nss_seedbits = cfg->setup.options[KBF_SEEDBITS];
 			keep_alive = deltatime(cfg->setup.options[KBF_KEEPALIVE]);
 
@@ -1736,9 +1811,12 @@ int main(int argc, char **argv)
 	init_state_db();
 	init_connection_db();
 	init_server_fork();
+	init_ipsec_spi();
 	init_server(logger);
+	init_timer_wheel();
 
 	init_rate_log();
+	init_ike_rate_limit(logger);
 	init_nat_traversal(keep_alive, logger);
 
 	init_virtual_ip(virtual_private, logger);
@@ -1751,6 +1829,9 @@ int main(int argc, char **argv)
 	init_ikev2();
 	init_states();
 	init_revival();
+	init_acquire_queue();
+	init_rekey_schedule(logger);
+	init_updown_helper();
 	init_connections();
 	init_host_pair();
 	init_ike_alg(logger);
@@ -1836,19 +1917,26 @@ void show_setup_plutomain(struct show *s)
 		(intmax_t) pluto_xfrmlifetime
 	);
 
+#ifdef XFRM_SUPPORT
+	show_comment(s, "netlink-batch=%s", bool_str(pluto_netlink_batch));
+#endif
+
 	show_comment(s,
-		"ddos-cookies-threshold=%d, ddos-max-halfopen=%d, ddos-mode=%s, ikev1-policy=%s",
+		"ddos-cookies-threshold=%d, ddos-max-halfopen=%d, ddos-helper-threshold=%d, ddos-mode=%s, ikev1-policy=%s",
 		pluto_ddos_threshold,
 		pluto_max_halfopen,
+		pluto_ddos_helper_threshold,
 		(pluto_ddos_mode == DDOS_AUTO) ? "auto" :
 			(pluto_ddos_mode == DDOS_FORCE_BUSY) ? "busy" : "unlimited",
 		pluto_ikev1_pol == GLOBAL_IKEv1_ACCEPT ? "accept" :
 			pluto_ikev1_pol == GLOBAL_IKEv1_REJECT ? "reject" : "drop");
 
 	show_comment(s,
-		"ikebuf=%d, msg_errqueue=%s, crl-strict=%s, crlcheckinterval=%jd, listen=%s, nflog-all=%d",
+		"ikebuf=%d, msg_errqueue=%s, recv-batch=%u, socket-workers=%u, crl-strict=%s, crlcheckinterval=%jd, listen=%s, nflog-all=%d",
 		pluto_sock_bufsize,
 		bool_str(pluto_sock_errqueue),
+		pluto_sock_recv_batch,
+		pluto_sock_workers,
 		bool_str(crl_strict),
 		deltasecs(crl_check_interval),
 		pluto_listen != NULL ? pluto_listen : "<any>",
@@ -872,6 +872,13 @@ static void whack_process(const struct whack_message *const m, struct show *s)
 		dbg("whack: ... trafficstatus");
 	}
 
+	if (m->whack_peer_status) {
+		address_buf pb;
+		dbg("whack: peerstatus %s ...", str_address(&m->whack_peer_status_peer, &pb));
+		show_peer_status(s, &m->whack_peer_status_peer);
+		dbg("whack: ... peerstatus %s", str_address(&m->whack_peer_status_peer, &pb));
+	}
+
 	if (m->whack_shunt_status) {
 		dbg("whack: shuntstatus ...");
 		show_shunt_status(s);
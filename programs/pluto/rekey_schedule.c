@@ -0,0 +1,214 @@
+/* spreading out of rekey events, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include "defs.h"
+#include "rekey_schedule.h"
+#include "log.h"
+#include "rnd.h"
+#include "show.h"
+#include "connections.h"	/* for st_ike_version */
+#include "state.h"
+#include "timer.h"
+
+/*
+ * SAs established together (a restart, a peer coming back, a burst
+ * of opportunistic connections) also rekey together; rekeyfuzz
+ * helps but, being a percentage of the margin, its spread is often
+ * only a few seconds.
+ *
+ * When rekey-window is set, each rekey (or replace that still leaves
+ * a margin) is instead brought forward to a random second in the
+ * WINDOW seconds before it was due; when rekey-rate is also set, a
+ * second that already has RATE rekeys due is skipped in favour of
+ * the nearest one, inside the window, that doesn't.  Rekeys are only
+ * ever moved earlier so an SA never outlives its lifetime.
+ *
+ * The number of rekeys due each second is kept in a ring indexed by
+ * monotonic second; it covers REKEY_RING_SECONDS (a bit over 36
+ * hours) which is well past the longest lifetime.  Anything further
+ * out is scheduled untouched and isn't counted.
+ */
+
+#define REKEY_RING_SECONDS (1u << 17)
+
+unsigned pluto_rekey_window;
+unsigned pluto_rekey_rate;
+
+static uint32_t *rekeys_due;	/* [REKEY_RING_SECONDS] */
+
+static unsigned long total_scheduled;
+static unsigned long total_moved;
+static unsigned long total_over_rate;
+
+static uint32_t *due_slot(intmax_t secs)
+{
+	return &rekeys_due[(uintmax_t)secs % REKEY_RING_SECONDS];
+}
+
+/* pick a second in [FIRST, LAST] to schedule the rekey */
+static intmax_t pick_rekey_second(intmax_t first, intmax_t last)
+{
+	uint32_t r;
+	get_rnd_bytes(&r, sizeof(r));
+	intmax_t pick = first + r % (last - first + 1);
+	if (pluto_rekey_rate == 0 || *due_slot(pick) < pluto_rekey_rate) {
+		return pick;
+	}
+
+	/*
+	 * The second is full; look outwards for the nearest one that
+	 * isn't, remembering the least loaded in case all are.
+	 */
+	intmax_t best = pick;
+	for (intmax_t d = 1; pick - d >= first || pick + d <= last; d++) {
+		intmax_t try[] = { pick - d, pick + d, };
+		for (unsigned i = 0; i < elemsof(try); i++) {
+			if (try[i] < first || try[i] > last) {
+				continue;
+			}
+			uint32_t due = *due_slot(try[i]);
+			if (due < pluto_rekey_rate) {
+				return try[i];
+			}
+			if (due < *due_slot(best)) {
+				best = try[i];
+			}
+		}
+	}
+	total_over_rate++;
+	return best;
+}
+
+void schedule_rekey_event(enum event_type kind, deltatime_t delay,
+			  struct state *st)
+{
+	if (rekeys_due == NULL) {
+		event_schedule(kind, delay, st);
+		return;
+	}
+
+	monotime_t now = mononow();
+	intmax_t due = monosecs(monotime_add(now, delay));
+	intmax_t delay_secs = deltasecs(delay);
+	if (delay_secs < 0 || (uintmax_t)delay_secs >= REKEY_RING_SECONDS) {
+		event_schedule(kind, delay, st);
+		return;
+	}
+
+	/*
+	 * Never bring the rekey forward by more than half its delay,
+	 * and never into the current second.
+	 */
+	intmax_t window = pluto_rekey_window;
+	if (window > delay_secs / 2) {
+		window = delay_secs / 2;
+	}
+	intmax_t first = due - window;
+	if (first <= monosecs(now)) {
+		first = monosecs(now) + 1;
+	}
+	if (first > due) {
+		first = due;
+	}
+
+	intmax_t when = pick_rekey_second(first, due);
+	if (when != due) {
+		total_moved++;
+		delay = deltatime_sub(delay, deltatime(due - when));
+		/*
+		 * IKEv1 schedules EVENT_SA_EXPIRE from the margin, so
+		 * widen it to keep the SA expiring when it would have;
+		 * IKEv2 expires at st_replace_by and only uses the
+		 * margin to judge a viable parent.
+		 */
+		if (st->st_ike_version == IKEv1) {
+			st->st_replace_margin = deltatime_add(st->st_replace_margin,
+							      deltatime(due - when));
+		}
+		deltatime_buf db;
+		dbg("#%lu %s brought forward %jd seconds to %s by the rekey scheduler",
+		    st->st_serialno, enum_name(&timer_event_names, kind),
+		    due - when, str_deltatime(delay, &db));
+	}
+
+	event_schedule(kind, delay, st);
+	struct pluto_event *ev = *state_event(st, kind);
+	if (ev != NULL) {
+		ev->ev_rekey = true;
+		(*due_slot(monosecs(ev->ev_time)))++;
+		total_scheduled++;
+	}
+}
+
+void release_rekey_event(monotime_t when)
+{
+	if (rekeys_due == NULL) {
+		return;
+	}
+	uint32_t *due = due_slot(monosecs(when));
+	if (pexpect(*due > 0)) {
+		(*due)--;
+	}
+}
+
+void init_rekey_schedule(struct logger *logger)
+{
+	if (pluto_rekey_window == 0 && pluto_rekey_rate == 0) {
+		return;
+	}
+	rekeys_due = alloc_things(uint32_t, REKEY_RING_SECONDS, "rekeys due");
+	llog(RC_LOG, logger,
+	     "rekeys spread over %u seconds, at most %u per second",
+	     pluto_rekey_window, pluto_rekey_rate);
+}
+
+void free_rekey_schedule(void)
+{
+	pfreeany(rekeys_due);
+}
+
+void show_rekey_schedule(struct show *s)
+{
+	show_raw(s, "config.setup.rekey.window=%u", pluto_rekey_window);
+	show_raw(s, "config.setup.rekey.rate=%u", pluto_rekey_rate);
+
+	/* rekeys due within each interval (not cumulative) */
+	static const struct {
+		const char *name;
+		unsigned secs;
+	} upcoming[] = {
+		{ "1m", 60, },
+		{ "5m", 5 * 60, },
+		{ "15m", 15 * 60, },
+		{ "1h", 60 * 60, },
+		{ "4h", 4 * 60 * 60, },
+		{ "24h", 24 * 60 * 60, },
+	};
+	intmax_t now = monosecs(mononow());
+	unsigned from = 0;
+	for (unsigned i = 0; i < elemsof(upcoming); i++) {
+		unsigned long due = 0;
+		if (rekeys_due != NULL) {
+			for (unsigned secs = from; secs < upcoming[i].secs; secs++) {
+				due += *due_slot(now + secs);
+			}
+		}
+		show_raw(s, "current.rekey.upcoming.%s=%lu", upcoming[i].name, due);
+		from = upcoming[i].secs;
+	}
+
+	show_raw(s, "total.rekey.scheduled=%lu", total_scheduled);
+	show_raw(s, "total.rekey.moved=%lu", total_moved);
+	show_raw(s, "total.rekey.over_rate=%lu", total_over_rate);
+}
@@ -0,0 +1,46 @@
+/* spreading out of rekey events, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef REKEY_SCHEDULE_H
+#define REKEY_SCHEDULE_H
+
+#include "deltatime.h"
+#include "monotime.h"
+
+struct state;
+struct show;
+struct logger;
+enum event_type;
+
+extern unsigned pluto_rekey_window;	/* seconds; 0 disables spreading */
+extern unsigned pluto_rekey_rate;	/* rekeys/second; 0 means no cap */
+
+void init_rekey_schedule(struct logger *logger);
+void free_rekey_schedule(void);
+
+/*
+ * Like event_schedule() but, when enabled, KIND (a rekey or replace
+ * that still leaves a margin) may be brought forward by up to
+ * rekey-window seconds so that no second has more than rekey-rate
+ * rekeys due.
+ */
+void schedule_rekey_event(enum event_type kind, deltatime_t delay,
+			  struct state *st);
+
+/* a counted rekey event, due at WHEN, fired or was deleted */
+void release_rekey_event(monotime_t when);
+
+void show_rekey_schedule(struct show *s);
+
+#endif
@@ -43,6 +43,158 @@
 #include "ip_protocol.h"
 #include "iface.h"
 #include "impair_message.h"
+#include "pluto_timing.h"
+
+/*
+ * Transmit queue.
+ *
+ * When the interface supports it, packets are not written straight
+ * away; instead they are copied onto this queue which is flushed,
+ * using one write_packets() (sendmmsg()) call per interface, once
+ * the current batch of event-loop callbacks has run.  Write errors
+ * are still reported, per packet, when the queue is flushed.
+ *
+ * Interfaces are only freed after the queue has been flushed (see
+ * free_any_iface_endpoint()) so the raw pointer is safe.
+ */
+
+#define SEND_QUEUE_SIZE 64
+
+struct queued_packet {
+	const struct iface_endpoint *interface;	/* NULL once sent */
+	uint8_t *ptr;
+	size_t len;
+	ip_endpoint remote_endpoint;
+	so_serial_t serialno;
+	const char *where;
+	bool just_a_keepalive;
+};
+
+static struct queued_packet send_queue[SEND_QUEUE_SIZE];
+static unsigned send_queue_len;
+static struct event *send_queue_event;
+
+static void log_send_failure(struct logger *logger, int error,
+			     const struct iface_endpoint *interface,
+			     const ip_endpoint *remote_endpoint,
+			     const char *where)
+{
+	endpoint_buf lb;
+	endpoint_buf rb;
+	log_errno(logger, error,
+		  "send on %s from %s to %s using %s failed in %s",
+		  interface->ip_dev->id_rname,
+		  str_endpoint(&interface->local_endpoint, &lb),
+		  str_endpoint_sensitive(remote_endpoint, &rb),
+		  interface->protocol->name,
+		  where);
+}
+
+static void flush_interface_packets(const struct iface_endpoint *interface,
+				    unsigned first)
+{
+	struct logger global_logger = GLOBAL_LOGGER(null_fd);
+
+	/* gather this interface's packets, in order */
+	struct iface_write writes[SEND_QUEUE_SIZE];
+	struct queued_packet *packets[SEND_QUEUE_SIZE];
+	unsigned nr = 0;
+	for (unsigned i = first; i < send_queue_len; i++) {
+		struct queued_packet *p = &send_queue[i];
+		if (p->interface == interface) {
+			packets[nr] = p;
+			writes[nr] = (struct iface_write) {
+				.ptr = p->ptr,
+				.len = p->len,
+				.remote_endpoint = p->remote_endpoint,
+			};
+			nr++;
+		}
+	}
+
+	interface->io->write_packets(interface, writes, nr, &global_logger);
+	pstats_ike_send_batches++;
+	pstats_ike_send_batched += nr;
+
+	for (unsigned i = 0; i < nr; i++) {
+		struct queued_packet *p = packets[i];
+		if (writes[i].wlen == (ssize_t)p->len) {
+			pstats_ike_out_bytes += p->len;
+		} else if (!p->just_a_keepalive) {
+			/* the state may have gone away */
+			struct state *st = state_with_serialno(p->serialno);
+			struct logger from_logger = logger_from(&global_logger,
+								 &p->remote_endpoint);
+			log_send_failure(st != NULL ? st->st_logger : &from_logger,
+					 writes[i].error, interface,
+					 &p->remote_endpoint, p->where);
+		}
+		pfree(p->ptr);
+		p->ptr = NULL;
+		p->interface = NULL;
+	}
+}
+
+void flush_send_queue(void)
+{
+	if (send_queue_len == 0) {
+		return;
+	}
+	dbg("flushing %u queued packets", send_queue_len);
+	for (unsigned i = 0; i < send_queue_len; i++) {
+		if (send_queue[i].interface != NULL) {
+			flush_interface_packets(send_queue[i].interface, i);
+		}
+	}
+	send_queue_len = 0;
+}
+
+static void send_queue_event_handler(evutil_socket_t fd UNUSED,
+				     const short event UNUSED,
+				     void *arg UNUSED)
+{
+	threadtime_t start = threadtime_start();
+	flush_send_queue();
+	threadtime_stop(&start, SOS_NOBODY, "%s()", __func__);
+}
+
+static void queue_packet(const struct iface_endpoint *interface,
+			 const uint8_t *ptr, size_t len,
+			 const ip_endpoint *remote_endpoint,
+			 so_serial_t serialno, const char *where,
+			 bool just_a_keepalive)
+{
+	if (send_queue_len == SEND_QUEUE_SIZE) {
+		flush_send_queue();
+	}
+	if (send_queue_len == 0) {
+		/* run the flush after the current callbacks */
+		if (send_queue_event == NULL) {
+			send_queue_event = event_new(get_pluto_event_base(), -1, 0,
+						     send_queue_event_handler, NULL);
+			passert(send_queue_event != NULL);
+		}
+		event_active(send_queue_event, EV_TIMEOUT, 0);
+	}
+	send_queue[send_queue_len++] = (struct queued_packet) {
+		.interface = interface,
+		.ptr = clone_bytes(ptr, len, "queued packet"),
+		.len = len,
+		.remote_endpoint = *remote_endpoint,
+		.serialno = serialno,
+		.where = where,
+		.just_a_keepalive = just_a_keepalive,
+	};
+}
+
+void free_send_queue(void)
+{
+	flush_send_queue();
+	if (send_queue_event != NULL) {
+		event_free(send_queue_event);
+		send_queue_event = NULL;
+	}
+}
 
 /* send_ike_msg logic is broken into layers.
  * The rest of the system thinks it is simple.
@@ -164,20 +316,19 @@ static bool send_chunks(const char *where, bool just_a_keepalive,
 		DBG_dump(NULL, ptr, len);
 	}
 
-	if (!impair_outgoing_message(shunk2(ptr, len), logger)) {
+	if (impair_outgoing_message(shunk2(ptr, len), logger)) {
+		/* dropped */
+	} else if (interface->io->write_packets != NULL && !impair.jacob_two_two) {
+		/* JACOB 2-2 expects the original to be sent first */
+		queue_packet(interface, ptr, len, &remote_endpoint,
+			     serialno, where, just_a_keepalive);
+	} else {
 		ssize_t wlen = interface->io->write_packet(interface, ptr, len,
 							   &remote_endpoint, logger);
 		if (wlen != (ssize_t)len) {
 			if (!just_a_keepalive) {
-				endpoint_buf lb;
-				endpoint_buf rb;
-				log_errno(logger, errno,
-					  "send on %s from %s to %s using %s failed in %s",
-					  interface->ip_dev->id_rname,
-					  str_endpoint(&interface->local_endpoint, &lb),
-					  str_endpoint_sensitive(&remote_endpoint, &rb),
-					  interface->protocol->name,
-					  where);
+				log_send_failure(logger, errno, interface,
+						 &remote_endpoint, where);
 			}
 			return false;
 		}
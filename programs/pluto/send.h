@@ -41,4 +41,11 @@ bool send_chunk_using_state(struct state *st, const char *where, chunk_t packet)
 
 bool send_keepalive_using_state(struct state *st, const char *where);
 
+/*
+ * Write out any packets queued for a batched send; called before an
+ * interface is freed.
+ */
+void flush_send_queue(void);
+void free_send_queue(void);
+
 #endif
@@ -200,10 +200,13 @@ enum seccomp_mode pluto_seccomp_mode = SECCOMP_DISABLED;
 #endif
 unsigned int pluto_max_halfopen = DEFAULT_MAXIMUM_HALFOPEN_IKE_SA;
 unsigned int pluto_ddos_threshold = DEFAULT_IKE_SA_DDOS_THRESHOLD;
+unsigned int pluto_ddos_helper_threshold = DEFAULT_HELPER_BACKLOG_DDOS_THRESHOLD;
 deltatime_t pluto_shunt_lifetime = DELTATIME_INIT(PLUTO_SHUNT_LIFE_DURATION_DEFAULT);
 
 unsigned int pluto_sock_bufsize = IKE_BUF_AUTO; /* use system values */
 bool pluto_sock_errqueue = true; /* Enable MSG_ERRQUEUE on IKE socket */
+unsigned pluto_sock_recv_batch = DEFAULT_IKE_RECV_BATCH; /* datagrams per recvmmsg() */
+unsigned pluto_sock_workers = 0; /* SO_REUSEPORT receive threads; 0 disables */
 
 /*
  * Static events.
@@ -247,6 +250,9 @@ static struct global_timer_desc global_timers[] = {
 	E(EVENT_RESET_LOG_RATE_LIMIT),
 	E(EVENT_PROCESS_KERNEL_QUEUE),
 	E(EVENT_NAT_T_KEEPALIVE),
+	E(EVENT_PROCESS_ACQUIRE_QUEUE),
+	E(EVENT_TIMER_WHEEL),
+	E(EVENT_FLUSH_UPDOWN_HELPER),
 #undef E
 };
 
@@ -531,24 +537,21 @@ void link_pluto_event_list(struct pluto_event *e) {
 void delete_pluto_event(struct pluto_event **evp)
 {
 	if (*evp != NULL) {
-		if ((*evp)->ev_state != NULL) {
-			pexpect((*evp)->next == NULL);
-			free_event_entry(evp);
-		} else {
-			for (struct pluto_event **pp = &pluto_events_head; ; ) {
-				struct pluto_event *p = *pp;
+		/* state events are on the timer wheel; see timer.c */
+		passert((*evp)->ev_state == NULL);
+		for (struct pluto_event **pp = &pluto_events_head; ; ) {
+			struct pluto_event *p = *pp;
 
-				passert(p != NULL);
+			passert(p != NULL);
 
-				if (p == *evp) {
-					/* found it; unlink this from the list */
-					*pp = free_event_entry(evp);
-					break;
-				}
-				pp = &p->next;
+			if (p == *evp) {
+				/* found it; unlink this from the list */
+				*pp = free_event_entry(evp);
+				break;
 			}
-			*evp = NULL;
+			pp = &p->next;
 		}
+		*evp = NULL;
 	}
 }
 
@@ -886,6 +889,7 @@ void list_timers(struct show *s, monotime_t now)
 		     monosecs(now));
 
 	list_global_timers(s, now);
+	list_timer_wheel(s, now);
 	list_signal_handlers(s);
 
 	for (struct pluto_event *ev = pluto_events_head;
@@ -1135,11 +1139,7 @@ void stop_server(server_stopped_cb cb)
 
 bool ev_before(struct pluto_event *pev, deltatime_t delay)
 {
-	struct timeval timeout;
-	if (!(event_pending(pev->ev, EV_TIMEOUT, &timeout) & EV_TIMEOUT)) {
-		return false;
-	}
-	return deltatime_cmp(deltatime_from_timeval(timeout), <, delay);
+	return deltatime_cmp(monotimediff(pev->ev_time, mononow()), <, delay);
 }
 
 void set_whack_pluto_ddos(enum ddos_mode mode, struct logger *logger)
@@ -57,9 +57,12 @@ extern enum ddos_mode pluto_ddos_mode; /* auto-detect or manual */
 extern enum global_ikev1_policy pluto_ikev1_pol; /* accept, drop or reject */
 extern unsigned int pluto_max_halfopen; /* Max allowed half-open IKE SA's before refusing */
 extern unsigned int pluto_ddos_threshold; /* Max incoming IKE before activating DCOOKIES */
+extern unsigned int pluto_ddos_helper_threshold; /* Max waiting helper jobs before activating DCOOKIES */
 extern deltatime_t pluto_shunt_lifetime; /* lifetime before we cleanup bare shunts (for OE) */
 extern unsigned int pluto_sock_bufsize; /* pluto IKE socket buffer */
 extern bool pluto_sock_errqueue; /* Enable MSG_ERRQUEUE on IKE socket */
+extern unsigned pluto_sock_recv_batch; /* datagrams per recvmmsg(); 1 disables */
+extern unsigned pluto_sock_workers; /* SO_REUSEPORT receive threads per UDP socket; 0 disables */
 
 extern enum pluto_ddos_mode ddos_mode;
 extern bool pluto_drop_oppo_null;
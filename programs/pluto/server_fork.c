@@ -89,8 +89,6 @@ static struct list_entry *pid_entry_entry(void *data)
 	return &entry->hash_entry;
 }
 
-static struct list_head pid_entry_slots[23];
-
 static struct hash_table pids_hash_table = {
 	.info = {
 		.name = "pid table",
@@ -98,8 +96,7 @@ static struct hash_table pids_hash_table = {
 	},
 	.hasher = pid_entry_hasher,
 	.entry = pid_entry_entry,
-	.nr_slots = elemsof(pid_entry_slots),
-	.slots = pid_entry_slots,
+	.nr_slots = 23,
 };
 
 void show_process_status(struct show *s)
@@ -107,8 +104,9 @@ void show_process_status(struct show *s)
 	show_separator(s);
 	/* XXX: don't sort for now */
 	show_comment(s, "  PID  Process");
-	for (unsigned i = 0; i < elemsof(pid_entry_slots); i++) {
-		const struct list_head *h = &pid_entry_slots[i];
+	finish_hash_table_resize(&pids_hash_table);
+	for (unsigned i = 0; i < pids_hash_table.nr_slots; i++) {
+		const struct list_head *h = &pids_hash_table.slots[i];
 		const struct pid_entry *e;
 		FOR_EACH_LIST_ENTRY_NEW2OLD(h, e) {
 			/*
@@ -304,3 +302,8 @@ void init_server_fork(void)
 {
 	init_hash_table(&pids_hash_table);
 }
+
+void free_server_fork(void)
+{
+	free_hash_table(&pids_hash_table);
+}
@@ -55,6 +55,7 @@ void server_fork_exec(const char *what, const char *path,
 
 void server_fork_sigchld_handler(struct logger *logger);
 void init_server_fork(void);
+void free_server_fork(void);
 void show_process_status(struct show *s);
 
 #endif /* _SERVER_H */
@@ -34,11 +34,13 @@
 #include "defs.h"
 #include "log.h"
 #include "state.h"
+#include "state_db.h"		/* for state_by_serialno() */
 #include "server.h"
 #include "pluto_shutdown.h"		/* for exiting_pluto */
 #include "server_pool.h"
 #include "list_entry.h"
 #include "pluto_timing.h"
+#include "crypt_dh.h"		/* for refill_dh_local_secret_pools() */
 
 #ifdef HAVE_SECCOMP
 # include "pluto_seccomp.h"
@@ -72,16 +74,41 @@ static resume_cb handle_helper_answer;
 typedef enum { JOB_ID_MIN = 1, JOB_ID_MAX = UINT_MAX, } job_id_t;
 typedef enum { HELPER_ID_MIN = 1, HELPER_ID_MAX = UINT_MAX, } helper_id_t;
 
+/*
+ * Jobs are run in priority order: work for an established IKE SA
+ * (rekeys, CHILD SAs) first, then work that was initiated locally
+ * (for instance by whack), and finally work for new peers.  During an
+ * IKE_SA_INIT flood this stops rekeys queueing behind (and expiring
+ * because of) thousands of unauthenticated DH computations.
+ */
+
+enum job_priority {
+	JOB_PRIORITY_ESTABLISHED,
+	JOB_PRIORITY_LOCAL,
+	JOB_PRIORITY_NEW_PEER,
+#define JOB_PRIORITY_ROOF (JOB_PRIORITY_NEW_PEER+1)
+};
+
+static const char *const job_priority_name[JOB_PRIORITY_ROOF] = {
+	[JOB_PRIORITY_ESTABLISHED] = "established",
+	[JOB_PRIORITY_LOCAL] = "local",
+	[JOB_PRIORITY_NEW_PEER] = "new-peer",
+};
+
 struct job {
 	struct task *task;
 	const struct task_handler *handler;
 	struct list_entry backlog;
+	enum job_priority priority;
 	so_serial_t so_serialno;		/* sponsoring state-object's serial number */
 	bool cancelled;
 	const char *name;
 	job_id_t job_id;
 	helper_id_t helper_id;
 	struct cpu_usage time_used;
+	threadtime_t time_submitted;
+	double seconds_waiting;		/* submitted -> started */
+	bool ran;
 
 	/* where to send messages */
 	struct logger *logger;
@@ -95,16 +122,81 @@ struct job {
 	    ##__VA_ARGS__)
 
 /*
- * The work queue.  Accesses must be locked.
+ * The work queues.
+ *
+ * Each helper has its own bounded queue of jobs, one per priority
+ * class.  Only the main
+ * thread adds jobs (at the tail); the owning helper, and any other
+ * helper looking for something to do (stealing), remove jobs from the
+ * head.  Since .head only ever increases, a compare-and-swap is
+ * enough to claim a job; no lock is needed.
+ *
+ * Should all the queues fill up, jobs overflow onto the backlog (again
+ * one per priority class).  Accesses to the backlog must be locked.
  */
 
+#define HELPER_QUEUE_SIZE 64	/* power of two */
+
+struct helper_queue {
+	uint64_t tail;		/* written by the main thread */
+	char tail_pad[64 - sizeof(uint64_t)];
+	uint64_t head;		/* claimed by helpers using CAS */
+	char head_pad[64 - sizeof(uint64_t)];
+	struct job *jobs[HELPER_QUEUE_SIZE];
+};
+
+/* IN THE MAIN THREAD */
+static bool push_helper_queue(struct helper_queue *q, struct job *job)
+{
+	uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail - head >= HELPER_QUEUE_SIZE) {
+		return false;
+	}
+	__atomic_store_n(&q->jobs[tail % HELPER_QUEUE_SIZE], job, __ATOMIC_RELAXED);
+	/* publish the job; see wake_helper() for why this is SEQ_CST */
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+/* IN A HELPER THREAD */
+static struct job *pop_helper_queue(struct helper_queue *q)
+{
+	uint64_t head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+	while (true) {
+		uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+		if (head == tail) {
+			return NULL;
+		}
+		/*
+		 * The slot can only be re-used once .head moves past
+		 * it, in which case the CAS below fails.
+		 */
+		struct job *job = __atomic_load_n(&q->jobs[head % HELPER_QUEUE_SIZE],
+						  __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&q->head, &head, head + 1,
+						/*weak*/false,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return job;
+		}
+		/* lost the race; HEAD has been reloaded */
+	}
+}
+
+static bool helper_queue_empty(struct helper_queue *q)
+{
+	return (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) ==
+		__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST));
+}
+
 static void jam_backlog(struct jambuf *buf, const void *data)
 {
 	if (data == NULL) {
 		jam(buf, "no job");
 	} else {
 		const struct job *job = data;
-		jam(buf, "job %ju", (uintmax_t)job->job_id);
+		jam(buf, "job %ju %s", (uintmax_t)job->job_id,
+		    job_priority_name[job->priority]);
 		if (job->so_serialno != SOS_NOBODY) {
 			jam(buf, " state #%lu", job->so_serialno);
 		}
@@ -129,36 +221,162 @@ static const struct list_info backlog_info = {
 };
 
 static pthread_mutex_t backlog_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t backlog_cond = PTHREAD_COND_INITIALIZER;
 
-struct list_head backlog = INIT_LIST_HEAD(&backlog, &backlog_info);
-static int backlog_queue_len = 0;
+struct list_head backlog[JOB_PRIORITY_ROOF] = {
+	[JOB_PRIORITY_ESTABLISHED] = INIT_LIST_HEAD(&backlog[JOB_PRIORITY_ESTABLISHED], &backlog_info),
+	[JOB_PRIORITY_LOCAL] = INIT_LIST_HEAD(&backlog[JOB_PRIORITY_LOCAL], &backlog_info),
+	[JOB_PRIORITY_NEW_PEER] = INIT_LIST_HEAD(&backlog[JOB_PRIORITY_NEW_PEER], &backlog_info),
+};
+/* peeked at without the lock */
+static unsigned backlog_queue_len[JOB_PRIORITY_ROOF];
 
-static void message_helpers(struct job *job)
-{
-	pthread_mutex_lock(&backlog_mutex);
-	if (job != NULL) {
-		insert_list_entry(&backlog, &job->backlog);
-		backlog_queue_len++;
-	}
-	/* wake up threads waiting for work */
-	pthread_cond_signal(&backlog_cond);
-	pthread_mutex_unlock(&backlog_mutex);
-}
+/*
+ * Number of jobs submitted but not yet picked up by a helper (or, when
+ * inline, not yet started); see server_helper_backlog().
+ */
+static unsigned nr_waiting_jobs = 0;
 
 /*
- * Note: this per-helper struct is never modified in a helper thread
+ * Note: apart from .queue, this per-helper struct is never modified
+ * in a helper thread
  */
 
 struct helper_thread {
 	helper_id_t helper_id;
 	pthread_t pid;
+	struct helper_queue queue[JOB_PRIORITY_ROOF];
 };
 
 /* may be NULL if we are to do all the work ourselves */
 static struct helper_thread *helper_threads = NULL;
 
 static int nr_helper_threads = 0;
+static int nr_helper_queues = 0;	/* not decremented as helpers exit */
+
+/*
+ * Waking up helpers.
+ *
+ * A helper with nothing to do is first "searching" (checking all the
+ * queues) and then "idle" (waiting on idle_cond).  The main thread
+ * only wakes an idle helper when no helper is searching, since a
+ * searching helper is guaranteed to see the new job.  A helper that
+ * finds a job while others are idle passes the wakeup on.  This way
+ * a burst of jobs costs the main thread a few signals, not one per
+ * job.
+ *
+ * All the counter and queue accesses are SEQ_CST so that either the
+ * main thread sees the helper idle (and wakes it), or the helper,
+ * after declaring itself idle, sees the job.
+ */
+
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static unsigned nr_idle_helpers = 0;
+static unsigned nr_searching_helpers = 0;
+
+static bool work_available(void)
+{
+	for (enum job_priority p = 0; p < JOB_PRIORITY_ROOF; p++) {
+		for (int n = 0; n < nr_helper_queues; n++) {
+			if (!helper_queue_empty(&helper_threads[n].queue[p])) {
+				return true;
+			}
+		}
+		if (__atomic_load_n(&backlog_queue_len[p], __ATOMIC_SEQ_CST) > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void wake_helper(void)
+{
+	if (__atomic_load_n(&nr_searching_helpers, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&nr_idle_helpers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&idle_mutex);
+		pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_mutex);
+	}
+}
+
+static void wake_all_helpers(void)
+{
+	pthread_mutex_lock(&idle_mutex);
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+/* IN THE MAIN THREAD */
+static void message_helpers(struct job *job)
+{
+	/*
+	 * Spread the jobs across the helper queues; should they all
+	 * be full, add the job to the backlog.
+	 */
+	static int next_queue = 0;
+	enum job_priority p = job->priority;
+	bool queued = false;
+	for (int i = 0; i < nr_helper_queues && !queued; i++) {
+		struct helper_queue *q = &helper_threads[next_queue].queue[p];
+		next_queue = (next_queue + 1) % nr_helper_queues;
+		queued = push_helper_queue(q, job);
+	}
+	if (!queued) {
+		pthread_mutex_lock(&backlog_mutex);
+		insert_list_entry(&backlog[p], &job->backlog);
+		__atomic_add_fetch(&backlog_queue_len[p], 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&backlog_mutex);
+	}
+	wake_helper();
+}
+
+/* IN A HELPER THREAD */
+static struct job *find_job_by_priority(const struct helper_thread *w,
+					enum job_priority p)
+{
+	/* first, this helper's own queue */
+	int self = w->helper_id - 1;
+	struct job *job = pop_helper_queue(&helper_threads[self].queue[p]);
+	if (job != NULL) {
+		return job;
+	}
+	/* then steal from the other queues */
+	for (int i = 1; i < nr_helper_queues; i++) {
+		int n = (self + i) % nr_helper_queues;
+		job = pop_helper_queue(&helper_threads[n].queue[p]);
+		if (job != NULL) {
+			return job;
+		}
+	}
+	/* finally, the overflow */
+	if (__atomic_load_n(&backlog_queue_len[p], __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&backlog_mutex);
+		FOR_EACH_LIST_ENTRY_OLD2NEW(&backlog[p], job) { break; }
+		if (job != NULL) {
+			remove_list_entry(&job->backlog);
+			__atomic_sub_fetch(&backlog_queue_len[p], 1, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&backlog_mutex);
+	}
+	return job;
+}
+
+static struct job *find_job(const struct helper_thread *w)
+{
+	for (enum job_priority p = 0; p < JOB_PRIORITY_ROOF; p++) {
+		struct job *job = find_job_by_priority(w, p);
+		if (job != NULL) {
+			__atomic_sub_fetch(&nr_waiting_jobs, 1, __ATOMIC_RELAXED);
+			return job;
+		}
+	}
+	return NULL;
+}
+
+unsigned server_helper_backlog(void)
+{
+	return __atomic_load_n(&nr_waiting_jobs, __ATOMIC_RELAXED);
+}
 
 /*
  * If there are any helper threads, this code is always executed IN A HELPER
@@ -175,6 +393,7 @@ static void do_job(struct job *job, helper_id_t helper_id)
 	}
 
 	logtime_t start = logtime_start(job->logger);
+	job->seconds_waiting = threadtime_sub(start.time, job->time_submitted).wall_seconds;
 
 	dbg_job(job, "helper %d starting job", helper_id);
 	if (helper_thread_delay > 0) {
@@ -190,6 +409,17 @@ static void do_job(struct job *job, helper_id_t helper_id)
 			     "helper %u processing job %u for state #%lu: %s (%s)",
 			     helper_id, job->job_id, job->so_serialno,
 			     job->name, job->handler->name);
+	job->ran = true;
+}
+
+/* IN THE MAIN THREAD */
+static void record_job_latency(const struct job *job)
+{
+	static struct latency wait_latency[JOB_PRIORITY_ROOF];
+	static struct latency run_latency;
+	record_latency(&wait_latency[job->priority], job->seconds_waiting,
+		       "helper.wait.%s", job_priority_name[job->priority]);
+	record_latency(&run_latency, job->time_used.wall_seconds, "helper.run");
 }
 
 /* IN A HELPER THREAD */
@@ -213,46 +443,57 @@ static void *helper_thread(void *arg)
 	    w->helper_id, status);
 #endif
 
+	__atomic_add_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
 	while (true) {
-		struct job *job = NULL;
-		pthread_mutex_lock(&backlog_mutex);
-		{
+		/*
+		 * Search the queues for something to do.  If needed
+		 * wait.
+		 *
+		 * No JOB implies pluto is exiting but not reverse -
+		 * could grab a JOB in parallel to pluto starting to
+		 * exit.
+		 */
+		struct job *job = (exiting_pluto ? NULL : find_job(w));
+		if (job == NULL && !exiting_pluto) {
 			/*
-			 * Search the backlog[] for something to do.
-			 * If needed wait.
+			 * Nothing queued; use the spare time to top
+			 * up the DH secret pools.  While doing that
+			 * this helper isn't searching, so a new job
+			 * will wake another helper.
 			 */
-			pexpect(job == NULL);
-			while (!exiting_pluto) {
-				/* grab the next entry, if there is one */
-				pexpect(job == NULL);
-				FOR_EACH_LIST_ENTRY_OLD2NEW(&backlog, job) { break; }
-				if (job != NULL) {
-					/*
-					 * Assign the entry to this
-					 * thread, removing it from
-					 * the backlog.
-					 */
-					remove_list_entry(&job->backlog);
-					job->helper_id = w->helper_id;
-					break;
-				}
+			__atomic_sub_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
+			bool refilled = refill_dh_local_secret_pools(logger);
+			__atomic_add_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
+			if (refilled) {
+				continue;
+			}
+		}
+		if (job == NULL) {
+			pthread_mutex_lock(&idle_mutex);
+			__atomic_add_fetch(&nr_idle_helpers, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
+			if (!exiting_pluto && !work_available()) {
 				dbg("helper thread %d has nothing to do",
 				    w->helper_id);
-				pthread_cond_wait(&backlog_cond, &backlog_mutex);
+				pthread_cond_wait(&idle_cond, &idle_mutex);
 			}
-			if (job == NULL) {
-				/*
-				 * No JOB implies pluto is exiting but
-				 * not reverse - could grab a JOB in
-				 * parallel to pluto starting to exit.
-				 */
-				pexpect(exiting_pluto);
+			__atomic_add_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&nr_idle_helpers, 1, __ATOMIC_SEQ_CST);
+			bool exiting = exiting_pluto;
+			pthread_mutex_unlock(&idle_mutex);
+			if (exiting) {
+				break;
 			}
+			continue;
 		}
-		pthread_mutex_unlock(&backlog_mutex);
-		if (job == NULL) {
-			/* per above, must be shutting down */
-			break;
+		/*
+		 * Assign the entry to this thread and, if this was
+		 * the last searching helper, pass on the wakeup.
+		 */
+		job->helper_id = w->helper_id;
+		if (__atomic_sub_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST) == 0 &&
+		    work_available()) {
+			wake_helper();
 		}
 		/* might be cancelled */
 		do_job(job, w->helper_id);
@@ -261,7 +502,9 @@ static void *helper_thread(void *arg)
 		schedule_resume("sending helper answer back to state",
 				job->so_serialno,
 				handle_helper_answer, job);
+		__atomic_add_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
 	}
+	__atomic_sub_fetch(&nr_searching_helpers, 1, __ATOMIC_SEQ_CST);
 	dbg("telling main thread that the helper thread %d is done", w->helper_id);
 	schedule_callback("helper stopped", SOS_NOBODY,
 			  helper_thread_stopped_callback, NULL);
@@ -282,6 +525,7 @@ static void inline_worker(struct state *unused_st UNUSED,
 			  void *arg)
 {
 	struct job *job = arg;
+	__atomic_sub_fetch(&nr_waiting_jobs, 1, __ATOMIC_RELAXED);
 	/* might be cancelled */
 	do_job(job, -1);
 	schedule_resume("inline worker sending helper answer",
@@ -325,6 +569,21 @@ static void inline_worker(struct state *unused_st UNUSED,
  *
  */
 
+static enum job_priority state_job_priority(struct state *st)
+{
+	/* a CHILD SA, or IKE SA rekey, is established when its parent is */
+	struct state *ike = (IS_CHILD_SA(st) ? state_by_serialno(st->st_clonedfrom) : st);
+	if (ike != NULL && IS_IKE_SA_ESTABLISHED(ike)) {
+		return JOB_PRIORITY_ESTABLISHED;
+	}
+	/* whack is attached, or we started it */
+	if (st->st_logger->object_whackfd != NULL ||
+	    st->st_sa_role == SA_INITIATOR) {
+		return JOB_PRIORITY_LOCAL;
+	}
+	return JOB_PRIORITY_NEW_PEER;
+}
+
 void submit_task(const struct logger *logger,
 		 struct state *st,
 		 struct task *task,
@@ -352,6 +611,8 @@ void submit_task(const struct logger *logger,
 
 	job->handler = handler;
 	job->task = task;
+	job->priority = state_job_priority(st);
+	job->time_submitted = threadtime_start();
 
 	/*
 	 * Save in case it needs to be cancelled.
@@ -361,7 +622,8 @@ void submit_task(const struct logger *logger,
 	st->st_offloaded_task = job;
 	st->st_v1_offloaded_task_in_background = false;
 	job->logger = clone_logger(logger, HERE);
-	dbg_job(job, "adding job to queue");
+	dbg_job(job, "adding %s job to queue", job_priority_name[job->priority]);
+	__atomic_add_fetch(&nr_waiting_jobs, 1, __ATOMIC_RELAXED);
 
 	/*
 	 * do it all ourselves?
@@ -383,7 +645,7 @@ void submit_task(const struct logger *logger,
 		delete_event(st);
 		clear_retransmits(st);
 		event_schedule(EVENT_CRYPTO_TIMEOUT, EVENT_CRYPTO_TIMEOUT_DELAY, st);
-		/* add to backlog */
+		/* add to a helper queue */
 		message_helpers(job);
 	}
 }
@@ -415,6 +677,9 @@ static stf_status handle_helper_answer(struct state *st,
 
 	struct job *job = arg;
 	dbg_job(job, "processing response from helper %d", job->helper_id);
+	if (job->ran) {
+		record_job_latency(job);
+	}
 
 	const struct task_handler *h = job->handler;
 	passert(h != NULL);
@@ -529,6 +794,7 @@ void start_server_helpers(int nhelpers, struct logger *logger)
 		 */
 		helper_threads = alloc_things(struct helper_thread, nhelpers,
 					      "pluto helpers");
+		nr_helper_queues = nhelpers;
 		for (int n = 0; n < nhelpers; n++) {
 			struct helper_thread *w = &helper_threads[n];
 			w->helper_id = n + 1; /* i.e., not 0 */
@@ -565,7 +831,7 @@ static void helper_thread_stopped_callback(struct state *st UNUSED, void *contex
 	/* wait for more? */
 	if (nr_helper_threads > 0) {
 		/* poke threads waiting for work */
-		message_helpers(NULL);
+		wake_all_helpers();
 		return;
 	}
 
@@ -574,6 +840,7 @@ static void helper_thread_stopped_callback(struct state *st UNUSED, void *contex
 	 * its allocated data.
 	 */
 	pfreeany(helper_threads);
+	nr_helper_queues = 0;
 	schedule_callback("all helper threads stopped", SOS_NOBODY,
 			  server_helpers_stopped_callback, NULL);
 }
@@ -582,7 +849,7 @@ void stop_server_helpers(void)
 {
 	if (nr_helper_threads > 0) {
 		/* poke threads waiting for work */
-		message_helpers(NULL);
+		wake_all_helpers();
 	} else {
 		dbg("no helper threads to shutdown");
 		pexpect(helper_threads == NULL);
@@ -66,6 +66,12 @@ extern void submit_task(const struct logger *logger,
 			const struct task_handler *handler,
 			const char *name);
 
+/*
+ * Number of submitted jobs waiting for a helper; see
+ * require_ddos_cookies().
+ */
+unsigned server_helper_backlog(void);
+
 extern void start_server_helpers(int nhelpers, struct logger *logger);
 void stop_server_helpers(void);
 void server_helpers_stopped_callback(struct state *st, void *context); /* see pluto_shutdown.c */
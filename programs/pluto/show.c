@@ -42,6 +42,15 @@
 #include "kernel_xfrm_interface.h"
 #include "iface.h"
 #include "show.h"
+#include "state_db.h"		/* for show_state_db_stats() */
+#include "connection_db.h"	/* for show_connection_db_stats() */
+#include "host_pair.h"		/* for show_host_pair_stats() */
+#include "ipsec_spi.h"		/* for show_ipsec_spi_stats() */
+#include "acquire_queue.h"	/* for show_acquire_queue() */
+#include "rekey_schedule.h"	/* for show_rekey_schedule() */
+#include "updown_helper.h"	/* for show_updown_helper() */
+#include "crypt_dh.h"		/* for show_dh_local_secret_pools() */
+#include "ike_rate_limit.h"	/* for show_ike_rate_limit() */
 #ifdef HAVE_SECCOMP
 #include "pluto_seccomp.h"
 #endif
@@ -192,6 +201,16 @@ void show_global_status(struct show *s)
 {
 	show_globalstate_status(s);
 	show_pluto_stats(s);
+	show_state_db_stats(s);
+	show_connection_db_stats(s);
+	show_host_pair_stats(s);
+	show_ipsec_spi_stats(s);
+	show_acquire_queue(s);
+	show_rekey_schedule(s);
+	show_updown_helper(s);
+	show_log_queue(s);
+	show_dh_local_secret_pools(s);
+	show_ike_rate_limit(s);
 }
 
 void show_status(struct show *s)
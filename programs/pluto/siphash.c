@@ -0,0 +1,114 @@
+/* SipHash keyed MAC, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include <string.h>		/* for memcpy() */
+
+#include "siphash.h"
+#include "passert.h"
+
+#define ROTL64(X, B) (((X) << (B)) | ((X) >> (64 - (B))))
+
+static inline void sipround(struct siphash *sip)
+{
+	sip->v0 += sip->v1; sip->v1 = ROTL64(sip->v1, 13); sip->v1 ^= sip->v0; sip->v0 = ROTL64(sip->v0, 32);
+	sip->v2 += sip->v3; sip->v3 = ROTL64(sip->v3, 16); sip->v3 ^= sip->v2;
+	sip->v0 += sip->v3; sip->v3 = ROTL64(sip->v3, 21); sip->v3 ^= sip->v0;
+	sip->v2 += sip->v1; sip->v1 = ROTL64(sip->v1, 17); sip->v1 ^= sip->v2; sip->v2 = ROTL64(sip->v2, 32);
+}
+
+static void compress(struct siphash *sip, uint64_t m)
+{
+	sip->v3 ^= m;
+	for (unsigned r = 0; r < sip->rounds.c; r++) {
+		sipround(sip);
+	}
+	sip->v0 ^= m;
+}
+
+static uint64_t finalize(struct siphash *sip)
+{
+	for (unsigned r = 0; r < sip->rounds.d; r++) {
+		sipround(sip);
+	}
+	return sip->v0 ^ sip->v1 ^ sip->v2 ^ sip->v3;
+}
+
+/* little endian, as the reference implementation */
+static void store_le64(uint8_t *out, uint64_t v)
+{
+	for (unsigned i = 0; i < 8; i++) {
+		out[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+void siphash_init(struct siphash *sip, const struct siphash_key *key,
+		  struct siphash_rounds rounds, unsigned outlen)
+{
+	passert(outlen == SIPHASH_64_SIZE || outlen == SIPHASH_128_SIZE);
+	passert(rounds.c > 0 && rounds.d > 0);
+	*sip = (struct siphash) {
+		.v0 = key->k0 ^ UINT64_C(0x736f6d6570736575),
+		.v1 = key->k1 ^ UINT64_C(0x646f72616e646f6d),
+		.v2 = key->k0 ^ UINT64_C(0x6c7967656e657261),
+		.v3 = key->k1 ^ UINT64_C(0x7465646279746573),
+		.outlen = outlen,
+		.rounds = rounds,
+	};
+	if (outlen == SIPHASH_128_SIZE) {
+		sip->v1 ^= 0xee;
+	}
+}
+
+void siphash_update(struct siphash *sip, const void *ptr, size_t len)
+{
+	const uint8_t *bytes = ptr;
+	/* top up a partial word left by the previous call */
+	while (len > 0 && sip->len % 8 != 0) {
+		sip->tail |= (uint64_t)*bytes++ << (8 * (sip->len % 8));
+		sip->len++;
+		len--;
+		if (sip->len % 8 == 0) {
+			compress(sip, sip->tail);
+			sip->tail = 0;
+		}
+	}
+	while (len >= 8) {
+		uint64_t m = 0;
+		for (unsigned i = 0; i < 8; i++) {
+			m |= (uint64_t)bytes[i] << (8 * i);
+		}
+		compress(sip, m);
+		bytes += 8;
+		sip->len += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		sip->tail |= (uint64_t)*bytes++ << (8 * (sip->len % 8));
+		sip->len++;
+		len--;
+	}
+}
+
+void siphash_final(struct siphash *sip, uint8_t *out)
+{
+	compress(sip, sip->tail | ((uint64_t)sip->len << 56));
+	sip->v2 ^= (sip->outlen == SIPHASH_128_SIZE ? 0xee : 0xff);
+	store_le64(out, finalize(sip));
+	if (sip->outlen == SIPHASH_128_SIZE) {
+		sip->v1 ^= 0xdd;
+		store_le64(out + 8, finalize(sip));
+	}
+	/* don't leave key material lying around */
+	*sip = (struct siphash) {0};
+}
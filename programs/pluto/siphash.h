@@ -0,0 +1,72 @@
+/* SipHash keyed MAC, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stdint.h>
+#include <stddef.h>		/* for size_t */
+
+/*
+ * SipHash-c-d (https://131002.net/siphash/) with either the 64-bit
+ * or the 128-bit output; C and D are the number of compression and
+ * finalization rounds.
+ *
+ * SipHash-2-4 (SIPHASH_2_4) is used where a stateless value derived
+ * from a local secret is needed for every unauthenticated packet
+ * (responder SPI, COOKIE): it is a PRF so the output can't be
+ * predicted without the key, yet it costs little more than a
+ * memcpy() and needs no NSS context.
+ *
+ * hash_table_hasher() is only concerned with bucket spread so uses
+ * the cheaper SipHash-1-3 (SIPHASH_1_3).
+ */
+
+struct siphash_key {
+	uint64_t k0;
+	uint64_t k1;
+};
+
+struct siphash_rounds {
+	unsigned c;		/* per 8 bytes of input */
+	unsigned d;		/* per 8 bytes of output */
+};
+
+#define SIPHASH_1_3 ((struct siphash_rounds) { .c = 1, .d = 3, })
+#define SIPHASH_2_4 ((struct siphash_rounds) { .c = 2, .d = 4, })
+
+struct siphash {
+	uint64_t v0, v1, v2, v3;
+	uint64_t tail;		/* 0..7 unconsumed bytes */
+	size_t len;		/* total bytes fed in */
+	unsigned outlen;	/* 8 or 16 */
+	struct siphash_rounds rounds;
+};
+
+#define SIPHASH_64_SIZE 8
+#define SIPHASH_128_SIZE 16
+
+void siphash_init(struct siphash *sip, const struct siphash_key *key,
+		  struct siphash_rounds rounds, unsigned outlen);
+void siphash_update(struct siphash *sip, const void *ptr, size_t len);
+void siphash_final(struct siphash *sip, uint8_t *out);
+
+#define siphash_update_thing(SIP, THING) siphash_update(SIP, &(THING), sizeof(THING))
+#define siphash_update_hunk(SIP, HUNK)					\
+	{								\
+		typeof(HUNK) hunk_ = HUNK; /* evaluate once */		\
+		siphash_update(SIP, hunk_.ptr, hunk_.len);		\
+	}
+
+#endif
@@ -38,6 +38,7 @@
 #include "connections.h"	/* needs id.h */
 #include "state.h"
 #include "state_db.h"
+#include "connection_db.h"
 #include "ikev1_msgid.h"
 #include "log.h"
 #include "rnd.h"
@@ -61,6 +62,7 @@
 #include "ikev1.h"		/* for send_v1_delete() */
 #include "ikev2_delete.h"	/* for record_v2_delete() */
 #include "orient.h"
+#include "server_pool.h"	/* for server_helper_backlog() */
 
 bool uniqueIDs = FALSE;
 
@@ -1225,10 +1227,14 @@ bool shared_phase1_connection(const struct connection *c)
 	if (serial_us == SOS_NOBODY)
 		return FALSE;
 
-	dbg("FOR_EACH_STATE_... in %s", __func__);
+	struct state *parent = state_by_serialno(serial_us);
+	if (parent == NULL) {
+		return FALSE;
+	}
+
 	struct state *st = NULL;
-	FOR_EACH_STATE_NEW2OLD(st) {
-		if (st->st_connection != c && st->st_clonedfrom == serial_us)
+	FOR_EACH_CHILD_STATE_NEW2OLD(parent, st) {
+		if (st->st_connection != c)
 			return TRUE;
 	}
 
@@ -1407,8 +1413,35 @@ void delete_states_by_connection(struct connection *c, bool relations, struct fd
 }
 
 /*
- * Walk through the state table, and delete each state whose phase 1 (IKE)
- * peer is among those given.
+ * Collect the serial numbers of all the states belonging to a peer.
+ *
+ * Since replacing a state adds states to the state DB, the states
+ * can't be replaced while the remote address table is being walked.
+ */
+
+struct peer_states {
+	so_serial_t *serialnos;
+	unsigned nr;
+};
+
+static bool collect_peer_state(struct state *st, void *context)
+{
+	struct peer_states *peer_states = context;
+	realloc_things(peer_states->serialnos, peer_states->nr,
+		       peer_states->nr + 1, "peer states");
+	peer_states->serialnos[peer_states->nr++] = st->st_serialno;
+	return false; /* keep looking */
+}
+
+static int serialno_compare_new2old(const void *l, const void *r)
+{
+	so_serial_t lso = *(const so_serial_t *)l;
+	so_serial_t rso = *(const so_serial_t *)r;
+	return (lso < rso) - (lso > rso);
+}
+
+/*
+ * Delete each state whose phase 1 (IKE) peer is among those given.
  * This function is only called for ipsec whack --crash peer
  */
 void delete_states_by_peer(const struct fd *whackfd, const ip_address *peer)
@@ -1420,28 +1453,31 @@ void delete_states_by_peer(const struct fd *whackfd, const ip_address *peer)
 
 	/* first restart the phase1s */
 	for (int ph1 = 0; ph1 < 2; ph1++) {
-		struct state *this;
-		dbg("FOR_EACH_STATE_... in %s", __func__);
-		FOR_EACH_STATE_NEW2OLD(this) {
+		struct peer_states peer_states = { .nr = 0, };
+		state_by_remote_address(peer, collect_peer_state, &peer_states, __func__);
+		if (peer_states.nr == 0) {
+			continue;
+		}
+		qsort(peer_states.serialnos, peer_states.nr,
+		      sizeof(peer_states.serialnos[0]), serialno_compare_new2old);
+		for (unsigned i = 0; i < peer_states.nr; i++) {
+			/* an earlier replace may have deleted it */
+			struct state *this = state_by_serialno(peer_states.serialnos[i]);
+			if (this == NULL) {
+				continue;
+			}
 			const struct connection *c = this->st_connection;
-			endpoint_buf b;
-			dbg("comparing %s to %s",
-			    str_endpoint(&this->st_remote_endpoint, &b),
-			    peerstr);
-
-			if (peer != NULL /* ever false? */ &&
-			    endpoint_address_eq_address(this->st_remote_endpoint, *peer)) {
-				if (ph1 == 0 && IS_IKE_SA(this)) {
-					whack_log(RC_COMMENT, whackfd,
-						  "peer %s for connection %s crashed; replacing",
-						  peerstr,
-						  c->name);
-					ipsecdoi_replace(this, 1);
-				} else {
-					event_force(EVENT_SA_REPLACE, this);
-				}
+			if (ph1 == 0 && IS_IKE_SA(this)) {
+				whack_log(RC_COMMENT, whackfd,
+					  "peer %s for connection %s crashed; replacing",
+					  peerstr,
+					  c->name);
+				ipsecdoi_replace(this, 1);
+			} else {
+				event_force(EVENT_SA_REPLACE, this);
 			}
 		}
+		pfree(peer_states.serialnos);
 	}
 }
 
@@ -1484,6 +1520,7 @@ static struct state *duplicate_state(struct connection *c,
 	nst->quirks = st->quirks;
 	nst->hidden_variables = st->hidden_variables;
 	nst->st_remote_endpoint = st->st_remote_endpoint;
+	rehash_state_remote_address(nst);
 	pexpect_st_local_endpoint(st);
 	endpoint_buf eb;
 	dbg("#%lu setting local endpoint to %s from #%ld.st_localport "PRI_WHERE,
@@ -1493,6 +1530,7 @@ static struct state *duplicate_state(struct connection *c,
 	nst->st_interface = st->st_interface;
 	pexpect_st_local_endpoint(nst);
 	nst->st_clonedfrom = st->st_serialno;
+	rehash_state_clonedfrom(nst);
 	passert(nst->st_ike_version == st->st_ike_version);
 	nst->st_ikev2_anon = st->st_ikev2_anon;
 	nst->st_seen_fragmentation_supported = st->st_seen_fragmentation_supported;
@@ -1667,61 +1705,25 @@ struct ike_sa *find_v2_ike_sa_by_initiator_spi(const ike_spi_t *ike_initiator_sp
  * AH packets.
  */
 
-struct v2_spi_filter {
-	uint8_t protoid;
-	ipsec_spi_t outbound_spi;
-};
-
-static bool v2_spi_predicate(struct state *st, void *context)
+static bool v2_child_of_ike_predicate(struct state *st, void *context)
 {
-	struct v2_spi_filter *filter = context;
-
-	struct ipsec_proto_info *pr;
-	switch (filter->protoid) {
-	case PROTO_IPSEC_AH:
-		pr = &st->st_ah;
-		break;
-	case PROTO_IPSEC_ESP:
-		pr = &st->st_esp;
-		break;
-	default:
-		bad_case(filter->protoid);
-	}
-
-	if (pr->present) {
-		if (pr->attrs.spi == filter->outbound_spi) {
-			dbg("v2 CHILD SA #%lu found using their inbound (our outbound) SPI, in %s",
-			    st->st_serialno,
-			    st->st_state->name);
-			return true;
-		}
-#if 0
-		/* see function description above */
-		if (pr->our_spi == filter->outbound_spi) {
-			dbg("v2 CHILD SA #%lu found using our inbound (their outbound) !?! SPI, in %s",
-			    st->st_serialno,
-			    st->st_state->name);
-			return true;
-		}
-#endif
-	}
-	return false;
+	const struct ike_sa *ike = context;
+	return (st->st_ike_version == IKEv2 &&
+		st->st_clonedfrom == ike->sa.st_serialno);
 }
 
 struct child_sa *find_v2_child_sa_by_outbound_spi(struct ike_sa *ike,
 						  uint8_t protoid,
 						  ipsec_spi_t outbound_spi)
 {
-	struct v2_spi_filter filter = {
-		.protoid = protoid,
-		.outbound_spi = outbound_spi,
-	};
-	struct state *st = state_by_ike_spis(IKEv2,
-					     &ike->sa.st_serialno,
-					     NULL /* ignore v1 msgid */,
-					     NULL /* ignore-role */,
-					     &ike->sa.st_ike_spis,
-					     v2_spi_predicate, &filter, __func__);
+	/*
+	 * Only the outbound SPI is checked; see the comments in
+	 * find_phase2_state_to_delete() for why an IKEv1 peer might
+	 * send our inbound SPI.
+	 */
+	struct state *st = state_by_outbound_spi(protoid, outbound_spi,
+						 v2_child_of_ike_predicate, ike,
+						 __func__);
 	return pexpect_child_sa(st);
 }
 
@@ -1767,42 +1769,41 @@ struct state *find_v1_info_state(const ike_spis_t *ike_spis, msgid_t msgid)
  * Certain CISCO implementations send our side's SPI instead.
  * We'll accept this, but mark it as bogus.
  */
+struct phase2_to_delete_filter {
+	const struct connection *p1c;
+};
+
+static bool phase2_to_delete_predicate(struct state *st, void *context)
+{
+	const struct phase2_to_delete_filter *filter = context;
+	const struct connection *c = st->st_connection;
+	return (IS_IPSEC_SA_ESTABLISHED(st) &&
+		filter->p1c->host_pair == c->host_pair &&
+		same_peer_ids(filter->p1c, c, NULL));
+}
+
 struct state *find_phase2_state_to_delete(const struct state *p1st,
 					  uint8_t protoid,
 					  ipsec_spi_t spi,
 					  bool *bogus)
 {
-	const struct connection *p1c = p1st->st_connection;
-	struct state  *bogusst = NULL;
-
-	*bogus = FALSE;
-	dbg("FOR_EACH_STATE_... in %s", __func__);
-	struct state *st;
-	FOR_EACH_STATE_NEW2OLD(st) {
-		const struct connection *c = st->st_connection;
-		if (IS_IPSEC_SA_ESTABLISHED(st) &&
-		    p1c->host_pair == c->host_pair &&
-		    same_peer_ids(p1c, c, NULL))
-		{
-			struct ipsec_proto_info *pr =
-				protoid == PROTO_IPSEC_AH ?
-					&st->st_ah : &st->st_esp;
-
-			if (pr->present) {
-				if (pr->attrs.spi == spi) {
-					*bogus = FALSE;
-					return st;
-				}
+	struct phase2_to_delete_filter filter = {
+		.p1c = p1st->st_connection,
+	};
 
-				if (pr->our_spi == spi) {
-					*bogus = TRUE;
-					bogusst = st;
-					/* don't return! */
-				}
-			}
-		}
+	struct state *st = state_by_outbound_spi(protoid, spi,
+						 phase2_to_delete_predicate,
+						 &filter, __func__);
+	if (st != NULL) {
+		*bogus = false;
+		return st;
 	}
-	return bogusst;
+
+	st = state_by_inbound_spi(protoid, spi,
+				  phase2_to_delete_predicate,
+				  &filter, __func__);
+	*bogus = (st != NULL);
+	return st;
 }
 
 bool find_pending_phase2(const so_serial_t psn,
@@ -1813,12 +1814,15 @@ bool find_pending_phase2(const so_serial_t psn,
 
 	passert(psn >= SOS_FIRST);
 
-	dbg("FOR_EACH_STATE_... in %s", __func__);
+	struct state *parent = state_by_serialno(psn);
+	if (parent == NULL) {
+		return false;
+	}
+
 	struct state *st = NULL;
-	FOR_EACH_STATE_NEW2OLD(st) {
+	FOR_EACH_CHILD_STATE_NEW2OLD(parent, st) {
 		if (LHAS(ok_states, st->st_state->kind) &&
 		    IS_CHILD_SA(st) &&
-		    st->st_clonedfrom == psn &&
 		    streq(st->st_connection->name, c->name)) /* not instances */
 		{
 			n++;
@@ -2333,6 +2337,7 @@ static int show_newest_state_traffic(struct connection *c,
 
 void show_traffic_status(struct show *s, const char *name)
 {
+	begin_sa_info_walk(show_logger(s));
 	if (name == NULL) {
 		struct state **array = sort_states(state_compare_serial,
 						   __func__);
@@ -2370,6 +2375,7 @@ void show_traffic_status(struct show *s, const char *name)
 			}
 		}
 	}
+	end_sa_info_walk();
 }
 
 void show_brief_status(struct show *s)
@@ -2399,6 +2405,8 @@ void show_states(struct show *s)
 
 	if (array != NULL) {
 		monotime_t n = mononow();
+		/* fmt_state() calls get_sa_info() */
+		begin_sa_info_walk(show_logger(s));
 		/* now print sorted results */
 		int i;
 		for (i = 0; array[i] != NULL; i++) {
@@ -2417,56 +2425,64 @@ void show_states(struct show *s)
 				show_pending_phase2(s, st->st_connection,
 						    pexpect_ike_sa(st));
 		}
+		end_sa_info_walk();
 		pfree(array);
 	}
 }
 
 /*
- * Given that we've used up a range of unused CPI's,
- * search for a new range of currently unused ones.
- * Note: this is very expensive when not trivial!
- * If we can't find one easily, choose 0 (a bad SPI,
- * no matter what order) indicating failure.
+ * List everything tied to one peer: the connections with that remote
+ * host address, and the states with that remote endpoint address.
+ * Both are found using the remote address hash tables.
  */
-void find_my_cpi_gap(cpi_t *latest_cpi, cpi_t *first_busy_cpi)
+
+struct show_peer_connections {
+	struct show *s;
+	unsigned nr;
+};
+
+static bool show_peer_connection(struct connection *c, void *context)
 {
-	int tries = 0;
-	cpi_t base = *latest_cpi;
-	cpi_t closest;
+	struct show_peer_connections *spc = context;
+	connection_buf cb;
+	show_comment(spc->s, PRI_CONNECTION": %s; %s",
+		     pri_connection(c, &cb),
+		     enum_name(&connection_kind_names, c->kind),
+		     enum_name(&routing_story, c->spd.routing));
+	spc->nr++;
+	return false; /* keep looking */
+}
 
-startover:
-	closest = ~0;   /* not close at all */
-	dbg("FOR_EACH_STATE_... in %s", __func__);
-	struct state *st;
-	FOR_EACH_STATE_NEW2OLD(st) {
-		if (st->st_ipcomp.present) {
-			cpi_t c = ntohl(st->st_ipcomp.our_spi) - base;
+void show_peer_status(struct show *s, const ip_address *peer)
+{
+	address_buf pb;
+	show_separator(s);
+	show_comment(s, "Peer %s:", str_address(peer, &pb));
 
-			if (c < closest) {
-				if (c == 0) {
-					/*
-					 * oops: next spot is
-					 * occupied; start over
-					 */
-					if (++tries == 20) {
-						/* FAILURE */
-						*latest_cpi = 0;
-						*first_busy_cpi = 0;
-						return;
-					}
-					base++;
-					if (base > IPCOMP_LAST_NEGOTIATED)
-						base = IPCOMP_FIRST_NEGOTIATED;
-
-					/* really a tail call */
-					goto startover;
-				}
-				closest = c;
-			}
+	struct show_peer_connections spc = { .s = s, .nr = 0, };
+	connection_by_remote_address(peer, show_peer_connection, &spc, __func__);
+
+	struct peer_states peer_states = { .nr = 0, };
+	state_by_remote_address(peer, collect_peer_state, &peer_states, __func__);
+	if (peer_states.nr > 0) {
+		qsort(peer_states.serialnos, peer_states.nr,
+		      sizeof(peer_states.serialnos[0]), serialno_compare_new2old);
+		monotime_t n = mononow();
+		for (unsigned i = 0; i < peer_states.nr; i++) {
+			struct state *st = state_by_serialno(peer_states.serialnos[i]);
+			char state_buf[LOG_WIDTH];
+			char state_buf2[LOG_WIDTH];
+			fmt_state(st, n, state_buf, sizeof(state_buf),
+				  state_buf2, sizeof(state_buf2));
+			show_comment(s, "%s", state_buf);
+			if (state_buf2[0] != '\0')
+				show_comment(s, "%s", state_buf2);
 		}
+		pfree(peer_states.serialnos);
 	}
-	*latest_cpi = base;	/* base is first in next free range */
-	*first_busy_cpi = closest + base;	/* and this is the roof */
+
+	show_comment(s, "Total for peer %s: connections %u, states %u",
+		     str_address(peer, &pb), spc.nr, peer_states.nr);
 }
 
 /*
@@ -2537,6 +2553,7 @@ void update_ike_endpoints(struct ike_sa *ike,
 {
 	/* caller must ensure we are not behind NAT */
 	ike->sa.st_remote_endpoint = md->sender;
+	rehash_state_remote_address(&ike->sa);
 	endpoint_buf eb1, eb2;
 	dbg("#%lu updating local interface from %s to %s using md->iface "PRI_WHERE,
 	    ike->sa.st_serialno,
@@ -2648,9 +2665,12 @@ bool update_mobike_endpoints(struct ike_sa *ike, const struct msg_digest *md)
 		dbg("%s() %s.host_port: %u->%u", __func__, c->spd.that.leftright,
 		    c->spd.that.host_port, endpoint_hport(md->sender));
 		c->spd.that.host_port = endpoint_hport(md->sender);
+		rehash_connection_remote_address(c);
 
 		/* for the consistency, correct output in ipsec status */
 		child->sa.st_remote_endpoint = ike->sa.st_remote_endpoint = md->sender;
+		rehash_state_remote_address(&child->sa);
+		rehash_state_remote_address(&ike->sa);
 		child->sa.st_interface = ike->sa.st_interface = md->iface;
 		break;
 	default:
@@ -2697,37 +2717,6 @@ bool dpd_active_locally(const struct state *st)
  * Find all CHILD SAs belonging to FROM and migrate them to TO.
  */
 
-struct v2_migrate_filter {
-	struct ike_sa *from;
-	struct child_sa *to;
-};
-
-static bool v2_migrate_predicate(struct state *st, void *context)
-{
-	struct v2_migrate_filter *filter = context;
-	passert(st->st_serialno != filter->to->sa.st_serialno);
-	/*
-	 * Migrate the CHILD SA.
-	 *
-	 * Just the IKE_SPIrehash the SPIs without moving entry.
-	 *
-	 * XXX: this should also wipe message counters but first need
-	 * evidence.
-	 */
-	dbg("#%lu migrated from IKE SA #%lu to IKE SA #%lu",
-	    st->st_serialno, filter->from->sa.st_serialno,
-	    filter->to->sa.st_serialno);
-	st->st_clonedfrom = filter->to->sa.st_serialno;
-	st->st_ike_spis = filter->to->sa.st_ike_spis;
-	/*
-	 * Delete the old IKE_SPI hash entries (both for I and I+R
-	 * and), and then inserts new ones using ST's current IKE SPI
-	 * values.  The serialno tables are not touched.
-	 */
-	rehash_state_cookies_in_db(st);
-	return false; /* keep going */
-}
-
 void v2_migrate_children(struct ike_sa *from, struct child_sa *to)
 {
 	/*
@@ -2743,64 +2732,62 @@ void v2_migrate_children(struct ike_sa *from, struct child_sa *to)
 	/* passert(SPIs should be different) */
 
 	/*
-	 * Use ..._NEW2OLD() to iterate over the slot.  Since this
-	 * macro maintains a "cursor" that is one ahead of ST it is
-	 * safe for rehash_state_cookies_in_db(st) to delete the old
-	 * hash entries.  Similarly, since the table is walked
-	 * NEW2OLD, insert will happen at the front of the table
-	 * which, the cursor is past (this odds of this are very low).
-	 */
-	struct v2_migrate_filter filter = {
-		.from = from,
-		.to = to,
-	};
-	state_by_ike_spis(IKEv2,
-			  &from->sa.st_serialno,
-			  NULL /*ignore v1 msgid */,
-			  NULL /*ignore-sa-role */,
-			  &from->sa.st_ike_spis,
-			  v2_migrate_predicate, &filter, __func__);
-}
-
-static bool delete_ike_family_child(struct state *st, void *unused_context UNUSED)
-{
-	struct ike_sa *ike = ike_sa(st, HERE);
-	/*
-	 * Transfer the IKE SA's whack-fd to the child so that the
-	 * child can also log its demise; better abstraction?
+	 * Use ..._NEW2OLD() to iterate over FROM's children.  Since
+	 * this macro maintains a "cursor" that is one ahead of ST it
+	 * is safe for rehash_state_clonedfrom(st) to move ST onto
+	 * TO's list.
 	 */
-	if (ike != NULL &&
-	    &ike->sa != st &&
-	    fd_p(ike->sa.st_logger->global_whackfd)) {
-		close_any(&st->st_logger->global_whackfd);
-		st->st_logger->global_whackfd = dup_any(ike->sa.st_logger->global_whackfd);
-	}
-	switch (st->st_ike_version) {
-	case IKEv1:
-		break;
-	case IKEv2:
-		st->st_dont_send_delete = true;
-		break;
+	struct state *st;
+	FOR_EACH_CHILD_STATE_NEW2OLD(&from->sa, st) {
+		passert(st->st_serialno != to->sa.st_serialno);
+		/*
+		 * Migrate the CHILD SA.
+		 *
+		 * XXX: this should also wipe message counters but
+		 * first need evidence.
+		 */
+		dbg("#%lu migrated from IKE SA #%lu to IKE SA #%lu",
+		    st->st_serialno, from->sa.st_serialno,
+		    to->sa.st_serialno);
+		st->st_clonedfrom = to->sa.st_serialno;
+		rehash_state_clonedfrom(st);
+		st->st_ike_spis = to->sa.st_ike_spis;
+		/*
+		 * Delete the old IKE_SPI hash entries (both for I and
+		 * I+R and), and then inserts new ones using ST's
+		 * current IKE SPI values.  The serialno tables are not
+		 * touched.
+		 */
+		rehash_state_cookies_in_db(st);
 	}
-	delete_other_state(&ike->sa, st/*other*/);
-	return false; /* keep going */
 }
 
 void delete_ike_family(struct ike_sa *ike, enum send_delete send_delete)
 {
 	/*
-	 * We are a parent: delete our children and
-	 * then prepare to delete ourself.
-	 * Our children will be on the same hash chain
-	 * because we share IKE SPIs.
+	 * We are a parent: delete our children and then prepare to
+	 * delete ourself.
 	 */
-	state_by_ike_spis(ike->sa.st_ike_version,
-			  &ike->sa.st_serialno,
-			  NULL /*ignore v1 msgid */,
-			  NULL /*ignore-sa-role */,
-			  &ike->sa.st_ike_spis,
-			  delete_ike_family_child, NULL,
-			  __func__);
+	struct state *st;
+	FOR_EACH_CHILD_STATE_NEW2OLD(&ike->sa, st) {
+		/*
+		 * Transfer the IKE SA's whack-fd to the child so that
+		 * the child can also log its demise; better
+		 * abstraction?
+		 */
+		if (fd_p(ike->sa.st_logger->global_whackfd)) {
+			close_any(&st->st_logger->global_whackfd);
+			st->st_logger->global_whackfd = dup_any(ike->sa.st_logger->global_whackfd);
+		}
+		switch (st->st_ike_version) {
+		case IKEv1:
+			break;
+		case IKEv2:
+			st->st_dont_send_delete = true;
+			break;
+		}
+		delete_other_state(&ike->sa, st/*other*/);
+	}
 	/* delete self */
 	switch (send_delete) {
 	case DONT_SEND_DELETE:
@@ -2906,7 +2893,8 @@ bool require_ddos_cookies(void)
 {
 	return pluto_ddos_mode == DDOS_FORCE_BUSY ||
 		(pluto_ddos_mode == DDOS_AUTO &&
-		 cat_count[CAT_HALF_OPEN_IKE_SA] >= pluto_ddos_threshold);
+		 (cat_count[CAT_HALF_OPEN_IKE_SA] >= pluto_ddos_threshold ||
+		  server_helper_backlog() >= pluto_ddos_helper_threshold));
 }
 
 bool drop_new_exchanges(void)
@@ -2920,6 +2908,10 @@ void show_globalstate_status(struct show *s)
 
 	show_raw(s, "config.setup.ike.ddos_threshold=%u", pluto_ddos_threshold);
 	show_raw(s, "config.setup.ike.max_halfopen=%u", pluto_max_halfopen);
+	show_raw(s, "config.setup.ike.ddos_helper_threshold=%u", pluto_ddos_helper_threshold);
+	show_raw(s, "config.setup.ike.socket_recv_batch=%u", pluto_sock_recv_batch);
+	show_raw(s, "config.setup.ike.socket_workers=%u", pluto_sock_workers);
+	show_raw(s, "current.helpers.backlog=%u", server_helper_backlog());
 
 	/* technically shunts are not a struct state's - but makes it easier to group */
 	show_raw(s, "current.states.all="PRI_CAT, shunts + total_sa());
@@ -57,6 +57,7 @@
 #include "ip_selector.h"
 #include "crypt_mac.h"
 #include "show.h"
+#include "timer.h"		/* for struct pluto_event */
 
 struct state_v2_microcode;
 struct ikev2_ipseckey_dns; /* forward declaration of tag */
@@ -231,9 +232,19 @@ enum state_hash_tables {
 	STATE_REQID_HASH_TABLE,
 	STATE_IKE_SPIS_HASH_TABLE,
 	STATE_IKE_INITIATOR_SPI_HASH_TABLE,
+	STATE_REMOTE_ADDRESS_HASH_TABLE,
+	/* only states with an IPsec SA; see rehash_state_ipsec_spis() */
+	STATE_OUTBOUND_AH_SPI_HASH_TABLE,
+	STATE_OUTBOUND_ESP_SPI_HASH_TABLE,
+	STATE_OUTBOUND_IPCOMP_SPI_HASH_TABLE,
+	STATE_INBOUND_AH_SPI_HASH_TABLE,
+	STATE_INBOUND_ESP_SPI_HASH_TABLE,
+	STATE_INBOUND_IPCOMP_SPI_HASH_TABLE,
 	STATE_HASH_TABLES_ROOF,
 };
 
+#define STATE_IPSEC_SPI_HASH_TABLES_FLOOR STATE_OUTBOUND_AH_SPI_HASH_TABLE
+
 /*
  * For auditing, why an SA is being deleted.
  */
@@ -683,6 +694,10 @@ struct state {
 	/* state list entry */
 	struct list_entry st_serialno_list_entry;
 
+	/* family; see rehash_state_clonedfrom() */
+	struct list_entry st_child_list_entry;	/* on parent's list */
+	struct list_head st_child_list_head;	/* our children */
+
 	/* all the hash table entries */
 	struct list_entry st_hash_table_entries[STATE_HASH_TABLES_ROOF];
 
@@ -707,6 +722,9 @@ struct state {
 	uint32_t st_dpd_rdupcount;		/* openbsd isakmpd bug workaround */
 	struct pluto_event *st_dpd_event;	/* backpointer for IKEv1 DPD events */
 
+	/* storage for the above .st_*event pointers */
+	struct pluto_event st_events[STATE_EVENTS_ROOF];
+
 	bool st_seen_nortel_vid;                /* To work around a nortel bug */
 	struct isakmp_quirks quirks;            /* work arounds for faults in other products */
 	bool st_xauth_soft;                     /* XAUTH failed but policy is to soft fail */
@@ -840,13 +858,13 @@ extern void initialize_new_state(struct state *st,
 extern void show_traffic_status(struct show *s, const char *name);
 extern void show_brief_status(struct show *s);
 extern void show_states(struct show *s);
+void show_peer_status(struct show *s, const ip_address *peer);
 
 void v2_migrate_children(struct ike_sa *from, struct child_sa *to);
 
 void for_each_state(void (*f)(struct state *, void *data), void *data,
 		    const char *func);
 
-extern void find_my_cpi_gap(cpi_t *latest_cpi, cpi_t *first_busy_cpi);
 extern ipsec_spi_t uniquify_peer_cpi(ipsec_spi_t cpi, const struct state *st, int tries);
 
 extern void fmt_state(struct state *st, const monotime_t n,
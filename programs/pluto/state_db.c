@@ -70,6 +70,46 @@ static const struct list_info state_serialno_list_info = {
 struct list_head state_serialno_list_head = INIT_LIST_HEAD(&state_serialno_list_head,
 							   &state_serialno_list_info);
 
+/*
+ * A list, per parent, of the states cloned from it.
+ */
+
+static const struct list_info state_child_list_info = {
+	.name = "child list",
+	.jam = jam_state,
+};
+
+static void add_state_to_parent(struct state *st)
+{
+	st->st_child_list_entry = list_entry(&state_child_list_info, st);
+	if (st->st_clonedfrom == SOS_NOBODY) {
+		return;
+	}
+	struct state *parent = state_by_serialno(st->st_clonedfrom);
+	if (parent == NULL) {
+		dbg("State DB: parent #%lu of state #%lu is gone",
+		    st->st_clonedfrom, st->st_serialno);
+		return;
+	}
+	insert_list_entry(&parent->st_child_list_head,
+			  &st->st_child_list_entry);
+}
+
+static void del_state_from_parent(struct state *st)
+{
+	if (!detached_list_entry(&st->st_child_list_entry)) {
+		remove_list_entry(&st->st_child_list_entry);
+	}
+}
+
+void rehash_state_clonedfrom(struct state *st)
+{
+	dbg("State DB: re-linking state #%lu to parent #%lu",
+	    st->st_serialno, st->st_clonedfrom);
+	del_state_from_parent(st);
+	add_state_to_parent(st);
+}
+
 /*
  * A table hashed by serialno.
  */
@@ -367,14 +407,190 @@ struct state *state_by_ike_spis(enum ike_version ike_version,
 	return NULL;
 }
 
+/*
+ * A table hashed by the remote (peer's) address; the port is ignored
+ * so that all states belonging to a peer land in the same bucket.
+ */
+
+static hash_t remote_address_hasher(const ip_address *address)
+{
+	return hash_table_hasher(address_as_shunk(address), zero_hash);
+}
+
+static hash_t state_remote_address_hasher(const void *data)
+{
+	const struct state *st = data;
+	ip_address address = endpoint_address(st->st_remote_endpoint);
+	return remote_address_hasher(&address);
+}
+
+static struct list_entry *state_remote_address_entry(void *data)
+{
+	struct state *st = data;
+	return &st->st_hash_table_entries[STATE_REMOTE_ADDRESS_HASH_TABLE];
+}
+
+struct state *state_by_remote_address(const ip_address *address,
+				      state_by_predicate *predicate /*optional*/,
+				      void *predicate_context,
+				      const char *reason)
+{
+	struct state *st;
+	hash_t hash = remote_address_hasher(address);
+	struct list_head *bucket = hash_table_bucket(&state_hash_tables[STATE_REMOTE_ADDRESS_HASH_TABLE], hash);
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, st) {
+		if (!endpoint_address_eq_address(st->st_remote_endpoint, *address)) {
+			continue;
+		}
+		if (predicate != NULL &&
+		    !predicate(st, predicate_context)) {
+			continue;
+		}
+		dbg("State DB: found state #%lu in %s (%s)",
+		    st->st_serialno, st->st_state->short_name, reason);
+		return st;
+	}
+	dbg("State DB: state not found (%s)", reason);
+	return NULL;
+}
+
+void rehash_state_remote_address(struct state *st)
+{
+	rehash_table_entry(&state_hash_tables[STATE_REMOTE_ADDRESS_HASH_TABLE], st);
+}
+
+/*
+ * Hash tables indexed by a CHILD SA's outbound (their) and inbound
+ * (our) AH, ESP and IPCOMP SPIs.
+ *
+ * There is a table per protocol and direction so that an IKEv1 AH+ESP
+ * bundle can be found using either SPI (the peer sends a Delete for
+ * each).
+ *
+ * Since these SPIs are only known once the CHILD SA has been
+ * negotiated, a state is only added to these tables when its IPsec SA
+ * is installed (and stays until it is deleted).
+ */
+
+static hash_t ipsec_spi_hasher(const ipsec_spi_t *spi)
+{
+	return hash_table_hasher(shunk2(spi, sizeof(*spi)), zero_hash);
+}
+
+#define IPSEC_SPI_HASH_TABLE(NAME, TABLE, PROTO, SPI)		\
+								\
+static hash_t state_##NAME##_spi_hasher(const void *data)	\
+{								\
+	const struct state *st = data;				\
+	return ipsec_spi_hasher(&st->PROTO.SPI);		\
+}								\
+								\
+static struct list_entry *state_##NAME##_spi_entry(void *data)	\
+{								\
+	struct state *st = data;				\
+	return &st->st_hash_table_entries[TABLE];		\
+}
+
+IPSEC_SPI_HASH_TABLE(outbound_ah, STATE_OUTBOUND_AH_SPI_HASH_TABLE, st_ah, attrs.spi)
+IPSEC_SPI_HASH_TABLE(outbound_esp, STATE_OUTBOUND_ESP_SPI_HASH_TABLE, st_esp, attrs.spi)
+IPSEC_SPI_HASH_TABLE(outbound_ipcomp, STATE_OUTBOUND_IPCOMP_SPI_HASH_TABLE, st_ipcomp, attrs.spi)
+IPSEC_SPI_HASH_TABLE(inbound_ah, STATE_INBOUND_AH_SPI_HASH_TABLE, st_ah, our_spi)
+IPSEC_SPI_HASH_TABLE(inbound_esp, STATE_INBOUND_ESP_SPI_HASH_TABLE, st_esp, our_spi)
+IPSEC_SPI_HASH_TABLE(inbound_ipcomp, STATE_INBOUND_IPCOMP_SPI_HASH_TABLE, st_ipcomp, our_spi)
+
+static struct ipsec_proto_info *ipsec_spi_table_proto_info(struct state *st,
+							    enum state_hash_tables h)
+{
+	switch (h) {
+	case STATE_OUTBOUND_AH_SPI_HASH_TABLE:
+	case STATE_INBOUND_AH_SPI_HASH_TABLE:
+		return &st->st_ah;
+	case STATE_OUTBOUND_ESP_SPI_HASH_TABLE:
+	case STATE_INBOUND_ESP_SPI_HASH_TABLE:
+		return &st->st_esp;
+	case STATE_OUTBOUND_IPCOMP_SPI_HASH_TABLE:
+	case STATE_INBOUND_IPCOMP_SPI_HASH_TABLE:
+		return &st->st_ipcomp;
+	default:
+		bad_case(h);
+	}
+}
+
+static enum state_hash_tables ipsec_spi_table(bool outbound, uint8_t protoid)
+{
+	switch (protoid) {
+	case PROTO_IPSEC_AH:
+		return (outbound ? STATE_OUTBOUND_AH_SPI_HASH_TABLE :
+			STATE_INBOUND_AH_SPI_HASH_TABLE);
+	case PROTO_IPSEC_ESP:
+		return (outbound ? STATE_OUTBOUND_ESP_SPI_HASH_TABLE :
+			STATE_INBOUND_ESP_SPI_HASH_TABLE);
+	case PROTO_IPCOMP:
+		return (outbound ? STATE_OUTBOUND_IPCOMP_SPI_HASH_TABLE :
+			STATE_INBOUND_IPCOMP_SPI_HASH_TABLE);
+	default:
+		bad_case(protoid);
+	}
+}
+
+static struct state *state_by_ipsec_spi(bool outbound,
+					uint8_t protoid, ipsec_spi_t spi,
+					state_by_predicate *predicate,
+					void *predicate_context,
+					const char *reason)
+{
+	enum state_hash_tables h = ipsec_spi_table(outbound, protoid);
+	hash_t hash = ipsec_spi_hasher(&spi);
+	struct list_head *bucket = hash_table_bucket(&state_hash_tables[h], hash);
+	struct state *st;
+	FOR_EACH_LIST_ENTRY_NEW2OLD(bucket, st) {
+		const struct ipsec_proto_info *pr = ipsec_spi_table_proto_info(st, h);
+		if (!pr->present) {
+			continue;
+		}
+		if ((outbound ? pr->attrs.spi : pr->our_spi) != spi) {
+			continue;
+		}
+		if (predicate != NULL &&
+		    !predicate(st, predicate_context)) {
+			continue;
+		}
+		dbg("State DB: found state #%lu in %s using %s SPI %08x (%s)",
+		    st->st_serialno, st->st_state->short_name,
+		    outbound ? "outbound" : "inbound", ntohl(spi), reason);
+		return st;
+	}
+	dbg("State DB: state with %s SPI %08x not found (%s)",
+	    outbound ? "outbound" : "inbound", ntohl(spi), reason);
+	return NULL;
+}
+
+struct state *state_by_outbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				    state_by_predicate *predicate,
+				    void *predicate_context,
+				    const char *reason)
+{
+	return state_by_ipsec_spi(true/*outbound*/,
+				  protoid, spi, predicate, predicate_context,
+				  reason);
+}
+
+struct state *state_by_inbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				   state_by_predicate *predicate,
+				   void *predicate_context,
+				   const char *reason)
+{
+	return state_by_ipsec_spi(false/*inbound*/,
+				  protoid, spi, predicate, predicate_context,
+				  reason);
+}
+
 /*
  * Maintain the contents of the hash tables.
  *
  * Unlike serialno, the IKE SPI[ir] keys can change over time.
  */
 
-static struct list_head hash_slots[STATE_HASH_TABLES_ROOF][STATE_TABLE_SIZE];
-
 static struct hash_table state_hash_tables[] = {
 	[STATE_SERIALNO_HASH_TABLE] = {
 		.info = {
@@ -383,8 +599,7 @@ static struct hash_table state_hash_tables[] = {
 		},
 		.hasher = state_serialno_hasher,
 		.entry = state_serialno_entry,
-		.nr_slots = elemsof(hash_slots[STATE_SERIALNO_HASH_TABLE]),
-		.slots = hash_slots[STATE_SERIALNO_HASH_TABLE],
+		.nr_slots = STATE_TABLE_SIZE,
 	},
 	[STATE_CONNECTION_HASH_TABLE] = {
 		.info = {
@@ -393,8 +608,7 @@ static struct hash_table state_hash_tables[] = {
 		},
 		.hasher = state_connection_hasher,
 		.entry = state_connection_entry,
-		.nr_slots = elemsof(hash_slots[STATE_CONNECTION_HASH_TABLE]),
-		.slots = hash_slots[STATE_CONNECTION_HASH_TABLE],
+		.nr_slots = STATE_TABLE_SIZE,
 	},
 	[STATE_REQID_HASH_TABLE] = {
 		.info = {
@@ -403,8 +617,7 @@ static struct hash_table state_hash_tables[] = {
 		},
 		.hasher = state_reqid_hasher,
 		.entry = state_reqid_entry,
-		.nr_slots = elemsof(hash_slots[STATE_REQID_HASH_TABLE]),
-		.slots = hash_slots[STATE_REQID_HASH_TABLE],
+		.nr_slots = STATE_TABLE_SIZE,
 	},
 	[STATE_IKE_INITIATOR_SPI_HASH_TABLE] = {
 		.info = {
@@ -413,8 +626,7 @@ static struct hash_table state_hash_tables[] = {
 		},
 		.hasher = state_ike_initiator_spi_hasher,
 		.entry = state_ike_initiator_spi_entry,
-		.nr_slots = elemsof(hash_slots[STATE_IKE_INITIATOR_SPI_HASH_TABLE]),
-		.slots = hash_slots[STATE_IKE_INITIATOR_SPI_HASH_TABLE],
+		.nr_slots = STATE_TABLE_SIZE,
 	},
 	[STATE_IKE_SPIS_HASH_TABLE] = {
 		.info = {
@@ -423,11 +635,84 @@ static struct hash_table state_hash_tables[] = {
 		},
 		.hasher = state_ike_spis_hasher,
 		.entry = state_ike_spis_entry,
-		.nr_slots = elemsof(hash_slots[STATE_IKE_SPIS_HASH_TABLE]),
-		.slots = hash_slots[STATE_IKE_SPIS_HASH_TABLE],
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_REMOTE_ADDRESS_HASH_TABLE] = {
+		.info = {
+			.name = "st_remote_address table",
+			.jam = jam_state,
+		},
+		.hasher = state_remote_address_hasher,
+		.entry = state_remote_address_entry,
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_OUTBOUND_AH_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "outbound AH SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_outbound_ah_spi_hasher,
+		.entry = state_outbound_ah_spi_entry,
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_OUTBOUND_ESP_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "outbound ESP SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_outbound_esp_spi_hasher,
+		.entry = state_outbound_esp_spi_entry,
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_OUTBOUND_IPCOMP_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "outbound IPCOMP SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_outbound_ipcomp_spi_hasher,
+		.entry = state_outbound_ipcomp_spi_entry,
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_INBOUND_AH_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "inbound AH SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_inbound_ah_spi_hasher,
+		.entry = state_inbound_ah_spi_entry,
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_INBOUND_ESP_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "inbound ESP SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_inbound_esp_spi_hasher,
+		.entry = state_inbound_esp_spi_entry,
+		.nr_slots = STATE_TABLE_SIZE,
+	},
+	[STATE_INBOUND_IPCOMP_SPI_HASH_TABLE] = {
+		.info = {
+			.name = "inbound IPCOMP SPI table",
+			.jam = jam_state,
+		},
+		.hasher = state_inbound_ipcomp_spi_hasher,
+		.entry = state_inbound_ipcomp_spi_entry,
+		.nr_slots = STATE_TABLE_SIZE,
 	},
 };
 
+/*
+ * Is ST in the IPsec SPI table H?  The entry is zero until the state
+ * is first added.
+ */
+
+static bool state_in_ipsec_spi_table(struct state *st, enum state_hash_tables h)
+{
+	const struct list_entry *entry = &st->st_hash_table_entries[h];
+	return entry->data != NULL && !detached_list_entry(entry);
+}
+
 void add_state_to_db(struct state *st)
 {
 	dbg("State DB: adding %s state #%lu in %s",
@@ -440,7 +725,13 @@ void add_state_to_db(struct state *st)
 	insert_list_entry(&state_serialno_list_head,
 			  &st->st_serialno_list_entry);
 
-	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
+	/* family list, entries are moved by rehash_state_clonedfrom() */
+	st->st_child_list_head = (struct list_head) INIT_LIST_HEAD(&st->st_child_list_head,
+								  &state_child_list_info);
+	add_state_to_parent(st);
+
+	/* the IPsec SPI tables are added to when the SA is installed */
+	for (unsigned h = 0; h < STATE_IPSEC_SPI_HASH_TABLES_FLOOR; h++) {
 		add_hash_table_entry(&state_hash_tables[h], st);
 	}
 }
@@ -460,9 +751,37 @@ void del_state_from_db(struct state *st)
 	    enum_name(&ike_version_names, st->st_connection->ike_version),
 	    st->st_serialno, st->st_state->short_name);
 	remove_list_entry(&st->st_serialno_list_entry);
-	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
+
+	del_state_from_parent(st);
+	struct state *child;
+	FOR_EACH_CHILD_STATE_NEW2OLD(st, child) {
+		dbg("State DB: orphaning state #%lu", child->st_serialno);
+		remove_list_entry(&child->st_child_list_entry);
+	}
+
+	for (unsigned h = 0; h < STATE_IPSEC_SPI_HASH_TABLES_FLOOR; h++) {
 		del_hash_table_entry(&state_hash_tables[h], st);
 	}
+	for (unsigned h = STATE_IPSEC_SPI_HASH_TABLES_FLOOR; h < elemsof(state_hash_tables); h++) {
+		if (state_in_ipsec_spi_table(st, h)) {
+			del_hash_table_entry(&state_hash_tables[h], st);
+		}
+	}
+}
+
+void rehash_state_ipsec_spis(struct state *st)
+{
+	dbg("State DB: re-hashing %s state #%lu IPsec SPIs",
+	    enum_name(&ike_version_names, st->st_connection->ike_version),
+	    st->st_serialno);
+	for (unsigned h = STATE_IPSEC_SPI_HASH_TABLES_FLOOR; h < elemsof(state_hash_tables); h++) {
+		if (state_in_ipsec_spi_table(st, h)) {
+			del_hash_table_entry(&state_hash_tables[h], st);
+		}
+		if (ipsec_spi_table_proto_info(st, h)->present) {
+			add_hash_table_entry(&state_hash_tables[h], st);
+		}
+	}
 }
 
 void init_state_db(void)
@@ -471,3 +790,31 @@ void init_state_db(void)
 		init_hash_table(&state_hash_tables[h]);
 	}
 }
+
+void free_state_db(void)
+{
+	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
+		free_hash_table(&state_hash_tables[h]);
+	}
+}
+
+void show_state_db_stats(struct show *s)
+{
+	static const char *const names[] = {
+		[STATE_SERIALNO_HASH_TABLE] = "hash.state.serialno",
+		[STATE_CONNECTION_HASH_TABLE] = "hash.state.connection",
+		[STATE_REQID_HASH_TABLE] = "hash.state.reqid",
+		[STATE_IKE_INITIATOR_SPI_HASH_TABLE] = "hash.state.ike_initiator_spi",
+		[STATE_IKE_SPIS_HASH_TABLE] = "hash.state.ike_spis",
+		[STATE_REMOTE_ADDRESS_HASH_TABLE] = "hash.state.remote_address",
+		[STATE_OUTBOUND_AH_SPI_HASH_TABLE] = "hash.state.outbound_ah_spi",
+		[STATE_OUTBOUND_ESP_SPI_HASH_TABLE] = "hash.state.outbound_esp_spi",
+		[STATE_OUTBOUND_IPCOMP_SPI_HASH_TABLE] = "hash.state.outbound_ipcomp_spi",
+		[STATE_INBOUND_AH_SPI_HASH_TABLE] = "hash.state.inbound_ah_spi",
+		[STATE_INBOUND_ESP_SPI_HASH_TABLE] = "hash.state.inbound_esp_spi",
+		[STATE_INBOUND_IPCOMP_SPI_HASH_TABLE] = "hash.state.inbound_ipcomp_spi",
+	};
+	for (unsigned h = 0; h < elemsof(state_hash_tables); h++) {
+		show_hash_table_stats(s, names[h], &state_hash_tables[h]);
+	}
+}
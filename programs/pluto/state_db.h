@@ -18,12 +18,17 @@
 
 #include "ike_spi.h"
 #include "reqid.h"
+#include "libreswan.h"		/* for ipsec_spi_t */
+#include "ip_address.h"
 
 struct state;
 struct connection;
 struct list_entry;
+struct show;
 
 void init_state_db(void);
+void free_state_db(void);
+void show_state_db_stats(struct show *s);
 
 void add_state_to_db(struct state *st);
 void rehash_state_cookies_in_db(struct state *st);
@@ -46,6 +51,23 @@ extern struct list_head state_serialno_list_head;
 #define FOR_EACH_STATE_OLD2NEW(ST)				\
 	FOR_EACH_LIST_ENTRY_OLD2NEW(&state_serialno_list_head, ST)
 
+/*
+ * List of a state's children (states with .st_clonedfrom pointing
+ * at PARENT); can be iterated in old-to-new and new-to-old order.
+ *
+ * When .st_clonedfrom changes, call rehash_state_clonedfrom() to move
+ * the state to its new parent's list.  When a parent is deleted
+ * first, any remaining children are orphaned (removed from the list).
+ */
+
+#define FOR_EACH_CHILD_STATE_NEW2OLD(PARENT, ST)			\
+	FOR_EACH_LIST_ENTRY_NEW2OLD(&(PARENT)->st_child_list_head, ST)
+
+#define FOR_EACH_CHILD_STATE_OLD2NEW(PARENT, ST)			\
+	FOR_EACH_LIST_ENTRY_OLD2NEW(&(PARENT)->st_child_list_head, ST)
+
+void rehash_state_clonedfrom(struct state *st);
+
 /*
  * Lookup and generic search functions.
  */
@@ -80,4 +102,39 @@ struct state *state_by_reqid(reqid_t reqid,
 			     const char *reason);
 void rehash_state_reqid(struct state *st);
 
+/*
+ * Lookup a state using the remote (peer's) address; the port is
+ * ignored.  When .st_remote_endpoint changes, call
+ * rehash_state_remote_address().
+ */
+
+struct state *state_by_remote_address(const ip_address *address,
+				      state_by_predicate *predicate /*optional*/,
+				      void *predicate_context,
+				      const char *reason);
+void rehash_state_remote_address(struct state *st);
+
+/*
+ * Lookup a CHILD SA using the SPI of one of its IPsec SAs.
+ *
+ * OUTBOUND is their SPI (.attrs.spi), INBOUND is ours (.our_spi);
+ * PROTOID is PROTO_IPSEC_AH, PROTO_IPSEC_ESP or PROTO_IPCOMP.  A
+ * state is indexed by the SPIs of every protocol present.
+ *
+ * Since the SPIs are only settled once the IPsec SA is negotiated,
+ * the tables are updated when the IPsec SA is installed using
+ * rehash_state_ipsec_spis(); states without an installed IPsec SA
+ * are not indexed.
+ */
+
+struct state *state_by_outbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				    state_by_predicate *predicate /*optional*/,
+				    void *predicate_context,
+				    const char *reason);
+struct state *state_by_inbound_spi(uint8_t protoid, ipsec_spi_t spi,
+				   state_by_predicate *predicate /*optional*/,
+				   void *predicate_context,
+				   const char *reason);
+void rehash_state_ipsec_spis(struct state *st);
+
 #endif
@@ -65,6 +65,7 @@
 #include "pluto_stats.h"
 #include "iface.h"
 #include "ikev2_liveness.h"
+#include "rekey_schedule.h"
 
 struct pluto_event **state_event(struct state *st, enum event_type type)
 {
@@ -116,6 +117,240 @@ struct pluto_event **state_event(struct state *st, enum event_type type)
 	bad_case(type);
 }
 
+/*
+ * Find the pluto_event, embedded in ST, that backs the .st_*event
+ * pointer EVP.
+ */
+static struct pluto_event *state_event_storage(struct state *st,
+					       struct pluto_event **evp)
+{
+	struct pluto_event **pointers[STATE_EVENTS_ROOF] = {
+		[STATE_EVENT] = &st->st_event,
+		[STATE_RETRANSMIT_EVENT] = &st->st_retransmit_event,
+		[STATE_LIVENESS_EVENT] = &st->st_liveness_event,
+		[STATE_REL_WHACK_EVENT] = &st->st_rel_whack_event,
+		[STATE_SEND_XAUTH_EVENT] = &st->st_send_xauth_event,
+		[STATE_ADDR_CHANGE_EVENT] = &st->st_addr_change_event,
+		[STATE_DPD_EVENT] = &st->st_dpd_event,
+	};
+	for (unsigned e = 0; e < elemsof(pointers); e++) {
+		if (pointers[e] == evp) {
+			return &st->st_events[e];
+		}
+	}
+	PASSERT_FAIL("#%lu event pointer %p is not in the state",
+		     st->st_serialno, evp);
+}
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * State events are not given their own libevent timer (and a trip
+ * through libevent's heap, and a malloc(), each time they are
+ * rescheduled, which for rekey and liveness is often).  Instead they
+ * are threaded, using their embedded .ev_wheel_entry, onto a wheel
+ * whose one libevent timer (EVENT_TIMER_WHEEL) is armed for the next
+ * slot that needs looking at.  Insert and cancel are O(1).
+ *
+ * Time is counted in ticks of TIMER_WHEEL_TICK_MS.  Level 0 has a
+ * slot per tick for the next TIMER_WHEEL_SLOTS ticks; each higher
+ * level has slots TIMER_WHEEL_SLOTS times coarser.  When level 0
+ * wraps, the next level's current slot is cascaded (re-inserted) down
+ * to finer slots.  An event never fires early: its expiry is rounded
+ * up to a tick.
+ *
+ * Only the main thread touches the wheel.
+ */
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+static void jam_wheel_event(struct jambuf *buf, const void *data)
+{
+	const struct pluto_event *ev = data;
+	jam(buf, "%s #%lu", ev->ev_name, ev->ev_state->st_serialno);
+}
+
+static const struct list_info timer_wheel_info = {
+	.name = "timer wheel",
+	.jam = jam_wheel_event,
+};
+
+static struct {
+	uint64_t now;		/* ticks; slots before this have run */
+	uint64_t armed;		/* tick EVENT_TIMER_WHEEL will fire at, or 0 */
+	unsigned long nr_events;
+	struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/* round up, so that the event never fires early */
+static uint64_t monotime_ticks(monotime_t t, bool round_up)
+{
+	uint64_t us = (uint64_t)t.mt.tv_sec * 1000000 + t.mt.tv_usec;
+	uint64_t tick_us = TIMER_WHEEL_TICK_MS * 1000;
+	return (us + (round_up ? tick_us - 1 : 0)) / tick_us;
+}
+
+/*
+ * EARLIEST is the first slot that will still be run: the current
+ * slot when cascading (it is run next), else the one after.
+ */
+static void wheel_insert(struct pluto_event *ev, uint64_t earliest)
+{
+	uint64_t expires = monotime_ticks(ev->ev_time, true);
+	if (expires < earliest) {
+		expires = earliest;
+	}
+	uint64_t delta = expires - timer_wheel.now;
+	unsigned level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+	if (delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+		/* beyond the wheel; park it in the furthest slot */
+		expires = timer_wheel.now + ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	}
+	unsigned slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	insert_list_entry(&timer_wheel.slots[level][slot], &ev->ev_wheel_entry);
+}
+
+static bool wheel_slot_empty(unsigned level, unsigned slot)
+{
+	const struct list_head *head = &timer_wheel.slots[level][slot];
+	return head->head.newer == &head->head;
+}
+
+/*
+ * Arm EVENT_TIMER_WHEEL for the next tick with something to do: an
+ * occupied level 0 slot or, failing that, the level 0 wrap where the
+ * next cascade happens.
+ */
+static void arm_timer_wheel(void)
+{
+	if (timer_wheel.nr_events == 0) {
+		if (timer_wheel.armed != 0) {
+			deschedule_oneshot_timer(EVENT_TIMER_WHEEL);
+			timer_wheel.armed = 0;
+		}
+		return;
+	}
+	uint64_t next = timer_wheel.now + 1;
+	while ((next & TIMER_WHEEL_MASK) != 0 &&
+	       wheel_slot_empty(0, next & TIMER_WHEEL_MASK)) {
+		next++;
+	}
+	if (next == timer_wheel.armed) {
+		return;
+	}
+	uint64_t now = monotime_ticks(mononow(), false);
+	intmax_t ms = (next > now ? (next - now) * TIMER_WHEEL_TICK_MS : 0);
+	schedule_oneshot_timer(EVENT_TIMER_WHEEL, deltatime_ms(ms));
+	timer_wheel.armed = next;
+}
+
+static event_callback_routine timer_event_cb;
+
+static void run_timer_wheel(struct logger *unused_logger UNUSED)
+{
+	timer_wheel.armed = 0;
+	uint64_t target = monotime_ticks(mononow(), false);
+	while (timer_wheel.now < target) {
+		timer_wheel.now++;
+		/* when a level wraps, pull the next level's slot down */
+		for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			uint64_t shift = TIMER_WHEEL_BITS * level;
+			if ((timer_wheel.now & (((uint64_t)1 << shift) - 1)) != 0) {
+				break;
+			}
+			struct list_head *head =
+				&timer_wheel.slots[level][(timer_wheel.now >> shift) & TIMER_WHEEL_MASK];
+			struct pluto_event *ev;
+			FOR_EACH_LIST_ENTRY_OLD2NEW(head, ev) {
+				remove_list_entry(&ev->ev_wheel_entry);
+				wheel_insert(ev, timer_wheel.now);
+			}
+		}
+		/*
+		 * Run the slot.  An event can delete others, so
+		 * always take the oldest that remains.
+		 */
+		struct list_head *head = &timer_wheel.slots[0][timer_wheel.now & TIMER_WHEEL_MASK];
+		while (!wheel_slot_empty(0, timer_wheel.now & TIMER_WHEEL_MASK)) {
+			struct pluto_event *ev = head->head.newer->data;
+			remove_list_entry(&ev->ev_wheel_entry);
+			if (monotime_ticks(ev->ev_time, true) > timer_wheel.now) {
+				/* parked beyond the wheel; go round again */
+				wheel_insert(ev, timer_wheel.now + 1);
+				continue;
+			}
+			timer_wheel.nr_events--;
+			timer_event_cb(0/*sock*/, 0/*event*/, ev);
+		}
+	}
+	arm_timer_wheel();
+}
+
+static void add_wheel_event(struct pluto_event *ev)
+{
+	passert(in_main_thread());
+	ev->ev_wheel_entry = list_entry(&timer_wheel_info, ev);
+	wheel_insert(ev, timer_wheel.now + 1);
+	timer_wheel.nr_events++;
+	uint64_t expires = monotime_ticks(ev->ev_time, true);
+	if (timer_wheel.armed == 0 || expires < timer_wheel.armed) {
+		arm_timer_wheel();
+	}
+}
+
+/* cancel state event *EVP (if any); leave *EVP == NULL */
+static void delete_wheel_event(struct pluto_event **evp)
+{
+	struct pluto_event *ev = *evp;
+	if (ev == NULL) {
+		return;
+	}
+	passert(ev->ev_state != NULL);
+	if (!detached_list_entry(&ev->ev_wheel_entry)) {
+		remove_list_entry(&ev->ev_wheel_entry);
+		timer_wheel.nr_events--;
+	}
+	if (ev->ev_rekey) {
+		release_rekey_event(ev->ev_time);
+	}
+	dbg("%s: release %s-pe@%p", __func__, ev->ev_name, ev);
+	*ev = (struct pluto_event) {0};
+	*evp = NULL;
+}
+
+void init_timer_wheel(void)
+{
+	for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for (unsigned slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			struct list_head *head = &timer_wheel.slots[level][slot];
+			*head = (struct list_head) INIT_LIST_HEAD(head, &timer_wheel_info);
+		}
+	}
+	timer_wheel.now = monotime_ticks(mononow(), false);
+	init_oneshot_timer(EVENT_TIMER_WHEEL, run_timer_wheel);
+}
+
+void list_timer_wheel(struct show *s, monotime_t now)
+{
+	show_comment(s, "timer wheel: %lu state events, %dms ticks, %u levels of %u slots",
+		     timer_wheel.nr_events, TIMER_WHEEL_TICK_MS,
+		     TIMER_WHEEL_LEVELS, TIMER_WHEEL_SLOTS);
+	if (timer_wheel.armed != 0) {
+		/* ticks are unsigned; armed can be in the past */
+		intmax_t ticks = (intmax_t)timer_wheel.armed - (intmax_t)monotime_ticks(now, false);
+		intmax_t ms = (ticks > 0 ? ticks * TIMER_WHEEL_TICK_MS : 0);
+		show_comment(s, "timer wheel: next tick in %jdms", ms);
+	}
+}
+
 /*
  * This file has the event handling routines. Events are
  * kept as a linked list of event structures. These structures
@@ -123,7 +358,6 @@ struct pluto_event **state_event(struct state *st, enum event_type type)
  * to event specific data (for example, to a state structure).
  */
 
-static event_callback_routine timer_event_cb;
 static void timer_event_cb(evutil_socket_t unused_fd UNUSED,
 			   const short unused_event UNUSED,
 			   void *arg)
@@ -181,8 +415,8 @@ static void timer_event_cb(evutil_socket_t unused_fd UNUSED,
 				     ev);
 			return;
 		}
-		delete_pluto_event(evp);
-		arg = ev = *evp = NULL; /* all gone */
+		delete_wheel_event(evp);
+		arg = ev = NULL; /* all gone */
 	}
 
 	statetime_t start = statetime_backdate(st, &inception);
@@ -482,7 +716,7 @@ void delete_event(struct state *st)
 			dbg("state #%lu deleting .%s %s",
 			    st->st_serialno, l->name,
 			    enum_show(&timer_event_names, (*l->event)->ev_type, &b));
-			delete_pluto_event(l->event);
+			delete_wheel_event(l->event);
 		}
 	}
 }
@@ -515,10 +749,10 @@ void event_schedule(enum event_type type, deltatime_t delay, struct state *st)
 			     "#%lu already has a scheduled %s; forcing replacement",
 			     st->st_serialno,
 			     enum_name(&timer_event_names, type));
-		delete_pluto_event(evp);
+		delete_wheel_event(evp);
 	}
 
-	struct pluto_event *ev = alloc_thing(struct pluto_event, en);
+	struct pluto_event *ev = state_event_storage(st, evp);
 	dbg("%s: newref %s-pe@%p", __func__, en, ev);
 	ev->ev_type = type;
 	ev->ev_name = en;
@@ -531,7 +765,7 @@ void event_schedule(enum event_type type, deltatime_t delay, struct state *st)
 	    en, str_deltatime(delay, &buf),
 	    ev->ev_state->st_serialno);
 
-	fire_timer_photon_torpedo(&ev->ev, timer_event_cb, ev, delay);
+	add_wheel_event(ev);
 }
 
 /*
@@ -550,7 +784,7 @@ void event_delete(enum event_type type, struct state *st)
 		dbg("#%lu requesting %s-pe@%p be deleted",
 		    st->st_serialno, enum_name(&timer_event_names, (*evp)->ev_type), *evp);
 		pexpect(st == (*evp)->ev_state);
-		delete_pluto_event(evp);
+		delete_wheel_event(evp);
 		pexpect((*evp) == NULL);
 	};
 }
@@ -22,6 +22,7 @@
 
 #include "deltatime.h"
 #include "monotime.h"
+#include "list_entry.h"
 
 struct state;   /* forward declaration */
 struct fd;
@@ -35,6 +36,24 @@ struct pluto_event {
 	struct event *ev;               /* libevent data structure */
 	monotime_t ev_time;
 	struct pluto_event *next;
+	struct list_entry ev_wheel_entry;	/* state events are on the timer wheel */
+	bool ev_rekey;			/* counted by schedule_rekey_event() */
+};
+
+/*
+ * A state's events live in the state (.st_events[]) so scheduling
+ * one doesn't allocate; the .st_*event pointers point into it while
+ * the event is pending.
+ */
+enum state_events {
+	STATE_EVENT,			/* .st_event */
+	STATE_RETRANSMIT_EVENT,
+	STATE_LIVENESS_EVENT,
+	STATE_REL_WHACK_EVENT,
+	STATE_SEND_XAUTH_EVENT,
+	STATE_ADDR_CHANGE_EVENT,
+	STATE_DPD_EVENT,
+	STATE_EVENTS_ROOF,
 };
 
 extern void event_schedule(enum event_type type, deltatime_t delay,
@@ -44,12 +63,13 @@ struct pluto_event **state_event(struct state *st, enum event_type type);
 extern void event_force(enum event_type type, struct state *st);
 extern void delete_event(struct state *st);
 extern void handle_next_timer_event(void);
-extern void init_timer(void);
+extern void init_timer_wheel(void);
 
 void call_state_event_inline(struct logger *logger, struct state *st,
 			     enum event_type type);
 
 extern void list_timers(struct show *s, monotime_t now);
+void list_timer_wheel(struct show *s, monotime_t now);
 extern char *revive_conn;
 
 /*
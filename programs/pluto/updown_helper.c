@@ -0,0 +1,405 @@
+/* long-lived updown helper process, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "defs.h"
+#include "updown_helper.h"
+#include "log.h"
+#include "server.h"		/* for add_fd_read_event_handler() */
+#include "server_fork.h"
+#include "show.h"
+#include "timer.h"
+
+/*
+ * leftupdown=%helper: instead of a shell per updown event, pluto
+ * starts the updown-helper= program once, with a socket as its stdin
+ * and stdout, and writes it one line per event: the NAME='value'
+ * assignments that a script gets in its environment, PLUTO_VERB
+ * first.  The helper answers each event, in order, with a line
+ * holding its exit status (0 is success) optionally followed by a
+ * message.
+ *
+ * Pluto acts on the outcome of prepare, route, up and down events so
+ * those are answered before do_command() returns.  Unroute events are
+ * queued for UPDOWN_HELPER_BATCH_MILLISECONDS and written together,
+ * or with the next event that is waited for; their answers are read
+ * as they arrive and failures logged.
+ *
+ * Should the helper die, or stop answering for
+ * UPDOWN_HELPER_TIMEOUT_SECONDS, unanswered events are dropped and a
+ * new helper is started for the next one.
+ */
+
+#define UPDOWN_HELPER_BATCH_MILLISECONDS 10
+#define UPDOWN_HELPER_TIMEOUT_SECONDS 10
+#define UPDOWN_HELPER_MAX_PENDING 1024	/* events without an answer */
+#define UPDOWN_HELPER_OUTPUT_SIZE (64 * 1024)
+
+char *pluto_updown_helper;
+
+static struct {
+	pid_t pid;			/* 0 when not running */
+	int fd;
+	int child_fd;			/* for updown_helper_op() */
+	uintptr_t generation;		/* which helper exited */
+	struct pluto_event *reader;
+	/* events, written or not, waiting for an answer; oldest first */
+	char pending[UPDOWN_HELPER_MAX_PENDING][64];
+	unsigned first_pending;
+	unsigned nr_pending;
+	/* events not yet written */
+	char output[UPDOWN_HELPER_OUTPUT_SIZE];
+	size_t output_len;
+	/* the start of an answer */
+	char input[1024];
+	size_t input_len;
+	/* of the most recent answer */
+	bool answer_ok;
+} helper = {
+	.fd = -1,
+};
+
+static unsigned long total_events;
+static unsigned long total_writes;
+static unsigned long total_failed;
+static unsigned long total_started;
+static unsigned long total_lost;
+
+static void stop_updown_helper(const char *why, struct logger *logger)
+{
+	if (helper.pid == 0) {
+		return;
+	}
+	if (helper.nr_pending > 0) {
+		llog(RC_LOG_SERIOUS, logger,
+		     "updown helper (pid %d) %s; dropping %u unanswered events",
+		     helper.pid, why, helper.nr_pending);
+		total_lost += helper.nr_pending;
+	} else {
+		dbg("updown helper (pid %d) %s", helper.pid, why);
+	}
+	deschedule_oneshot_timer(EVENT_FLUSH_UPDOWN_HELPER);
+	delete_pluto_event(&helper.reader);
+	close(helper.fd);
+	helper.fd = -1;
+	helper.pid = 0;
+	helper.first_pending = helper.nr_pending = 0;
+	helper.output_len = 0;
+	helper.input_len = 0;
+}
+
+static void updown_helper_exited(struct state *st UNUSED,
+				 struct msg_digest *md UNUSED,
+				 int status, void *context,
+				 struct logger *logger)
+{
+	if ((uintptr_t)context != helper.generation) {
+		/* an earlier helper that was already given up on */
+		return;
+	}
+	if (helper.pid != 0) {
+		llog(RC_LOG_SERIOUS, logger,
+		     "updown helper (pid %d) exited with status %d",
+		     helper.pid, status);
+	}
+	stop_updown_helper("exited", logger);
+}
+
+static int updown_helper_op(void *context UNUSED, struct logger *logger UNUSED)
+{
+	/* the socket becomes stdin and stdout; dup2() clears CLOEXEC */
+	if (dup2(helper.child_fd, STDIN_FILENO) < 0 ||
+	    dup2(helper.child_fd, STDOUT_FILENO) < 0) {
+		return 127;
+	}
+	/*
+	 * The helper outlives the event that started it; don't let
+	 * it hold pluto's sockets, in particular whack's, open.
+	 */
+	for (int fd = getdtablesize() - 1; fd > STDERR_FILENO; fd--) {
+		close(fd);
+	}
+	execl("/bin/sh", "sh", "-c", pluto_updown_helper, (char *)NULL);
+	return 127;
+}
+
+/* one line of answer for the oldest pending event */
+static void process_answer(const char *line, struct logger *logger)
+{
+	if (helper.nr_pending == 0) {
+		llog(RC_LOG_SERIOUS, logger,
+		     "updown helper sent an unexpected answer: %s", line);
+		return;
+	}
+	const char *what = helper.pending[helper.first_pending];
+	char *end;
+	long status = strtol(line, &end, 10);
+	helper.answer_ok = (end != line && status == 0);
+	if (!helper.answer_ok) {
+		total_failed++;
+		llog(RC_LOG_SERIOUS, logger,
+		     "updown helper %s failed: %s", what, line);
+	} else {
+		dbg("updown helper %s: %s", what, line);
+	}
+	helper.first_pending = (helper.first_pending + 1) % UPDOWN_HELPER_MAX_PENDING;
+	helper.nr_pending--;
+}
+
+/* read whatever answers are available; false when the helper is gone */
+static bool read_answers(struct logger *logger)
+{
+	while (true) {
+		ssize_t r = read(helper.fd, helper.input + helper.input_len,
+				 sizeof(helper.input) - 1 - helper.input_len);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return true;
+			}
+			log_errno(logger, errno, "reading from updown helper failed");
+			stop_updown_helper("could not be read", logger);
+			return false;
+		}
+		if (r == 0) {
+			stop_updown_helper("closed its output", logger);
+			return false;
+		}
+		helper.input_len += r;
+		helper.input[helper.input_len] = '\0';
+
+		char *line = helper.input;
+		char *nl;
+		while ((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			process_answer(line, logger);
+			line = nl + 1;
+		}
+		helper.input_len -= line - helper.input;
+		memmove(helper.input, line, helper.input_len);
+		if (helper.input_len == sizeof(helper.input) - 1) {
+			kill(helper.pid, SIGTERM);
+			stop_updown_helper("sent an overlong answer", logger);
+			return false;
+		}
+	}
+}
+
+static void updown_helper_read_cb(evutil_socket_t fd UNUSED,
+				  const short event UNUSED,
+				  void *arg UNUSED)
+{
+	struct logger logger[1] = { GLOBAL_LOGGER(null_fd), };
+	read_answers(logger);
+}
+
+/*
+ * Wait, for at most the timeout, until the helper's socket can be
+ * written (WRITING) or until it has answered everything.  Answers are
+ * read meanwhile so that the helper never blocks on its output.
+ */
+static bool wait_for_updown_helper(bool writing, monotime_t deadline,
+				   struct logger *logger)
+{
+	while (writing || helper.nr_pending > 0) {
+		intmax_t ms = deltamillisecs(monotimediff(deadline, mononow()));
+		if (ms <= 0) {
+			kill(helper.pid, SIGTERM);
+			stop_updown_helper("timed out", logger);
+			return false;
+		}
+		struct pollfd pfd = {
+			.fd = helper.fd,
+			.events = POLLIN | (writing ? POLLOUT : 0),
+		};
+		int r = poll(&pfd, 1, (int)ms);
+		if (r < 0 && errno != EINTR) {
+			log_errno(logger, errno, "waiting for updown helper failed");
+			stop_updown_helper("could not be polled", logger);
+			return false;
+		}
+		if (r > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+			if (!read_answers(logger)) {
+				return false;
+			}
+		}
+		if (r > 0 && writing && (pfd.revents & POLLOUT)) {
+			return true;
+		}
+	}
+	return true;
+}
+
+/* write all queued events */
+static bool flush_updown_helper(struct logger *logger)
+{
+	monotime_t deadline = monotime_add(mononow(), deltatime(UPDOWN_HELPER_TIMEOUT_SECONDS));
+	size_t written = 0;
+	while (helper.pid != 0 && written < helper.output_len) {
+		ssize_t r = send(helper.fd, helper.output + written,
+				 helper.output_len - written, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				if (!wait_for_updown_helper(true, deadline, logger)) {
+					return false;
+				}
+				continue;
+			}
+			log_errno(logger, errno, "writing to updown helper failed");
+			kill(helper.pid, SIGTERM);
+			stop_updown_helper("could not be written", logger);
+			return false;
+		}
+		written += r;
+		total_writes++;
+	}
+	helper.output_len = 0;
+	return helper.pid != 0;
+}
+
+static void flush_updown_helper_cb(struct logger *logger)
+{
+	flush_updown_helper(logger);
+}
+
+static bool start_updown_helper(struct logger *logger)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		log_errno(logger, errno, "socketpair() for updown helper failed");
+		return false;
+	}
+	helper.child_fd = fds[1];
+	helper.generation++;
+	/*
+	 * server_fork() keeps its logger, and any whack attached to
+	 * it, until the child exits; the helper outlives the command
+	 * that started it.
+	 */
+	struct logger global_logger[1] = { GLOBAL_LOGGER(null_fd), };
+	pid_t pid = server_fork("updown helper", SOS_NOBODY,
+				updown_helper_op, updown_helper_exited,
+				(void *)helper.generation, global_logger);
+	close(fds[1]);
+	if (pid < 0) {
+		close(fds[0]);
+		return false;
+	}
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) {
+		log_errno(logger, errno, "fcntl(O_NONBLOCK) for updown helper failed");
+	}
+	helper.fd = fds[0];
+	helper.pid = pid;
+	helper.reader = add_fd_read_event_handler(helper.fd, updown_helper_read_cb,
+						  NULL, "updown helper");
+	total_started++;
+	llog(RC_LOG, global_logger, "started updown helper %s (pid %d)",
+	     pluto_updown_helper, pid);
+	return true;
+}
+
+bool updown_helper_command(const char *verb, const char *verb_suffix,
+			   const char *connection, const char *shell_out,
+			   struct logger *logger)
+{
+	if (helper.pid == 0 && !start_updown_helper(logger)) {
+		return false;
+	}
+
+	/* make room */
+	size_t len = strlen("PLUTO_VERB='' \n") + strlen(verb) +
+		strlen(verb_suffix) + strlen(shell_out);
+	if (helper.nr_pending == UPDOWN_HELPER_MAX_PENDING ||
+	    helper.output_len + len >= sizeof(helper.output)) {
+		monotime_t deadline = monotime_add(mononow(), deltatime(UPDOWN_HELPER_TIMEOUT_SECONDS));
+		if (!flush_updown_helper(logger) ||
+		    !wait_for_updown_helper(false, deadline, logger)) {
+			return false;
+		}
+	}
+	passert(helper.output_len + len < sizeof(helper.output));
+
+	/* one line per event; squash anything that would end it early */
+	char *start = helper.output + helper.output_len;
+	int n = snprintf(start, sizeof(helper.output) - helper.output_len,
+			 "PLUTO_VERB='%s%s' %s", verb, verb_suffix, shell_out);
+	for (int i = 0; i < n; i++) {
+		if (start[i] == '\n' || start[i] == '\r') {
+			start[i] = ' ';
+		}
+	}
+	start[n++] = '\n';
+	helper.output_len += n;
+
+	unsigned last = (helper.first_pending + helper.nr_pending) % UPDOWN_HELPER_MAX_PENDING;
+	snprintf(helper.pending[last], sizeof(helper.pending[last]),
+		 "%s%s \"%s\"", verb, verb_suffix, connection);
+	helper.nr_pending++;
+	total_events++;
+
+	/* pluto acts on the outcome of these */
+	if (!streq(verb, "unroute")) {
+		deschedule_oneshot_timer(EVENT_FLUSH_UPDOWN_HELPER);
+		monotime_t deadline = monotime_add(mononow(), deltatime(UPDOWN_HELPER_TIMEOUT_SECONDS));
+		return (flush_updown_helper(logger) &&
+			wait_for_updown_helper(false, deadline, logger) &&
+			helper.answer_ok);
+	}
+
+	if (helper.output_len == (size_t)n) {
+		schedule_oneshot_timer(EVENT_FLUSH_UPDOWN_HELPER,
+				       deltatime_ms(UPDOWN_HELPER_BATCH_MILLISECONDS));
+	}
+	return true;
+}
+
+void init_updown_helper(void)
+{
+	init_oneshot_timer(EVENT_FLUSH_UPDOWN_HELPER, flush_updown_helper_cb);
+}
+
+void free_updown_helper(struct logger *logger)
+{
+	if (helper.pid != 0) {
+		/* send anything queued; the helper sees EOF and exits */
+		monotime_t deadline = monotime_add(mononow(), deltatime(UPDOWN_HELPER_TIMEOUT_SECONDS));
+		if (flush_updown_helper(logger)) {
+			wait_for_updown_helper(false, deadline, logger);
+		}
+		stop_updown_helper("stopped", logger);
+	}
+	pfreeany(pluto_updown_helper);
+}
+
+void show_updown_helper(struct show *s)
+{
+	show_raw(s, "current.updown.helper.pid=%d", helper.pid);
+	show_raw(s, "current.updown.helper.pending=%u", helper.nr_pending);
+	show_raw(s, "total.updown.helper.events=%lu", total_events);
+	show_raw(s, "total.updown.helper.writes=%lu", total_writes);
+	show_raw(s, "total.updown.helper.failed=%lu", total_failed);
+	show_raw(s, "total.updown.helper.lost=%lu", total_lost);
+	show_raw(s, "total.updown.helper.started=%lu", total_started);
+}
@@ -0,0 +1,40 @@
+/* long-lived updown helper process, for libreswan
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <https://www.gnu.org/licenses/gpl2.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ */
+
+#ifndef UPDOWN_HELPER_H
+#define UPDOWN_HELPER_H
+
+#include <stdbool.h>
+
+struct show;
+struct logger;
+
+extern char *pluto_updown_helper;	/* updown-helper=; NULL when unset */
+
+void init_updown_helper(void);
+void free_updown_helper(struct logger *logger);
+
+/*
+ * Hand the updown event VERB+VERB_SUFFIX, with the script environment
+ * SHELL_OUT, to the helper (started as needed).  Returns the helper's
+ * verdict for prepare and route; other events are batched and only
+ * fail when they can't be queued.
+ */
+bool updown_helper_command(const char *verb, const char *verb_suffix,
+			   const char *connection, const char *shell_out,
+			   struct logger *logger);
+
+void show_updown_helper(struct show *s);
+
+#endif
@@ -201,7 +201,8 @@ static void help(void)
 		"\n"
 		"status: whack [--status] | [--trafficstatus] | [--globalstatus] | \\\n"
 		"	[--clearstats] | [--shuntstatus] | [--fipsstatus] | [--briefstatus] \n"
-		"	[--showstates] | [--addresspoolstatus] [--processstatus]\n"
+		"	[--showstates] | [--addresspoolstatus] [--processstatus] \n"
+		"	[--peerstatus <ip-address>]\n"
 		"\n"
 		"refresh dns: whack --ddns\n"
 		"\n"
@@ -335,6 +336,7 @@ enum option_enums {
 	OPT_SHUTDOWN_DIRTY,
 	OPT_TRAFFIC_STATUS,
 	OPT_SHUNT_STATUS,
+	OPT_PEER_STATUS,
 	OPT_SHOW_STATES,
 	OPT_ADDRESSPOOL_STATUS,
 	OPT_FIPS_STATUS,
@@ -605,6 +607,7 @@ static const struct option long_opts[] = {
 	{ "clearstats", no_argument, NULL, OPT_CLEAR_STATS + OO },
 	{ "trafficstatus", no_argument, NULL, OPT_TRAFFIC_STATUS + OO },
 	{ "shuntstatus", no_argument, NULL, OPT_SHUNT_STATUS + OO },
+	{ "peerstatus", required_argument, NULL, OPT_PEER_STATUS + OO },
 	{ "addresspoolstatus", no_argument, NULL, OPT_ADDRESSPOOL_STATUS + OO },
 	{ "fipsstatus", no_argument, NULL, OPT_FIPS_STATUS + OO },
 	{ "briefstatus", no_argument, NULL, OPT_BRIEF_STATUS + OO },
@@ -1458,6 +1461,16 @@ int main(int argc, char **argv)
 			ignore_errors = TRUE;
 			continue;
 
+		case OPT_PEER_STATUS:	/* --peerstatus <ip-address> */
+			msg.whack_peer_status = true;
+			opt_to_address(&host_family, &msg.whack_peer_status_peer);
+			if (address_is_any(msg.whack_peer_status_peer)) {
+				diagq("0.0.0.0 or 0::0 isn't a valid peer address",
+				      optarg);
+			}
+			ignore_errors = TRUE;
+			continue;
+
 		case OPT_ADDRESSPOOL_STATUS:	/* --addresspoolstatus */
 			msg.whack_addresspool_status = TRUE;
 			ignore_errors = TRUE;
@@ -2619,6 +2632,7 @@ int main(int argc, char **argv)
 	      msg.whack_unlisten || msg.whack_list || msg.ike_buf_size ||
 	      msg.whack_ddos != DDOS_undefined || msg.whack_ddns ||
 	      msg.whack_reread || msg.whack_crash || msg.whack_shunt_status ||
+	      msg.whack_peer_status ||
 	      msg.whack_status || msg.whack_global_status || msg.whack_traffic_status ||
 	      msg.whack_addresspool_status ||
 	      msg.whack_process_status ||
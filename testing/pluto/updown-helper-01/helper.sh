@@ -0,0 +1,11 @@
+#!/bin/sh
+# trivial updown helper: log each event and answer success, except
+# for route events of connections whose name ends in -fail
+while read -r event ; do
+	eval "${event}"
+	echo "${PLUTO_VERB} ${PLUTO_CONNECTION}" >> /tmp/updown-helper.log
+	case "${PLUTO_VERB} ${PLUTO_CONNECTION}" in
+	route-*-fail ) echo "1 refusing ${PLUTO_VERB}" ;;
+	* ) echo "0" ;;
+	esac
+done
@@ -0,0 +1,14 @@
+/testing/guestbin/swan-prep
+rm -f /tmp/updown-helper.log
+ipsec start
+../../guestbin/wait-until-pluto-started
+ipsec auto --add westnet-eastnet-helper
+ipsec auto --add westnet-eastnet-helper-fail
+# prepare and route are answered by the helper
+ipsec auto --route westnet-eastnet-helper
+# the helper refuses this route
+ipsec auto --route westnet-eastnet-helper-fail
+ipsec auto --unroute westnet-eastnet-helper
+ipsec whack --shutdown
+cat /tmp/updown-helper.log
+grep "updown helper" /tmp/pluto.log | sed -e 's/(pid [0-9]*)/(pid NNN)/'
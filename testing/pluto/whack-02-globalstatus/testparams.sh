@@ -0,0 +1,3 @@
+#!/bin/sh
+. ../../default-testparams.sh
+WEST_CONSOLE_FIXUPS="$REF_CONSOLE_FIXUPS globalstatus-latency.sed"